@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include "bench.h"
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+uint64_t vfs_bench_now(void)
+{
+    LARGE_INTEGER freq, cnt;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&cnt);
+    return (uint64_t)((double)cnt.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+}
+
+#else
+
+#include <time.h>
+
+uint64_t vfs_bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#endif
+
+void vfs_bench_report(const char* name, const char* op, size_t param,
+    size_t cnt, uint64_t cost)
+{
+    double per_op = cnt != 0 ? (double)cost / (double)cnt : 0.0;
+    printf("%-16s %-10s %10zu %10zu ops %12.1f ns/op\n", name, op, param, cnt, per_op);
+}
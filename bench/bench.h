@@ -0,0 +1,43 @@
+#ifndef __VFS_BENCH_H__
+#define __VFS_BENCH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs/vfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct vfs_bench_case
+{
+    const char* name;   /**< The name of the benchmark. */
+
+    /**
+     * @brief Benchmark entry point.
+     * @return 0 on success, or -errno on error.
+     */
+    int (*entry)(void);
+} vfs_bench_case_t;
+
+/**
+ * @brief Get monotonic time in nanoseconds.
+ * @return Time in nanoseconds.
+ */
+uint64_t vfs_bench_now(void);
+
+/**
+ * @brief Print one result line.
+ * @param[in] name - The benchmark name.
+ * @param[in] op - The operation name.
+ * @param[in] param - The benchmark parameter, e.g. directory size.
+ * @param[in] cnt - The number of operations.
+ * @param[in] cost - Total cost in nanoseconds.
+ */
+void vfs_bench_report(const char* name, const char* op, size_t param,
+    size_t cnt, uint64_t cost);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
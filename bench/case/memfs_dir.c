@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include "vfs/fs/memfs.h"
+#include "utils/defs.h"
+#include "bench.h"
+
+#define VFS_BENCH_MEMFS_DIR_NAME    "memfs_dir"
+
+static const size_t s_bench_memfs_dir_sizes[] = {
+    10, 100, 1000, 10000, 100000, 1000000,
+};
+
+static void _vfs_bench_memfs_dir_path(char* buf, size_t size, size_t idx)
+{
+    snprintf(buf, size, "/d/f%zu", idx);
+}
+
+static int _vfs_bench_memfs_dir_create(vfs_operations_t* fs, size_t num)
+{
+    size_t i;
+    char path[64];
+
+    uint64_t start = vfs_bench_now();
+    for (i = 0; i < num; i++)
+    {
+        uintptr_t fh;
+        _vfs_bench_memfs_dir_path(path, sizeof(path), i);
+
+        int ret = fs->open(fs, &fh, path, VFS_O_WRONLY | VFS_O_CREATE);
+        if (ret != 0)
+        {
+            return ret;
+        }
+        fs->close(fs, fh);
+    }
+    vfs_bench_report(VFS_BENCH_MEMFS_DIR_NAME, "create", num, num, vfs_bench_now() - start);
+
+    return 0;
+}
+
+static int _vfs_bench_memfs_dir_stat(vfs_operations_t* fs, size_t num)
+{
+    size_t i;
+    char path[64];
+    vfs_stat_t info;
+
+    /* Look up every entry, in reverse order of creation. */
+    uint64_t start = vfs_bench_now();
+    for (i = 0; i < num; i++)
+    {
+        _vfs_bench_memfs_dir_path(path, sizeof(path), num - i - 1);
+
+        int ret = fs->stat(fs, path, &info);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+    vfs_bench_report(VFS_BENCH_MEMFS_DIR_NAME, "stat", num, num, vfs_bench_now() - start);
+
+    /* Negative lookup. */
+    start = vfs_bench_now();
+    for (i = 0; i < num; i++)
+    {
+        _vfs_bench_memfs_dir_path(path, sizeof(path), num + i);
+        if (fs->stat(fs, path, &info) != VFS_ENOENT)
+        {
+            return VFS_EIO;
+        }
+    }
+    vfs_bench_report(VFS_BENCH_MEMFS_DIR_NAME, "stat_miss", num, num, vfs_bench_now() - start);
+
+    return 0;
+}
+
+static int _vfs_bench_memfs_dir_unlink(vfs_operations_t* fs, size_t num)
+{
+    size_t i;
+    char path[64];
+
+    uint64_t start = vfs_bench_now();
+    for (i = 0; i < num; i++)
+    {
+        _vfs_bench_memfs_dir_path(path, sizeof(path), i);
+
+        int ret = fs->unlink(fs, path);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+    vfs_bench_report(VFS_BENCH_MEMFS_DIR_NAME, "unlink", num, num, vfs_bench_now() - start);
+
+    return 0;
+}
+
+static int _vfs_bench_memfs_dir_run(size_t num)
+{
+    int ret;
+    vfs_operations_t* fs = NULL;
+    if ((ret = vfs_make_memory(&fs)) != 0)
+    {
+        return ret;
+    }
+
+    do
+    {
+        if ((ret = fs->mkdir(fs, "/d")) != 0)
+        {
+            break;
+        }
+        if ((ret = _vfs_bench_memfs_dir_create(fs, num)) != 0)
+        {
+            break;
+        }
+        if ((ret = _vfs_bench_memfs_dir_stat(fs, num)) != 0)
+        {
+            break;
+        }
+        ret = _vfs_bench_memfs_dir_unlink(fs, num);
+    } while (0);
+
+    fs->destroy(fs);
+    return ret;
+}
+
+static int _vfs_bench_memfs_dir(void)
+{
+    int ret;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(s_bench_memfs_dir_sizes); i++)
+    {
+        if ((ret = _vfs_bench_memfs_dir_run(s_bench_memfs_dir_sizes[i])) != 0)
+        {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create, look up and unlink entries in a single directory of various size.
+ */
+const vfs_bench_case_t vfs_bench_memfs_dir = {
+    VFS_BENCH_MEMFS_DIR_NAME, _vfs_bench_memfs_dir,
+};
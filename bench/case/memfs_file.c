@@ -0,0 +1,106 @@
+#include <string.h>
+#include "vfs/fs/memfs.h"
+#include "utils/defs.h"
+#include "bench.h"
+
+#define VFS_BENCH_MEMFS_FILE_NAME   "memfs_file"
+
+/* Size of each write, in bytes. */
+static const size_t s_bench_memfs_file_block_sizes[] = {
+    16, 256, 4096, 65536,
+};
+
+/* Total file size, in bytes. */
+#define VFS_BENCH_MEMFS_FILE_SIZE   (64 * 1024 * 1024)
+
+static int _vfs_bench_memfs_file_append(vfs_operations_t* fs, uintptr_t fh, const void* buf, size_t block)
+{
+    size_t i;
+    const size_t num = VFS_BENCH_MEMFS_FILE_SIZE / block;
+
+    uint64_t start = vfs_bench_now();
+    for (i = 0; i < num; i++)
+    {
+        int ret = fs->write(fs, fh, buf, block);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    vfs_bench_report(VFS_BENCH_MEMFS_FILE_NAME, "append", block, num, vfs_bench_now() - start);
+
+    return 0;
+}
+
+static int _vfs_bench_memfs_file_read(vfs_operations_t* fs, uintptr_t fh, void* buf, size_t block)
+{
+    size_t i;
+    const size_t num = VFS_BENCH_MEMFS_FILE_SIZE / block;
+
+    fs->seek(fs, fh, 0, VFS_SEEK_SET);
+
+    uint64_t start = vfs_bench_now();
+    for (i = 0; i < num; i++)
+    {
+        int ret = fs->read(fs, fh, buf, block);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    vfs_bench_report(VFS_BENCH_MEMFS_FILE_NAME, "read", block, num, vfs_bench_now() - start);
+
+    return 0;
+}
+
+static int _vfs_bench_memfs_file_run(size_t block)
+{
+    static uint8_t s_buf[65536];
+
+    int ret;
+    vfs_operations_t* fs = NULL;
+    if ((ret = vfs_make_memory(&fs)) != 0)
+    {
+        return ret;
+    }
+    memset(s_buf, 0xa5, sizeof(s_buf));
+
+    uintptr_t fh;
+    if ((ret = fs->open(fs, &fh, "/f", VFS_O_RDWR | VFS_O_CREATE | VFS_O_APPEND)) != 0)
+    {
+        goto finish;
+    }
+
+    if ((ret = _vfs_bench_memfs_file_append(fs, fh, s_buf, block)) == 0)
+    {
+        ret = _vfs_bench_memfs_file_read(fs, fh, s_buf, block);
+    }
+    fs->close(fs, fh);
+
+finish:
+    fs->destroy(fs);
+    return ret;
+}
+
+static int _vfs_bench_memfs_file(void)
+{
+    int ret;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(s_bench_memfs_file_block_sizes); i++)
+    {
+        if ((ret = _vfs_bench_memfs_file_run(s_bench_memfs_file_block_sizes[i])) != 0)
+        {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Append a large file with blocks of various size, then read it back.
+ */
+const vfs_bench_case_t vfs_bench_memfs_file = {
+    VFS_BENCH_MEMFS_FILE_NAME, _vfs_bench_memfs_file,
+};
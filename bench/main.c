@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <string.h>
+#include "utils/defs.h"
+#include "bench.h"
+
+extern const vfs_bench_case_t vfs_bench_memfs_dir;
+extern const vfs_bench_case_t vfs_bench_memfs_file;
+
+static const vfs_bench_case_t* s_bench_cases[] = {
+    &vfs_bench_memfs_dir,
+    &vfs_bench_memfs_file,
+};
+
+/**
+ * @brief Run all benchmarks, or the benchmarks whose name is given in command line.
+ */
+int main(int argc, char* argv[])
+{
+    int ret = 0;
+    size_t i;
+    int j;
+
+    for (i = 0; i < ARRAY_SIZE(s_bench_cases); i++)
+    {
+        const vfs_bench_case_t* bench = s_bench_cases[i];
+
+        int selected = argc <= 1;
+        for (j = 1; j < argc; j++)
+        {
+            if (strcmp(argv[j], bench->name) == 0)
+            {
+                selected = 1;
+            }
+        }
+        if (!selected)
+        {
+            continue;
+        }
+
+        int bench_ret = bench->entry();
+        if (bench_ret != 0)
+        {
+            fprintf(stderr, "%s: failed with %d\n", bench->name, bench_ret);
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
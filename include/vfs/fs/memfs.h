@@ -15,6 +15,318 @@ extern "C" {
  */
 int vfs_make_memory(vfs_operations_t** fs);
 
+/**
+ * @brief Memory usage of a in-memory file system.
+ */
+typedef struct vfs_memfs_statfs
+{
+    uint64_t    meta_used;      /**< Bytes used by nodes, names, directory and chunk tables. */
+
+    /**
+     * @brief Bytes used by file content.
+     * Content shared with snapshots and clones is counted by each of them.
+     * Small files keep content inside their nodes, which is part of meta_used.
+     */
+    uint64_t    data_used;
+
+    uint64_t    pool_cached;    /**< Bytes of free memory cached for reuse, not counted as used. */
+    uint64_t    hard_limit;     /**< Limit of used bytes, or 0 if unlimited. */
+    uint64_t    soft_limit;     /**< Used bytes that trigger soft limit callback, or 0 if disabled. */
+
+    uint64_t    zsrc_bytes;     /**< Bytes of file content that is stored compressed, before compression. */
+    uint64_t    zdata_bytes;    /**< Bytes used by compressed file content, included in data_used. */
+    uint64_t    decompress_cnt; /**< The number of times a compressed chunk is decompressed. */
+    uint64_t    decompress_ns;  /**< Total time spent on decompression, in nanoseconds. */
+} vfs_memfs_statfs_t;
+
+/**
+ * @brief Soft limit callback.
+ *
+ * It is called without lock held once usage goes over soft limit, so it is
+ * safe to free space by removing files of \p fs. It is not called again until
+ * usage drops to soft limit and goes over it again.
+ *
+ * @param[in] fs - The file system.
+ * @param[in] info - Usage at the time of callback.
+ * @param[in] data - User defined data.
+ */
+typedef void (*vfs_memfs_soft_limit_cb)(vfs_operations_t* fs, const vfs_memfs_statfs_t* info, void* data);
+
+/**
+ * @brief Set memory limits of in-memory file system.
+ *
+ * Once used bytes would go over \p hard_limit, any operation that requires
+ * more memory fails with #VFS_ENOSPC.
+ *
+ * @param[in] fs - The file system created by #vfs_make_memory().
+ * @param[in] hard_limit - Limit of used bytes, or 0 if unlimited.
+ * @param[in] soft_limit - Used bytes that trigger \p cb, or 0 to disable.
+ * @param[in] cb - Soft limit callback, can be NULL.
+ * @param[in] data - User defined data passed to \p cb.
+ * @return - 0: on success.
+ * @return - #VFS_EINVAL: if \p soft_limit is larger than \p hard_limit.
+ */
+int vfs_memfs_set_limit(vfs_operations_t* fs, uint64_t hard_limit, uint64_t soft_limit,
+    vfs_memfs_soft_limit_cb cb, void* data);
+
+/**
+ * @brief Get memory usage of in-memory file system.
+ * @param[in] fs - The file system created by #vfs_make_memory().
+ * @param[out] info - Memory usage.
+ */
+void vfs_memfs_statfs(vfs_operations_t* fs, vfs_memfs_statfs_t* info);
+
+/**
+ * @brief Enable or disable compression of cold file content.
+ *
+ * When enabled, the last access time of file content is tracked per block of
+ * a few KiB, and #vfs_memfs_compress() compresses blocks that are not
+ * accessed for \p idle_sec seconds. Compressed content is decompressed into
+ * a small cache when it is read, and is decompressed for good when it is
+ * written. Access before compression is enabled is not tracked, so such
+ * content is treated as accessed at the time of the call.
+ *
+ * @param[in] fs - The file system created by #vfs_make_memory().
+ * @param[in] enable - Non-zero to enable, or 0 to disable.
+ * @param[in] idle_sec - Content not accessed for this many seconds is cold.
+ * @return - 0: on success.
+ * @return - #VFS_EINVAL: if \p fs is read-only.
+ */
+int vfs_memfs_set_compress(vfs_operations_t* fs, int enable, uint32_t idle_sec);
+
+/**
+ * @brief Compress cold file content.
+ *
+ * The file system stays usable during the call. It is meant to be called
+ * periodically, e.g. from a background thread. Content shared with snapshots
+ * and clones is skipped, as compressing one copy does not save memory. This
+ * includes files that have not changed since a snapshot that is still used.
+ *
+ * @param[in] fs - The file system created by #vfs_make_memory().
+ * @return - 0: on success.
+ * @return - #VFS_EINVAL: if compression is not enabled, or \p fs is read-only.
+ * @return - #VFS_ENOMEM: if out of memory, content compressed so far is kept.
+ */
+int vfs_memfs_compress(vfs_operations_t* fs);
+
+/**
+ * @brief Frozen content of a in-memory file system.
+ */
+typedef struct vfs_memfs_snapshot vfs_memfs_snapshot_t;
+
+/**
+ * @brief Take a snapshot of in-memory file system.
+ *
+ * It takes constant time. The snapshot shares the tree of \p fs, and a
+ * directory is copied into the snapshot the first time it changes afterwards,
+ * or a file changes in it. File content is shared and copied on write. Every
+ * file is captured consistently, but changes made to \p fs during the call
+ * may or may not be captured.
+ *
+ * @param[in] fs - The file system created by #vfs_make_memory().
+ * @param[out] snapshot - The snapshot.
+ * @return - 0: on success.
+ * @return - #VFS_EINVAL: if \p fs is read-only.
+ * @return - -errno: on failure.
+ */
+int vfs_memfs_snapshot(vfs_operations_t* fs, vfs_memfs_snapshot_t** snapshot);
+
+/**
+ * @brief Release snapshot.
+ *
+ * File systems cloned from \p snapshot are not affected.
+ *
+ * @param[in] snapshot - The snapshot.
+ */
+void vfs_memfs_snapshot_release(vfs_memfs_snapshot_t* snapshot);
+
+/**
+ * @brief Create a in-memory file system with the content of \p snapshot.
+ *
+ * It takes constant time. A directory is copied from the snapshot when it is
+ * accessed for the first time, and file content is copied on write, so a
+ * clone only uses memory for what it has changed.
+ *
+ * @param[in] snapshot - The snapshot.
+ * @param[out] fs - The created file system.
+ * @return - 0: on success.
+ * @return - -errno: on failure.
+ */
+int vfs_memfs_clone(const vfs_memfs_snapshot_t* snapshot, vfs_operations_t** fs);
+
+/**
+ * @brief Content addressed store of file content, shared by in-memory file
+ *   systems for deduplication.
+ */
+typedef struct vfs_memfs_store vfs_memfs_store_t;
+
+/**
+ * @brief Dedup store statistics.
+ */
+typedef struct vfs_memfs_store_stat
+{
+    uint64_t    unique_bytes;   /**< Bytes of distinct content in store. */
+
+    /**
+     * @brief Bytes of file content that refer to content in store.
+     * Dedup ratio is this value divided by unique_bytes.
+     */
+    uint64_t    ref_bytes;
+
+    uint64_t    lookup_cnt;     /**< The number of blocks looked up in store. */
+    uint64_t    hit_cnt;        /**< The number of blocks found in store and shared. */
+} vfs_memfs_store_stat_t;
+
+/**
+ * @brief Create an empty dedup store.
+ * @param[out] store - The store.
+ * @return - 0: on success.
+ * @return - #VFS_ENOMEM: if out of memory.
+ */
+int vfs_memfs_store_create(vfs_memfs_store_t** store);
+
+/**
+ * @brief Release dedup store.
+ *
+ * File systems that use \p store are not affected, the store is freed once
+ * nobody uses it.
+ *
+ * @param[in] store - The store.
+ */
+void vfs_memfs_store_release(vfs_memfs_store_t* store);
+
+/**
+ * @brief Get statistics of dedup store.
+ * @param[in] store - The store.
+ * @param[out] info - Statistics.
+ */
+void vfs_memfs_store_stat(vfs_memfs_store_t* store, vfs_memfs_store_stat_t* info);
+
+/**
+ * @brief Deduplicate file content of in-memory file system through \p store.
+ *
+ * When a file opened for write is closed, its content is hashed in blocks of
+ * a few KiB. Blocks that already exist in \p store are shared, the others
+ * are added to \p store, and shared blocks are copied on write. Shared
+ * content is still counted in #vfs_memfs_statfs_t::data_used of each file
+ * system, as it is for snapshots.
+ *
+ * @param[in] fs - The file system created by #vfs_make_memory().
+ * @param[in] store - The store, or NULL to disable deduplication.
+ * @return - 0: on success.
+ * @return - #VFS_EINVAL: if \p fs is read-only.
+ */
+int vfs_memfs_set_dedup(vfs_operations_t* fs, vfs_memfs_store_t* store);
+
+/**
+ * @brief Save in-memory file system as an image file.
+ *
+ * The image holds a node table, a string table of names and file content,
+ * so it can be loaded by #vfs_memfs_load() in a single sequential read.
+ * Holes are not stored, and compressed content is stored as is. The tree is
+ * captured through #vfs_memfs_snapshot(), so \p fs may be used at the same
+ * time.
+ *
+ * @param[in] fs - The file system created by #vfs_make_memory().
+ * @param[in] path - Path of image file in native file system. Existing file
+ *   is overwritten.
+ * @return - 0: on success.
+ * @return - #VFS_EINVAL: if \p fs is read-only.
+ * @return - -errno: on failure.
+ */
+int vfs_memfs_save(vfs_operations_t* fs, const char* path);
+
+/**
+ * @brief Create a in-memory file system from image file.
+ * @param[out] fs - The created file system.
+ * @param[in] path - Path of image file created by #vfs_memfs_save().
+ * @return - 0: on success.
+ * @return - #VFS_EIO: if image is malformed.
+ * @return - -errno: on other failures.
+ */
+int vfs_memfs_load(vfs_operations_t** fs, const char* path);
+
+/**
+ * @brief Journal configuration.
+ */
+typedef struct vfs_memfs_journal_config
+{
+    const char* image_path;         /**< Path of checkpoint image in native file system. */
+    const char* journal_path;       /**< Path of journal in native file system. */
+
+    /**
+     * @brief Group commit interval in milliseconds.
+     * Records of operations in the same interval are flushed to storage
+     * together, so at most this much of recent changes is lost on crash. If
+     * 0, every operation is flushed before it returns.
+     */
+    uint32_t    flush_ms;
+
+    /**
+     * @brief Take a checkpoint once journal grows over this size in bytes, or
+     *   0 to only take checkpoints by #vfs_memfs_checkpoint().
+     */
+    uint64_t    checkpoint_bytes;
+} vfs_memfs_journal_config_t;
+
+/**
+ * @brief Create a durable in-memory file system.
+ *
+ * The file system is loaded from checkpoint image, and operations recorded in
+ * journal after that checkpoint are replayed. Afterwards every successful
+ * mkdir, rmdir, unlink, write, truncate and open that may create or truncate
+ * a file is appended to journal. A checkpoint saves the whole file system as
+ * a new image and empties the journal.
+ *
+ * Journaled operations are serialized, reads are not affected. Once journal
+ * can not be written, journaled operations fail with the same error.
+ *
+ * @param[out] fs - The created file system.
+ * @param[in] config - Journal configuration.
+ * @return - 0: on success.
+ * @return - -errno: on failure.
+ */
+int vfs_make_memory_journal(vfs_operations_t** fs, const vfs_memfs_journal_config_t* config);
+
+/**
+ * @brief Take a checkpoint of journaled in-memory file system.
+ * @param[in] fs - The file system created by #vfs_make_memory_journal().
+ * @return - 0: on success.
+ * @return - #VFS_EINVAL: if \p fs is not journaled.
+ * @return - -errno: on other failures.
+ */
+int vfs_memfs_checkpoint(vfs_operations_t* fs);
+
+/**
+ * @brief Flush journal to storage without waiting for group commit.
+ * @param[in] fs - The file system created by #vfs_make_memory_journal().
+ * @return - 0: on success.
+ * @return - #VFS_EINVAL: if \p fs is not journaled.
+ * @return - -errno: on other failures.
+ */
+int vfs_memfs_sync(vfs_operations_t* fs);
+
+/**
+ * @brief Make in-memory file system read-only for good.
+ *
+ * The tree is compacted into one array of nodes, where children of each
+ * directory are contiguous and sorted by name, and all file content is
+ * copied into one data region, decompressed. Afterwards lookups and reads
+ * take no lock and no reference, and every operation that changes the file
+ * system fails with #VFS_EROFS.
+ *
+ * A file handle of read-only file system must not be used by multiple threads
+ * at the same time.
+ *
+ * @warning \p fs must not be used by other threads during the call.
+ * @param[in] fs - The file system created by #vfs_make_memory().
+ * @return - 0: on success, or if \p fs is read-only already.
+ * @return - #VFS_EBUSY: if any file is opened.
+ * @return - #VFS_EINVAL: if \p fs is journaled.
+ * @return - -errno: on other failures, \p fs is not changed.
+ */
+int vfs_memfs_set_readonly(vfs_operations_t* fs);
+
 #ifdef __cplusplus
 }
 #endif
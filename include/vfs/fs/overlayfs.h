@@ -9,6 +9,8 @@ extern "C" {
 
 /**
  * @brief Create an overlay file system.
+ * @note Entries of both file systems are indexed in memory, so neither of
+ *   them may be changed except through the overlay file system.
  * @param[out] fs - The created file system.
  * @param[in] lower - The lower file system.
  * @param[in] upper - The upper file system.
@@ -18,6 +20,112 @@ extern "C" {
 int vfs_make_overlay(vfs_operations_t** fs, vfs_operations_t* lower,
 	vfs_operations_t* upper);
 
+/**
+ * @brief Create an overlay file system on top of several lower layers.
+ *
+ * Layers are searched from \p upper down to the last lower layer, and the
+ * first layer that has an entry wins. Whiteout entries and opaque directories
+ * in lower layers are honored the same way as in upper layer, so a previously
+ * used upper layer can be reused as a lower one.
+ *
+ * @note Entries of all layers are indexed in memory, so no layer may be changed
+ *   except through the overlay file system. Only recently used directories
+ *   of each layer are kept, others are listed again when needed.
+ * @note The overlay file system takes ownership of all layers.
+ * @param[out] fs - The created file system.
+ * @param[in] lowers - The lower file systems, `lowers[0]` is the top-most one.
+ * @param[in] lower_sz - The number of lower file systems, must not be 0.
+ * @param[in] upper - The upper file system.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+*/
+int vfs_make_overlay_ex(vfs_operations_t** fs, vfs_operations_t** lowers,
+	size_t lower_sz, vfs_operations_t* upper);
+
+/**
+ * @brief Set block size of copy-up.
+ *
+ * By default a file in lower layer is fully copied to upper layer when it is
+ * opened for write. With a non-zero \p block_sz the open returns at once, and
+ * content is copied block by block: a block is copied only when it is
+ * partially written, blocks that are fully overwritten are never copied, and
+ * untouched blocks are read from lower layer. Remaining blocks are copied
+ * when the last handle of the file is closed.
+ *
+ * Opening with #VFS_O_TRUNCATE never copies any content.
+ *
+ * @param[in] fs - The file system created by #vfs_make_overlay().
+ * @param[in] block_sz - Block size in bytes, or 0 to copy whole file on open.
+ * @return - 0: on success.
+*/
+int vfs_overlayfs_set_copyup_block(vfs_operations_t* fs, size_t block_sz);
+
+/**
+ * @brief Copy files from lower layer in background.
+ *
+ * Copy-up works block by block as described in
+ * #vfs_overlayfs_set_copyup_block(), and a background worker copies all
+ * blocks in order at once after the file is opened. Reads are served from
+ * lower layer until the worker catches up, and writes only wait for the block
+ * that is being copied.
+ *
+ * If block size is not set, a default one is used, and it is reset to 0
+ * when background copy-up is disabled again.
+ *
+ * @warning Must not be called while any file is open.
+ * @param[in] fs - The file system created by #vfs_make_overlay().
+ * @param[in] thread_sz - The number of worker threads, or 0 to disable.
+ * @return - 0: on success.
+*/
+int vfs_overlayfs_set_copyup_async(vfs_operations_t* fs, size_t thread_sz);
+
+/**
+ * @brief Get progress of copy-up of a file.
+ * @param[in] fs - The file system created by #vfs_make_overlay().
+ * @param[in] path - File path.
+ * @param[out] copied - Bytes already copied to upper layer.
+ * @param[out] total - Size of the file in lower layer.
+ * @return - 0: on success.
+ * @return - #VFS_ENOENT: if \p path is not being copied.
+ * @return - -errno: if copy failed. The error is also returned when the file
+ *   is closed, and copy is tried again when its last handle is closed.
+*/
+int vfs_overlayfs_copyup_progress(vfs_operations_t* fs, const char* path,
+	uint64_t* copied, uint64_t* total);
+
+/**
+ * @brief Remove directory trees of upper layer in parallel.
+ *
+ * Removing a directory also removes whiteout entries under it from upper
+ * layer, which can be many. With a non-zero \p thread_sz they are removed by
+ * that many threads.
+ * The threads are created on first removal and kept until \p fs is
+ * destroyed.
+ *
+ * @note The upper layer must be thread safe if \p thread_sz is not 0.
+ * @param[in] fs - The file system created by #vfs_make_overlay().
+ * @param[in] thread_sz - The number of threads, or 0 to remove in calling thread.
+ * @return - 0: on success.
+*/
+int vfs_overlayfs_set_rmdir_async(vfs_operations_t* fs, size_t thread_sz);
+
+/**
+ * @brief Write merged content of overlay file system into \p dst.
+ *
+ * The result is a plain tree without any whiteout entry or opaque marker, so
+ * it can be used as the only lower layer of a new overlay file system with an
+ * empty upper layer, which collapses all existing layers into one.
+ *
+ * @warning The overlay file system must not be changed during squash.
+ * @param[in] fs - The file system created by #vfs_make_overlay().
+ * @param[in] dst - The target file system, should be empty.
+ * @param[in] thread_sz - The number of threads that copy files, or 0 to copy
+ *   them in calling thread.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+*/
+int vfs_overlay_squash(vfs_operations_t* fs, vfs_operations_t* dst, size_t thread_sz);
+
 #ifdef __cplusplus
 }
 #endif
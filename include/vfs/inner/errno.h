@@ -32,6 +32,15 @@
 #   define VFS_EIO          (-5)
 #endif
 
+/**
+ * @brief No such device or address.
+ */
+#if defined(ENXIO)
+#   define VFS_ENXIO        VFS__ERR(ENXIO)
+#else
+#   define VFS_ENXIO        (-6)
+#endif
+
 /**
  * @brief Bad file descriptor.
  */
@@ -59,6 +68,15 @@
 #   define VFS_EACCES       (-13)
 #endif
 
+/**
+ * @brief Device or resource busy.
+ */
+#if defined(EBUSY)
+#   define VFS_EBUSY        VFS__ERR(EBUSY)
+#else
+#   define VFS_EBUSY        (-16)
+#endif
+
 /**
  * @brief File exists.
  */
@@ -95,6 +113,15 @@
 #   define VFS_EINVAL       (-22)
 #endif
 
+/**
+ * @brief No space left on device.
+ */
+#if defined(ENOSPC)
+#   define VFS_ENOSPC       VFS__ERR(ENOSPC)
+#else
+#   define VFS_ENOSPC       (-28)
+#endif
+
 /**
  * @brief Invalid seek.
  */
@@ -104,6 +131,15 @@
 #   define VFS_ESPIPE       (-29)
 #endif
 
+/**
+ * @brief Read-only file system.
+ */
+#if defined(EROFS)
+#   define VFS_EROFS        VFS__ERR(EROFS)
+#else
+#   define VFS_EROFS        (-30)
+#endif
+
 #if defined(ENOSYS)
 #   define VFS_ENOSYS       VFS__ERR(ENOSYS)
 #else
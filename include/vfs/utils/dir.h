@@ -37,6 +37,49 @@ int vfs_dir_make(vfs_operations_t* fs, const char* path);
  */
 int vfs_dir_delete(vfs_operations_t* fs, const char* path);
 
+/**
+ * @brief Progress callback of #vfs_dir_delete_ex().
+ * @param[in] removed - The number of files and directories removed so far.
+ * @param[in] data - User defined data.
+ */
+typedef void (*vfs_dir_delete_progress_cb)(uint64_t removed, void* data);
+
+typedef struct vfs_dir_delete_cfg
+{
+    /**
+     * @brief The number of threads that remove files, or 0 to remove them in
+     *   calling thread.
+     * @note \p fs must be thread safe if it is not 0.
+     */
+    size_t                      thread_sz;
+
+    /**
+     * @brief (Optional) Progress callback, always called in calling thread.
+     */
+    vfs_dir_delete_progress_cb  progress;
+
+    void*                       data;       /**< User defined data passed to #vfs_dir_delete_cfg_t::progress. */
+} vfs_dir_delete_cfg_t;
+
+/**
+ * @brief Delete directory with options.
+ *
+ * Same as #vfs_dir_delete(), with exception that:
+ * 1. Files of each directory are listed first, and then removed by up to
+ *   #vfs_dir_delete_cfg_t::thread_sz threads.
+ * 2. Directories are removed bottom-up after all files are removed.
+ * 3. It stops on the first error, and the error is returned.
+ *
+ * @param[in] fs - The file system.
+ * @param[in] path - The path of the directory, encoding in UTF-8.
+ * @param[in] cfg - (Optional) Configuration, NULL to remove in calling thread.
+ * @return - 0: on success.
+ * @return - #VFS_ENOSYS: \p fs does not implement #vfs_operations_t::rmdir(),
+ *   #vfs_operations_t::unlink() or #vfs_operations_t::ls().
+ * @return - -errno: on error.
+ */
+int vfs_dir_delete_ex(vfs_operations_t* fs, const char* path, const vfs_dir_delete_cfg_t* cfg);
+
 #ifdef __cplusplus
 }
 #endif
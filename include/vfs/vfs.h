@@ -31,6 +31,8 @@ typedef enum vfs_seek_flag
     VFS_SEEK_SET    = 0,    /**< Start of file. */
     VFS_SEEK_CUR    = 1,    /**< Current position. */
     VFS_SEEK_END    = 2,    /**< End of file. */
+    VFS_SEEK_DATA   = 3,    /**< Next data at or after offset. #VFS_ENXIO if there is no more data. */
+    VFS_SEEK_HOLE   = 4,    /**< Next hole at or after offset. End of file is always treated as a hole. */
 } vfs_seek_flag_t;
 
 typedef struct vfs_stat
@@ -38,6 +40,7 @@ typedef struct vfs_stat
     uint64_t st_mode;   /**< File mode. See #vfs_stat_flag_t. */
     uint64_t st_size;   /**< File size in bytes. */
     uint64_t st_mtime;  /**< File last modification time in seconds in UTC. */
+    uint64_t st_blocks; /**< Number of 512B blocks allocated. It may be less than #vfs_stat_t::st_size for sparse files. */
 } vfs_stat_t;
 
 /**
@@ -1,3 +1,6 @@
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#   define _GNU_SOURCE /* For SEEK_DATA and SEEK_HOLE. */
+#endif
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
@@ -39,7 +42,7 @@ static uint64_t _vfs_win_filetime_2_utc(const FILETIME* t)
 
 static vfs_stat_t _vfs_win_find_data_to_vfs_stat(const WIN32_FIND_DATAA* src)
 {
-    vfs_stat_t info = { 0,0,0 };
+    vfs_stat_t info = { 0,0,0,0 };
 
     if (src->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
     {
@@ -54,6 +57,7 @@ static vfs_stat_t _vfs_win_find_data_to_vfs_stat(const WIN32_FIND_DATAA* src)
     file_size.LowPart = src->nFileSizeLow;
     file_size.HighPart = src->nFileSizeHigh;
     info.st_size = file_size.QuadPart;
+    info.st_blocks = (info.st_size + 511) / 512;
 
     info.st_mtime = _vfs_win_filetime_2_utc(&src->ftLastWriteTime);
 
@@ -76,7 +80,7 @@ static int _vfs_local_ls_drivers(vfs_ls_cb fn, void* data)
     assert(dwResult > 0);
 
     const vfs_stat_t info = {
-        VFS_S_IFDIR, 0, 0,
+        VFS_S_IFDIR, 0, 0, 0,
     };
     char* szSingleDrive = logical_drives.str;
     assert(szSingleDrive != NULL);
@@ -303,6 +307,7 @@ static vfs_stat_t _vfs_localfs_stat_to_vfs(const struct _stat* src)
         0,
         src->st_size,
         src->st_mtime,
+        (src->st_size + 511) / 512,
     };
 
     if ((src->st_mode & S_IFMT) == S_IFREG)
@@ -329,11 +334,48 @@ static DWORD _vfs_localfs_vfs_whence_to_win32(int whence)
     abort();
 }
 
+/**
+ * @brief Emulate #VFS_SEEK_DATA and #VFS_SEEK_HOLE, the whole file is treated as data.
+ */
+static int64_t _vfs_localfs_seek_data(HANDLE file_handle, int64_t offset, int whence)
+{
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size))
+    {
+        DWORD errcode = GetLastError();
+        return vfs_translate_sys_err(errcode);
+    }
+
+    if (offset < 0)
+    {
+        return VFS_EINVAL;
+    }
+    if (offset >= file_size.QuadPart)
+    {
+        return VFS_ENXIO;
+    }
+
+    LARGE_INTEGER pos;
+    pos.QuadPart = whence == VFS_SEEK_DATA ? offset : file_size.QuadPart;
+    if (!SetFilePointerEx(file_handle, pos, NULL, FILE_BEGIN))
+    {
+        DWORD errcode = GetLastError();
+        return vfs_translate_sys_err(errcode);
+    }
+
+    return pos.QuadPart;
+}
+
 static int64_t _vfs_localfs_seek(struct vfs_operations* thiz, uintptr_t fh, int64_t offset, int whence)
 {
     (void)thiz;
     HANDLE file_handle = (HANDLE)fh;
 
+    if (whence == VFS_SEEK_DATA || whence == VFS_SEEK_HOLE)
+    {
+        return _vfs_localfs_seek_data(file_handle, offset, whence);
+    }
+
     LARGE_INTEGER win_offset;
     win_offset.QuadPart = offset;
     LONG lDistanceToMove = win_offset.LowPart;
@@ -415,6 +457,7 @@ static vfs_stat_t _vfs_localfs_stat_to_vfs(const struct stat* src)
         0,
         src->st_size,
         src->st_mtim.tv_sec,
+        src->st_blocks,
     };
 
     if ((src->st_mode & S_IFMT) == S_IFREG)
@@ -597,16 +640,60 @@ static int _vfs_localfs_vfs_whence_to_linux(int whence)
     case VFS_SEEK_SET:  return SEEK_SET;
     case VFS_SEEK_CUR:  return SEEK_CUR;
     case VFS_SEEK_END:  return SEEK_END;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    case VFS_SEEK_DATA: return SEEK_DATA;
+    case VFS_SEEK_HOLE: return SEEK_HOLE;
+#endif
     default:            break;
     }
     abort();
 }
 
+#if !defined(SEEK_DATA) || !defined(SEEK_HOLE)
+
+/**
+ * @brief Emulate #VFS_SEEK_DATA and #VFS_SEEK_HOLE, the whole file is treated as data.
+ */
+static int64_t _vfs_localfs_seek_data(int fd, int64_t offset, int whence)
+{
+    struct stat buf;
+    if (fstat(fd, &buf) != 0)
+    {
+        int errcode = errno;
+        return vfs_translate_sys_err(errcode);
+    }
+
+    if (offset < 0)
+    {
+        return VFS_EINVAL;
+    }
+    if (offset >= buf.st_size)
+    {
+        return VFS_ENXIO;
+    }
+
+    off_t pos = whence == VFS_SEEK_DATA ? offset : buf.st_size;
+    if (lseek(fd, pos, SEEK_SET) < 0)
+    {
+        int errcode = errno;
+        return vfs_translate_sys_err(errcode);
+    }
+    return pos;
+}
+
+#endif
+
 static int64_t _vfs_localfs_seek(struct vfs_operations* thiz, uintptr_t fh, int64_t offset, int whence)
 {
     (void)thiz;
 
     int fd = fh;
+#if !defined(SEEK_DATA) || !defined(SEEK_HOLE)
+    if (whence == VFS_SEEK_DATA || whence == VFS_SEEK_HOLE)
+    {
+        return _vfs_localfs_seek_data(fd, offset, whence);
+    }
+#endif
     whence = _vfs_localfs_vfs_whence_to_linux(whence);
 
     off_t ret = lseek(fd, offset, whence);
@@ -1,20 +1,134 @@
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_WIN32)
+#   include <io.h>
+#else
+#   include <unistd.h>
+#endif
+#include "utils/clock.h"
 #include "utils/defs.h"
+#include "utils/epoch.h"
+#include "utils/hash.h"
+#include "utils/lz4.h"
+#include "utils/sem.h"
+#include "utils/slab.h"
 #include "utils/strlist.h"
+#include "utils/thread.h"
 #include "utils/dir.h"
 #include "memfs.h"
 
+/**
+ * @brief Lock-free search of a directory is retried this many times if the
+ *   directory is changing, before falling back to lock.
+ */
+#define VFS_MEMFS_LOOKUP_RETRY  8
+
 typedef struct vfs_memfs
 {
     vfs_operations_t            op;                 /**< Base operations. */
     vfs_memfs_io_t              io;                 /**< IO layer. */
 
+    /**
+     * @brief Reference count.
+     * One is held by user, and one by each directory of other file systems
+     * whose origin is owned by this file system.
+     */
+    vfs_atomic_t                refcnt;
+
     ev_map_t                    session_map;        /**< Session map. */
     vfs_mutex_t                 session_map_lock;   /**< Session map lock. */
 
     vfs_memfs_node_t*           root;               /**< File system tree. */
+    vfs_epoch_t                 epoch;              /**< Reclamation of nodes and directory arrays. */
+    vfs_slab_t                  node_slab;          /**< Allocator of nodes. */
+    vfs_slab_t                  session_slab;       /**< Allocator of sessions. */
+
+    struct
+    {
+        vfs_mutex_t             lock;               /**< Pool lock. */
+        vfs_memfs_chunk_t*      free_list;          /**< Free chunks. */
+        size_t                  free_sz;            /**< The number of free chunks. */
+    } chunk_pool;
+
+    struct
+    {
+        vfs_mutex_t             lock;               /**< Protects all usage fields. */
+        uint64_t                meta;               /**< Bytes used by nodes, names, children arrays, indexes and chunk tables. */
+        uint64_t                data;               /**< Bytes used by file content. */
+        uint64_t                hard_limit;         /**< Limit of total usage, or 0 if unlimited. */
+        uint64_t                soft_limit;         /**< Usage that triggers callback, or 0 if disabled. */
+        int                     soft_notified;      /**< Callback is called since usage went over soft limit. */
+        vfs_memfs_soft_limit_cb soft_cb;            /**< Soft limit callback. */
+        void*                   soft_data;          /**< Soft limit callback data. */
+        uint64_t                zsrc;               /**< Bytes of content stored compressed, before compression. */
+        uint64_t                zdata;              /**< Bytes used by compressed content, included in data. */
+        uint64_t                decompress_cnt;     /**< The number of decompressions. */
+        uint64_t                decompress_ns;      /**< Time spent on decompression. */
+    } usage;
+
+    struct
+    {
+        vfs_atomic_t            enabled;            /**< Non-zero if access time of chunks is tracked. */
+        vfs_atomic_t            tick;               /**< Current time in seconds since #vfs_memfs_t::compress::base. */
+        uint64_t                base;               /**< Creation time of file system, in nanoseconds. */
+        vfs_mutex_t             lock;               /**< Serializes compression passes, and protects fields below. */
+        int                     enable_tick;        /**< Tick when compression is enabled. */
+        uint32_t                idle_sec;           /**< Chunks not accessed for this many seconds are cold. */
+    } compress;
+
+    struct
+    {
+        vfs_mutex_t             lock;               /**< Protects #vfs_memfs_t::dedup::store. */
+        vfs_memfs_store_t*      store;              /**< Referenced dedup store, or NULL if disabled. */
+    } dedup;
+
+    /**
+     * @brief Recently decompressed chunks.
+     * Each slot holds a reference of a compressed chunk, so it can not be
+     * freed and reused while it is cached.
+     */
+    struct
+    {
+        vfs_mutex_t             lock;               /**< Protects all slots. */
+        size_t                  next;               /**< The slot to replace on next miss. */
+        struct
+        {
+            vfs_memfs_chunk_t*  chunk;              /**< Compressed chunk, or NULL if slot is empty. */
+            uint8_t             data[VFS_MEMFS_CHUNK_SIZE]; /**< Decompressed content. */
+        } slots[VFS_MEMFS_ZCACHE_SIZE];
+    } zcache;
+
+    struct vfs_memfs_journal*   journal;            /**< Journal, or NULL if not journaled. */
+    struct vfs_memfs_readonly*  readonly;           /**< Read-only tree, or NULL if writable. */
+
+    /**
+     * @brief Snapshots taken from this file system.
+     * A snapshot shares the tree of this file system until it changes. Every
+     * snapshot has a generation, and a node older than a snapshot is captured
+     * by it before the node changes.
+     */
+    struct
+    {
+        vfs_mutex_t             lock;               /**< Serializes captures, and protects list and last. */
+        ev_list_t               list;               /**< Snapshots that may share nodes, oldest first. */
+        int                     last;               /**< Generation of the last snapshot taken. */
+        vfs_atomic_t            gen;                /**< Generation of the newest snapshot in list, or 0 if list is empty. */
+    } snap;
+
+    /**
+     * @brief The file system that this snapshot is taken from.
+     * Only set if this file system holds a snapshot, which is never exposed
+     * to user.
+     */
+    struct
+    {
+        struct vfs_memfs*       fs;                 /**< Referenced source, or NULL if this is not a snapshot. */
+        ev_list_node_t          node;               /**< Node in #vfs_memfs_t::snap::list of source. */
+        int                     gen;                /**< Generation of snapshot. */
+    } source;
 } vfs_memfs_t;
 
 static int _vfs_memfs_common_cmp_session(const ev_map_node_t* key1,
@@ -35,1075 +149,5896 @@ static void _vfs_memfs_common_acquire_node(vfs_memfs_node_t* node)
     (void)vfs_atomic_add(&node->refcnt);
 }
 
-static void _vfs_memfs_common_remove_node_from_parent(vfs_memfs_node_t* node)
+/**
+ * @brief Acquire \p node found without lock, unless it is being destroyed.
+ * @param[in] node - The node.
+ * @return 1 if acquired, or 0 if reference count has dropped to zero.
+ */
+static int _vfs_memfs_common_try_acquire_node(vfs_memfs_node_t* node)
 {
-    vfs_memfs_node_t* parent = node->parent;
-    if (parent == NULL)
+    int cnt = vfs_atomic_load(&node->refcnt);
+    while (cnt != 0)
     {
-        return;
+        int old = vfs_atomic_cas(&node->refcnt, cnt, cnt + 1);
+        if (old == cnt)
+        {
+            return 1;
+        }
+        cnt = old;
     }
-    assert(parent->stat.st_mode & VFS_S_IFDIR);
+    return 0;
+}
 
-    size_t i;
-    vfs_rwlock_wrlock(&parent->rwlock);
-    for (i = 0; i < parent->data.dir.children_sz; i++)
+/**
+ * @brief Charge \p size bytes to usage \p counter of \p fs.
+ * @param[in] fs - File system object.
+ * @param[in,out] counter - Either `fs->usage.meta` or `fs->usage.data`.
+ * @param[in] size - Bytes to charge.
+ * @return 0 on success, or #VFS_ENOSPC if hard limit is exceeded.
+ */
+static int _vfs_memfs_usage_charge(vfs_memfs_t* fs, uint64_t* counter, uint64_t size)
+{
+    int ret = 0;
+    vfs_mutex_enter(&fs->usage.lock);
     {
-        if (parent->data.dir.children[i] == node)
+        const uint64_t used = fs->usage.meta + fs->usage.data;
+        if (fs->usage.hard_limit != 0 && used + size > fs->usage.hard_limit)
         {
-            /* Set to NULL to unlink child. */
-            parent->data.dir.children[i] = NULL;
-
-            /* Move element if necessary. */
-            if (i != parent->data.dir.children_sz - 1)
-            {
-                size_t move_sz = parent->data.dir.children_sz - i - 1;
-                move_sz = move_sz * sizeof(vfs_memfs_node_t*);
-
-                vfs_memfs_node_t* dst_pos = parent->data.dir.children[i];
-                vfs_memfs_node_t* src_pos = parent->data.dir.children[i + 1];
-
-                memmove(dst_pos, src_pos, move_sz);
-            }
-
-            parent->data.dir.children_sz--;
+            ret = VFS_ENOSPC;
+        }
+        else
+        {
+            *counter += size;
+        }
+    }
+    vfs_mutex_leave(&fs->usage.lock);
+    return ret;
+}
 
-            break;
+/**
+ * @brief Give back \p size bytes charged by #_vfs_memfs_usage_charge().
+ */
+static void _vfs_memfs_usage_uncharge(vfs_memfs_t* fs, uint64_t* counter, uint64_t size)
+{
+    vfs_mutex_enter(&fs->usage.lock);
+    {
+        *counter -= size;
+        if (fs->usage.meta + fs->usage.data <= fs->usage.soft_limit)
+        {
+            fs->usage.soft_notified = 0;
         }
     }
-    vfs_rwlock_wrunlock(&parent->rwlock);
+    vfs_mutex_leave(&fs->usage.lock);
+}
 
-    node->parent = NULL;
+/**
+ * @brief Account \p cnt compressed chunks using \p zbytes bytes in total.
+ * Both are negative when compressed chunks are released.
+ * @note Data usage is charged separately.
+ */
+static void _vfs_memfs_usage_compressed(vfs_memfs_t* fs, int64_t cnt, int64_t zbytes)
+{
+    vfs_mutex_enter(&fs->usage.lock);
+    {
+        fs->usage.zsrc += (uint64_t)(cnt * VFS_MEMFS_CHUNK_SIZE);
+        fs->usage.zdata += (uint64_t)zbytes;
+    }
+    vfs_mutex_leave(&fs->usage.lock);
 }
 
 /**
- * @brief Release the ownership of \p node.
- * @param[in] node - The node to be released.
- * @param[in] unlink - If true, force unlink the node from its parent.
+ * @brief Get current usage of \p fs.
  */
-static void _vfs_memfs_common_release_node(vfs_memfs_node_t* node, int unlink)
+static void _vfs_memfs_usage_query(vfs_memfs_t* fs, vfs_memfs_statfs_t* info)
 {
-    if (unlink)
+    vfs_mutex_enter(&fs->usage.lock);
     {
-        _vfs_memfs_common_remove_node_from_parent(node);
+        info->meta_used = fs->usage.meta;
+        info->data_used = fs->usage.data;
+        info->hard_limit = fs->usage.hard_limit;
+        info->soft_limit = fs->usage.soft_limit;
+        info->zsrc_bytes = fs->usage.zsrc;
+        info->zdata_bytes = fs->usage.zdata;
+        info->decompress_cnt = fs->usage.decompress_cnt;
+        info->decompress_ns = fs->usage.decompress_ns;
     }
+    vfs_mutex_leave(&fs->usage.lock);
 
-    if (vfs_atomic_dec(&node->refcnt) != 0)
+    vfs_mutex_enter(&fs->chunk_pool.lock);
     {
-        return;
+        info->pool_cached = (uint64_t)fs->chunk_pool.free_sz * VFS_MEMFS_CHUNK_SIZE;
     }
+    vfs_mutex_leave(&fs->chunk_pool.lock);
+}
 
-    _vfs_memfs_common_remove_node_from_parent(node);
+/**
+ * @brief Call soft limit callback if usage has gone over soft limit.
+ * @warning Must not be called with any lock held, as the callback may access
+ *   the file system.
+ * @param[in] fs - File system object.
+ */
+static void _vfs_memfs_usage_check_soft_limit(vfs_memfs_t* fs)
+{
+    vfs_memfs_soft_limit_cb cb = NULL;
+    void* cb_data = NULL;
 
-    if (node->stat.st_mode & VFS_S_IFDIR)
+    vfs_mutex_enter(&fs->usage.lock);
+    if (fs->usage.soft_cb != NULL && fs->usage.soft_limit != 0 && !fs->usage.soft_notified
+        && fs->usage.meta + fs->usage.data > fs->usage.soft_limit)
     {
-        while (node->data.dir.children_sz != 0)
-        {
-            vfs_memfs_node_t* child = node->data.dir.children[node->data.dir.children_sz - 1];
-            _vfs_memfs_common_release_node(child, 1);
-
-            /*
-             * DO NOT REDUCE SIZE HERE!
-             * The #_vfs_memfs_common_release_node() will maintain the children size.
-             */
-        }
-        free(node->data.dir.children);
-        node->data.dir.children = NULL;
-        node->data.dir.children_sz = 0;
-        node->data.dir.children_cap = 0;
+        fs->usage.soft_notified = 1;
+        cb = fs->usage.soft_cb;
+        cb_data = fs->usage.soft_data;
     }
-    else
+    vfs_mutex_leave(&fs->usage.lock);
+
+    if (cb != NULL)
     {
-        free(node->data.reg.data);
-        node->data.reg.data = NULL;
-        node->stat.st_size = 0;
+        vfs_memfs_statfs_t info;
+        _vfs_memfs_usage_query(fs, &info);
+        cb(&fs->op, &info, cb_data);
     }
+}
 
-    vfs_str_exit(&node->name);
-    free(node);
+static uint64_t _vfs_memfs_common_hash_name(const vfs_str_t* name)
+{
+    return vfs_hash64(name->str, name->len, 0);
 }
 
-static vfs_memfs_node_t* _vfs_memfs_common_search_for_nolock(vfs_memfs_node_t* parent, const vfs_str_t* name)
+static void _vfs_memfs_dir_index_insert(vfs_memfs_dir_index_t* index, vfs_memfs_node_t* node)
 {
-    size_t i;
-    vfs_memfs_node_t* node = NULL;
+    const size_t mask = index->cap - 1;
+    size_t pos = (size_t)node->name_hash & mask;
 
-    for (i = 0; i < parent->data.dir.children_sz; i++)
+    while (index->slots[pos] != NULL)
     {
-        vfs_memfs_node_t* child = parent->data.dir.children[i];
-        if (vfs_str_cmp2(&child->name, name) == 0)
-        {
-            node = child;
-            _vfs_memfs_common_acquire_node(node);
-            break;
-        }
+        pos = (pos + 1) & mask;
     }
-
-    return node;
+    index->slots[pos] = node;
 }
 
-/**
- * @brief Search for \p name in \p parent.
- * @param[in] parent - Parent node.
- * @param[in] name - Name to search for.
- * @return Found node, or NULL if not found. If found, the reference count will be increased.
- */
-static vfs_memfs_node_t* _vfs_memfs_common_search_for(vfs_memfs_node_t* parent, const vfs_str_t* name)
+static void _vfs_memfs_dir_index_erase(vfs_memfs_dir_index_t* index, vfs_memfs_node_t* node)
 {
-    vfs_memfs_node_t* node = NULL;
+    const size_t mask = index->cap - 1;
+    size_t hole = (size_t)node->name_hash & mask;
 
-    vfs_rwlock_rdlock(&parent->rwlock);
+    while (index->slots[hole] != node)
     {
-        node = _vfs_memfs_common_search_for_nolock(parent, name);
+        hole = (hole + 1) & mask;
     }
-    vfs_rwlock_rdunlock(&parent->rwlock);
 
-    return node;
+    /*
+     * Backward shift deletion, so we do not need tombstones. Every entry after
+     * the hole in the same cluster is moved into the hole if the hole lies
+     * between its home slot and its current slot.
+     */
+    size_t pos;
+    for (pos = (hole + 1) & mask; index->slots[pos] != NULL; pos = (pos + 1) & mask)
+    {
+        size_t home = (size_t)index->slots[pos]->name_hash & mask;
+        if (((pos - home) & mask) >= ((pos - hole) & mask))
+        {
+            index->slots[hole] = index->slots[pos];
+            hole = pos;
+        }
+    }
+    index->slots[hole] = NULL;
 }
 
 /**
- * @brief Common operation for \p path.
- * @param[in] fs - File system object.
- * @param[in] path - The path.
- * @param[in] cb - Callback function.
- * @param[in] data - Callback data.
- * @return 0 on success, or -errno on error.
+ * @brief The number of bytes used by a hash index of \p cap slots.
  */
-static int _vfs_memfs_common_op_path(vfs_memfs_t* fs, const vfs_str_t* path,
-    int (*cb)(vfs_memfs_node_t* node, void* data), void* data)
+#define VFS_MEMFS_DIR_INDEX_BYTES(cap)  (sizeof(vfs_memfs_dir_index_t) + (cap) * sizeof(vfs_memfs_node_t*))
+
+static int _vfs_memfs_dir_index_rebuild(vfs_memfs_t* fs, vfs_memfs_node_dir_t* dir, size_t cap)
 {
     int ret;
-    vfs_memfs_node_t* parent = fs->root;
-    _vfs_memfs_common_acquire_node(parent);
+    if ((ret = _vfs_memfs_usage_charge(fs, &fs->usage.meta, VFS_MEMFS_DIR_INDEX_BYTES(cap))) != 0)
+    {
+        return ret;
+    }
 
-    vfs_strlist_t path_list = vfs_str_split(path, "/", 1);
-    if (path_list.num == 0)
+    vfs_memfs_dir_index_t* new_index = calloc(1, VFS_MEMFS_DIR_INDEX_BYTES(cap));
+    if (new_index == NULL)
     {
-        goto do_cb;
+        _vfs_memfs_usage_uncharge(fs, &fs->usage.meta, VFS_MEMFS_DIR_INDEX_BYTES(cap));
+        return VFS_ENOMEM;
     }
+    new_index->cap = cap;
 
-    for (size_t i = 0; i < path_list.num; i++)
+    size_t i;
+    for (i = 0; i < dir->children_sz; i++)
     {
-        vfs_str_t* name = &path_list.arr[i];
-        vfs_memfs_node_t* child = _vfs_memfs_common_search_for(parent, name);
-        _vfs_memfs_common_release_node(parent, 0);
+        _vfs_memfs_dir_index_insert(new_index, dir->children[i]);
+    }
 
-        if (child == NULL)
-        {
-            ret = VFS_ENOENT;
-            goto finish;
-        }
-        parent = child;
+    /* Publish the index after it is built. Lock-free readers may still use the old one. */
+    vfs_memfs_dir_index_t* old_index = dir->index;
+    vfs_atomic_fence();
+    dir->index = new_index;
+
+    if (old_index != NULL)
+    {
+        _vfs_memfs_usage_uncharge(fs, &fs->usage.meta, VFS_MEMFS_DIR_INDEX_BYTES(old_index->cap));
+        vfs_epoch_retire(&fs->epoch, old_index, free);
     }
 
-do_cb:
-    ret = cb(parent, data);
-    _vfs_memfs_common_release_node(parent, 0);
-finish:
-    vfs_strlist_exit(&path_list);
-    return ret;
+    return 0;
 }
 
-static int _vfs_memfs_common_node_ensure_capacity(vfs_memfs_node_t* node, size_t cap)
+/**
+ * @brief Make sure \p dir is able to hold \p sz children without allocation.
+ * @param[in] fs - File system object.
+ * @param[in,out] dir - Directory.
+ * @param[in] sz - The number of children.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_dir_reserve(vfs_memfs_t* fs, vfs_memfs_node_dir_t* dir, size_t sz)
 {
-    if (node->data.dir.children_cap >= cap)
+    int ret;
+    if (dir->children_cap < sz)
     {
-        return 0;
+        size_t new_cap = max(sz, dir->children_cap * 2);
+        const uint64_t grow_sz = (new_cap - dir->children_cap) * sizeof(vfs_memfs_node_t*);
+        if ((ret = _vfs_memfs_usage_charge(fs, &fs->usage.meta, grow_sz)) != 0)
+        {
+            return ret;
+        }
+
+        vfs_memfs_node_t** new_children = malloc(new_cap * sizeof(vfs_memfs_node_t*));
+        if (new_children == NULL)
+        {
+            _vfs_memfs_usage_uncharge(fs, &fs->usage.meta, grow_sz);
+            return VFS_ENOMEM;
+        }
+        if (dir->children_sz != 0)
+        {
+            memcpy(new_children, dir->children, dir->children_sz * sizeof(vfs_memfs_node_t*));
+        }
+
+        /*
+         * Never realloc() in place, lock-free readers may still scan the old
+         * array. The array is replaced before the size grows, so a reader that
+         * loads the size first always gets an array large enough.
+         */
+        vfs_memfs_node_t** old_children = dir->children;
+        vfs_atomic_fence();
+        dir->children = new_children;
+        dir->children_cap = new_cap;
+
+        if (old_children != NULL)
+        {
+            vfs_epoch_retire(&fs->epoch, old_children, free);
+        }
     }
 
-    size_t malloc_sz = cap * sizeof(vfs_memfs_node_t*);
-    vfs_memfs_node_t** new_children = realloc(node->data.dir.children, malloc_sz);
-    if (new_children == NULL)
+    /* Keep load factor of index no more than 50%. */
+    if (sz > VFS_MEMFS_DIR_INDEX_THRESHOLD && (dir->index == NULL || sz * 2 > dir->index->cap))
     {
-        return VFS_ENOMEM;
+        size_t new_cap = 64;
+        while (new_cap < sz * 4)
+        {
+            new_cap *= 2;
+        }
+        return _vfs_memfs_dir_index_rebuild(fs, dir, new_cap);
     }
 
-    node->data.dir.children = new_children;
-    node->data.dir.children_cap = cap;
-
     return 0;
 }
 
-static vfs_memfs_node_t* _vfs_memfs_common_new_node(vfs_memfs_node_t* parent,
-    const vfs_str_t* name, vfs_stat_flag_t type)
+/**
+ * @brief Start changing children of \p dir. Must hold write lock of the directory.
+ */
+static void _vfs_memfs_dir_write_begin(vfs_memfs_node_dir_t* dir)
 {
-    int ret;
-    vfs_memfs_node_t* new_node = calloc(1, sizeof(vfs_memfs_node_t));
-    if (new_node == NULL)
-    {
-        return NULL;
-    }
-    new_node->parent = parent;
-    new_node->refcnt = 1;
-    new_node->name = vfs_str_dup(name);
-    new_node->stat.st_mode = type;
-    vfs_rwlock_init(&new_node->rwlock);
+    (void)vfs_atomic_add(&dir->seq);
+    vfs_atomic_fence();
+}
 
-    if (parent != NULL)
+/**
+ * @brief Finish changing children of \p dir.
+ */
+static void _vfs_memfs_dir_write_end(vfs_memfs_node_dir_t* dir)
+{
+    vfs_atomic_fence();
+    (void)vfs_atomic_add(&dir->seq);
+}
+
+/**
+ * @brief Find \p name in children of \p dir.
+ * @note Without lock of the directory, the result is only meaningful if
+ *   #vfs_memfs_node_dir_t::seq does not change during the search.
+ * @param[in] dir - Directory.
+ * @param[in] name - Name to search for.
+ * @param[in] hash - Hash of \p name.
+ * @return Found node, or NULL if not found. The reference count is not changed.
+ */
+static vfs_memfs_node_t* _vfs_memfs_dir_find(const vfs_memfs_node_dir_t* dir,
+    const vfs_str_t* name, uint64_t hash)
+{
+    size_t i;
+    const vfs_memfs_dir_index_t* index = dir->index;
+
+    if (index == NULL)
     {
-       
-        do {
-            ret = _vfs_memfs_common_node_ensure_capacity(parent, parent->data.dir.children_sz + 1);
-            if (ret != 0)
+        /* See #_vfs_memfs_dir_reserve() for why size is loaded first. */
+        const size_t sz = dir->children_sz;
+        vfs_atomic_fence();
+        vfs_memfs_node_t* const* children = dir->children;
+
+        for (i = 0; i < sz; i++)
+        {
+            vfs_memfs_node_t* child = children[i];
+            if (child->name_hash == hash && vfs_str_cmp2(&child->name, name) == 0)
             {
-                break;
+                return child;
             }
-            parent->data.dir.children[parent->data.dir.children_sz] = new_node;
-            parent->data.dir.children_sz++;
-        } while (0);
+        }
+        return NULL;
+    }
 
-        if (ret != 0)
+    /*
+     * At most half of slots are used, so probing always ends. Each slot is
+     * loaded once, a lock-free reader may see it cleared by erase in between.
+     */
+    const size_t mask = index->cap - 1;
+    vfs_memfs_node_t* child;
+    for (i = (size_t)hash & mask; (child = index->slots[i]) != NULL; i = (i + 1) & mask)
+    {
+        if (child->name_hash == hash && vfs_str_cmp2(&child->name, name) == 0)
         {
-            _vfs_memfs_common_release_node(new_node, 1);
-            return NULL;
+            return child;
         }
     }
-
-    return new_node;
+    return NULL;
 }
 
-static void _vfs_memfs_common_release_session(vfs_memfs_session_t* session)
+/**
+ * @brief The initial number of buckets of dedup store.
+ */
+#define VFS_MEMFS_STORE_INIT_CAP    64
+
+struct vfs_memfs_store
 {
-    if (vfs_atomic_dec(&session->refcnt) != 0)
+    /**
+     * @brief Reference count.
+     * One is held by creator, one by each file system that uses this store,
+     * and one by each chunk in this store.
+     */
+    vfs_atomic_t                refcnt;
+
+    vfs_mutex_t                 lock;               /**< Protects everything below. */
+    vfs_memfs_chunk_t**         buckets;            /**< Chunks chained by #vfs_memfs_chunk_t::next. */
+    size_t                      bucket_cap;         /**< The number of buckets, always power of 2. */
+    size_t                      chunk_sz;           /**< The number of chunks. */
+    uint64_t                    lookup_cnt;         /**< The number of lookups. */
+    uint64_t                    hit_cnt;            /**< The number of lookups that found a chunk. */
+};
+
+static void _vfs_memfs_store_release(vfs_memfs_store_t* store)
+{
+    if (vfs_atomic_dec(&store->refcnt) != 0)
     {
         return;
     }
 
-    if (session->data.node != NULL)
+    /* Every chunk holds a reference, so the store is empty now. */
+    free(store->buckets);
+    vfs_mutex_exit(&store->lock);
+    free(store);
+}
+
+/**
+ * @brief Unlink \p chunk from bucket of \p store.
+ * @warning Must be called with store lock held.
+ */
+static void _vfs_memfs_store_unlink(vfs_memfs_store_t* store, vfs_memfs_chunk_t* chunk)
+{
+    vfs_memfs_chunk_t** it = &store->buckets[chunk->hash & (store->bucket_cap - 1)];
+    while (*it != chunk)
     {
-        _vfs_memfs_common_release_node(session->data.node, 0);
-        session->data.node = NULL;
+        it = &(*it)->next;
     }
-
-    vfs_mutex_exit(&session->mutex);
-    free(session);
+    *it = chunk->next;
+    store->chunk_sz--;
 }
 
-static int _vfs_memfs_common_op_fh(vfs_memfs_t* fs, uintptr_t fh,
-    int (*cb)(vfs_memfs_session_t* session, void* data), void* data)
+/**
+ * @brief Find a chunk with the same content as \p data and acquire it.
+ * @param[in] store - Dedup store.
+ * @param[in] hash - Hash of \p data.
+ * @param[in] data - Content of #VFS_MEMFS_CHUNK_SIZE bytes.
+ * @return The chunk with reference count increased, or NULL if not found.
+ */
+static vfs_memfs_chunk_t* _vfs_memfs_store_find(vfs_memfs_store_t* store, uint64_t hash, const uint8_t* data)
 {
-    vfs_memfs_session_t tmp_session;
-    tmp_session.data.fh = fh;
+    vfs_memfs_chunk_t* chunk;
 
-    vfs_memfs_session_t* session = NULL;
-    vfs_mutex_enter(&fs->session_map_lock);
-    do {
-        ev_map_node_t* it = vfs_map_find(&fs->session_map, &tmp_session.node);
-        if (it == NULL)
+    vfs_mutex_enter(&store->lock);
+    store->lookup_cnt++;
+    for (chunk = store->buckets[hash & (store->bucket_cap - 1)]; chunk != NULL; chunk = chunk->next)
+    {
+        /* Hash may collide, so content is always compared. */
+        if (chunk->hash != hash || memcmp(chunk->data, data, VFS_MEMFS_CHUNK_SIZE) != 0)
         {
-            break;
+            continue;
         }
 
-        session = EV_CONTAINER_OF(it, vfs_memfs_session_t, node);
-        (void)vfs_atomic_add(&session->refcnt);
-    } while (0);
-    vfs_mutex_leave(&fs->session_map_lock);
-
-    if (session == NULL)
-    {
-        return VFS_EBADF;
+        /* A chunk whose reference count dropped to zero is being removed. */
+        int cnt = vfs_atomic_load(&chunk->refcnt);
+        while (cnt != 0)
+        {
+            int old = vfs_atomic_cas(&chunk->refcnt, cnt, cnt + 1);
+            if (old == cnt)
+            {
+                break;
+            }
+            cnt = old;
+        }
+        if (cnt != 0)
+        {
+            store->hit_cnt++;
+            break;
+        }
     }
+    vfs_mutex_leave(&store->lock);
 
-    int ret = cb(session, data);
-    _vfs_memfs_common_release_session(session);
-
-    return ret;
+    return chunk;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// destroy
-//////////////////////////////////////////////////////////////////////////
-
-static void _vfs_memfs_cleanup_session(vfs_memfs_t* fs)
+/**
+ * @brief Add \p chunk to \p store.
+ * Nothing happens if out of memory, as deduplication is best effort.
+ * @param[in] store - Dedup store.
+ * @param[in] chunk - Plain chunk, its content must not be changed until it
+ *   is taken out of \p store.
+ * @param[in] hash - Hash of content.
+ */
+static void _vfs_memfs_store_insert(vfs_memfs_store_t* store, vfs_memfs_chunk_t* chunk, uint64_t hash)
 {
-    ev_map_node_t* it;
+    size_t i;
 
-    vfs_mutex_enter(&fs->session_map_lock);
-    while ((it = vfs_map_begin(&fs->session_map))!= NULL)
+    vfs_mutex_enter(&store->lock);
+    if (store->chunk_sz >= store->bucket_cap)
     {
-        vfs_memfs_session_t* session = EV_CONTAINER_OF(it, vfs_memfs_session_t, node);
-        vfs_map_erase(&fs->session_map, it);
-        vfs_mutex_leave(&fs->session_map_lock);
+        const size_t new_cap = store->bucket_cap * 2;
+        vfs_memfs_chunk_t** new_buckets = calloc(new_cap, sizeof(vfs_memfs_chunk_t*));
+        if (new_buckets == NULL)
         {
-            _vfs_memfs_common_release_session(session);
+            vfs_mutex_leave(&store->lock);
+            return;
         }
-        vfs_mutex_enter(&fs->session_map_lock);
+        for (i = 0; i < store->bucket_cap; i++)
+        {
+            vfs_memfs_chunk_t* it;
+            while ((it = store->buckets[i]) != NULL)
+            {
+                store->buckets[i] = it->next;
+                it->next = new_buckets[it->hash & (new_cap - 1)];
+                new_buckets[it->hash & (new_cap - 1)] = it;
+            }
+        }
+        free(store->buckets);
+        store->buckets = new_buckets;
+        store->bucket_cap = new_cap;
     }
-    vfs_mutex_leave(&fs->session_map_lock);
+
+    vfs_memfs_chunk_t** bucket = &store->buckets[hash & (store->bucket_cap - 1)];
+    chunk->hash = hash;
+    chunk->store = store;
+    chunk->next = *bucket;
+    *bucket = chunk;
+    store->chunk_sz++;
+    (void)vfs_atomic_add(&store->refcnt);
+    vfs_mutex_leave(&store->lock);
 }
 
-static void _vfs_memfs_destroy(struct vfs_operations* thiz)
+/**
+ * @brief Take \p chunk out of its store if nobody else references it.
+ * @param[in] chunk - Chunk in a dedup store, referenced by caller.
+ * @return 1 if \p chunk is taken out and is exclusively owned, otherwise 0.
+ */
+static int _vfs_memfs_store_detach(vfs_memfs_chunk_t* chunk)
 {
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    int detached = 0;
+    vfs_memfs_store_t* store = chunk->store;
+
+    vfs_mutex_enter(&store->lock);
+    if (vfs_atomic_load(&chunk->refcnt) == 1)
+    {
+        _vfs_memfs_store_unlink(store, chunk);
+        chunk->store = NULL;
+        detached = 1;
+    }
+    vfs_mutex_leave(&store->lock);
+
+    if (detached)
+    {
+        _vfs_memfs_store_release(store);
+    }
+    return detached;
+}
+
+/**
+ * @brief Take a chunk from the pool, or allocate one if the pool is empty.
+ * @note The content of returned chunk is undefined, and its reference count is 1.
+ * @param[in] fs - File system object.
+ * @return The chunk, or NULL if out of memory.
+ */
+static vfs_memfs_chunk_t* _vfs_memfs_chunk_alloc(vfs_memfs_t* fs)
+{
+    vfs_memfs_chunk_t* chunk;
+
+    vfs_mutex_enter(&fs->chunk_pool.lock);
+    if ((chunk = fs->chunk_pool.free_list) != NULL)
+    {
+        fs->chunk_pool.free_list = chunk->next;
+        fs->chunk_pool.free_sz--;
+    }
+    vfs_mutex_leave(&fs->chunk_pool.lock);
+
+    if (chunk == NULL && (chunk = malloc(sizeof(vfs_memfs_chunk_t) + VFS_MEMFS_CHUNK_SIZE)) == NULL)
+    {
+        return NULL;
+    }
+    chunk->refcnt = 1;
+    chunk->atime = vfs_atomic_load(&fs->compress.tick);
+    chunk->zsize = 0;
+    chunk->store = NULL;
+    return chunk;
+}
+
+/**
+ * @brief Release reference of \p chunk, and give it back to the pool if it is
+ *   no longer used.
+ * @param[in] fs - File system object.
+ * @param[in] chunk - The chunk.
+ */
+static void _vfs_memfs_chunk_release(vfs_memfs_t* fs, vfs_memfs_chunk_t* chunk)
+{
+    if (vfs_atomic_dec(&chunk->refcnt) != 0)
+    {
+        return;
+    }
+
+    vfs_memfs_store_t* store = chunk->store;
+    if (store != NULL)
+    {
+        vfs_mutex_enter(&store->lock);
+        _vfs_memfs_store_unlink(store, chunk);
+        vfs_mutex_leave(&store->lock);
+
+        chunk->store = NULL;
+        _vfs_memfs_store_release(store);
+    }
+
+    /* Compressed chunks have various sizes, so they are not pooled. */
+    vfs_mutex_enter(&fs->chunk_pool.lock);
+    if (chunk->zsize == 0 && fs->chunk_pool.free_sz < VFS_MEMFS_CHUNK_POOL_MAX)
+    {
+        chunk->next = fs->chunk_pool.free_list;
+        fs->chunk_pool.free_list = chunk;
+        fs->chunk_pool.free_sz++;
+        chunk = NULL;
+    }
+    vfs_mutex_leave(&fs->chunk_pool.lock);
+
+    free(chunk);
+}
+
+static void _vfs_memfs_chunk_pool_exit(vfs_memfs_t* fs)
+{
+    vfs_memfs_chunk_t* chunk;
+    while ((chunk = fs->chunk_pool.free_list) != NULL)
+    {
+        fs->chunk_pool.free_list = chunk->next;
+        free(chunk);
+    }
+    fs->chunk_pool.free_sz = 0;
+    vfs_mutex_exit(&fs->chunk_pool.lock);
+}
+
+/**
+ * @brief Bytes charged to data usage for one reference of \p chunk.
+ */
+static uint64_t _vfs_memfs_chunk_charge_size(const vfs_memfs_chunk_t* chunk)
+{
+    return chunk->zsize != 0 ? chunk->zsize : VFS_MEMFS_CHUNK_SIZE;
+}
+
+/**
+ * @brief Update current time of \p fs if compression is enabled.
+ * @param[in] fs - File system object.
+ */
+static void _vfs_memfs_compress_update_tick(vfs_memfs_t* fs)
+{
+    if (!vfs_atomic_load(&fs->compress.enabled))
+    {
+        return;
+    }
+
+    const int tick = (int)((vfs_clock_now() - fs->compress.base) / 1000000000ULL);
+    if (vfs_atomic_load(&fs->compress.tick) != tick)
+    {
+        vfs_atomic_store(&fs->compress.tick, tick);
+    }
+}
+
+/**
+ * @brief Mark \p chunk as accessed now.
+ */
+static void _vfs_memfs_chunk_touch(vfs_memfs_t* fs, vfs_memfs_chunk_t* chunk)
+{
+    const int tick = vfs_atomic_load(&fs->compress.tick);
+    if (vfs_atomic_load(&chunk->atime) != tick)
+    {
+        vfs_atomic_store(&chunk->atime, tick);
+    }
+}
+
+/**
+ * @brief Decompress content of compressed \p chunk.
+ * @param[in] fs - File system object, for statistics.
+ * @param[in] chunk - Compressed chunk.
+ * @param[out] buf - Buffer of #VFS_MEMFS_CHUNK_SIZE bytes.
+ */
+static void _vfs_memfs_chunk_decompress(vfs_memfs_t* fs, const vfs_memfs_chunk_t* chunk, uint8_t* buf)
+{
+    const uint64_t beg = vfs_clock_now();
+    int ret = vfs_lz4_decompress(chunk->data, chunk->zsize, buf, VFS_MEMFS_CHUNK_SIZE);
+    assert(ret == VFS_MEMFS_CHUNK_SIZE);
+    (void)ret;
+    const uint64_t cost = vfs_clock_now() - beg;
+
+    vfs_mutex_enter(&fs->usage.lock);
+    {
+        fs->usage.decompress_cnt++;
+        fs->usage.decompress_ns += cost;
+    }
+    vfs_mutex_leave(&fs->usage.lock);
+}
+
+/**
+ * @brief Read content of compressed \p chunk through decompression cache.
+ * @param[in] fs - File system object.
+ * @param[in] chunk - Compressed chunk.
+ * @param[in] offset - Offset in chunk.
+ * @param[out] buf - Buffer.
+ * @param[in] len - Bytes to read, must be inside chunk.
+ */
+static void _vfs_memfs_zcache_read(vfs_memfs_t* fs, vfs_memfs_chunk_t* chunk,
+    size_t offset, void* buf, size_t len)
+{
+    size_t i;
+    vfs_memfs_chunk_t* evicted = NULL;
+
+    vfs_mutex_enter(&fs->zcache.lock);
+    {
+        for (i = 0; i < ARRAY_SIZE(fs->zcache.slots); i++)
+        {
+            if (fs->zcache.slots[i].chunk == chunk)
+            {
+                break;
+            }
+        }
+
+        if (i == ARRAY_SIZE(fs->zcache.slots))
+        {
+            i = fs->zcache.next;
+            fs->zcache.next = (i + 1) % ARRAY_SIZE(fs->zcache.slots);
+
+            evicted = fs->zcache.slots[i].chunk;
+            (void)vfs_atomic_add(&chunk->refcnt);
+            fs->zcache.slots[i].chunk = chunk;
+            _vfs_memfs_chunk_decompress(fs, chunk, fs->zcache.slots[i].data);
+        }
+
+        memcpy(buf, fs->zcache.slots[i].data + offset, len);
+    }
+    vfs_mutex_leave(&fs->zcache.lock);
+
+    if (evicted != NULL)
+    {
+        _vfs_memfs_chunk_release(fs, evicted);
+    }
+}
+
+static void _vfs_memfs_zcache_exit(vfs_memfs_t* fs)
+{
+    size_t i;
+    for (i = 0; i < ARRAY_SIZE(fs->zcache.slots); i++)
+    {
+        if (fs->zcache.slots[i].chunk != NULL)
+        {
+            _vfs_memfs_chunk_release(fs, fs->zcache.slots[i].chunk);
+            fs->zcache.slots[i].chunk = NULL;
+        }
+    }
+    vfs_mutex_exit(&fs->zcache.lock);
+}
+
+/**
+ * @brief Make chunk \p idx of regular file \p node exclusively owned, not
+ *   compressed and not in dedup store, so it can be changed.
+ * @param[in] fs - File system object.
+ * @param[in,out] reg - Regular file.
+ * @param[in] idx - Chunk index, the chunk must exist.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_chunk_unshare(vfs_memfs_t* fs, vfs_memfs_node_reg_t* reg, size_t idx)
+{
+    int ret;
+    vfs_memfs_chunk_t* chunk = reg->chunks[idx];
+    if (chunk->zsize == 0 && vfs_atomic_load(&chunk->refcnt) == 1
+        && (chunk->store == NULL || _vfs_memfs_store_detach(chunk)))
+    {
+        return 0;
+    }
+
+    /* Decompressed content is charged in full. */
+    const uint64_t grow_sz = VFS_MEMFS_CHUNK_SIZE - _vfs_memfs_chunk_charge_size(chunk);
+    if (grow_sz != 0 && (ret = _vfs_memfs_usage_charge(fs, &fs->usage.data, grow_sz)) != 0)
+    {
+        return ret;
+    }
+
+    vfs_memfs_chunk_t* copy = _vfs_memfs_chunk_alloc(fs);
+    if (copy == NULL)
+    {
+        if (grow_sz != 0)
+        {
+            _vfs_memfs_usage_uncharge(fs, &fs->usage.data, grow_sz);
+        }
+        return VFS_ENOMEM;
+    }
+
+    if (chunk->zsize != 0)
+    {
+        _vfs_memfs_chunk_decompress(fs, chunk, copy->data);
+        _vfs_memfs_usage_compressed(fs, -1, -(int64_t)chunk->zsize);
+    }
+    else
+    {
+        memcpy(copy->data, chunk->data, VFS_MEMFS_CHUNK_SIZE);
+    }
+
+    reg->chunks[idx] = copy;
+    _vfs_memfs_chunk_release(fs, chunk);
+    return 0;
+}
+
+/**
+ * @brief Get the number of chunks required to hold \p size bytes.
+ */
+static size_t _vfs_memfs_chunk_count(uint64_t size)
+{
+    return (size_t)((size + VFS_MEMFS_CHUNK_SIZE - 1) / VFS_MEMFS_CHUNK_SIZE);
+}
+
+/**
+ * @brief The number of 512-byte blocks occupied by one chunk.
+ */
+#define VFS_MEMFS_CHUNK_BLOCKS  (VFS_MEMFS_CHUNK_SIZE / 512)
+
+/**
+ * @brief Make sure the chunk table of \p node has at least \p chunk_sz entries.
+ * New entries are holes.
+ * @param[in] fs - File system object.
+ * @param[in,out] node - Regular file node.
+ * @param[in] chunk_sz - The number of entries.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_reg_reserve(vfs_memfs_t* fs, vfs_memfs_node_t* node, size_t chunk_sz)
+{
+    int ret;
+    vfs_memfs_node_reg_t* reg = &node->data.reg;
+    if (chunk_sz <= reg->chunk_sz)
+    {
+        return 0;
+    }
+
+    if (chunk_sz > reg->chunk_cap)
+    {
+        size_t new_cap = max(chunk_sz, reg->chunk_cap * 2);
+        const uint64_t grow_sz = (new_cap - reg->chunk_cap) * sizeof(vfs_memfs_chunk_t*);
+        if ((ret = _vfs_memfs_usage_charge(fs, &fs->usage.meta, grow_sz)) != 0)
+        {
+            return ret;
+        }
+
+        vfs_memfs_chunk_t** new_chunks = realloc(reg->chunks, new_cap * sizeof(vfs_memfs_chunk_t*));
+        if (new_chunks == NULL)
+        {
+            _vfs_memfs_usage_uncharge(fs, &fs->usage.meta, grow_sz);
+            return VFS_ENOMEM;
+        }
+        reg->chunks = new_chunks;
+        reg->chunk_cap = new_cap;
+    }
+
+    memset(reg->chunks + reg->chunk_sz, 0, (chunk_sz - reg->chunk_sz) * sizeof(vfs_memfs_chunk_t*));
+    reg->chunk_sz = chunk_sz;
+
+    return 0;
+}
+
+/**
+ * @brief Move content of inline file \p node into chunks.
+ *
+ * Content of all zeros becomes a hole.
+ *
+ * @param[in] fs - File system object.
+ * @param[in,out] node - Inline regular file node.
+ * @return 0 on success, or -errno on error. It never fails if content is all zeros.
+ */
+static int _vfs_memfs_reg_spill(vfs_memfs_t* fs, vfs_memfs_node_t* node)
+{
+    int ret;
+    vfs_memfs_node_reg_t* reg = &node->data.reg;
+    assert(reg->inlined && reg->chunk_sz == 0);
+
+    size_t used = (size_t)node->stat.st_size;
+    while (used != 0 && reg->inline_data[used - 1] == 0)
+    {
+        used--;
+    }
+
+    if (used != 0)
+    {
+        if ((ret = _vfs_memfs_reg_reserve(fs, node, 1)) != 0)
+        {
+            return ret;
+        }
+        if ((ret = _vfs_memfs_usage_charge(fs, &fs->usage.data, VFS_MEMFS_CHUNK_SIZE)) != 0)
+        {
+            reg->chunk_sz = 0;
+            return ret;
+        }
+        vfs_memfs_chunk_t* chunk = _vfs_memfs_chunk_alloc(fs);
+        if (chunk == NULL)
+        {
+            _vfs_memfs_usage_uncharge(fs, &fs->usage.data, VFS_MEMFS_CHUNK_SIZE);
+            reg->chunk_sz = 0;
+            return VFS_ENOMEM;
+        }
+
+        memcpy(chunk->data, reg->inline_data, VFS_MEMFS_INLINE_SIZE);
+        memset(chunk->data + VFS_MEMFS_INLINE_SIZE, 0, VFS_MEMFS_CHUNK_SIZE - VFS_MEMFS_INLINE_SIZE);
+        memset(reg->inline_data, 0, VFS_MEMFS_INLINE_SIZE);
+        reg->chunks[0] = chunk;
+        node->stat.st_blocks += VFS_MEMFS_CHUNK_BLOCKS;
+    }
+
+    reg->inlined = 0;
+    return 0;
+}
+
+/**
+ * @brief Move the first \p size bytes of \p node into inline storage.
+ *
+ * Chunks are not released, the caller is going to drop the whole chunk table.
+ *
+ * @param[in] fs - File system object.
+ * @param[in,out] node - Regular file node that is not inline.
+ * @param[in] size - Bytes to keep, at most #VFS_MEMFS_INLINE_SIZE.
+ */
+static void _vfs_memfs_reg_unspill(vfs_memfs_t* fs, vfs_memfs_node_t* node, size_t size)
+{
+    vfs_memfs_node_reg_t* reg = &node->data.reg;
+    const vfs_memfs_chunk_t* chunk = reg->chunk_sz != 0 ? reg->chunks[0] : NULL;
+
+    size = (size_t)min(size, node->stat.st_size);
+    if (chunk == NULL || size == 0)
+    {
+        return;
+    }
+
+    if (chunk->zsize == 0)
+    {
+        memcpy(reg->inline_data, chunk->data, size);
+        return;
+    }
+
+    uint8_t buf[VFS_MEMFS_CHUNK_SIZE];
+    _vfs_memfs_chunk_decompress(fs, chunk, buf);
+    memcpy(reg->inline_data, buf, size);
+}
+
+/**
+ * @brief Set the size of regular file \p node.
+ *
+ * Growing a file only changes its size, the new range is a hole. Shrinking
+ * a file releases whole chunks after the new end of file. A file that fits in
+ * #VFS_MEMFS_INLINE_SIZE bytes is moved inline.
+ *
+ * @param[in] fs - File system object.
+ * @param[in,out] node - Regular file node.
+ * @param[in] size - New size in bytes.
+ * @return 0 on success, or -errno on error. It never fails if \p size is not
+ *   larger than #VFS_MEMFS_INLINE_SIZE.
+ */
+static int _vfs_memfs_reg_truncate(vfs_memfs_t* fs, vfs_memfs_node_t* node, uint64_t size)
+{
+    int ret;
+    vfs_memfs_node_reg_t* reg = &node->data.reg;
+    const int inlined = size <= VFS_MEMFS_INLINE_SIZE;
+
+    if (reg->inlined)
+    {
+        if (inlined)
+        {
+            if (size < node->stat.st_size)
+            {
+                memset(reg->inline_data + size, 0, (size_t)(node->stat.st_size - size));
+            }
+            node->stat.st_size = size;
+            return 0;
+        }
+        if ((ret = _vfs_memfs_reg_spill(fs, node)) != 0)
+        {
+            return ret;
+        }
+    }
+    else if (inlined)
+    {
+        _vfs_memfs_reg_unspill(fs, node, (size_t)size);
+    }
+
+    /* The tail of last chunk is going to be zeroed, so it must not be shared. */
+    const size_t chunk_sz = inlined ? 0 : _vfs_memfs_chunk_count(size);
+    const size_t offset = (size_t)(size % VFS_MEMFS_CHUNK_SIZE);
+    if (offset != 0 && chunk_sz != 0 && reg->chunk_sz >= chunk_sz && reg->chunks[chunk_sz - 1] != NULL
+        && (ret = _vfs_memfs_chunk_unshare(fs, reg, chunk_sz - 1)) != 0)
+    {
+        return ret;
+    }
+
+    /*
+     * Chunks may exist after end of file if a write failed half way, so always
+     * trim the chunk table, even if the file grows.
+     */
+    uint64_t release_sz = 0;
+    int64_t zcnt = 0, zbytes = 0;
+    while (reg->chunk_sz > chunk_sz)
+    {
+        vfs_memfs_chunk_t* chunk = reg->chunks[--reg->chunk_sz];
+        if (chunk == NULL)
+        {
+            continue;
+        }
+
+        release_sz += _vfs_memfs_chunk_charge_size(chunk);
+        if (chunk->zsize != 0)
+        {
+            zcnt--;
+            zbytes -= chunk->zsize;
+        }
+        _vfs_memfs_chunk_release(fs, chunk);
+        node->stat.st_blocks -= VFS_MEMFS_CHUNK_BLOCKS;
+    }
+    if (release_sz != 0)
+    {
+        _vfs_memfs_usage_uncharge(fs, &fs->usage.data, release_sz);
+    }
+    if (zcnt != 0)
+    {
+        _vfs_memfs_usage_compressed(fs, zcnt, zbytes);
+    }
+
+    if (inlined)
+    {
+        /* Inline file has no chunk table at all. */
+        if (reg->chunk_cap != 0)
+        {
+            _vfs_memfs_usage_uncharge(fs, &fs->usage.meta, reg->chunk_cap * sizeof(vfs_memfs_chunk_t*));
+            free(reg->chunks);
+            reg->chunks = NULL;
+            reg->chunk_cap = 0;
+        }
+        reg->inlined = 1;
+    }
+    else if (offset != 0 && reg->chunk_sz == chunk_sz && reg->chunks[chunk_sz - 1] != NULL)
+    {
+        /* The tail of last chunk must be zero. */
+        memset(reg->chunks[chunk_sz - 1]->data + offset, 0, VFS_MEMFS_CHUNK_SIZE - offset);
+    }
+
+    node->stat.st_size = size;
+    return 0;
+}
+
+/**
+ * @brief Read content of regular file \p node. Holes are read as zeros.
+ * @param[in] fs - File system object.
+ * @param[in] node - Regular file node.
+ * @param[in] pos - Start position, must be less than file size.
+ * @param[out] buf - Buffer.
+ * @param[in] len - Buffer size.
+ * @return The number of bytes read.
+ */
+static size_t _vfs_memfs_reg_read(vfs_memfs_t* fs, vfs_memfs_node_t* node, uint64_t pos, void* buf, size_t len)
+{
+    const vfs_memfs_node_reg_t* reg = &node->data.reg;
+    len = (size_t)min(len, node->stat.st_size - pos);
+
+    if (reg->inlined)
+    {
+        memcpy(buf, reg->inline_data + pos, len);
+        return len;
+    }
+
+    size_t read_sz = 0;
+    while (read_sz < len)
+    {
+        const size_t idx = (size_t)(pos / VFS_MEMFS_CHUNK_SIZE);
+        const size_t offset = (size_t)(pos % VFS_MEMFS_CHUNK_SIZE);
+        const size_t copy_sz = min(len - read_sz, VFS_MEMFS_CHUNK_SIZE - offset);
+
+        vfs_memfs_chunk_t* chunk = idx < reg->chunk_sz ? reg->chunks[idx] : NULL;
+        if (chunk == NULL)
+        {
+            memset((uint8_t*)buf + read_sz, 0, copy_sz);
+        }
+        else if (chunk->zsize != 0)
+        {
+            _vfs_memfs_chunk_touch(fs, chunk);
+            _vfs_memfs_zcache_read(fs, chunk, offset, (uint8_t*)buf + read_sz, copy_sz);
+        }
+        else
+        {
+            _vfs_memfs_chunk_touch(fs, chunk);
+            memcpy((uint8_t*)buf + read_sz, chunk->data + offset, copy_sz);
+        }
+        read_sz += copy_sz;
+        pos += copy_sz;
+    }
+
+    return read_sz;
+}
+
+/**
+ * @brief Make range [\p pos, \p end) of regular file \p node writable.
+ *
+ * Holes in range are filled with chunks, shared or compressed chunks in range
+ * are copied, and the file is extended to \p end, so content can be copied
+ * afterwards by #_vfs_memfs_reg_copy(). Only the part of new chunks that is
+ * not going to be written is zeroed. An inline file that grows larger than
+ * #VFS_MEMFS_INLINE_SIZE is moved into chunks first. A failed call leaves file
+ * size and content untouched.
+ *
+ * @param[in] fs - File system object.
+ * @param[in,out] node - Regular file node.
+ * @param[in] pos - Start position.
+ * @param[in] end - End position, must be larger than \p pos.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_reg_prepare(vfs_memfs_t* fs, vfs_memfs_node_t* node, uint64_t pos, uint64_t end)
+{
+    int ret;
+    size_t idx, hole_cnt = 0;
+    vfs_memfs_node_reg_t* reg = &node->data.reg;
+    vfs_memfs_chunk_t* fresh = NULL;
+    const size_t idx_beg = (size_t)(pos / VFS_MEMFS_CHUNK_SIZE);
+    const size_t idx_end = (size_t)((end - 1) / VFS_MEMFS_CHUNK_SIZE);
+
+    if (reg->inlined)
+    {
+        /* Bytes after end of file are zero already. */
+        if (end <= VFS_MEMFS_INLINE_SIZE)
+        {
+            node->stat.st_size = max(node->stat.st_size, end);
+            return 0;
+        }
+        if ((ret = _vfs_memfs_reg_spill(fs, node)) != 0)
+        {
+            return ret;
+        }
+    }
+
+    if ((ret = _vfs_memfs_reg_reserve(fs, node, _vfs_memfs_chunk_count(end))) != 0)
+    {
+        return ret;
+    }
+
+    for (idx = idx_beg; idx <= idx_end; idx++)
+    {
+        if (reg->chunks[idx] == NULL)
+        {
+            hole_cnt++;
+        }
+        else if ((ret = _vfs_memfs_chunk_unshare(fs, reg, idx)) != 0)
+        {
+            return ret;
+        }
+    }
+
+    /* Allocate all chunks for holes first, so a failure changes nothing. */
+    const uint64_t charge_sz = (uint64_t)hole_cnt * VFS_MEMFS_CHUNK_SIZE;
+    if (hole_cnt != 0 && (ret = _vfs_memfs_usage_charge(fs, &fs->usage.data, charge_sz)) != 0)
+    {
+        return ret;
+    }
+    for (idx = 0; idx < hole_cnt; idx++)
+    {
+        vfs_memfs_chunk_t* chunk = _vfs_memfs_chunk_alloc(fs);
+        if (chunk == NULL)
+        {
+            while ((chunk = fresh) != NULL)
+            {
+                fresh = chunk->next;
+                _vfs_memfs_chunk_release(fs, chunk);
+            }
+            _vfs_memfs_usage_uncharge(fs, &fs->usage.data, charge_sz);
+            return VFS_ENOMEM;
+        }
+        chunk->next = fresh;
+        fresh = chunk;
+    }
+
+    /* Only the part of chunk that is not going to be written need to be zeroed. */
+    for (idx = idx_beg; idx <= idx_end && fresh != NULL; idx++)
+    {
+        if (reg->chunks[idx] != NULL)
+        {
+            continue;
+        }
+
+        vfs_memfs_chunk_t* chunk = fresh;
+        fresh = chunk->next;
+
+        const uint64_t chunk_beg = (uint64_t)idx * VFS_MEMFS_CHUNK_SIZE;
+        const size_t head = pos > chunk_beg ? (size_t)(pos - chunk_beg) : 0;
+        const size_t tail = end < chunk_beg + VFS_MEMFS_CHUNK_SIZE ? (size_t)(end - chunk_beg) : VFS_MEMFS_CHUNK_SIZE;
+        memset(chunk->data, 0, head);
+        memset(chunk->data + tail, 0, VFS_MEMFS_CHUNK_SIZE - tail);
+
+        reg->chunks[idx] = chunk;
+        node->stat.st_blocks += VFS_MEMFS_CHUNK_BLOCKS;
+    }
+
+    if (end > node->stat.st_size)
+    {
+        node->stat.st_size = end;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check whether range [\p pos, \p end) of regular file \p node can be
+ *   written without #_vfs_memfs_reg_prepare().
+ * @param[in] node - Regular file node.
+ * @param[in] pos - Start position.
+ * @param[in] end - End position, must be larger than \p pos.
+ * @return 1 if range is inside file, and file is inline or all chunks in range
+ *   exist and are exclusively owned, not compressed and not in dedup store,
+ *   otherwise 0.
+ */
+static int _vfs_memfs_reg_is_prepared(const vfs_memfs_node_t* node, uint64_t pos, uint64_t end)
+{
+    size_t idx;
+    const vfs_memfs_node_reg_t* reg = &node->data.reg;
+
+    if (end > node->stat.st_size)
+    {
+        return 0;
+    }
+    if (reg->inlined)
+    {
+        return 1;
+    }
+
+    for (idx = (size_t)(pos / VFS_MEMFS_CHUNK_SIZE); idx <= (size_t)((end - 1) / VFS_MEMFS_CHUNK_SIZE); idx++)
+    {
+        const vfs_memfs_chunk_t* chunk = idx < reg->chunk_sz ? reg->chunks[idx] : NULL;
+        if (chunk == NULL || chunk->zsize != 0 || chunk->store != NULL
+            || vfs_atomic_load(&chunk->refcnt) != 1)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Copy data into prepared range of regular file \p node.
+ * @see #_vfs_memfs_reg_prepare()
+ * @param[in] fs - File system object.
+ * @param[in,out] node - Regular file node.
+ * @param[in] pos - Start position.
+ * @param[in] buf - Data to write.
+ * @param[in] len - Data size.
+ */
+static void _vfs_memfs_reg_copy(vfs_memfs_t* fs, vfs_memfs_node_t* node, uint64_t pos, const void* buf, size_t len)
+{
+    vfs_memfs_node_reg_t* reg = &node->data.reg;
+
+    if (reg->inlined)
+    {
+        memcpy(reg->inline_data + pos, buf, len);
+        return;
+    }
+
+    size_t write_sz = 0;
+    while (write_sz < len)
+    {
+        const size_t idx = (size_t)(pos / VFS_MEMFS_CHUNK_SIZE);
+        const size_t offset = (size_t)(pos % VFS_MEMFS_CHUNK_SIZE);
+        const size_t copy_sz = min(len - write_sz, VFS_MEMFS_CHUNK_SIZE - offset);
+
+        _vfs_memfs_chunk_touch(fs, reg->chunks[idx]);
+        memcpy(reg->chunks[idx]->data + offset, (const uint8_t*)buf + write_sz, copy_sz);
+        write_sz += copy_sz;
+        pos += copy_sz;
+    }
+}
+
+/**
+ * @brief The maximum number of chunks replaced under one write lock.
+ */
+#define VFS_MEMFS_SWAP_BATCH    16
+
+typedef struct vfs_memfs_chunk_swap
+{
+    size_t                  idx;        /**< Chunk index. */
+    vfs_memfs_chunk_t*      chunk;      /**< New chunk, or old chunk after swap. */
+} vfs_memfs_chunk_swap_t;
+
+/**
+ * @brief Replace chunks of regular file \p node with chunks of same content.
+ *
+ * Content is never changed, so readers only need to be excluded briefly.
+ * After return, \p batch holds the old chunks, and references to them are
+ * owned by caller.
+ *
+ * @param[in,out] node - Regular file node.
+ * @param[in,out] batch - New chunks.
+ * @param[in] batch_sz - The number of new chunks.
+ */
+static void _vfs_memfs_reg_swap_chunks(vfs_memfs_node_t* node, vfs_memfs_chunk_swap_t* batch, size_t batch_sz)
+{
+    size_t i;
+    vfs_memfs_node_reg_t* reg = &node->data.reg;
+
+    vfs_rwlock_wrlock(&node->rwlock);
+    for (i = 0; i < batch_sz; i++)
+    {
+        vfs_memfs_chunk_t* chunk = batch[i].chunk;
+        batch[i].chunk = reg->chunks[batch[i].idx];
+        reg->chunks[batch[i].idx] = chunk;
+    }
+    vfs_rwlock_wrunlock(&node->rwlock);
+}
+
+/**
+ * @brief Find next data or hole in regular file \p node.
+ * @param[in] node - Regular file node.
+ * @param[in] offset - Start position.
+ * @param[in] hole - Search for hole if non-zero, otherwise search for data.
+ * @return The position of data or hole, or -errno on error.
+ */
+static int64_t _vfs_memfs_reg_seek_data(vfs_memfs_node_t* node, int64_t offset, int hole)
+{
+    const vfs_memfs_node_reg_t* reg = &node->data.reg;
+
+    if (offset < 0)
+    {
+        return VFS_EINVAL;
+    }
+    if ((uint64_t)offset >= node->stat.st_size)
+    {
+        return VFS_ENXIO;
+    }
+
+    /* Inline file is all data, followed by the virtual hole at end of file. */
+    if (reg->inlined)
+    {
+        return hole ? (int64_t)node->stat.st_size : offset;
+    }
+
+    size_t idx;
+    for (idx = (size_t)(offset / VFS_MEMFS_CHUNK_SIZE); idx < reg->chunk_sz; idx++)
+    {
+        if ((reg->chunks[idx] == NULL) == !!hole)
+        {
+            return max(offset, (int64_t)idx * VFS_MEMFS_CHUNK_SIZE);
+        }
+    }
+
+    /* Everything after chunk table is hole, and there is a virtual hole at end of file. */
+    if (!hole)
+    {
+        return VFS_ENXIO;
+    }
+    return (int64_t)min(node->stat.st_size, max((uint64_t)offset, (uint64_t)reg->chunk_sz * VFS_MEMFS_CHUNK_SIZE));
+}
+
+typedef struct vfs_memfs_range_waiter
+{
+    ev_list_node_t  node;       /**< Node in #vfs_memfs_range_t::waiters. */
+    vfs_sem_t       sem;        /**< Posted when the range is unlocked. */
+} vfs_memfs_range_waiter_t;
+
+static vfs_memfs_range_t* _vfs_memfs_range_find_conflict(vfs_memfs_range_lock_t* lock,
+    const vfs_memfs_range_t* range)
+{
+    ev_list_node_t* it = vfs_list_begin(&lock->ranges);
+    for (; it != NULL; it = vfs_list_next(it))
+    {
+        vfs_memfs_range_t* locked = EV_CONTAINER_OF(it, vfs_memfs_range_t, node);
+        if (locked->beg < range->end && range->beg < locked->end
+            && !(locked->shared && range->shared))
+        {
+            return locked;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Lock range [\p beg, \p end) of regular file \p node.
+ * @warning Must not be called with lock of \p node held.
+ * @param[in] node - Regular file node.
+ * @param[out] range - Range record, must stay valid until unlocked.
+ * @param[in] beg - Start position.
+ * @param[in] end - End position, exclusive.
+ * @param[in] shared - Non-zero to lock for read.
+ */
+static void _vfs_memfs_range_lock(vfs_memfs_node_t* node, vfs_memfs_range_t* range,
+    uint64_t beg, uint64_t end, int shared)
+{
+    vfs_memfs_range_lock_t* lock = &node->data.reg.range;
+    vfs_memfs_range_t* locked;
+
+    range->beg = beg;
+    range->end = end;
+    range->shared = shared;
+    vfs_list_init(&range->waiters);
+
+    vfs_mutex_enter(&lock->lock);
+    while ((locked = _vfs_memfs_range_find_conflict(lock, range)) != NULL)
+    {
+        vfs_memfs_range_waiter_t waiter;
+        vfs_sem_init(&waiter.sem, 0);
+        vfs_list_push_back(&locked->waiters, &waiter.node);
+
+        vfs_mutex_leave(&lock->lock);
+        {
+            vfs_sem_wait(&waiter.sem);
+            vfs_sem_exit(&waiter.sem);
+        }
+        vfs_mutex_enter(&lock->lock);
+    }
+    vfs_list_push_back(&lock->ranges, &range->node);
+    vfs_mutex_leave(&lock->lock);
+}
+
+static void _vfs_memfs_range_unlock(vfs_memfs_node_t* node, vfs_memfs_range_t* range)
+{
+    vfs_memfs_range_lock_t* lock = &node->data.reg.range;
+    ev_list_node_t* it;
+
+    vfs_mutex_enter(&lock->lock);
+    {
+        vfs_list_erase(&lock->ranges, &range->node);
+
+        /* Wake up everyone, they check conflict again by themselves. */
+        while ((it = vfs_list_pop_front(&range->waiters)) != NULL)
+        {
+            vfs_memfs_range_waiter_t* waiter = EV_CONTAINER_OF(it, vfs_memfs_range_waiter_t, node);
+            vfs_sem_post(&waiter->sem);
+        }
+    }
+    vfs_mutex_leave(&lock->lock);
+}
+
+/**
+ * @brief Set the size of regular file \p node, waiting for all IO in progress.
+ * @param[in] fs - File system object.
+ * @param[in,out] node - Regular file node.
+ * @param[in] size - New size in bytes.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_reg_set_size(vfs_memfs_t* fs, vfs_memfs_node_t* node, uint64_t size)
+{
+    int ret;
+    vfs_memfs_range_t range;
+    _vfs_memfs_range_lock(node, &range, 0, UINT64_MAX, 0);
+    vfs_rwlock_wrlock(&node->rwlock);
+    {
+        ret = _vfs_memfs_reg_truncate(fs, node, size);
+    }
+    vfs_rwlock_wrunlock(&node->rwlock);
+    _vfs_memfs_range_unlock(node, &range);
+    return ret;
+}
+
+/**
+ * @brief Epoch callback to free \p ptr, which is a #vfs_memfs_node_t.
+ */
+static void _vfs_memfs_common_free_node(void* ptr)
+{
+    vfs_memfs_node_t* node = ptr;
+
+    if (node->stat.st_mode & VFS_S_IFDIR)
+    {
+        free(node->data.dir.children);
+        free(node->data.dir.index);
+    }
+    else
+    {
+        free(node->data.reg.chunks);
+        vfs_mutex_exit(&node->data.reg.range.lock);
+    }
+
+    vfs_str_exit(&node->name);
+    vfs_rwlock_exit(&node->rwlock);
+    vfs_slab_free(node);
+}
+
+/**
+ * @brief Remove \p node from its parent.
+ * @warning Parent must be locked in write mode.
+ * @param[in] fs - File system object.
+ * @param[in] node - The node, must have a parent.
+ * @param[out] retired - (Optional) Set to the index that is no longer needed,
+ *   or NULL. Caller must retire it after parent is unlocked. If it is NULL,
+ *   the index is kept.
+ */
+static void _vfs_memfs_common_remove_node_from_parent_nolock(vfs_memfs_t* fs, vfs_memfs_node_t* node,
+    vfs_memfs_dir_index_t** retired)
+{
+    vfs_memfs_node_dir_t* dir = &node->parent->data.dir;
+    assert(dir->children[node->dir_pos] == node);
+
+    _vfs_memfs_dir_write_begin(dir);
+    {
+        if (dir->index != NULL)
+        {
+            _vfs_memfs_dir_index_erase(dir->index, node);
+        }
+
+        /* Move the last child into the gap, so removal is O(1). */
+        vfs_memfs_node_t* last = dir->children[dir->children_sz - 1];
+        dir->children[node->dir_pos] = last;
+        last->dir_pos = node->dir_pos;
+        dir->children_sz--;
+    }
+    _vfs_memfs_dir_write_end(dir);
+
+    /* The directory shrinks enough, linear scan is good enough. */
+    if (retired != NULL)
+    {
+        *retired = NULL;
+        if (dir->index != NULL && dir->children_sz <= VFS_MEMFS_DIR_INDEX_THRESHOLD / 2)
+        {
+            *retired = dir->index;
+            dir->index = NULL;
+            _vfs_memfs_usage_uncharge(fs, &fs->usage.meta, VFS_MEMFS_DIR_INDEX_BYTES((*retired)->cap));
+        }
+    }
+
+    node->parent = NULL;
+}
+
+static void _vfs_memfs_common_remove_node_from_parent(vfs_memfs_t* fs, vfs_memfs_node_t* node)
+{
+    vfs_memfs_dir_index_t* retired = NULL;
+    vfs_memfs_node_t* parent = node->parent;
+    if (parent == NULL)
+    {
+        return;
+    }
+    assert(parent->stat.st_mode & VFS_S_IFDIR);
+
+    vfs_rwlock_wrlock(&parent->rwlock);
+    {
+        /* Someone else might have removed it before we get the lock. */
+        if (node->parent == parent)
+        {
+            _vfs_memfs_common_remove_node_from_parent_nolock(fs, node, &retired);
+        }
+    }
+    vfs_rwlock_wrunlock(&parent->rwlock);
+
+    /* Retire may wait for readers, so never do it with lock held. */
+    if (retired != NULL)
+    {
+        vfs_epoch_retire(&fs->epoch, retired, free);
+    }
+}
+
+/**
+ * @brief Get memory used by a node with name of \p name_len bytes, without
+ *   its children or chunk table.
+ */
+static uint64_t _vfs_memfs_common_node_size(size_t name_len)
+{
+    return sizeof(vfs_memfs_node_t) + (name_len < VFS_MEMFS_NAME_INLINE ? 0 : name_len + 1);
+}
+
+/**
+ * @brief The number of bytes of metadata charged for \p node.
+ */
+static uint64_t _vfs_memfs_common_node_meta_size(const vfs_memfs_node_t* node)
+{
+    uint64_t size = _vfs_memfs_common_node_size(node->name.len);
+    if (node->stat.st_mode & VFS_S_IFDIR)
+    {
+        size += node->data.dir.children_cap * sizeof(vfs_memfs_node_t*);
+        if (node->data.dir.index != NULL)
+        {
+            size += VFS_MEMFS_DIR_INDEX_BYTES(node->data.dir.index->cap);
+        }
+    }
+    else
+    {
+        size += node->data.reg.chunk_cap * sizeof(vfs_memfs_chunk_t*);
+    }
+    return size;
+}
+
+/**
+ * @brief Release reference of \p fs, and free it if it is no longer used.
+ * @warning The file system tree must be released already, unless \p fs is a
+ *   snapshot, whose tree is released with the last reference but one.
+ * @param[in] fs - File system object.
+ */
+static void _vfs_memfs_common_release_fs(vfs_memfs_t* fs)
+{
+    const int cnt = vfs_atomic_dec(&fs->refcnt);
+
+    /*
+     * The last reference of a snapshot is held by its own tree, so nobody
+     * shares the snapshot any more. Source stops capturing into it, and the
+     * tree is released by destroy, which drops the last reference.
+     */
+    vfs_memfs_t* source = fs->source.fs;
+    if (cnt == 1 && source != NULL)
+    {
+        vfs_mutex_enter(&source->snap.lock);
+        {
+            vfs_list_erase(&source->snap.list, &fs->source.node);
+            ev_list_node_t* it = vfs_list_end(&source->snap.list);
+            vfs_atomic_store(&source->snap.gen, it != NULL ? EV_CONTAINER_OF(it, vfs_memfs_t, source.node)->source.gen : 0);
+        }
+        vfs_mutex_leave(&source->snap.lock);
+
+        fs->source.fs = NULL;
+        fs->op.destroy(&fs->op);
+        _vfs_memfs_common_release_fs(source);
+        return;
+    }
+    if (cnt != 0)
+    {
+        return;
+    }
+
+    vfs_mutex_exit(&fs->snap.lock);
+    vfs_mutex_exit(&fs->session_map_lock);
+    vfs_epoch_exit(&fs->epoch);
+    vfs_slab_exit(&fs->node_slab);
+    vfs_slab_exit(&fs->session_slab);
+    _vfs_memfs_zcache_exit(fs);
+    _vfs_memfs_chunk_pool_exit(fs);
+    if (fs->dedup.store != NULL)
+    {
+        _vfs_memfs_store_release(fs->dedup.store);
+    }
+    vfs_mutex_exit(&fs->dedup.lock);
+    vfs_mutex_exit(&fs->compress.lock);
+    vfs_mutex_exit(&fs->usage.lock);
+    free(fs);
+}
+
+/**
+ * @brief Release the ownership of \p node.
+ * @warning Must not be called in epoch critical section.
+ * @param[in] fs - File system object.
+ * @param[in] node - The node to be released.
+ * @param[in] unlink - If true, force unlink the node from its parent.
+ */
+static void _vfs_memfs_common_release_node(vfs_memfs_t* fs, vfs_memfs_node_t* node, int unlink)
+{
+    if (unlink)
+    {
+        _vfs_memfs_common_remove_node_from_parent(fs, node);
+    }
+
+    if (vfs_atomic_dec(&node->refcnt) != 0)
+    {
+        return;
+    }
+
+    _vfs_memfs_common_remove_node_from_parent(fs, node);
+
+    if (node->stat.st_mode & VFS_S_IFDIR)
+    {
+        while (node->data.dir.children_sz != 0)
+        {
+            vfs_memfs_node_t* child = node->data.dir.children[node->data.dir.children_sz - 1];
+            _vfs_memfs_common_release_node(fs, child, 1);
+
+            /*
+             * DO NOT REDUCE SIZE HERE!
+             * The #_vfs_memfs_common_release_node() will maintain the children size.
+             */
+        }
+
+        if (node->data.dir.origin != NULL)
+        {
+            _vfs_memfs_common_release_node(node->data.dir.origin_fs, node->data.dir.origin, 0);
+            _vfs_memfs_common_release_fs(node->data.dir.origin_fs);
+            node->data.dir.origin = NULL;
+            node->data.dir.origin_fs = NULL;
+        }
+    }
+    else
+    {
+        /* File content is never accessed without reference, release it now. */
+        (void)_vfs_memfs_reg_truncate(fs, node, 0);
+    }
+
+    _vfs_memfs_usage_uncharge(fs, &fs->usage.meta, _vfs_memfs_common_node_meta_size(node));
+
+    /* Lock-free readers may still be looking at this node. */
+    vfs_epoch_retire(&fs->epoch, node, _vfs_memfs_common_free_node);
+}
+
+/**
+ * @brief Create a node in \p parent.
+ * @warning \p parent must be locked in write mode.
+ * @param[in] fs - File system object.
+ * @param[in] parent - Parent directory, or NULL for root.
+ * @param[in] name - Node name.
+ * @param[in] type - Node type.
+ * @param[out] node - The new node, owned by \p parent.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_common_new_node(vfs_memfs_t* fs, vfs_memfs_node_t* parent,
+    const vfs_str_t* name, vfs_stat_flag_t type, vfs_memfs_node_t** node)
+{
+    int ret;
+    if (parent != NULL && (ret = _vfs_memfs_dir_reserve(fs, &parent->data.dir, parent->data.dir.children_sz + 1)) != 0)
+    {
+        return ret;
+    }
+
+    const uint64_t meta_sz = _vfs_memfs_common_node_size(name->len);
+    if ((ret = _vfs_memfs_usage_charge(fs, &fs->usage.meta, meta_sz)) != 0)
+    {
+        return ret;
+    }
+
+    vfs_memfs_node_t* new_node = vfs_slab_alloc(&fs->node_slab);
+    if (new_node == NULL)
+    {
+        _vfs_memfs_usage_uncharge(fs, &fs->usage.meta, meta_sz);
+        return VFS_ENOMEM;
+    }
+    memset(new_node, 0, sizeof(*new_node));
+    new_node->parent = parent;
+    new_node->refcnt = 1;
+    if (name->len < VFS_MEMFS_NAME_INLINE)
+    {
+        memcpy(new_node->name_buf, name->str, name->len);
+        new_node->name_buf[name->len] = '\0';
+        new_node->name = vfs_str_from_static(new_node->name_buf, name->len);
+    }
+    else
+    {
+        new_node->name = vfs_str_dup(name);
+    }
+    new_node->name_hash = _vfs_memfs_common_hash_name(name);
+    new_node->stat.st_mode = type;
+    vfs_rwlock_init(&new_node->rwlock);
+    if (type & VFS_S_IFREG)
+    {
+        new_node->data.reg.inlined = 1;
+        vfs_mutex_init(&new_node->data.reg.range.lock);
+        vfs_list_init(&new_node->data.reg.range.ranges);
+    }
+
+    if (parent != NULL)
+    {
+        vfs_memfs_node_dir_t* dir = &parent->data.dir;
+
+        /* The node is fully initialized before it is visible to lock-free readers. */
+        _vfs_memfs_dir_write_begin(dir);
+        {
+            new_node->dir_pos = dir->children_sz;
+            dir->children[dir->children_sz] = new_node;
+            dir->children_sz++;
+
+            if (dir->index != NULL)
+            {
+                _vfs_memfs_dir_index_insert(dir->index, new_node);
+            }
+        }
+        _vfs_memfs_dir_write_end(dir);
+    }
+
+    *node = new_node;
+    return 0;
+}
+
+/**
+ * @brief Make \p dst share type, stat and content of \p src.
+ *
+ * Shared content is charged to \p fs as if it is owned by \p dst. A
+ * directory is shared as origin of \p dst, or its own origin is shared if
+ * that is in a snapshot.
+ *
+ * @warning If \p src is a regular file, it must not be changed at the same time.
+ * @param[in] fs - File system of \p dst.
+ * @param[in] dst - New node without content.
+ * @param[in] src_fs - File system of \p src.
+ * @param[in] src - Source node.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_common_share_node(vfs_memfs_t* fs, vfs_memfs_node_t* dst,
+    vfs_memfs_t* src_fs, vfs_memfs_node_t* src)
+{
+    int ret;
+    size_t i;
+    uint64_t charge_sz = 0;
+    int64_t zcnt = 0, zbytes = 0;
+
+    if (src->stat.st_mode & VFS_S_IFDIR)
+    {
+        vfs_rwlock_rdlock(&src->rwlock);
+        {
+            /* Origin in a snapshot never changes, but origin of a snapshot may. */
+            const vfs_memfs_node_dir_t* dir = &src->data.dir;
+            const int pass = dir->origin != NULL && dir->origin_fs->source.fs != NULL;
+            vfs_memfs_node_t* origin = pass ? dir->origin : src;
+            vfs_memfs_t* origin_fs = pass ? dir->origin_fs : src_fs;
+            _vfs_memfs_common_acquire_node(origin);
+            (void)vfs_atomic_add(&origin_fs->refcnt);
+            dst->data.dir.origin = origin;
+            dst->data.dir.origin_fs = origin_fs;
+            dst->stat = src->stat;
+        }
+        vfs_rwlock_rdunlock(&src->rwlock);
+        return 0;
+    }
+
+    const vfs_memfs_node_reg_t* reg = &src->data.reg;
+    if (reg->inlined)
+    {
+        memcpy(dst->data.reg.inline_data, reg->inline_data, VFS_MEMFS_INLINE_SIZE);
+        dst->stat = src->stat;
+        return 0;
+    }
+
+    dst->data.reg.inlined = 0;
+    if ((ret = _vfs_memfs_reg_reserve(fs, dst, reg->chunk_sz)) != 0)
+    {
+        return ret;
+    }
+    for (i = 0; i < reg->chunk_sz; i++)
+    {
+        const vfs_memfs_chunk_t* chunk = reg->chunks[i];
+        if (chunk == NULL)
+        {
+            continue;
+        }
+        charge_sz += _vfs_memfs_chunk_charge_size(chunk);
+        if (chunk->zsize != 0)
+        {
+            zcnt++;
+            zbytes += chunk->zsize;
+        }
+    }
+    if ((ret = _vfs_memfs_usage_charge(fs, &fs->usage.data, charge_sz)) != 0)
+    {
+        return ret;
+    }
+    if (zcnt != 0)
+    {
+        _vfs_memfs_usage_compressed(fs, zcnt, zbytes);
+    }
+
+    for (i = 0; i < reg->chunk_sz; i++)
+    {
+        if ((dst->data.reg.chunks[i] = reg->chunks[i]) != NULL)
+        {
+            (void)vfs_atomic_add(&reg->chunks[i]->refcnt);
+        }
+    }
+    dst->stat = src->stat;
+    return 0;
+}
+
+/**
+ * @brief Copy children of origin into directory \p node.
+ * @warning \p node must be locked in write mode.
+ * @param[in] fs - File system object.
+ * @param[in] node - Directory node with origin.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_dir_materialize(vfs_memfs_t* fs, vfs_memfs_node_t* node)
+{
+    int ret;
+    size_t i;
+    vfs_memfs_node_dir_t* dir = &node->data.dir;
+    vfs_memfs_node_t* origin = dir->origin;
+    vfs_memfs_t* origin_fs = dir->origin_fs;
+    const vfs_memfs_node_dir_t* src = &origin->data.dir;
+
+    /* Origin in a snapshot may still share the directory it is taken from. */
+    vfs_rwlock_rdlock(&origin->rwlock);
+    while (src->origin != NULL)
+    {
+        vfs_rwlock_rdunlock(&origin->rwlock);
+        vfs_rwlock_wrlock(&origin->rwlock);
+        {
+            ret = src->origin != NULL ? _vfs_memfs_dir_materialize(origin_fs, origin) : 0;
+        }
+        vfs_rwlock_wrunlock(&origin->rwlock);
+
+        if (ret != 0)
+        {
+            return ret;
+        }
+        vfs_rwlock_rdlock(&origin->rwlock);
+    }
+
+    if ((ret = _vfs_memfs_dir_reserve(fs, dir, src->children_sz)) != 0)
+    {
+        goto error;
+    }
+
+    for (i = 0; i < src->children_sz; i++)
+    {
+        vfs_memfs_node_t* src_child = src->children[i];
+        vfs_memfs_node_t* child = NULL;
+        if ((ret = _vfs_memfs_common_new_node(fs, node, &src_child->name,
+            (vfs_stat_flag_t)(src_child->stat.st_mode & (VFS_S_IFDIR | VFS_S_IFREG)), &child)) != 0)
+        {
+            goto error;
+        }
+
+        if (src_child->stat.st_mode & VFS_S_IFDIR)
+        {
+            ret = _vfs_memfs_common_share_node(fs, child, origin_fs, src_child);
+        }
+        else
+        {
+            /* Wait for writers of a live origin, so the file is captured as a whole. */
+            vfs_memfs_range_t range;
+            _vfs_memfs_range_lock(src_child, &range, 0, UINT64_MAX, 1);
+            vfs_rwlock_rdlock(&src_child->rwlock);
+            {
+                ret = _vfs_memfs_common_share_node(fs, child, origin_fs, src_child);
+            }
+            vfs_rwlock_rdunlock(&src_child->rwlock);
+            _vfs_memfs_range_unlock(src_child, &range);
+        }
+        if (ret != 0)
+        {
+            _vfs_memfs_common_remove_node_from_parent_nolock(fs, child, NULL);
+            _vfs_memfs_common_release_node(fs, child, 0);
+            goto error;
+        }
+    }
+    vfs_rwlock_rdunlock(&origin->rwlock);
+
+    _vfs_memfs_dir_write_begin(dir);
+    {
+        dir->origin = NULL;
+        dir->origin_fs = NULL;
+    }
+    _vfs_memfs_dir_write_end(dir);
+
+    _vfs_memfs_common_release_node(origin_fs, origin, 0);
+    _vfs_memfs_common_release_fs(origin_fs);
+    return 0;
+
+error:
+    vfs_rwlock_rdunlock(&origin->rwlock);
+    while (dir->children_sz != 0)
+    {
+        vfs_memfs_node_t* child = dir->children[dir->children_sz - 1];
+        _vfs_memfs_common_remove_node_from_parent_nolock(fs, child, NULL);
+        _vfs_memfs_common_release_node(fs, child, 0);
+    }
+    return ret;
+}
+
+/**
+ * @brief Lock directory \p node in read mode, copying children of origin if
+ *   necessary.
+ * @param[in] fs - File system object.
+ * @param[in] node - Directory node.
+ * @return 0 on success and \p node is locked, or -errno on error.
+ */
+static int _vfs_memfs_dir_rdlock(vfs_memfs_t* fs, vfs_memfs_node_t* node)
+{
+    int ret;
+    vfs_rwlock_rdlock(&node->rwlock);
+    while (node->data.dir.origin != NULL)
+    {
+        vfs_rwlock_rdunlock(&node->rwlock);
+        vfs_rwlock_wrlock(&node->rwlock);
+        {
+            ret = node->data.dir.origin != NULL ? _vfs_memfs_dir_materialize(fs, node) : 0;
+        }
+        vfs_rwlock_wrunlock(&node->rwlock);
+
+        if (ret != 0)
+        {
+            return ret;
+        }
+        vfs_rwlock_rdlock(&node->rwlock);
+    }
+    return 0;
+}
+
+/**
+ * @brief Lock directory \p node in write mode, copying children of origin if
+ *   necessary.
+ * @param[in] fs - File system object.
+ * @param[in] node - Directory node.
+ * @return 0 on success and \p node is locked, or -errno on error.
+ */
+static int _vfs_memfs_dir_wrlock(vfs_memfs_t* fs, vfs_memfs_node_t* node)
+{
+    int ret;
+    vfs_rwlock_wrlock(&node->rwlock);
+    if (node->data.dir.origin != NULL && (ret = _vfs_memfs_dir_materialize(fs, node)) != 0)
+    {
+        vfs_rwlock_wrunlock(&node->rwlock);
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get children of directory \p node, including children of its origin.
+ * @warning \p node must be locked, or never change.
+ * @param[in] node - Directory node. Its origin is in a snapshot if any.
+ * @param[out] dir - Directory that holds the children.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_dir_children(vfs_memfs_node_t* node, const vfs_memfs_node_dir_t** dir)
+{
+    int ret;
+    vfs_memfs_node_t* origin = node->data.dir.origin;
+    if (origin == NULL)
+    {
+        *dir = &node->data.dir;
+        return 0;
+    }
+
+    /* Directory of a snapshot never changes once it is copied from its origin. */
+    if ((ret = _vfs_memfs_dir_rdlock(node->data.dir.origin_fs, origin)) != 0)
+    {
+        return ret;
+    }
+    vfs_rwlock_rdunlock(&origin->rwlock);
+
+    *dir = &origin->data.dir;
+    return 0;
+}
+
+/**
+ * @brief Check if directory \p node has no children.
+ * @param[in] node - Directory node.
+ * @return 1 if empty, 0 if not, or -errno on error.
+ */
+static int _vfs_memfs_dir_is_empty(vfs_memfs_node_t* node)
+{
+    int ret;
+    const vfs_memfs_node_dir_t* dir = NULL;
+    vfs_rwlock_rdlock(&node->rwlock);
+    {
+        if ((ret = _vfs_memfs_dir_children(node, &dir)) == 0)
+        {
+            ret = dir->children_sz == 0;
+        }
+    }
+    vfs_rwlock_rdunlock(&node->rwlock);
+    return ret;
+}
+
+static vfs_memfs_node_t* _vfs_memfs_common_search_for_nolock(vfs_memfs_node_t* parent, const vfs_str_t* name)
+{
+    const uint64_t hash = _vfs_memfs_common_hash_name(name);
+    vfs_memfs_node_t* node = _vfs_memfs_dir_find(&parent->data.dir, name, hash);
+
+    if (node != NULL)
+    {
+        _vfs_memfs_common_acquire_node(node);
+    }
+
+    return node;
+}
+
+/**
+ * @brief Search for \p name in \p parent.
+ * @param[in] fs - File system object.
+ * @param[in] parent - Parent node.
+ * @param[in] name - Name to search for.
+ * @return Found node, or NULL if not found. If found, the reference count will be increased.
+ */
+static vfs_memfs_node_t* _vfs_memfs_common_search_for(vfs_memfs_t* fs, vfs_memfs_node_t* parent, const vfs_str_t* name)
+{
+    vfs_memfs_node_t* node = NULL;
+
+    if (_vfs_memfs_dir_rdlock(fs, parent) != 0)
+    {
+        return NULL;
+    }
+    node = _vfs_memfs_common_search_for_nolock(parent, name);
+    vfs_rwlock_rdunlock(&parent->rwlock);
+
+    return node;
+}
+
+/**
+ * @brief Search for \p name in \p parent without lock.
+ * @warning Must be called in epoch critical section.
+ * @param[in] parent - Parent node.
+ * @param[in] name - Name to search for.
+ * @param[out] node - Found node, or NULL if not found. The reference count is not changed.
+ * @return 0 on success, or non-zero if the directory keeps changing.
+ */
+static int _vfs_memfs_common_search_for_rcu(vfs_memfs_node_t* parent, const vfs_str_t* name,
+    vfs_memfs_node_t** node)
+{
+    int retry;
+    vfs_memfs_node_dir_t* dir = &parent->data.dir;
+    const uint64_t hash = _vfs_memfs_common_hash_name(name);
+
+    for (retry = 0; retry < VFS_MEMFS_LOOKUP_RETRY; retry++)
+    {
+        const int seq = vfs_atomic_load(&dir->seq);
+        if (seq & 0x01)
+        {
+            continue;
+        }
+
+        /* Children of a clone are copied with lock. */
+        if (dir->origin != NULL)
+        {
+            return -1;
+        }
+
+        *node = _vfs_memfs_dir_find(dir, name, hash);
+
+        vfs_atomic_fence();
+        if (vfs_atomic_load(&dir->seq) == seq)
+        {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Find the node of \p path_list.
+ *
+ * Directories are walked in epoch critical section without any lock or
+ * reference, and only the final node is acquired. If a directory keeps
+ * changing, it is searched with lock outside of the critical section.
+ *
+ * @param[in] fs - File system object.
+ * @param[in] path_list - Path components.
+ * @param[out] node - Found node with reference count increased.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_common_lookup(vfs_memfs_t* fs, const vfs_strlist_t* path_list,
+    vfs_memfs_node_t** node)
+{
+    size_t i;
+    int ret = 0;
+    vfs_memfs_node_t* pinned = NULL; /* Node acquired by slow path. */
+    vfs_memfs_node_t* cur = fs->root;
+
+    int token = vfs_epoch_enter(&fs->epoch);
+    for (i = 0; i < path_list->num; i++)
+    {
+        const vfs_str_t* name = &path_list->arr[i];
+        vfs_memfs_node_t* child = NULL;
+
+        if (!(cur->stat.st_mode & VFS_S_IFDIR))
+        {
+            ret = VFS_ENOENT;
+            goto finish;
+        }
+
+        if (_vfs_memfs_common_search_for_rcu(cur, name, &child) != 0)
+        {
+            if (!_vfs_memfs_common_try_acquire_node(cur))
+            {
+                ret = VFS_ENOENT;
+                goto finish;
+            }
+
+            /* Never wait for lock in critical section. */
+            vfs_epoch_leave(&fs->epoch, token);
+            {
+                if (pinned != NULL)
+                {
+                    _vfs_memfs_common_release_node(fs, pinned, 0);
+                }
+                child = _vfs_memfs_common_search_for(fs, cur, name);
+                _vfs_memfs_common_release_node(fs, cur, 0);
+                pinned = child;
+            }
+            token = vfs_epoch_enter(&fs->epoch);
+        }
+
+        if (child == NULL)
+        {
+            ret = VFS_ENOENT;
+            goto finish;
+        }
+        cur = child;
+    }
+
+    if (cur == pinned)
+    {
+        pinned = NULL;
+    }
+    else if (!_vfs_memfs_common_try_acquire_node(cur))
+    {
+        ret = VFS_ENOENT;
+    }
+
+finish:
+    vfs_epoch_leave(&fs->epoch, token);
+    if (pinned != NULL)
+    {
+        _vfs_memfs_common_release_node(fs, pinned, 0);
+    }
+    if (ret == 0)
+    {
+        *node = cur;
+    }
+    return ret;
+}
+
+/**
+ * @brief Common operation for \p path.
+ * @param[in] fs - File system object.
+ * @param[in] path - The path.
+ * @param[in] cb - Callback function.
+ * @param[in] data - Callback data.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_common_op_path(vfs_memfs_t* fs, const vfs_str_t* path,
+    int (*cb)(vfs_memfs_t* fs, vfs_memfs_node_t* node, void* data), void* data)
+{
+    int ret;
+    vfs_memfs_node_t* node = NULL;
+    vfs_strlist_t path_list = vfs_str_split(path, "/", 1);
+
+    if ((ret = _vfs_memfs_common_lookup(fs, &path_list, &node)) == 0)
+    {
+        ret = cb(fs, node, data);
+        _vfs_memfs_common_release_node(fs, node, 0);
+    }
+
+    vfs_strlist_exit(&path_list);
+    return ret;
+}
+
+static void _vfs_memfs_common_release_session(vfs_memfs_t* fs, vfs_memfs_session_t* session)
+{
+    if (vfs_atomic_dec(&session->refcnt) != 0)
+    {
+        return;
+    }
+
+    if (session->data.node != NULL)
+    {
+        _vfs_memfs_common_release_node(fs, session->data.node, 0);
+        session->data.node = NULL;
+    }
+
+    vfs_mutex_exit(&session->mutex);
+    vfs_slab_free(session);
+}
+
+static int _vfs_memfs_common_op_fh(vfs_memfs_t* fs, uintptr_t fh,
+    int (*cb)(vfs_memfs_session_t* session, void* data), void* data)
+{
+    vfs_memfs_session_t tmp_session;
+    tmp_session.data.fh = fh;
+
+    vfs_memfs_session_t* session = NULL;
+    vfs_mutex_enter(&fs->session_map_lock);
+    do {
+        ev_map_node_t* it = vfs_map_find(&fs->session_map, &tmp_session.node);
+        if (it == NULL)
+        {
+            break;
+        }
+
+        session = EV_CONTAINER_OF(it, vfs_memfs_session_t, node);
+        (void)vfs_atomic_add(&session->refcnt);
+    } while (0);
+    vfs_mutex_leave(&fs->session_map_lock);
+
+    if (session == NULL)
+    {
+        return VFS_EBADF;
+    }
+
+    int ret = cb(session, data);
+    _vfs_memfs_common_release_session(fs, session);
+
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// snapshot
+//////////////////////////////////////////////////////////////////////////
+
+struct vfs_memfs_snapshot
+{
+    vfs_memfs_t*    fs;     /**< Referenced file system of snapshot. It is never exposed to user. */
+};
+
+static void _vfs_memfs_snapshot_release_path(vfs_memfs_t* fs, vfs_memfs_node_t** path, size_t path_sz)
+{
+    size_t i;
+    for (i = 0; i < path_sz; i++)
+    {
+        _vfs_memfs_common_release_node(fs, path[i], 0);
+    }
+    free(path);
+}
+
+/**
+ * @brief Get \p node and all its ancestors.
+ *
+ * A node never moves to another directory, so parents of a node that is
+ * still in the tree are found without lock.
+ *
+ * @param[in] fs - File system object.
+ * @param[in] node - Referenced node.
+ * @param[out] path - Referenced nodes, \p node first and root last.
+ * @param[out] path_sz - The number of nodes, or 0 if \p node is not in the tree.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_snapshot_path(vfs_memfs_t* fs, vfs_memfs_node_t* node,
+    vfs_memfs_node_t*** path, size_t* path_sz)
+{
+    int ret = 0;
+    size_t sz = 0, cap = 0;
+    vfs_memfs_node_t** list = NULL;
+    vfs_memfs_node_t* cur = node;
+    _vfs_memfs_common_acquire_node(cur);
+
+    /* Parent is not freed in epoch critical section, even if it is removed. */
+    int token = vfs_epoch_enter(&fs->epoch);
+    while (cur != NULL)
+    {
+        if (sz == cap)
+        {
+            size_t new_cap = cap == 0 ? 16 : cap * 2;
+            vfs_memfs_node_t** new_list = realloc(list, sizeof(vfs_memfs_node_t*) * new_cap);
+            if (new_list == NULL)
+            {
+                ret = VFS_ENOMEM;
+                break;
+            }
+            list = new_list;
+            cap = new_cap;
+        }
+        list[sz++] = cur;
+
+        vfs_memfs_node_t* parent = cur != fs->root ? cur->parent : NULL;
+        cur = parent != NULL && _vfs_memfs_common_try_acquire_node(parent) ? parent : NULL;
+    }
+    vfs_epoch_leave(&fs->epoch, token);
+
+    if (ret != 0)
+    {
+        _vfs_memfs_common_release_node(fs, cur, 0);
+        _vfs_memfs_snapshot_release_path(fs, list, sz);
+        return ret;
+    }
+    if (list[sz - 1] != fs->root)
+    {
+        _vfs_memfs_snapshot_release_path(fs, list, sz);
+        list = NULL;
+        sz = 0;
+    }
+
+    *path = list;
+    *path_sz = sz;
+    return 0;
+}
+
+/**
+ * @brief Capture \p path of source into snapshot \p fs.
+ *
+ * Directories of the snapshot along the path are copied from source if they
+ * still share it, so the last directory in \p path and its children are
+ * owned by the snapshot.
+ *
+ * @param[in] fs - File system of snapshot.
+ * @param[in] path - Path of source, as returned by #_vfs_memfs_snapshot_path().
+ * @param[in] path_sz - The number of nodes in \p path.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_snapshot_capture_path(vfs_memfs_t* fs, vfs_memfs_node_t** path, size_t path_sz)
+{
+    int ret = 0;
+    size_t i;
+    vfs_memfs_node_t* copy = fs->root;
+    _vfs_memfs_common_acquire_node(copy);
+
+    for (i = path_sz; i != 0 && copy != NULL; i--)
+    {
+        vfs_memfs_node_t* node = path[i - 1];
+        vfs_memfs_node_t* next = NULL;
+
+        if ((node->stat.st_mode & VFS_S_IFDIR) && (copy->stat.st_mode & VFS_S_IFDIR))
+        {
+            vfs_rwlock_wrlock(&copy->rwlock);
+            {
+                if (copy->data.dir.origin == node)
+                {
+                    ret = _vfs_memfs_dir_materialize(fs, copy);
+                }
+
+                /* Directory that shares something else never sees source. */
+                if (ret == 0 && copy->data.dir.origin == NULL && i > 1)
+                {
+                    next = _vfs_memfs_common_search_for_nolock(copy, &path[i - 2]->name);
+                }
+            }
+            vfs_rwlock_wrunlock(&copy->rwlock);
+        }
+
+        _vfs_memfs_common_release_node(fs, copy, 0);
+        copy = next;
+    }
+
+    if (copy != NULL)
+    {
+        _vfs_memfs_common_release_node(fs, copy, 0);
+    }
+    return ret;
+}
+
+/**
+ * @brief Capture \p node into snapshots that still share it, before it changes.
+ *
+ * A directory is captured by copying it into the snapshot, and a regular file
+ * is captured by copying its parent.
+ *
+ * @warning No node of \p fs may be locked by caller.
+ * @param[in] fs - File system object.
+ * @param[in] node - Referenced node that is about to change.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_snapshot_capture(vfs_memfs_t* fs, vfs_memfs_node_t* node)
+{
+    int ret;
+    size_t path_sz = 0;
+    vfs_memfs_node_t** path = NULL;
+
+    /* Captured by every snapshot, or nobody shares it. */
+    if (vfs_atomic_load(&node->gen) >= vfs_atomic_load(&fs->snap.gen))
+    {
+        return 0;
+    }
+
+    vfs_mutex_enter(&fs->snap.lock);
+    if ((ret = _vfs_memfs_snapshot_path(fs, node, &path, &path_sz)) == 0)
+    {
+        ev_list_node_t* it;
+        const int gen = vfs_atomic_load(&node->gen);
+        for (it = vfs_list_begin(&fs->snap.list); it != NULL && ret == 0; it = vfs_list_next(it))
+        {
+            vfs_memfs_t* snapshot = EV_CONTAINER_OF(it, vfs_memfs_t, source.node);
+            if (path_sz != 0 && snapshot->source.gen > gen)
+            {
+                ret = _vfs_memfs_snapshot_capture_path(snapshot, path, path_sz);
+            }
+        }
+        if (ret == 0)
+        {
+            vfs_atomic_store(&node->gen, fs->snap.last);
+        }
+        _vfs_memfs_snapshot_release_path(fs, path, path_sz);
+    }
+    vfs_mutex_leave(&fs->snap.lock);
+
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// destroy
+//////////////////////////////////////////////////////////////////////////
+
+static void _vfs_memfs_cleanup_session(vfs_memfs_t* fs)
+{
+    ev_map_node_t* it;
+
+    vfs_mutex_enter(&fs->session_map_lock);
+    while ((it = vfs_map_begin(&fs->session_map))!= NULL)
+    {
+        vfs_memfs_session_t* session = EV_CONTAINER_OF(it, vfs_memfs_session_t, node);
+        vfs_map_erase(&fs->session_map, it);
+        vfs_mutex_leave(&fs->session_map_lock);
+        {
+            _vfs_memfs_common_release_session(fs, session);
+        }
+        vfs_mutex_enter(&fs->session_map_lock);
+    }
+    vfs_mutex_leave(&fs->session_map_lock);
+}
+
+static void _vfs_memfs_destroy(struct vfs_operations* thiz)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
 
     _vfs_memfs_cleanup_session(fs);
 
-    if (fs->root != NULL)
+    if (fs->root != NULL)
+    {
+        _vfs_memfs_common_release_node(fs, fs->root, 1);
+        fs->root = NULL;
+    }
+
+    /* Nodes shared by other file systems are released by us later. */
+    _vfs_memfs_common_release_fs(fs);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// ls
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct vfs_memfs_ls_helper
+{
+    vfs_ls_cb   fn;
+    void*       data;
+} vfs_memfs_ls_helper_t;
+
+typedef struct vfs_memfs_ls_entry
+{
+    vfs_memfs_node_t*   node;       /**< Child node with reference count increased. */
+    vfs_stat_t          stat;       /**< Stat of child at the time of snapshot. */
+} vfs_memfs_ls_entry_t;
+
+static int _vfs_memfs_ls_inner(vfs_memfs_t* fs, vfs_memfs_node_t* node, void* data)
+{
+    size_t i, entry_sz;
+    int ret = 0;
+    vfs_memfs_ls_helper_t* helper = data;
+
+    /* Small directories are listed without touching the heap. */
+    vfs_memfs_ls_entry_t entry_buf[VFS_MEMFS_DIR_INDEX_THRESHOLD];
+    vfs_memfs_ls_entry_t* entries = entry_buf;
+
+    if (!(node->stat.st_mode & VFS_S_IFDIR))
+    {
+        return VFS_ENOTDIR;
+    }
+
+    /*
+     * Take a snapshot of children under read lock, so that concurrent listers
+     * and lookups are not blocked, and the result is consistent even if the
+     * directory is changed by callbacks.
+     */
+    if ((ret = _vfs_memfs_dir_rdlock(fs, node)) != 0)
+    {
+        return ret;
+    }
+    {
+        entry_sz = node->data.dir.children_sz;
+        if (entry_sz > ARRAY_SIZE(entry_buf)
+            && (entries = malloc(sizeof(vfs_memfs_ls_entry_t) * entry_sz)) == NULL)
+        {
+            vfs_rwlock_rdunlock(&node->rwlock);
+            return VFS_ENOMEM;
+        }
+
+        for (i = 0; i < entry_sz; i++)
+        {
+            entries[i].node = node->data.dir.children[i];
+            _vfs_memfs_common_acquire_node(entries[i].node);
+        }
+    }
+    vfs_rwlock_rdunlock(&node->rwlock);
+
+    /* Copy stat without holding parent lock, so lock order is never nested. */
+    for (i = 0; i < entry_sz; i++)
+    {
+        vfs_memfs_node_t* child = entries[i].node;
+        vfs_rwlock_rdlock(&child->rwlock);
+        {
+            entries[i].stat = child->stat;
+        }
+        vfs_rwlock_rdunlock(&child->rwlock);
+    }
+
+    for (i = 0; i < entry_sz && ret == 0; i++)
+    {
+        ret = helper->fn(entries[i].node->name.str, &entries[i].stat, helper->data);
+    }
+
+    for (i = 0; i < entry_sz; i++)
+    {
+        _vfs_memfs_common_release_node(fs, entries[i].node, 0);
+    }
+
+    if (entries != entry_buf)
+    {
+        free(entries);
+    }
+
+    return 0;
+}
+
+static int _vfs_memfs_ls(struct vfs_operations* thiz, const char* path,
+    vfs_ls_cb fn, void* data)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_str_t path_str = vfs_str_from_static1(path);
+
+    vfs_memfs_ls_helper_t helper = { fn, data };
+    return _vfs_memfs_common_op_path(fs, &path_str, _vfs_memfs_ls_inner, &helper);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// stat
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct vfs_memfs_stat_helper
+{
+    vfs_stat_t*     info;
+} vfs_memfs_stat_helper_t;
+
+static int _vfs_memfs_stat_inner(vfs_memfs_t* fs, vfs_memfs_node_t* node, void* data)
+{
+    (void)fs;
+    vfs_memfs_stat_helper_t* helper = data;
+
+    vfs_rwlock_rdlock(&node->rwlock);
+    {
+        *helper->info = node->stat;
+    }
+    vfs_rwlock_rdunlock(&node->rwlock);
+    return 0;
+}
+
+static int _vfs_memfs_stat(struct vfs_operations* thiz, const char* path,
+    vfs_stat_t* info)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_str_t path_str = vfs_str_from_static1(path);
+
+    vfs_memfs_stat_helper_t helper = { info };
+    return _vfs_memfs_common_op_path(fs, &path_str, _vfs_memfs_stat_inner, &helper);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// open
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct vfs_mmefs_open_searcher
+{
+    vfs_memfs_node_t* node;
+} vfs_mmefs_open_searcher_t;
+
+static int _vfs_memfs_open_searcher(vfs_memfs_t* fs, vfs_memfs_node_t* node, void* data)
+{
+    (void)fs;
+    vfs_mmefs_open_searcher_t* searcher = data;
+
+    searcher->node = node;
+    _vfs_memfs_common_acquire_node(node);
+
+    return 0;
+}
+
+static int _vfs_memfs_open_exist(vfs_memfs_t* fs, vfs_memfs_node_t* node, uintptr_t* fh, uint64_t flags)
+{
+    int ret;
+    if ((flags & VFS_O_TRUNCATE) && (ret = _vfs_memfs_snapshot_capture(fs, node)) != 0)
+    {
+        return ret;
+    }
+
+    vfs_memfs_session_t* session = vfs_slab_alloc(&fs->session_slab);
+    if (session == NULL)
+    {
+        return VFS_ENOMEM;
+    }
+    memset(session, 0, sizeof(*session));
+    session->refcnt = 1;
+    vfs_mutex_init(&session->mutex);
+    session->data.fh = (uintptr_t)session;
+    session->data.flags = flags;
+    session->data.fpos = 0;
+    session->data.node = node;
+    _vfs_memfs_common_acquire_node(node);
+
+    /* Handle APPEND flag. */
+    if (flags & VFS_O_APPEND)
+    {
+        session->data.fpos = UINT64_MAX;
+    }
+    /* Handle TRUNCATE flag. */
+    if (flags & VFS_O_TRUNCATE)
+    {
+        (void)_vfs_memfs_reg_set_size(fs, node, 0);
+    }
+
+    /* Save session. */
+    {
+        ev_map_node_t* orig;
+        vfs_mutex_enter(&fs->session_map_lock);
+        {
+            orig = vfs_map_insert(&fs->session_map, &session->node);
+        }
+        vfs_mutex_leave(&fs->session_map_lock);
+        if (orig != NULL)
+        {
+            abort();
+        }
+    }
+
+    *fh = session->data.fh;
+    return 0;
+}
+
+typedef struct vfs_memfs_open_helper
+{
+    uintptr_t*  fh;
+    uint64_t    flags;
+} vfs_memfs_open_helper_t;
+
+static int _vfs_memfs_open_exist_inner(vfs_memfs_t* fs, vfs_memfs_node_t* node, void* data)
+{
+    vfs_memfs_open_helper_t* helper = data;
+
+    if (!(node->stat.st_mode & VFS_S_IFREG))
+    {
+        return VFS_EISDIR;
+    }
+
+    return _vfs_memfs_open_exist(fs, node, helper->fh, helper->flags);
+}
+
+static int _vfs_memfs_open_inner(vfs_memfs_t* fs, vfs_memfs_node_t* parent,
+    uintptr_t* fh, const vfs_str_t* name, uint64_t flags)
+{
+    int ret = 0;
+
+    if (!(parent->stat.st_mode & VFS_S_IFDIR))
+    {
+        return VFS_ENOENT;
+    }
+
+    vfs_memfs_node_t* child = NULL;
+    if ((flags & VFS_O_CREATE) && (ret = _vfs_memfs_snapshot_capture(fs, parent)) != 0)
+    {
+        return ret;
+    }
+    if ((ret = _vfs_memfs_dir_wrlock(fs, parent)) != 0)
+    {
+        return ret;
+    }
+    do 
+    {
+        if ((child = _vfs_memfs_common_search_for_nolock(parent, name)) == NULL)
+        {
+            if (!(flags & VFS_O_CREATE))
+            {
+                ret = VFS_ENOENT;
+                break;
+            }
+
+            if ((ret = _vfs_memfs_common_new_node(fs, parent, name, VFS_S_IFREG, &child)) != 0)
+            {
+                break;
+            }
+            _vfs_memfs_common_acquire_node(child);
+
+            /* Snapshots that have captured parent never see the new file. */
+            vfs_atomic_store(&child->gen, vfs_atomic_load(&parent->gen));
+        }
+    } while (0);
+    vfs_rwlock_wrunlock(&parent->rwlock);
+
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    /* Check type. */
+    if (!(child->stat.st_mode & VFS_S_IFREG))
+    {
+        ret = VFS_EISDIR;
+        goto finish;
+    }
+
+    /* Open file. */
+    ret = _vfs_memfs_open_exist(fs, child, fh, flags);
+
+finish:
+    _vfs_memfs_common_release_node(fs, child, 0);
+    return ret;
+}
+
+static int _vfs_memfs_open(struct vfs_operations* thiz, uintptr_t* fh, const char* path, uint64_t flags)
+{
+    int ret = 0;
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_str_t path_str = vfs_str_from_static1(path);
+    if (vfs_str_cmp1(&path_str, "/") == 0)
+    {
+        return VFS_EISDIR;
+    }
+
+    /* Existing file can be found without lock. */
+    if (!(flags & VFS_O_CREATE))
+    {
+        vfs_memfs_open_helper_t helper = { fh, flags };
+        return _vfs_memfs_common_op_path(fs, &path_str, _vfs_memfs_open_exist_inner, &helper);
+    }
+
+    vfs_str_t basename = VFS_STR_INIT;
+    vfs_str_t parent_path = vfs_path_parent(&path_str, &basename);
+
+    /* Search for parent node. */
+    vfs_memfs_node_t* parent = NULL;
+    if (vfs_str_cmp1(&parent_path, "/") != 0)
+    {
+        vfs_mmefs_open_searcher_t searcher = { NULL };
+        ret = _vfs_memfs_common_op_path(fs, &parent_path, _vfs_memfs_open_searcher, &searcher);
+        if (ret != 0)
+        {
+            goto finish;
+        }
+        parent = searcher.node;
+    }
+    else
+    {
+        parent = fs->root;
+        _vfs_memfs_common_acquire_node(parent);
+    }
+
+    ret = _vfs_memfs_open_inner(fs, parent, fh, &basename, flags);
+    _vfs_memfs_common_release_node(fs, parent, 0);
+
+finish:
+    vfs_str_exit(&parent_path);
+    vfs_str_exit(&basename);
+    _vfs_memfs_usage_check_soft_limit(fs);
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// dedup
+//////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Share content of regular file \p node through dedup \p store.
+ * @param[in] fs - File system object.
+ * @param[in] store - Dedup store.
+ * @param[in] node - Regular file node.
+ */
+static void _vfs_memfs_dedup_reg(vfs_memfs_t* fs, vfs_memfs_store_t* store, vfs_memfs_node_t* node)
+{
+    size_t i, idx = 0;
+    vfs_memfs_range_t range;
+    const vfs_memfs_node_reg_t* reg = &node->data.reg;
+
+    /* Writers wait for us, so content of chunks does not change. */
+    _vfs_memfs_range_lock(node, &range, 0, UINT64_MAX, 1);
+
+    for (;;)
+    {
+        vfs_memfs_chunk_swap_t batch[VFS_MEMFS_SWAP_BATCH];
+        size_t batch_sz = 0;
+
+        vfs_rwlock_rdlock(&node->rwlock);
+        for (; idx < reg->chunk_sz && batch_sz < ARRAY_SIZE(batch); idx++)
+        {
+            vfs_memfs_chunk_t* chunk = reg->chunks[idx];
+            if (chunk == NULL || chunk->zsize != 0 || chunk->store != NULL
+                || vfs_atomic_load(&chunk->refcnt) != 1)
+            {
+                continue;
+            }
+
+            const uint64_t hash = vfs_hash64(chunk->data, VFS_MEMFS_CHUNK_SIZE, 0);
+            vfs_memfs_chunk_t* found = _vfs_memfs_store_find(store, hash, chunk->data);
+            if (found == NULL)
+            {
+                _vfs_memfs_store_insert(store, chunk, hash);
+                continue;
+            }
+
+            batch[batch_sz].idx = idx;
+            batch[batch_sz].chunk = found;
+            batch_sz++;
+        }
+        const int done = idx >= reg->chunk_sz;
+        vfs_rwlock_rdunlock(&node->rwlock);
+
+        /* Both chunks are plain, so usage does not change. */
+        _vfs_memfs_reg_swap_chunks(node, batch, batch_sz);
+        for (i = 0; i < batch_sz; i++)
+        {
+            _vfs_memfs_chunk_release(fs, batch[i].chunk);
+        }
+
+        if (done)
+        {
+            break;
+        }
+    }
+
+    _vfs_memfs_range_unlock(node, &range);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// close
+//////////////////////////////////////////////////////////////////////////
+
+static int _vfs_memfs_close(struct vfs_operations* thiz, uintptr_t fh)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+
+    vfs_memfs_session_t tmp_session;
+    tmp_session.data.fh = fh;
+
+    vfs_memfs_session_t* session = NULL;
+    vfs_mutex_enter(&fs->session_map_lock);
+    do {
+        ev_map_node_t* it = vfs_map_find(&fs->session_map, &tmp_session.node);
+        if (it == NULL)
+        {
+            break;
+        }
+
+        session = EV_CONTAINER_OF(it, vfs_memfs_session_t, node);
+        vfs_map_erase(&fs->session_map, it);
+    } while (0);
+    vfs_mutex_leave(&fs->session_map_lock);
+
+    if (session == NULL)
+    {
+        return VFS_EBADF;
+    }
+
+    vfs_memfs_node_t* node = session->data.node;
+    if ((session->data.flags & VFS_O_WRONLY) && (node->stat.st_mode & VFS_S_IFREG))
+    {
+        vfs_mutex_enter(&fs->dedup.lock);
+        vfs_memfs_store_t* store = fs->dedup.store;
+        if (store != NULL)
+        {
+            (void)vfs_atomic_add(&store->refcnt);
+        }
+        vfs_mutex_leave(&fs->dedup.lock);
+
+        if (store != NULL)
+        {
+            _vfs_memfs_dedup_reg(fs, store, node);
+            _vfs_memfs_store_release(store);
+        }
+    }
+
+    _vfs_memfs_common_release_session(fs, session);
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// truncate
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct vfs_memfs_truncate_helper
+{
+    vfs_memfs_t*    fs;
+    uint64_t        size;
+} vfs_memfs_truncate_helper_t;
+
+static int _vfs_memfs_truncate_inner(vfs_memfs_session_t* session, void* data)
+{
+    int ret;
+    vfs_memfs_truncate_helper_t* helper = data;
+    if ((ret = _vfs_memfs_snapshot_capture(helper->fs, session->data.node)) != 0)
+    {
+        return ret;
+    }
+    return _vfs_memfs_reg_set_size(helper->fs, session->data.node, helper->size);
+}
+
+static int _vfs_memfs_truncate(struct vfs_operations* thiz, uintptr_t fh, uint64_t size)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_memfs_truncate_helper_t helper = { fs, size };
+    return _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_truncate_inner, &helper);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// seek
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct vfs_memfs_seek_helper
+{
+    int64_t offset;
+    int     whence;
+    int64_t ret;
+} vfs_memfs_seek_helper_t;
+
+static int _vfs_memfs_seek_inner(vfs_memfs_session_t* session, void* data)
+{
+    vfs_memfs_seek_helper_t* helper = data;
+    vfs_memfs_node_t* node = session->data.node;
+
+    if (helper->whence == VFS_SEEK_SET)
+    {
+        vfs_mutex_enter(&session->mutex);
+        {
+            session->data.fpos = helper->offset;
+            helper->ret = session->data.fpos;
+        }
+        vfs_mutex_leave(&session->mutex);
+        return 0;
+    }
+
+    if (helper->whence == VFS_SEEK_CUR)
+    {
+        if (session->data.fpos == UINT64_MAX)
+        {
+            goto handle_seek_end;
+        }
+        vfs_mutex_enter(&session->mutex);
+        {
+            session->data.fpos += helper->offset;
+            helper->ret = session->data.fpos;
+        }
+        vfs_mutex_leave(&session->mutex);
+        return 0;
+    }
+
+    if (helper->whence == VFS_SEEK_DATA || helper->whence == VFS_SEEK_HOLE)
+    {
+        int64_t pos;
+        vfs_mutex_enter(&session->mutex);
+        vfs_rwlock_rdlock(&node->rwlock);
+        {
+            pos = _vfs_memfs_reg_seek_data(node, helper->offset, helper->whence == VFS_SEEK_HOLE);
+            if (pos >= 0)
+            {
+                session->data.fpos = pos;
+            }
+        }
+        vfs_rwlock_rdunlock(&node->rwlock);
+        vfs_mutex_leave(&session->mutex);
+
+        if (pos < 0)
+        {
+            return (int)pos;
+        }
+        helper->ret = pos;
+        return 0;
+    }
+
+    /* Now whence is #VFS_SEEK_END. */
+
+    /* offset == 0 is special, it means always append to end of file. */
+    if (helper->offset == 0)
+    {
+        vfs_mutex_enter(&session->mutex);
+        {
+            session->data.fpos = UINT64_MAX;
+            helper->ret = node->stat.st_size;
+        }
+        vfs_mutex_leave(&session->mutex);
+        return 0;
+    }
+
+    /* In other condition, we need to have absolute position. */
+handle_seek_end:
+    vfs_mutex_enter(&session->mutex);
+    vfs_rwlock_rdlock(&node->rwlock);
+    {
+        session->data.fpos = node->stat.st_size + helper->offset;
+        helper->ret = session->data.fpos;
+    }
+    vfs_rwlock_rdunlock(&node->rwlock);
+    vfs_mutex_leave(&session->mutex);
+    
+    return 0;
+}
+
+static int64_t _vfs_memfs_seek(struct vfs_operations* thiz, uintptr_t fh, int64_t offset, int whence)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+
+    vfs_memfs_seek_helper_t helper = { offset, whence, 0 };
+    int ret = _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_seek_inner, &helper);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return helper.ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// read
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct vfs_memfs_read_helper
+{
+    vfs_memfs_t*    fs;
+    void*           buf;
+    size_t          len;
+} vfs_memfs_read_helper_t;
+
+static int _vfs_memfs_read_default(vfs_memfs_session_t* session, void* buf, size_t len, void* data)
+{
+    vfs_memfs_t* fs = data;
+    vfs_memfs_node_t* node = session->data.node;
+    if (session->data.fpos >= node->stat.st_size)
+    {
+        return VFS_EOF;
+    }
+
+    size_t read_sz = _vfs_memfs_reg_read(fs, node, session->data.fpos, buf, len);
+    session->data.fpos += read_sz;
+
+    return (int)read_sz;
+}
+
+static int _vfs_memfs_read_inner(vfs_memfs_session_t* session, void* data)
+{
+    int ret = 0;
+    vfs_memfs_read_helper_t* helper = data;
+    vfs_memfs_t* fs = helper->fs;
+    vfs_memfs_node_t* node = session->data.node;
+    vfs_memfs_range_t range;
+
+    if ((session->data.flags & VFS_O_RDWR) == VFS_O_WRONLY)
+    {
+        return VFS_EBADF;
+    }
+
+    vfs_mutex_enter(&session->mutex);
+    {
+        /* Readers only wait for writers of the same range. */
+        const uint64_t pos = session->data.fpos;
+        const uint64_t end = pos + helper->len < pos ? UINT64_MAX : pos + helper->len;
+        _vfs_memfs_range_lock(node, &range, pos, end, 1);
+
+        vfs_rwlock_rdlock(&node->rwlock);
+        {
+            ret = fs->io.read(session, helper->buf, helper->len, fs->io.data);
+        }
+        vfs_rwlock_rdunlock(&node->rwlock);
+
+        _vfs_memfs_range_unlock(node, &range);
+    }
+    vfs_mutex_leave(&session->mutex);
+
+    return ret;
+}
+
+static int _vfs_memfs_read(struct vfs_operations* thiz, uintptr_t fh, void* buf, size_t len)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_memfs_read_helper_t helper = { fs, buf, len };
+    _vfs_memfs_compress_update_tick(fs);
+    return _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_read_inner, &helper);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// write
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct vfs_memfs_write_helper
+{
+    vfs_memfs_t*    fs;
+    const void*     buf;
+    size_t          len;
+} vfs_memfs_write_helper_t;
+
+/**
+ * @brief Lock the range to be written by \p session.
+ *
+ * In append mode the range starts at end of file, which is only known after
+ * extension by other writers are finished, so the lock is retried until end
+ * of file is stable.
+ *
+ * @param[in] session - The session.
+ * @param[out] range - The locked range.
+ * @param[in] len - Data size.
+ * @return Start position of write.
+ */
+static uint64_t _vfs_memfs_write_lock_range(vfs_memfs_session_t* session, vfs_memfs_range_t* range, size_t len)
+{
+    vfs_memfs_node_t* node = session->data.node;
+    uint64_t pos = session->data.fpos;
+
+    if (pos != UINT64_MAX)
+    {
+        _vfs_memfs_range_lock(node, range, pos, pos + len, 0);
+        return pos;
+    }
+
+    for (;;)
+    {
+        vfs_rwlock_rdlock(&node->rwlock);
+        {
+            pos = node->stat.st_size;
+        }
+        vfs_rwlock_rdunlock(&node->rwlock);
+
+        /* Any write that extends the file overlaps this range. */
+        _vfs_memfs_range_lock(node, range, pos, UINT64_MAX, 0);
+
+        int stable;
+        vfs_rwlock_rdlock(&node->rwlock);
+        {
+            stable = node->stat.st_size == pos;
+        }
+        vfs_rwlock_rdunlock(&node->rwlock);
+
+        if (stable)
+        {
+            return pos;
+        }
+        _vfs_memfs_range_unlock(node, range);
+    }
+}
+
+static int _vfs_memfs_write_default(vfs_memfs_session_t* session,
+    const void* buf, size_t len, void* data)
+{
+    int ret = 0;
+    vfs_memfs_t* fs = data;
+    vfs_memfs_node_t* node = session->data.node;
+    vfs_memfs_range_t range;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (session->data.fpos != UINT64_MAX && session->data.fpos + len < session->data.fpos)
+    {
+        return VFS_EINVAL;
+    }
+
+    const uint64_t pos = _vfs_memfs_write_lock_range(session, &range, len);
+
+    /*
+     * Only filling holes and extending the file change the chunk table, which
+     * requires write lock. Content is copied under read lock, so writers of
+     * disjoint ranges run in parallel.
+     */
+    vfs_rwlock_rdlock(&node->rwlock);
+    if (!_vfs_memfs_reg_is_prepared(node, pos, pos + len))
+    {
+        vfs_rwlock_rdunlock(&node->rwlock);
+        vfs_rwlock_wrlock(&node->rwlock);
+        {
+            ret = _vfs_memfs_reg_prepare(fs, node, pos, pos + len);
+        }
+        vfs_rwlock_wrunlock(&node->rwlock);
+
+        /* Nobody else can touch our range, so it is still prepared. */
+        vfs_rwlock_rdlock(&node->rwlock);
+    }
+    if (ret == 0)
+    {
+        _vfs_memfs_reg_copy(fs, node, pos, buf, len);
+    }
+    vfs_rwlock_rdunlock(&node->rwlock);
+
+    _vfs_memfs_range_unlock(node, &range);
+
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    if (session->data.fpos != UINT64_MAX)
+    {
+        session->data.fpos += len;
+    }
+    return (int)len;
+}
+
+static int _vfs_memfs_write_inner(vfs_memfs_session_t* session, void* data)
+{
+    int ret = 0;
+    vfs_memfs_write_helper_t* helper = data;
+    vfs_memfs_t* fs = helper->fs;
+    vfs_memfs_node_t* node = session->data.node;
+
+    if ((session->data.flags & VFS_O_RDWR) == VFS_O_RDONLY)
+    {
+        return VFS_EBADF;
+    }
+    if ((ret = _vfs_memfs_snapshot_capture(fs, node)) != 0)
+    {
+        return ret;
+    }
+
+    vfs_mutex_enter(&session->mutex);
+    if (fs->io.write == _vfs_memfs_write_default)
+    {
+        /* Default IO layer locks the byte range by itself. */
+        ret = _vfs_memfs_write_default(session, helper->buf, helper->len, fs->io.data);
+    }
+    else
+    {
+        vfs_rwlock_wrlock(&node->rwlock);
+        {
+            ret = fs->io.write(session, helper->buf, helper->len, fs->io.data);
+        }
+        vfs_rwlock_wrunlock(&node->rwlock);
+    }
+    vfs_mutex_leave(&session->mutex);
+
+    return ret;
+}
+
+static int _vfs_memfs_write(struct vfs_operations* thiz, uintptr_t fh, const void* buf, size_t len)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_memfs_write_helper_t helper = { fs, buf, len };
+    _vfs_memfs_compress_update_tick(fs);
+    int ret = _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_write_inner, &helper);
+    _vfs_memfs_usage_check_soft_limit(fs);
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// mkdir
+//////////////////////////////////////////////////////////////////////////
+
+static int _vfs_memfs_mkdir_inner(vfs_memfs_t* fs, vfs_memfs_node_t* node, void* data)
+{
+    int ret = 0;
+    vfs_str_t* basename = data;
+
+    if (!(node->stat.st_mode & VFS_S_IFDIR))
+    {
+        return VFS_ENOTDIR;
+    }
+
+    if ((ret = _vfs_memfs_snapshot_capture(fs, node)) != 0)
+    {
+        return ret;
+    }
+    if ((ret = _vfs_memfs_dir_wrlock(fs, node)) != 0)
+    {
+        return ret;
+    }
+    do 
+    {
+        vfs_memfs_node_t* child = _vfs_memfs_common_search_for_nolock(node, basename);
+        if (child != NULL)
+        {
+            _vfs_memfs_common_release_node(fs, child, 0);
+            ret = VFS_EALREADY;
+            break;
+        }
+
+        if ((ret = _vfs_memfs_common_new_node(fs, node, basename, VFS_S_IFDIR, &child)) != 0)
+        {
+            break;
+        }
+
+        /* Snapshots that have captured parent never see the new directory. */
+        vfs_atomic_store(&child->gen, vfs_atomic_load(&node->gen));
+    } while (0);
+    vfs_rwlock_wrunlock(&node->rwlock);
+
+    return ret;
+}
+
+static int _vfs_memfs_mkdir(struct vfs_operations* thiz, const char* path)
+{
+    int ret = 0;
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_str_t path_str = vfs_str_from_static1(path);
+
+    vfs_str_t basename = VFS_STR_INIT;
+    vfs_str_t parent = vfs_path_parent(&path_str, &basename);
+    {
+        ret = _vfs_memfs_common_op_path(fs, &parent, _vfs_memfs_mkdir_inner, &basename);
+    }
+    vfs_str_exit(&basename);
+    vfs_str_exit(&parent);
+
+    _vfs_memfs_usage_check_soft_limit(fs);
+
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// rmdir
+//////////////////////////////////////////////////////////////////////////
+
+static int _vfs_memfs_rmdir_inner(vfs_memfs_t* fs, vfs_memfs_node_t* node, void* data)
+{
+    int ret;
+    vfs_str_t* basename = data;
+
+    if (!(node->stat.st_mode & VFS_S_IFDIR))
+    {
+        return VFS_ENOTDIR;
+    }
+
+    /* The reference count has been increased. */
+    vfs_memfs_node_t* child = _vfs_memfs_common_search_for(fs, node, basename);
+    if (child == NULL)
+    {
+        return VFS_ENOENT;
+    }
+
+    if (!(child->stat.st_mode & VFS_S_IFDIR))
+    {
+        _vfs_memfs_common_release_node(fs, child, 0);
+        return VFS_ENOTDIR;
+    }
+
+    if ((ret = _vfs_memfs_dir_is_empty(child)) != 1)
+    {
+        _vfs_memfs_common_release_node(fs, child, 0);
+        return ret == 0 ? VFS_ENOTEMPTY : ret;
+    }
+    if ((ret = _vfs_memfs_snapshot_capture(fs, node)) != 0)
+    {
+        _vfs_memfs_common_release_node(fs, child, 0);
+        return ret;
+    }
+
+    /* The first time to release reference increased by #_vfs_memfs_common_search_for(). */
+    _vfs_memfs_common_release_node(fs, child, 0);
+    /* The second time to release reference to actually delete it. */
+    _vfs_memfs_common_release_node(fs, child, 1);
+
+    return 0;
+}
+
+static int _vfs_memfs_rmdir(struct vfs_operations* thiz, const char* path)
+{
+    int ret;
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_str_t path_str = vfs_str_from_static1(path);
+
+    vfs_str_t basename = VFS_STR_INIT;
+    vfs_str_t parent = vfs_path_parent(&path_str, &basename);
+    {
+        ret = _vfs_memfs_common_op_path(fs, &parent, _vfs_memfs_rmdir_inner, &basename);
+    }
+    vfs_str_exit(&basename);
+    vfs_str_exit(&parent);
+
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// unlink
+//////////////////////////////////////////////////////////////////////////
+
+static int _vfs_memfs_unlink_inner(vfs_memfs_t* fs, vfs_memfs_node_t* node, void* data)
+{
+    int ret;
+    vfs_str_t* basename = data;
+
+    if (!(node->stat.st_mode & VFS_S_IFDIR))
+    {
+        return VFS_ENOTDIR;
+    }
+
+    /* The reference count has been increased. */
+    vfs_memfs_node_t* child = _vfs_memfs_common_search_for(fs, node, basename);
+    if (child == NULL)
+    {
+        return VFS_ENOENT;
+    }
+
+    if (!(child->stat.st_mode & VFS_S_IFREG))
+    {
+        _vfs_memfs_common_release_node(fs, child, 0);
+        return VFS_EISDIR;
+    }
+    if ((ret = _vfs_memfs_snapshot_capture(fs, node)) != 0)
+    {
+        _vfs_memfs_common_release_node(fs, child, 0);
+        return ret;
+    }
+
+    /* The first time to release reference increased by #_vfs_memfs_common_search_for(). */
+    _vfs_memfs_common_release_node(fs, child, 0);
+    /* The second time to release reference to actually delete it. */
+    _vfs_memfs_common_release_node(fs, child, 1);
+
+    return 0;
+}
+
+static int _vfs_memfs_unlink(struct vfs_operations* thiz, const char* path)
+{
+    int ret;
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_str_t path_str = vfs_str_from_static1(path);
+
+    vfs_str_t basename = VFS_STR_INIT;
+    vfs_str_t parent = vfs_path_parent(&path_str, &basename);
+    {
+        ret = _vfs_memfs_common_op_path(fs, &parent, _vfs_memfs_unlink_inner, &basename);
+    }
+    vfs_str_exit(&basename);
+    vfs_str_exit(&parent);
+
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// compress
+//////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Check whether \p chunk should be compressed.
+ * @warning Must be called with #vfs_memfs_t::compress::lock held.
+ * @param[in] fs - File system object.
+ * @param[in] chunk - The chunk, can be NULL.
+ * @param[in] now - Current tick.
+ * @return 1 if \p chunk is cold, plain, not shared and not in dedup store,
+ *   otherwise 0.
+ */
+static int _vfs_memfs_compress_is_cold(vfs_memfs_t* fs, vfs_memfs_chunk_t* chunk, int now)
+{
+    if (chunk == NULL || chunk->zsize != 0 || chunk->store != NULL
+        || vfs_atomic_load(&chunk->refcnt) != 1)
+    {
+        return 0;
+    }
+
+    const int atime = max(vfs_atomic_load(&chunk->atime), fs->compress.enable_tick);
+    return (int64_t)now - atime >= (int64_t)fs->compress.idle_sec;
+}
+
+/**
+ * @brief Replace chunks of regular file \p node with compressed ones.
+ * @param[in] fs - File system object.
+ * @param[in] node - Regular file node.
+ * @param[in] batch - Compressed chunks.
+ * @param[in] batch_sz - The number of compressed chunks.
+ */
+static void _vfs_memfs_compress_install(vfs_memfs_t* fs, vfs_memfs_node_t* node,
+    vfs_memfs_chunk_swap_t* batch, size_t batch_sz)
+{
+    size_t i;
+    uint64_t saved_sz = 0;
+    int64_t zbytes = 0;
+
+    for (i = 0; i < batch_sz; i++)
+    {
+        saved_sz += VFS_MEMFS_CHUNK_SIZE - batch[i].chunk->zsize;
+        zbytes += batch[i].chunk->zsize;
+    }
+    _vfs_memfs_reg_swap_chunks(node, batch, batch_sz);
+
+    _vfs_memfs_usage_uncharge(fs, &fs->usage.data, saved_sz);
+    _vfs_memfs_usage_compressed(fs, (int64_t)batch_sz, zbytes);
+
+    for (i = 0; i < batch_sz; i++)
+    {
+        _vfs_memfs_chunk_release(fs, batch[i].chunk);
+    }
+}
+
+/**
+ * @brief Compress cold chunks of regular file \p node.
+ * @param[in] fs - File system object.
+ * @param[in] node - Regular file node.
+ * @param[in] now - Current tick.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_compress_reg(vfs_memfs_t* fs, vfs_memfs_node_t* node, int now)
+{
+    int ret = 0;
+    size_t idx = 0;
+    uint8_t buf[VFS_MEMFS_COMPRESS_MAX];
+    vfs_memfs_range_t range;
+    const vfs_memfs_node_reg_t* reg = &node->data.reg;
+
+    /* Content is still shared with a snapshot until it is captured. */
+    if (vfs_atomic_load(&node->gen) < vfs_atomic_load(&fs->snap.gen))
+    {
+        return 0;
+    }
+
+    /* Writers wait for us, so the chunk table only changes by ourselves. */
+    _vfs_memfs_range_lock(node, &range, 0, UINT64_MAX, 1);
+
+    while (ret == 0)
+    {
+        vfs_memfs_chunk_swap_t batch[VFS_MEMFS_SWAP_BATCH];
+        size_t batch_sz = 0;
+
+        /* Compress under read lock, so readers are not blocked. */
+        vfs_rwlock_rdlock(&node->rwlock);
+        for (; idx < reg->chunk_sz && batch_sz < ARRAY_SIZE(batch); idx++)
+        {
+            vfs_memfs_chunk_t* chunk = reg->chunks[idx];
+            if (!_vfs_memfs_compress_is_cold(fs, chunk, now))
+            {
+                continue;
+            }
+
+            /* Content that does not shrink enough is left as is. */
+            const size_t zsize = vfs_lz4_compress(chunk->data, VFS_MEMFS_CHUNK_SIZE, buf, sizeof(buf));
+            if (zsize == 0)
+            {
+                continue;
+            }
+
+            vfs_memfs_chunk_t* zchunk = malloc(sizeof(vfs_memfs_chunk_t) + zsize);
+            if (zchunk == NULL)
+            {
+                ret = VFS_ENOMEM;
+                break;
+            }
+            zchunk->refcnt = 1;
+            zchunk->atime = vfs_atomic_load(&chunk->atime);
+            zchunk->zsize = (uint32_t)zsize;
+            zchunk->store = NULL;
+            memcpy(zchunk->data, buf, zsize);
+
+            batch[batch_sz].idx = idx;
+            batch[batch_sz].chunk = zchunk;
+            batch_sz++;
+        }
+        const int done = idx >= reg->chunk_sz;
+        vfs_rwlock_rdunlock(&node->rwlock);
+
+        if (batch_sz != 0)
+        {
+            _vfs_memfs_compress_install(fs, node, batch, batch_sz);
+        }
+        if (done)
+        {
+            break;
+        }
+    }
+
+    _vfs_memfs_range_unlock(node, &range);
+    return ret;
+}
+
+/**
+ * @brief Compress cold chunks of all files in directory \p node recursively.
+ * @param[in] fs - File system object.
+ * @param[in] node - Directory node.
+ * @param[in] now - Current tick.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_compress_dir(vfs_memfs_t* fs, vfs_memfs_node_t* node, int now)
+{
+    size_t i, child_sz;
+    int ret = 0;
+    vfs_memfs_node_t** children = NULL;
+
+    vfs_rwlock_rdlock(&node->rwlock);
+    {
+        /* Directory that is not copied from its origin yet only has shared content. */
+        child_sz = node->data.dir.origin != NULL ? 0 : node->data.dir.children_sz;
+        if (child_sz != 0 && (children = malloc(sizeof(vfs_memfs_node_t*) * child_sz)) == NULL)
+        {
+            vfs_rwlock_rdunlock(&node->rwlock);
+            return VFS_ENOMEM;
+        }
+        for (i = 0; i < child_sz; i++)
+        {
+            children[i] = node->data.dir.children[i];
+            _vfs_memfs_common_acquire_node(children[i]);
+        }
+    }
+    vfs_rwlock_rdunlock(&node->rwlock);
+
+    for (i = 0; i < child_sz && ret == 0; i++)
+    {
+        vfs_memfs_node_t* child = children[i];
+        if (child->stat.st_mode & VFS_S_IFDIR)
+        {
+            ret = _vfs_memfs_compress_dir(fs, child, now);
+        }
+        else
+        {
+            ret = _vfs_memfs_compress_reg(fs, child, now);
+        }
+    }
+
+    for (i = 0; i < child_sz; i++)
+    {
+        _vfs_memfs_common_release_node(fs, children[i], 0);
+    }
+    free(children);
+
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// image
+//////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Image file magic.
+ *
+ * An image is made of a header, a node table, a string table and a data
+ * region. All integers are little endian.
+ *
+ * + header: magic[8], version:u32, journal:u32, node_cnt:u64, str_sz:u64,
+ *   data_sz:u64. journal is the generation of journal that continues this
+ *   image, or 0 if none.
+ * + node table: node_cnt records of parent:u64, name_off:u64, name_len:u32,
+ *   mode:u32, size:u64, chunk_cnt:u64. Node 0 is root directory, and a
+ *   parent is always stored before its children.
+ * + string table: str_sz bytes of names, without terminating NUL.
+ * + data region: data_sz bytes. For each regular file in node order,
+ *   chunk_cnt records of idx:u64, zsize:u32, reserved:u32, followed by
+ *   zsize bytes of compressed content, or #VFS_MEMFS_CHUNK_SIZE bytes if
+ *   zsize is 0.
+ */
+#define VFS_MEMFS_IMAGE_MAGIC           "VFSMEMFS"
+#define VFS_MEMFS_IMAGE_VERSION         1
+#define VFS_MEMFS_IMAGE_HEADER_SIZE     40
+#define VFS_MEMFS_IMAGE_NODE_SIZE       40
+#define VFS_MEMFS_IMAGE_CHUNK_SIZE      16
+
+typedef struct vfs_memfs_image_node
+{
+    vfs_memfs_node_t*       node;       /**< Node of frozen file system. */
+    uint64_t                parent;     /**< Index of parent. */
+    uint64_t                name_off;   /**< Offset of name in string table. */
+    uint64_t                chunk_cnt;  /**< The number of chunks that are not holes. */
+} vfs_memfs_image_node_t;
+
+static void _vfs_memfs_image_put32(uint8_t* p, uint32_t v)
+{
+    size_t i;
+    for (i = 0; i < 4; i++)
+    {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static void _vfs_memfs_image_put64(uint8_t* p, uint64_t v)
+{
+    _vfs_memfs_image_put32(p, (uint32_t)v);
+    _vfs_memfs_image_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t _vfs_memfs_image_get32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t _vfs_memfs_image_get64(const uint8_t* p)
+{
+    return (uint64_t)_vfs_memfs_image_get32(p) | ((uint64_t)_vfs_memfs_image_get32(p + 4) << 32);
+}
+
+static int _vfs_memfs_image_open(FILE** file, const char* path, const char* mode)
+{
+#if defined(_WIN32)
+    const errno_t err = fopen_s(file, path, mode);
+    if (err == 0)
+    {
+        return 0;
+    }
+#else
+    if ((*file = fopen(path, mode)) != NULL)
+    {
+        return 0;
+    }
+    const int err = errno;
+#endif
+
+    switch (err)
+    {
+    case ENOENT:    return VFS_ENOENT;
+    case EACCES:    return VFS_EACCES;
+    case EISDIR:    return VFS_EISDIR;
+    case ENOSPC:    return VFS_ENOSPC;
+    default:        return VFS_EIO;
+    }
+}
+
+static int _vfs_memfs_image_write(FILE* file, const void* data, size_t size)
+{
+    return fwrite(data, 1, size, file) == size ? 0 : VFS_EIO;
+}
+
+static int _vfs_memfs_image_read(FILE* file, void* data, size_t size)
+{
+    return fread(data, 1, size, file) == size ? 0 : VFS_EIO;
+}
+
+/**
+ * @brief Write buffered data of \p file to storage device.
+ */
+static int _vfs_memfs_image_sync(FILE* file)
+{
+    if (fflush(file) != 0)
+    {
+        return VFS_EIO;
+    }
+#if defined(_WIN32)
+    return _commit(_fileno(file)) == 0 ? 0 : VFS_EIO;
+#else
+    return fsync(fileno(file)) == 0 ? 0 : VFS_EIO;
+#endif
+}
+
+/**
+ * @brief List all nodes of snapshot \p fs, parents before children.
+ * @param[in] fs - File system of snapshot.
+ * @param[out] nodes - Node list, must be freed by caller.
+ * @param[out] node_sz - The number of nodes.
+ * @param[out] str_sz - Size of string table.
+ * @param[out] data_sz - Size of data region.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_image_collect(vfs_memfs_t* fs, vfs_memfs_image_node_t** nodes,
+    size_t* node_sz, uint64_t* str_sz, uint64_t* data_sz)
+{
+    int ret;
+    size_t i, j, sz = 1, cap = 64;
+    uint64_t str_off = 0, data_off = 0;
+
+    vfs_memfs_image_node_t* list = malloc(sizeof(vfs_memfs_image_node_t) * cap);
+    if (list == NULL)
+    {
+        return VFS_ENOMEM;
+    }
+    list[0].node = fs->root;
+    list[0].parent = 0;
+
+    for (i = 0; i < sz; i++)
+    {
+        vfs_memfs_node_t* node = list[i].node;
+        list[i].name_off = str_off;
+        list[i].chunk_cnt = 0;
+        str_off += node->name.len;
+
+        if (node->stat.st_mode & VFS_S_IFREG)
+        {
+            /* Inline content is saved as a plain chunk. */
+            const vfs_memfs_node_reg_t* reg = &node->data.reg;
+            if (reg->inlined && node->stat.st_size != 0)
+            {
+                list[i].chunk_cnt = 1;
+                data_off += VFS_MEMFS_IMAGE_CHUNK_SIZE + VFS_MEMFS_CHUNK_SIZE;
+            }
+            for (j = 0; j < reg->chunk_sz; j++)
+            {
+                const vfs_memfs_chunk_t* chunk = reg->chunks[j];
+                if (chunk != NULL)
+                {
+                    list[i].chunk_cnt++;
+                    data_off += VFS_MEMFS_IMAGE_CHUNK_SIZE + (chunk->zsize != 0 ? chunk->zsize : VFS_MEMFS_CHUNK_SIZE);
+                }
+            }
+            continue;
+        }
+
+        /* Directories of a snapshot never change once they are copied from origins. */
+        if ((ret = _vfs_memfs_dir_rdlock(fs, node)) != 0)
+        {
+            free(list);
+            return ret;
+        }
+        vfs_rwlock_rdunlock(&node->rwlock);
+
+        const vfs_memfs_node_dir_t* dir = &node->data.dir;
+        if (sz + dir->children_sz > cap)
+        {
+            size_t new_cap = max(cap * 2, sz + dir->children_sz);
+            vfs_memfs_image_node_t* new_list = realloc(list, sizeof(vfs_memfs_image_node_t) * new_cap);
+            if (new_list == NULL)
+            {
+                free(list);
+                return VFS_ENOMEM;
+            }
+            list = new_list;
+            cap = new_cap;
+        }
+        for (j = 0; j < dir->children_sz; j++, sz++)
+        {
+            list[sz].node = dir->children[j];
+            list[sz].parent = i;
+        }
+    }
+
+    *nodes = list;
+    *node_sz = sz;
+    *str_sz = str_off;
+    *data_sz = data_off;
+    return 0;
+}
+
+/**
+ * @brief Write image of frozen file system \p fs.
+ * @param[in] file - Image file.
+ * @param[in] fs - Frozen file system.
+ * @param[in] generation - Generation of journal that continues this image.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_image_save(FILE* file, vfs_memfs_t* fs, uint32_t generation)
+{
+    int ret;
+    size_t i, j, node_sz;
+    uint64_t str_sz, data_sz;
+    vfs_memfs_image_node_t* nodes;
+    uint8_t header[VFS_MEMFS_IMAGE_HEADER_SIZE];
+
+    if ((ret = _vfs_memfs_image_collect(fs, &nodes, &node_sz, &str_sz, &data_sz)) != 0)
+    {
+        return ret;
+    }
+
+    memcpy(header, VFS_MEMFS_IMAGE_MAGIC, 8);
+    _vfs_memfs_image_put32(header + 8, VFS_MEMFS_IMAGE_VERSION);
+    _vfs_memfs_image_put32(header + 12, generation);
+    _vfs_memfs_image_put64(header + 16, node_sz);
+    _vfs_memfs_image_put64(header + 24, str_sz);
+    _vfs_memfs_image_put64(header + 32, data_sz);
+    if ((ret = _vfs_memfs_image_write(file, header, sizeof(header))) != 0)
+    {
+        goto finish;
+    }
+
+    uint8_t* table = malloc(node_sz * VFS_MEMFS_IMAGE_NODE_SIZE);
+    if (table == NULL)
+    {
+        ret = VFS_ENOMEM;
+        goto finish;
+    }
+    for (i = 0; i < node_sz; i++)
+    {
+        const vfs_memfs_node_t* node = nodes[i].node;
+        uint8_t* rec = table + i * VFS_MEMFS_IMAGE_NODE_SIZE;
+        _vfs_memfs_image_put64(rec, nodes[i].parent);
+        _vfs_memfs_image_put64(rec + 8, nodes[i].name_off);
+        _vfs_memfs_image_put32(rec + 16, (uint32_t)node->name.len);
+        _vfs_memfs_image_put32(rec + 20, (uint32_t)(node->stat.st_mode & (VFS_S_IFDIR | VFS_S_IFREG)));
+        _vfs_memfs_image_put64(rec + 24, (node->stat.st_mode & VFS_S_IFREG) ? node->stat.st_size : 0);
+        _vfs_memfs_image_put64(rec + 32, nodes[i].chunk_cnt);
+    }
+    ret = _vfs_memfs_image_write(file, table, node_sz * VFS_MEMFS_IMAGE_NODE_SIZE);
+    free(table);
+
+    for (i = 0; i < node_sz && ret == 0; i++)
+    {
+        ret = _vfs_memfs_image_write(file, nodes[i].node->name.str, nodes[i].node->name.len);
+    }
+
+    for (i = 0; i < node_sz && ret == 0; i++)
+    {
+        const vfs_memfs_node_t* node = nodes[i].node;
+        if (!(node->stat.st_mode & VFS_S_IFREG))
+        {
+            continue;
+        }
+
+        const vfs_memfs_node_reg_t* reg = &node->data.reg;
+        if (reg->inlined && node->stat.st_size != 0)
+        {
+            uint8_t rec[VFS_MEMFS_IMAGE_CHUNK_SIZE + VFS_MEMFS_CHUNK_SIZE];
+            memset(rec, 0, sizeof(rec));
+            memcpy(rec + VFS_MEMFS_IMAGE_CHUNK_SIZE, reg->inline_data, VFS_MEMFS_INLINE_SIZE);
+            ret = _vfs_memfs_image_write(file, rec, sizeof(rec));
+        }
+        for (j = 0; j < reg->chunk_sz && ret == 0; j++)
+        {
+            const vfs_memfs_chunk_t* chunk = reg->chunks[j];
+            if (chunk == NULL)
+            {
+                continue;
+            }
+
+            uint8_t rec[VFS_MEMFS_IMAGE_CHUNK_SIZE];
+            _vfs_memfs_image_put64(rec, j);
+            _vfs_memfs_image_put32(rec + 8, chunk->zsize);
+            _vfs_memfs_image_put32(rec + 12, 0);
+            if ((ret = _vfs_memfs_image_write(file, rec, sizeof(rec))) == 0)
+            {
+                ret = _vfs_memfs_image_write(file, chunk->data, chunk->zsize != 0 ? chunk->zsize : VFS_MEMFS_CHUNK_SIZE);
+            }
+        }
+    }
+
+finish:
+    free(nodes);
+    return ret;
+}
+
+/**
+ * @brief Read one chunk of regular file \p node from image.
+ * @param[in] fs - File system object.
+ * @param[in] file - Image file.
+ * @param[in,out] node - Regular file node.
+ * @param[in,out] data_sz - Bytes left in data region.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_image_load_chunk(vfs_memfs_t* fs, FILE* file, vfs_memfs_node_t* node, uint64_t* data_sz)
+{
+    int ret;
+    uint8_t rec[VFS_MEMFS_IMAGE_CHUNK_SIZE];
+    vfs_memfs_node_reg_t* reg = &node->data.reg;
+
+    if ((ret = _vfs_memfs_image_read(file, rec, sizeof(rec))) != 0)
+    {
+        return ret;
+    }
+    const uint64_t idx = _vfs_memfs_image_get64(rec);
+    const uint32_t zsize = _vfs_memfs_image_get32(rec + 8);
+    const size_t content_sz = zsize != 0 ? zsize : VFS_MEMFS_CHUNK_SIZE;
+    if (idx >= reg->chunk_sz || reg->chunks[idx] != NULL || zsize > VFS_MEMFS_COMPRESS_MAX
+        || *data_sz < VFS_MEMFS_IMAGE_CHUNK_SIZE + content_sz)
+    {
+        return VFS_EIO;
+    }
+    *data_sz -= VFS_MEMFS_IMAGE_CHUNK_SIZE + content_sz;
+
+    if ((ret = _vfs_memfs_usage_charge(fs, &fs->usage.data, content_sz)) != 0)
+    {
+        return ret;
+    }
+
+    vfs_memfs_chunk_t* chunk;
+    if (zsize == 0)
+    {
+        chunk = _vfs_memfs_chunk_alloc(fs);
+    }
+    else if ((chunk = malloc(sizeof(vfs_memfs_chunk_t) + zsize)) != NULL)
+    {
+        chunk->refcnt = 1;
+        chunk->atime = vfs_atomic_load(&fs->compress.tick);
+        chunk->zsize = zsize;
+        chunk->store = NULL;
+    }
+    if (chunk == NULL)
+    {
+        _vfs_memfs_usage_uncharge(fs, &fs->usage.data, content_sz);
+        return VFS_ENOMEM;
+    }
+
+    /* Installed first, so it is released together with the file on error. */
+    reg->chunks[idx] = chunk;
+    node->stat.st_blocks += VFS_MEMFS_CHUNK_BLOCKS;
+    if (zsize != 0)
+    {
+        _vfs_memfs_usage_compressed(fs, 1, zsize);
+    }
+    if ((ret = _vfs_memfs_image_read(file, chunk->data, content_sz)) != 0)
+    {
+        return ret;
+    }
+
+    /* Bytes after end of file must be zero. */
+    const uint64_t chunk_pos = idx * VFS_MEMFS_CHUNK_SIZE;
+    size_t tail = node->stat.st_size - chunk_pos < VFS_MEMFS_CHUNK_SIZE ?
+        (size_t)(node->stat.st_size - chunk_pos) : VFS_MEMFS_CHUNK_SIZE;
+    if (zsize == 0)
+    {
+        memset(chunk->data + tail, 0, VFS_MEMFS_CHUNK_SIZE - tail);
+        return 0;
+    }
+
+    uint8_t buf[VFS_MEMFS_CHUNK_SIZE];
+    if (vfs_lz4_decompress(chunk->data, zsize, buf, sizeof(buf)) != VFS_MEMFS_CHUNK_SIZE)
+    {
+        return VFS_EIO;
+    }
+    for (; tail < VFS_MEMFS_CHUNK_SIZE; tail++)
+    {
+        if (buf[tail] != 0)
+        {
+            return VFS_EIO;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Create nodes of image in empty file system \p fs.
+ * @param[in] fs - File system object.
+ * @param[in] table - Node table followed by string table.
+ * @param[in] node_cnt - The number of nodes.
+ * @param[in] str_sz - Size of string table.
+ * @param[out] nodes - Created nodes.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_image_load_nodes(vfs_memfs_t* fs, const uint8_t* table,
+    size_t node_cnt, uint64_t str_sz, vfs_memfs_node_t** nodes)
+{
+    int ret;
+    size_t i;
+    const uint8_t* str = table + node_cnt * VFS_MEMFS_IMAGE_NODE_SIZE;
+
+    if (!(_vfs_memfs_image_get32(table + 20) & VFS_S_IFDIR))
+    {
+        return VFS_EIO;
+    }
+    nodes[0] = fs->root;
+
+    for (i = 1; i < node_cnt; i++)
+    {
+        const uint8_t* rec = table + i * VFS_MEMFS_IMAGE_NODE_SIZE;
+        const uint64_t parent = _vfs_memfs_image_get64(rec);
+        const uint64_t name_off = _vfs_memfs_image_get64(rec + 8);
+        const uint32_t name_len = _vfs_memfs_image_get32(rec + 16);
+        const uint32_t type = _vfs_memfs_image_get32(rec + 20) & (VFS_S_IFDIR | VFS_S_IFREG);
+        const uint64_t size = _vfs_memfs_image_get64(rec + 24);
+
+        if (parent >= i || !(nodes[parent]->stat.st_mode & VFS_S_IFDIR)
+            || (type != VFS_S_IFDIR && type != VFS_S_IFREG)
+            || name_len == 0 || name_off > str_sz || name_len > str_sz - name_off
+            || memchr(str + name_off, '/', name_len) != NULL
+            || size > (uint64_t)SIZE_MAX / 2)
+        {
+            return VFS_EIO;
+        }
+
+        vfs_str_t name = vfs_str_from_static((const char*)str + name_off, name_len);
+        if (_vfs_memfs_common_search_for_nolock(nodes[parent], &name) != NULL)
+        {
+            return VFS_EIO;
+        }
+        if ((ret = _vfs_memfs_common_new_node(fs, nodes[parent], &name, (vfs_stat_flag_t)type, &nodes[i])) != 0)
+        {
+            return ret;
+        }
+        if (type == VFS_S_IFREG)
+        {
+            /* Content is loaded into chunks, small files are moved inline later. */
+            nodes[i]->data.reg.inlined = 0;
+            if ((ret = _vfs_memfs_reg_reserve(fs, nodes[i], _vfs_memfs_chunk_count(size))) != 0)
+            {
+                return ret;
+            }
+            nodes[i]->stat.st_size = size;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Load image into empty file system \p fs.
+ * @param[in] fs - File system object.
+ * @param[in] file - Image file.
+ * @param[out] generation - Generation of journal that continues this image.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_image_load(vfs_memfs_t* fs, FILE* file, uint32_t* generation)
+{
+    int ret;
+    size_t i;
+    uint64_t j;
+    uint8_t header[VFS_MEMFS_IMAGE_HEADER_SIZE];
+
+    if ((ret = _vfs_memfs_image_read(file, header, sizeof(header))) != 0)
+    {
+        return ret;
+    }
+    const uint64_t node_cnt = _vfs_memfs_image_get64(header + 16);
+    const uint64_t str_sz = _vfs_memfs_image_get64(header + 24);
+    uint64_t data_sz = _vfs_memfs_image_get64(header + 32);
+    if (memcmp(header, VFS_MEMFS_IMAGE_MAGIC, 8) != 0
+        || _vfs_memfs_image_get32(header + 8) != VFS_MEMFS_IMAGE_VERSION
+        || node_cnt == 0 || node_cnt > SIZE_MAX / VFS_MEMFS_IMAGE_NODE_SIZE / 2
+        || str_sz > SIZE_MAX / 2)
+    {
+        return VFS_EIO;
+    }
+    *generation = _vfs_memfs_image_get32(header + 12);
+
+    /* Node table and string table are read at once. */
+    const size_t table_sz = (size_t)node_cnt * VFS_MEMFS_IMAGE_NODE_SIZE + (size_t)str_sz;
+    uint8_t* table = malloc(table_sz);
+    vfs_memfs_node_t** nodes = malloc(sizeof(vfs_memfs_node_t*) * (size_t)node_cnt);
+    if (table == NULL || nodes == NULL)
+    {
+        ret = VFS_ENOMEM;
+        goto finish;
+    }
+    if ((ret = _vfs_memfs_image_read(file, table, table_sz)) != 0)
+    {
+        goto finish;
+    }
+    if ((ret = _vfs_memfs_image_load_nodes(fs, table, (size_t)node_cnt, str_sz, nodes)) != 0)
+    {
+        goto finish;
+    }
+
+    /* Content is read straight into chunks. */
+    for (i = 0; i < node_cnt && ret == 0; i++)
+    {
+        if (!(nodes[i]->stat.st_mode & VFS_S_IFREG))
+        {
+            continue;
+        }
+        const uint64_t chunk_cnt = _vfs_memfs_image_get64(table + i * VFS_MEMFS_IMAGE_NODE_SIZE + 32);
+        for (j = 0; j < chunk_cnt && ret == 0; j++)
+        {
+            ret = _vfs_memfs_image_load_chunk(fs, file, nodes[i], &data_sz);
+        }
+        if (ret == 0 && nodes[i]->stat.st_size <= VFS_MEMFS_INLINE_SIZE)
+        {
+            ret = _vfs_memfs_reg_truncate(fs, nodes[i], nodes[i]->stat.st_size);
+        }
+    }
+    if (ret == 0 && data_sz != 0)
+    {
+        ret = VFS_EIO;
+    }
+
+finish:
+    free(table);
+    free(nodes);
+    return ret;
+}
+
+/**
+ * @brief Save image of \p fs to \p path.
+ * @param[in] fs - File system object.
+ * @param[in] path - Path of image file.
+ * @param[in] generation - Generation of journal that continues this image.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_image_save_file(vfs_memfs_t* fs, const char* path, uint32_t generation)
+{
+    int ret;
+    FILE* file;
+    vfs_memfs_snapshot_t* snapshot;
+
+    if ((ret = vfs_memfs_snapshot(&fs->op, &snapshot)) != 0)
+    {
+        return ret;
+    }
+    if ((ret = _vfs_memfs_image_open(&file, path, "wb")) != 0)
+    {
+        vfs_memfs_snapshot_release(snapshot);
+        return ret;
+    }
+
+    if ((ret = _vfs_memfs_image_save(file, snapshot->fs, generation)) == 0)
+    {
+        ret = _vfs_memfs_image_sync(file);
+    }
+    if (fclose(file) != 0 && ret == 0)
+    {
+        ret = VFS_EIO;
+    }
+    vfs_memfs_snapshot_release(snapshot);
+
+    if (ret != 0)
+    {
+        remove(path);
+    }
+    return ret;
+}
+
+/**
+ * @brief Create file system from image at \p path.
+ * @param[out] fs - The created file system.
+ * @param[in] path - Path of image file.
+ * @param[out] generation - Generation of journal that continues this image.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_image_load_file(vfs_operations_t** fs, const char* path, uint32_t* generation)
+{
+    int ret;
+    FILE* file;
+    vfs_operations_t* op;
+
+    if ((ret = _vfs_memfs_image_open(&file, path, "rb")) != 0)
+    {
+        return ret;
+    }
+    if ((ret = vfs_make_memory(&op)) != 0)
+    {
+        fclose(file);
+        return ret;
+    }
+
+    ret = _vfs_memfs_image_load(EV_CONTAINER_OF(op, vfs_memfs_t, op), file, generation);
+    fclose(file);
+    if (ret != 0)
+    {
+        op->destroy(op);
+        return ret;
+    }
+
+    *fs = op;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// journal
+//////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Journal file magic.
+ *
+ * A journal is made of a header of magic[8], generation:u32, reserved:u32,
+ * followed by records of size:u32, checksum:u32 and size bytes of payload.
+ * Payload is type:u8, path_len:u32, path, arg:u64 and the data of write.
+ * Integers are little endian. A record that is cut short or does not match
+ * its checksum ends the journal.
+ */
+#define VFS_MEMFS_JOURNAL_MAGIC         "VFSMEMJL"
+#define VFS_MEMFS_JOURNAL_HEADER_SIZE   16
+#define VFS_MEMFS_JOURNAL_RECORD_SIZE   8
+#define VFS_MEMFS_JOURNAL_PAYLOAD_SIZE  13
+
+/**
+ * @brief Buffered records are written to journal file once they grow over
+ *   this size, even before they are flushed.
+ */
+#define VFS_MEMFS_JOURNAL_BUFFER_MAX    (1024 * 1024)
+
+typedef enum vfs_memfs_journal_op
+{
+    VFS_MEMFS_JOURNAL_MKDIR = 1,
+    VFS_MEMFS_JOURNAL_RMDIR,
+    VFS_MEMFS_JOURNAL_UNLINK,
+    VFS_MEMFS_JOURNAL_OPEN,                         /**< arg is open flags. */
+    VFS_MEMFS_JOURNAL_WRITE,                        /**< arg is file position. */
+    VFS_MEMFS_JOURNAL_TRUNCATE,                     /**< arg is file size. */
+} vfs_memfs_journal_op_t;
+
+typedef struct vfs_memfs_journal
+{
+    vfs_mutex_t             lock;                   /**< Serializes journaled operations, and protects all fields. */
+    FILE*                   file;                   /**< Journal file, or NULL if it is not opened yet. */
+    char*                   image_path;             /**< Path of checkpoint image. */
+    char*                   journal_path;           /**< Path of journal. */
+    uint32_t                generation;             /**< Generation of checkpoint image and journal. */
+    uint32_t                flush_ms;               /**< Group commit interval. */
+    uint64_t                checkpoint_bytes;       /**< Journal size that triggers checkpoint. */
+    uint64_t                journal_sz;             /**< Size of journal, including buffered records. */
+    uint8_t*                buf;                    /**< Records that are not written to file yet. */
+    size_t                  buf_sz;                 /**< Size of buffered records. */
+    size_t                  buf_cap;                /**< Capacity of buffer. */
+    int                     error;                  /**< Error of journal file. Once set, journaled operations fail. */
+    vfs_sem_t               stop;                   /**< Posted to stop flusher. */
+    vfs_thread_t            flusher;                /**< Group commit thread, only if flush_ms is not 0. */
+} vfs_memfs_journal_t;
+
+typedef struct vfs_memfs_journal_helper
+{
+    vfs_memfs_t*            fs;                     /**< File system object. */
+    int                     written;                /**< Bytes written by the operation. */
+    vfs_str_t               path;                   /**< Path of file. */
+    int                     linked;                 /**< Non-zero if file is still in the tree. */
+    uint64_t                pos;                    /**< Position of write. */
+} vfs_memfs_journal_helper_t;
+
+static char* _vfs_memfs_journal_strdup(const char* str)
+{
+    const size_t len = strlen(str);
+    char* copy = malloc(len + 1);
+    if (copy != NULL)
+    {
+        memcpy(copy, str, len + 1);
+    }
+    return copy;
+}
+
+/**
+ * @brief Write buffered records to journal file.
+ * @param[in] journal - Journal.
+ * @param[in] sync - Non-zero to also flush journal file to storage device.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_journal_flush(vfs_memfs_journal_t* journal, int sync)
+{
+    int ret = 0;
+    if (journal->buf_sz != 0)
+    {
+        ret = _vfs_memfs_image_write(journal->file, journal->buf, journal->buf_sz);
+        journal->buf_sz = 0;
+    }
+    if (ret == 0 && sync)
+    {
+        ret = _vfs_memfs_image_sync(journal->file);
+    }
+    if (ret != 0 && journal->error == 0)
+    {
+        journal->error = ret;
+    }
+    return ret;
+}
+
+/**
+ * @brief Start an empty journal of current generation.
+ * @param[in] journal - Journal.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_journal_reset(vfs_memfs_journal_t* journal)
+{
+    int ret;
+    uint8_t header[VFS_MEMFS_JOURNAL_HEADER_SIZE];
+
+    if (journal->file != NULL)
+    {
+        fclose(journal->file);
+        journal->file = NULL;
+    }
+    journal->buf_sz = 0;
+    journal->journal_sz = VFS_MEMFS_JOURNAL_HEADER_SIZE;
+
+    memcpy(header, VFS_MEMFS_JOURNAL_MAGIC, 8);
+    _vfs_memfs_image_put32(header + 8, journal->generation);
+    _vfs_memfs_image_put32(header + 12, 0);
+    if ((ret = _vfs_memfs_image_open(&journal->file, journal->journal_path, "wb")) == 0
+        && (ret = _vfs_memfs_image_write(journal->file, header, sizeof(header))) == 0)
+    {
+        ret = _vfs_memfs_image_sync(journal->file);
+    }
+    if (ret != 0)
+    {
+        journal->error = ret;
+    }
+    return ret;
+}
+
+/**
+ * @brief Replace checkpoint image by \p tmp_path.
+ */
+static int _vfs_memfs_journal_replace_image(const char* tmp_path, const char* image_path)
+{
+#if defined(_WIN32)
+    return MoveFileExA(tmp_path, image_path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : VFS_EIO;
+#else
+    return rename(tmp_path, image_path) == 0 ? 0 : VFS_EIO;
+#endif
+}
+
+/**
+ * @brief Save \p fs as checkpoint image of next generation, and empty journal.
+ *
+ * The journal of the old generation stays valid until the new image is in
+ * place, so a crash at any point loses nothing.
+ *
+ * @warning Must be called with #vfs_memfs_journal_t::lock held.
+ * @param[in] fs - File system object.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_journal_checkpoint(vfs_memfs_t* fs)
+{
+    int ret;
+    vfs_memfs_journal_t* journal = fs->journal;
+
+    vfs_str_t tmp_path = vfs_str_from1(journal->image_path);
+    vfs_str_append1(&tmp_path, ".tmp");
+    if ((ret = _vfs_memfs_image_save_file(fs, tmp_path.str, journal->generation + 1)) == 0)
+    {
+        if ((ret = _vfs_memfs_journal_replace_image(tmp_path.str, journal->image_path)) != 0)
+        {
+            remove(tmp_path.str);
+        }
+    }
+    vfs_str_exit(&tmp_path);
+
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    /* Buffered records are part of the image now. */
+    journal->generation++;
+    return _vfs_memfs_journal_reset(journal);
+}
+
+/**
+ * @brief Get path of \p node.
+ * @warning Must be called with #vfs_memfs_journal_t::lock held.
+ * @param[in] fs - File system object.
+ * @param[in] node - The node.
+ * @param[in,out] path - Path is appended to it.
+ * @return 1 if \p node is in the tree, otherwise 0.
+ */
+static int _vfs_memfs_journal_node_path(vfs_memfs_t* fs, const vfs_memfs_node_t* node, vfs_str_t* path)
+{
+    if (node == fs->root)
+    {
+        return 1;
+    }
+    if (node->parent == NULL || !_vfs_memfs_journal_node_path(fs, node->parent, path))
+    {
+        return 0;
+    }
+
+    vfs_str_append(path, "/", 1);
+    vfs_str_append2(path, &node->name);
+    return 1;
+}
+
+static int _vfs_memfs_journal_session_inner(vfs_memfs_session_t* session, void* data)
+{
+    vfs_memfs_journal_helper_t* helper = data;
+    vfs_memfs_node_t* node = session->data.node;
+
+    helper->linked = _vfs_memfs_journal_node_path(helper->fs, node, &helper->path);
+
+    vfs_mutex_enter(&session->mutex);
+    const uint64_t fpos = session->data.fpos;
+    vfs_mutex_leave(&session->mutex);
+
+    vfs_rwlock_rdlock(&node->rwlock);
+    helper->pos = (fpos == UINT64_MAX ? node->stat.st_size : fpos) - (uint64_t)helper->written;
+    vfs_rwlock_rdunlock(&node->rwlock);
+
+    return 0;
+}
+
+/**
+ * @brief Append a record to journal buffer.
+ * @warning Must be called with #vfs_memfs_journal_t::lock held.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_journal_append(vfs_memfs_journal_t* journal, vfs_memfs_journal_op_t type,
+    const char* path, size_t path_len, uint64_t arg, const void* data, size_t len)
+{
+    const size_t payload_sz = VFS_MEMFS_JOURNAL_PAYLOAD_SIZE + path_len + len;
+    const size_t rec_sz = VFS_MEMFS_JOURNAL_RECORD_SIZE + payload_sz;
+
+    if (journal->buf_sz + rec_sz > journal->buf_cap)
+    {
+        size_t new_cap = max(journal->buf_cap * 2, journal->buf_sz + rec_sz);
+        uint8_t* new_buf = realloc(journal->buf, new_cap);
+        if (new_buf == NULL)
+        {
+            return VFS_ENOMEM;
+        }
+        journal->buf = new_buf;
+        journal->buf_cap = new_cap;
+    }
+
+    uint8_t* rec = journal->buf + journal->buf_sz;
+    uint8_t* payload = rec + VFS_MEMFS_JOURNAL_RECORD_SIZE;
+    payload[0] = (uint8_t)type;
+    _vfs_memfs_image_put32(payload + 1, (uint32_t)path_len);
+    memcpy(payload + 5, path, path_len);
+    _vfs_memfs_image_put64(payload + 5 + path_len, arg);
+    if (len != 0)
+    {
+        memcpy(payload + VFS_MEMFS_JOURNAL_PAYLOAD_SIZE + path_len, data, len);
+    }
+    _vfs_memfs_image_put32(rec, (uint32_t)payload_sz);
+    _vfs_memfs_image_put32(rec + 4, (uint32_t)vfs_hash64(payload, payload_sz, 0));
+
+    journal->buf_sz += rec_sz;
+    journal->journal_sz += rec_sz;
+    if (journal->buf_sz >= VFS_MEMFS_JOURNAL_BUFFER_MAX)
+    {
+        return _vfs_memfs_journal_flush(journal, 0);
+    }
+    return 0;
+}
+
+/**
+ * @brief Start a journaled operation.
+ * @param[in] journal - Journal.
+ * @return 0 on success and #vfs_memfs_journal_t::lock is held, or -errno if
+ *   journal is broken.
+ */
+static int _vfs_memfs_journal_enter(vfs_memfs_journal_t* journal)
+{
+    vfs_mutex_enter(&journal->lock);
+    const int ret = journal->error;
+    if (ret != 0)
+    {
+        vfs_mutex_leave(&journal->lock);
+    }
+    return ret;
+}
+
+/**
+ * @brief Record result of journaled operation, and finish it.
+ * @param[in] fs - File system object.
+ * @param[in] ret - Result of operation. Nothing is recorded if it is negative.
+ * @param[in] type - Operation.
+ * @param[in] path - Path of operation, or NULL if nothing should be recorded.
+ * @param[in] path_len - Length of \p path.
+ * @param[in] arg - Argument of operation.
+ * @param[in] data - Data of write.
+ * @param[in] len - Length of \p data.
+ * @return \p ret, or -errno if the record can not be saved.
+ */
+static int _vfs_memfs_journal_leave(vfs_memfs_t* fs, int ret, vfs_memfs_journal_op_t type,
+    const char* path, size_t path_len, uint64_t arg, const void* data, size_t len)
+{
+    int err = 0;
+    vfs_memfs_journal_t* journal = fs->journal;
+
+    if (ret >= 0 && path != NULL)
+    {
+        if ((err = _vfs_memfs_journal_append(journal, type, path, path_len, arg, data, len)) == 0
+            && journal->flush_ms == 0)
+        {
+            /* Without group commit, checkpoint is taken by the operation itself. */
+            if (journal->checkpoint_bytes == 0 || journal->journal_sz < journal->checkpoint_bytes
+                || _vfs_memfs_journal_checkpoint(fs) != 0)
+            {
+                err = _vfs_memfs_journal_flush(journal, 1);
+            }
+        }
+        if (err != 0 && journal->error == 0)
+        {
+            journal->error = err;
+        }
+    }
+    vfs_mutex_leave(&journal->lock);
+
+    return err != 0 ? err : ret;
+}
+
+static int _vfs_memfs_journal_path_op(vfs_memfs_t* fs, vfs_memfs_journal_op_t type,
+    const char* path, int (*op)(struct vfs_operations*, const char*))
+{
+    int ret;
+    if ((ret = _vfs_memfs_journal_enter(fs->journal)) != 0)
+    {
+        return ret;
+    }
+    ret = op(&fs->op, path);
+    return _vfs_memfs_journal_leave(fs, ret, type, path, strlen(path), 0, NULL, 0);
+}
+
+static int _vfs_memfs_journal_mkdir(struct vfs_operations* thiz, const char* path)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    return _vfs_memfs_journal_path_op(fs, VFS_MEMFS_JOURNAL_MKDIR, path, _vfs_memfs_mkdir);
+}
+
+static int _vfs_memfs_journal_rmdir(struct vfs_operations* thiz, const char* path)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    return _vfs_memfs_journal_path_op(fs, VFS_MEMFS_JOURNAL_RMDIR, path, _vfs_memfs_rmdir);
+}
+
+static int _vfs_memfs_journal_unlink(struct vfs_operations* thiz, const char* path)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    return _vfs_memfs_journal_path_op(fs, VFS_MEMFS_JOURNAL_UNLINK, path, _vfs_memfs_unlink);
+}
+
+static int _vfs_memfs_journal_open(struct vfs_operations* thiz, uintptr_t* fh, const char* path, uint64_t flags)
+{
+    int ret;
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+
+    /* Only open that may create or truncate file changes anything. */
+    if (!(flags & (VFS_O_CREATE | VFS_O_TRUNCATE)))
+    {
+        return _vfs_memfs_open(thiz, fh, path, flags);
+    }
+
+    if ((ret = _vfs_memfs_journal_enter(fs->journal)) != 0)
+    {
+        return ret;
+    }
+    const int opened = (ret = _vfs_memfs_open(thiz, fh, path, flags)) == 0;
+    ret = _vfs_memfs_journal_leave(fs, ret, VFS_MEMFS_JOURNAL_OPEN, path, strlen(path),
+        flags & (VFS_O_CREATE | VFS_O_TRUNCATE), NULL, 0);
+
+    /* The change can not be recorded, so caller does not get the file. */
+    if (opened && ret != 0)
+    {
+        _vfs_memfs_close(thiz, *fh);
+    }
+    return ret;
+}
+
+static int _vfs_memfs_journal_write(struct vfs_operations* thiz, uintptr_t fh, const void* buf, size_t len)
+{
+    int ret;
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_memfs_journal_helper_t helper = { fs, 0, VFS_STR_INIT, 0, 0 };
+
+    if ((ret = _vfs_memfs_journal_enter(fs->journal)) != 0)
+    {
+        return ret;
+    }
+    if ((ret = _vfs_memfs_write(thiz, fh, buf, len)) > 0)
+    {
+        helper.written = ret;
+        _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_journal_session_inner, &helper);
+    }
+    ret = _vfs_memfs_journal_leave(fs, ret, VFS_MEMFS_JOURNAL_WRITE,
+        helper.linked ? helper.path.str : NULL, helper.path.len, helper.pos, buf, ret > 0 ? (size_t)ret : 0);
+    vfs_str_exit(&helper.path);
+
+    return ret;
+}
+
+static int _vfs_memfs_journal_truncate(struct vfs_operations* thiz, uintptr_t fh, uint64_t size)
+{
+    int ret;
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_memfs_journal_helper_t helper = { fs, 0, VFS_STR_INIT, 0, 0 };
+
+    if ((ret = _vfs_memfs_journal_enter(fs->journal)) != 0)
     {
-        _vfs_memfs_common_release_node(fs->root, 1);
-        fs->root = NULL;
+        return ret;
+    }
+    if ((ret = _vfs_memfs_truncate(thiz, fh, size)) == 0)
+    {
+        _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_journal_session_inner, &helper);
     }
+    ret = _vfs_memfs_journal_leave(fs, ret, VFS_MEMFS_JOURNAL_TRUNCATE,
+        helper.linked ? helper.path.str : NULL, helper.path.len, size, NULL, 0);
+    vfs_str_exit(&helper.path);
 
-    vfs_mutex_exit(&fs->session_map_lock);
-    free(fs);
+    return ret;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// ls
-//////////////////////////////////////////////////////////////////////////
+/**
+ * @brief Stop journaling and destroy file system.
+ */
+static void _vfs_memfs_journal_destroy(struct vfs_operations* thiz)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_memfs_journal_t* journal = fs->journal;
 
-typedef struct vfs_memfs_ls_helper
+    if (journal->flush_ms != 0)
+    {
+        vfs_sem_post(&journal->stop);
+        vfs_thread_exit(journal->flusher);
+    }
+    if (journal->file != NULL)
+    {
+        if (journal->error == 0)
+        {
+            _vfs_memfs_journal_flush(journal, 1);
+        }
+        fclose(journal->file);
+    }
+    vfs_sem_exit(&journal->stop);
+    vfs_mutex_exit(&journal->lock);
+    free(journal->buf);
+    free(journal->image_path);
+    free(journal->journal_path);
+    free(journal);
+    fs->journal = NULL;
+
+    _vfs_memfs_destroy(thiz);
+}
+
+static void _vfs_memfs_journal_flusher(void* arg)
 {
-    vfs_ls_cb   fn;
-    void*       data;
-} vfs_memfs_ls_helper_t;
+    vfs_memfs_t* fs = arg;
+    vfs_memfs_journal_t* journal = fs->journal;
+
+    while (vfs_sem_timedwait(&journal->stop, journal->flush_ms) != 0)
+    {
+        vfs_mutex_enter(&journal->lock);
+        if (journal->error == 0 && (journal->checkpoint_bytes == 0
+            || journal->journal_sz < journal->checkpoint_bytes
+            || _vfs_memfs_journal_checkpoint(fs) != 0))
+        {
+            _vfs_memfs_journal_flush(journal, 1);
+        }
+        vfs_mutex_leave(&journal->lock);
+    }
+}
 
-static int _vfs_memfs_ls_inner(vfs_memfs_node_t* node, void* data)
+/**
+ * @brief Apply one journal record to \p fs.
+ * @param[in] fs - File system that is not journaled yet.
+ * @param[in] payload - Record payload.
+ * @param[in] payload_sz - Size of \p payload.
+ * @return 0 on success, or #VFS_EIO if record is malformed.
+ */
+static int _vfs_memfs_journal_apply(vfs_operations_t* fs, const uint8_t* payload, size_t payload_sz)
+{
+    uintptr_t fh;
+    const uint8_t type = payload[0];
+    const size_t path_len = _vfs_memfs_image_get32(payload + 1);
+    if (path_len > payload_sz - VFS_MEMFS_JOURNAL_PAYLOAD_SIZE)
+    {
+        return VFS_EIO;
+    }
+    const uint64_t arg = _vfs_memfs_image_get64(payload + 5 + path_len);
+    const uint8_t* data = payload + VFS_MEMFS_JOURNAL_PAYLOAD_SIZE + path_len;
+    const size_t len = payload_sz - VFS_MEMFS_JOURNAL_PAYLOAD_SIZE - path_len;
+    vfs_str_t path = vfs_str_from((const char*)payload + 5, path_len);
+
+    /* Operations succeeded when they were recorded, so they succeed again. */
+    int ret = 0;
+    switch (type)
+    {
+    case VFS_MEMFS_JOURNAL_MKDIR:
+        fs->mkdir(fs, path.str);
+        break;
+
+    case VFS_MEMFS_JOURNAL_RMDIR:
+        fs->rmdir(fs, path.str);
+        break;
+
+    case VFS_MEMFS_JOURNAL_UNLINK:
+        fs->unlink(fs, path.str);
+        break;
+
+    case VFS_MEMFS_JOURNAL_OPEN:
+        if (fs->open(fs, &fh, path.str, VFS_O_WRONLY | (arg & (VFS_O_CREATE | VFS_O_TRUNCATE))) == 0)
+        {
+            fs->close(fs, fh);
+        }
+        break;
+
+    case VFS_MEMFS_JOURNAL_WRITE:
+        if (fs->open(fs, &fh, path.str, VFS_O_WRONLY) == 0)
+        {
+            if (fs->seek(fs, fh, (int64_t)arg, VFS_SEEK_SET) >= 0)
+            {
+                fs->write(fs, fh, data, len);
+            }
+            fs->close(fs, fh);
+        }
+        break;
+
+    case VFS_MEMFS_JOURNAL_TRUNCATE:
+        if (fs->open(fs, &fh, path.str, VFS_O_WRONLY) == 0)
+        {
+            fs->truncate(fs, fh, arg);
+            fs->close(fs, fh);
+        }
+        break;
+
+    default:
+        ret = VFS_EIO;
+        break;
+    }
+
+    vfs_str_exit(&path);
+    return ret;
+}
+
+/**
+ * @brief Replay journal into \p fs.
+ * @param[in] fs - File system that is not journaled yet.
+ * @param[in] journal - Journal.
+ * @param[out] dirty - Set to non-zero if \p fs is changed or journal has a
+ *   broken tail, so a checkpoint is required.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_journal_replay(vfs_memfs_t* fs, vfs_memfs_journal_t* journal, int* dirty)
 {
-    size_t i;
     int ret;
-    vfs_memfs_ls_helper_t* helper = data;
+    FILE* file;
+    uint8_t header[VFS_MEMFS_JOURNAL_HEADER_SIZE];
 
-    vfs_rwlock_wrlock(&node->rwlock);
-    for (i = 0; i < node->data.dir.children_sz; i++)
+    *dirty = 0;
+    if ((ret = _vfs_memfs_image_open(&file, journal->journal_path, "rb")) != 0)
     {
-        vfs_memfs_node_t* child = node->data.dir.children[i];
+        return ret == VFS_ENOENT ? 0 : ret;
+    }
 
-        vfs_rwlock_wrunlock(&node->rwlock);
+    /* Journal that is not started yet, or that belongs to an older image. */
+    if (_vfs_memfs_image_read(file, header, sizeof(header)) != 0
+        || _vfs_memfs_image_get32(header + 8) != journal->generation)
+    {
+        goto finish;
+    }
+    if (memcmp(header, VFS_MEMFS_JOURNAL_MAGIC, 8) != 0)
+    {
+        ret = VFS_EIO;
+        goto finish;
+    }
+
+    for (;;)
+    {
+        uint8_t rec[VFS_MEMFS_JOURNAL_RECORD_SIZE];
+        size_t read_sz = fread(rec, 1, sizeof(rec), file);
+        if (read_sz != sizeof(rec))
         {
-            ret = helper->fn(child->name.str, &child->stat, helper->data);
+            *dirty |= read_sz != 0;
+            break;
         }
-        vfs_rwlock_wrlock(&node->rwlock);
 
-        if (ret != 0)
+        const uint32_t payload_sz = _vfs_memfs_image_get32(rec);
+        uint8_t* payload = payload_sz >= VFS_MEMFS_JOURNAL_PAYLOAD_SIZE ? malloc(payload_sz) : NULL;
+        if (payload == NULL
+            || _vfs_memfs_image_read(file, payload, payload_sz) != 0
+            || (uint32_t)vfs_hash64(payload, payload_sz, 0) != _vfs_memfs_image_get32(rec + 4)
+            || _vfs_memfs_journal_apply(&fs->op, payload, payload_sz) != 0)
         {
+            free(payload);
+            *dirty = 1;
             break;
         }
+        free(payload);
+        *dirty = 1;
     }
-    vfs_rwlock_wrunlock(&node->rwlock);
 
-    return 0;
+finish:
+    fclose(file);
+    return ret;
 }
 
-static int _vfs_memfs_ls(struct vfs_operations* thiz, const char* path,
-    vfs_ls_cb fn, void* data)
+/**
+ * @brief Create journal of \p fs as described by \p config.
+ * @param[in] fs - File system that is loaded from checkpoint image.
+ * @param[in] config - Journal configuration.
+ * @param[in] generation - Generation of checkpoint image.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_journal_init(vfs_memfs_t* fs, const vfs_memfs_journal_config_t* config, uint32_t generation)
 {
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
-    vfs_str_t path_str = vfs_str_from_static1(path);
+    int ret, dirty;
+    vfs_memfs_journal_t* journal = calloc(1, sizeof(vfs_memfs_journal_t));
+    if (journal == NULL)
+    {
+        return VFS_ENOMEM;
+    }
+    vfs_mutex_init(&journal->lock);
+    vfs_sem_init(&journal->stop, 0);
+    journal->generation = generation;
+    journal->flush_ms = config->flush_ms;
+    journal->checkpoint_bytes = config->checkpoint_bytes;
+    journal->image_path = _vfs_memfs_journal_strdup(config->image_path);
+    journal->journal_path = _vfs_memfs_journal_strdup(config->journal_path);
+
+    /* Operations are not journaled yet, so replay does not record anything. */
+    if (journal->image_path == NULL || journal->journal_path == NULL)
+    {
+        ret = VFS_ENOMEM;
+    }
+    else if ((ret = _vfs_memfs_journal_replay(fs, journal, &dirty)) == 0)
+    {
+        fs->journal = journal;
+        ret = dirty ? _vfs_memfs_journal_checkpoint(fs) : _vfs_memfs_journal_reset(journal);
+        fs->journal = NULL;
+    }
 
-    vfs_memfs_ls_helper_t helper = { fn, data };
-    return _vfs_memfs_common_op_path(fs, &path_str, _vfs_memfs_ls_inner, &helper);
+    if (ret != 0)
+    {
+        if (journal->file != NULL)
+        {
+            fclose(journal->file);
+        }
+        vfs_sem_exit(&journal->stop);
+        vfs_mutex_exit(&journal->lock);
+        free(journal->image_path);
+        free(journal->journal_path);
+        free(journal);
+        return ret;
+    }
+
+    fs->journal = journal;
+    fs->op.destroy = _vfs_memfs_journal_destroy;
+    fs->op.open = _vfs_memfs_journal_open;
+    fs->op.truncate = _vfs_memfs_journal_truncate;
+    fs->op.write = _vfs_memfs_journal_write;
+    fs->op.mkdir = _vfs_memfs_journal_mkdir;
+    fs->op.rmdir = _vfs_memfs_journal_rmdir;
+    fs->op.unlink = _vfs_memfs_journal_unlink;
+    if (journal->flush_ms != 0)
+    {
+        vfs_thread_init(&journal->flusher, _vfs_memfs_journal_flusher, fs);
+    }
+    return 0;
 }
 
 //////////////////////////////////////////////////////////////////////////
-// stat
+// readonly
 //////////////////////////////////////////////////////////////////////////
 
-typedef struct vfs_memfs_stat_helper
+/**
+ * @brief A node of read-only file system.
+ *
+ * Nodes are stored in breadth-first order, children of a directory are
+ * contiguous and sorted by name, so a path is resolved by binary search of
+ * each component.
+ */
+typedef struct vfs_memfs_readonly_node
 {
-    vfs_stat_t*     info;
-} vfs_memfs_stat_helper_t;
+    vfs_stat_t                  stat;               /**< The stat of this node. */
+    const char*                 name;               /**< Name in name table, NUL terminated. */
+    size_t                      name_len;           /**< Length of name. */
+    size_t                      first;              /**< Index of first child, or first extent of regular file. */
+    size_t                      count;              /**< The number of children, or extents of regular file. */
+} vfs_memfs_readonly_node_t;
 
-static int _vfs_memfs_stat_inner(vfs_memfs_node_t* node, void* data)
+/**
+ * @brief A range of regular file that is not a hole.
+ * Extents of a file are sorted and never adjacent.
+ */
+typedef struct vfs_memfs_readonly_extent
 {
-    vfs_memfs_stat_helper_t* helper = data;
+    uint64_t                    pos;                /**< Position in file. */
+    uint64_t                    len;                /**< Length in bytes. */
+    const uint8_t*              data;               /**< Content in data region. */
+} vfs_memfs_readonly_extent_t;
 
-    vfs_rwlock_rdlock(&node->rwlock);
+typedef struct vfs_memfs_readonly
+{
+    vfs_memfs_readonly_node_t*      nodes;          /**< All nodes, the first one is root. */
+    vfs_memfs_readonly_extent_t*    extents;        /**< Extents of all regular files. */
+    char*                           names;          /**< Name table. */
+    uint8_t*                        data;           /**< Data region, content of all regular files. */
+    vfs_slab_t                      file_slab;      /**< Allocator of #vfs_memfs_readonly_file_t. */
+} vfs_memfs_readonly_t;
+
+/**
+ * @brief Opened file of read-only file system.
+ * The file handle is the address of this object.
+ */
+typedef struct vfs_memfs_readonly_file
+{
+    const vfs_memfs_readonly_node_t*    node;       /**< The file. */
+    uint64_t                            fpos;       /**< File position. */
+} vfs_memfs_readonly_file_t;
+
+static int _vfs_memfs_readonly_cmp_name(const char* name1, size_t len1, const char* name2, size_t len2)
+{
+    int ret = memcmp(name1, name2, min(len1, len2));
+    if (ret != 0)
     {
-        *helper->info = node->stat;
+        return ret;
     }
-    vfs_rwlock_rdunlock(&node->rwlock);
-    return 0;
+    return len1 < len2 ? -1 : (len1 > len2 ? 1 : 0);
 }
 
-static int _vfs_memfs_stat(struct vfs_operations* thiz, const char* path,
-    vfs_stat_t* info)
+static int _vfs_memfs_readonly_cmp_node(const void* key1, const void* key2)
 {
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
-    vfs_str_t path_str = vfs_str_from_static1(path);
-
-    vfs_memfs_stat_helper_t helper = { info };
-    return _vfs_memfs_common_op_path(fs, &path_str, _vfs_memfs_stat_inner, &helper);
+    const vfs_memfs_node_t* node1 = *(vfs_memfs_node_t* const*)key1;
+    const vfs_memfs_node_t* node2 = *(vfs_memfs_node_t* const*)key2;
+    return _vfs_memfs_readonly_cmp_name(node1->name.str, node1->name.len, node2->name.str, node2->name.len);
 }
 
-//////////////////////////////////////////////////////////////////////////
-// open
-//////////////////////////////////////////////////////////////////////////
-
-typedef struct vfs_mmefs_open_searcher
+/**
+ * @brief Get children of directory \p node, including children of its origin.
+ */
+static const vfs_memfs_node_dir_t* _vfs_memfs_readonly_children(const vfs_memfs_node_t* node)
 {
-    vfs_memfs_node_t* node;
-} vfs_mmefs_open_searcher_t;
+    return node->data.dir.origin != NULL ? &node->data.dir.origin->data.dir : &node->data.dir;
+}
 
-static int _vfs_memfs_open_searcher(vfs_memfs_node_t* node, void* data)
+/**
+ * @brief Get extents of regular file \p node.
+ * @param[in] fs - File system object.
+ * @param[in] node - Regular file node.
+ * @param[out] extents - Extents to fill, or NULL to only count them.
+ * @param[in] data - Where content is copied to, ignored if \p extents is NULL.
+ * @param[out] extent_sz - The number of extents.
+ * @return Bytes of content.
+ */
+static uint64_t _vfs_memfs_readonly_reg_extents(vfs_memfs_t* fs, const vfs_memfs_node_t* node,
+    vfs_memfs_readonly_extent_t* extents, uint8_t* data, size_t* extent_sz)
 {
-    vfs_mmefs_open_searcher_t* searcher = data;
+    size_t i, j, k;
+    uint64_t data_sz = 0;
+    const vfs_memfs_node_reg_t* reg = &node->data.reg;
+    const uint64_t size = node->stat.st_size;
+    *extent_sz = 0;
 
-    searcher->node = node;
-    _vfs_memfs_common_acquire_node(node);
+    if (reg->inlined)
+    {
+        if (size != 0 && extents != NULL)
+        {
+            extents[0].pos = 0;
+            extents[0].len = size;
+            extents[0].data = data;
+            memcpy(data, reg->inline_data, (size_t)size);
+        }
+        *extent_sz = size != 0;
+        return size;
+    }
 
-    return 0;
+    /* Runs of chunks become one extent each. */
+    const size_t chunk_sz = min(reg->chunk_sz, _vfs_memfs_chunk_count(size));
+    for (i = 0; i < chunk_sz; i = j)
+    {
+        if (reg->chunks[i] == NULL)
+        {
+            j = i + 1;
+            continue;
+        }
+        j = i + 1;
+        while (j < chunk_sz && reg->chunks[j] != NULL)
+        {
+            j++;
+        }
+
+        const uint64_t pos = (uint64_t)i * VFS_MEMFS_CHUNK_SIZE;
+        const uint64_t len = min((uint64_t)j * VFS_MEMFS_CHUNK_SIZE, size) - pos;
+        if (extents != NULL)
+        {
+            vfs_memfs_readonly_extent_t* extent = &extents[*extent_sz];
+            extent->pos = pos;
+            extent->len = len;
+            extent->data = data + data_sz;
+
+            for (k = i; k < j; k++)
+            {
+                const vfs_memfs_chunk_t* chunk = reg->chunks[k];
+                uint8_t* dst = data + data_sz + (k - i) * VFS_MEMFS_CHUNK_SIZE;
+                const size_t copy_sz = (size_t)min(len - (uint64_t)(k - i) * VFS_MEMFS_CHUNK_SIZE, VFS_MEMFS_CHUNK_SIZE);
+                if (chunk->zsize == 0)
+                {
+                    memcpy(dst, chunk->data, copy_sz);
+                    continue;
+                }
+
+                uint8_t buf[VFS_MEMFS_CHUNK_SIZE];
+                _vfs_memfs_chunk_decompress(fs, chunk, buf);
+                memcpy(dst, buf, copy_sz);
+            }
+        }
+        (*extent_sz)++;
+        data_sz += len;
+    }
+
+    return data_sz;
 }
 
-static int _vfs_memfs_open_exist(vfs_memfs_t* fs, vfs_memfs_node_t* node, uintptr_t* fh, uint64_t flags)
+static void _vfs_memfs_readonly_release(vfs_memfs_readonly_t* ro)
 {
-    vfs_memfs_session_t* session = calloc(1, sizeof(vfs_memfs_session_t));
-    if (session == NULL)
+    vfs_slab_exit(&ro->file_slab);
+    free(ro->nodes);
+    free(ro->extents);
+    free(ro->names);
+    free(ro->data);
+    free(ro);
+}
+
+/**
+ * @brief Build read-only copy of file system \p fs.
+ * @warning \p fs must not be changed at the same time.
+ * @param[in] fs - File system object.
+ * @param[out] ro - Read-only copy.
+ * @param[out] meta_sz - Bytes used by node table, name table and extents.
+ * @param[out] data_sz - Bytes used by data region.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_readonly_build(vfs_memfs_t* fs, vfs_memfs_readonly_t** ro,
+    uint64_t* meta_sz, uint64_t* data_sz)
+{
+    int ret = 0;
+    size_t i, sz = 1, cap = 64, extent_sz = 0, name_sz = 0;
+    uint64_t content_sz = 0;
+
+    /* Collect all nodes in breadth-first order, with children sorted by name. */
+    vfs_memfs_node_t** list = malloc(sizeof(vfs_memfs_node_t*) * cap);
+    if (list == NULL)
     {
         return VFS_ENOMEM;
     }
-    session->refcnt = 1;
-    vfs_mutex_init(&session->mutex);
-    session->data.fh = (uintptr_t)session;
-    session->data.flags = flags;
-    session->data.fpos = 0;
-    session->data.node = node;
-    _vfs_memfs_common_acquire_node(node);
+    list[0] = fs->root;
 
-    /* Handle APPEND flag. */
-    if (flags & VFS_O_APPEND)
-    {
-        session->data.fpos = UINT64_MAX;
-    }
-    /* Handle TRUNCATE flag. */
-    if (flags & VFS_O_TRUNCATE)
+    for (i = 0; i < sz; i++)
     {
-        void* buf;
-        vfs_rwlock_wrlock(&node->rwlock);
+        vfs_memfs_node_t* node = list[i];
+        name_sz += node->name.len + 1;
+
+        if (node->stat.st_mode & VFS_S_IFREG)
         {
-            buf = node->data.reg.data;
-            node->data.reg.data = NULL;
-            node->stat.st_size = 0;
+            size_t cnt;
+            content_sz += _vfs_memfs_readonly_reg_extents(fs, node, NULL, NULL, &cnt);
+            extent_sz += cnt;
+            continue;
+        }
+
+        /* Origins are copied from their own origins here, so they never change afterwards. */
+        const vfs_memfs_node_dir_t* dir = NULL;
+        if ((ret = _vfs_memfs_dir_children(node, &dir)) != 0)
+        {
+            free(list);
+            return ret;
+        }
+        if (sz + dir->children_sz > cap)
+        {
+            size_t new_cap = max(cap * 2, sz + dir->children_sz);
+            vfs_memfs_node_t** new_list = realloc(list, sizeof(vfs_memfs_node_t*) * new_cap);
+            if (new_list == NULL)
+            {
+                free(list);
+                return VFS_ENOMEM;
+            }
+            list = new_list;
+            cap = new_cap;
+        }
+        if (dir->children_sz != 0)
+        {
+            memcpy(list + sz, dir->children, sizeof(vfs_memfs_node_t*) * dir->children_sz);
+            qsort(list + sz, dir->children_sz, sizeof(vfs_memfs_node_t*), _vfs_memfs_readonly_cmp_node);
+            sz += dir->children_sz;
         }
-        vfs_rwlock_wrunlock(&node->rwlock);
-        free(buf);
     }
 
-    /* Save session. */
+    vfs_memfs_readonly_t* new_ro = calloc(1, sizeof(vfs_memfs_readonly_t));
+    if (new_ro == NULL || content_sz >= SIZE_MAX)
     {
-        ev_map_node_t* orig;
-        vfs_mutex_enter(&fs->session_map_lock);
+        free(new_ro);
+        free(list);
+        return VFS_ENOMEM;
+    }
+    vfs_slab_init(&new_ro->file_slab, sizeof(vfs_memfs_readonly_file_t));
+    new_ro->nodes = malloc(sizeof(vfs_memfs_readonly_node_t) * sz);
+    new_ro->extents = malloc(sizeof(vfs_memfs_readonly_extent_t) * (extent_sz + 1));
+    new_ro->names = malloc(name_sz);
+    new_ro->data = malloc((size_t)content_sz + 1);
+    if (new_ro->nodes == NULL || new_ro->extents == NULL
+        || new_ro->names == NULL || new_ro->data == NULL)
+    {
+        ret = VFS_ENOMEM;
+        goto finish;
+    }
+
+    /* Children are appended in the same order as they are collected. */
+    size_t next_child = 1, next_extent = 0, name_off = 0;
+    uint64_t data_off = 0;
+    for (i = 0; i < sz; i++)
+    {
+        const vfs_memfs_node_t* node = list[i];
+        vfs_memfs_readonly_node_t* dst = &new_ro->nodes[i];
+        dst->stat = node->stat;
+        dst->name = new_ro->names + name_off;
+        dst->name_len = node->name.len;
+        memcpy(new_ro->names + name_off, node->name.str, node->name.len);
+        new_ro->names[name_off + node->name.len] = '\0';
+        name_off += node->name.len + 1;
+
+        if (node->stat.st_mode & VFS_S_IFREG)
         {
-            orig = vfs_map_insert(&fs->session_map, &session->node);
+            dst->first = next_extent;
+            data_off += _vfs_memfs_readonly_reg_extents(fs, node, new_ro->extents + next_extent,
+                new_ro->data + data_off, &dst->count);
+            next_extent += dst->count;
         }
-        vfs_mutex_leave(&fs->session_map_lock);
-        if (orig != NULL)
+        else
         {
-            abort();
+            dst->first = next_child;
+            dst->count = _vfs_memfs_readonly_children(node)->children_sz;
+            next_child += dst->count;
         }
     }
 
-    *fh = session->data.fh;
-    return 0;
+    *meta_sz = sizeof(vfs_memfs_readonly_t) + sizeof(vfs_memfs_readonly_node_t) * sz
+        + sizeof(vfs_memfs_readonly_extent_t) * extent_sz + name_sz;
+    *data_sz = content_sz;
+    *ro = new_ro;
+    new_ro = NULL;
+
+finish:
+    if (new_ro != NULL)
+    {
+        _vfs_memfs_readonly_release(new_ro);
+    }
+    free(list);
+    return ret;
 }
 
-static int _vfs_memfs_open_inner(vfs_memfs_t* fs, vfs_memfs_node_t* parent,
-    uintptr_t* fh, const vfs_str_t* name, uint64_t flags)
+/**
+ * @brief Find node of \p path in read-only file system.
+ * @param[in] ro - Read-only file system.
+ * @param[in] path - The path.
+ * @return The node, or NULL if not found.
+ */
+static const vfs_memfs_readonly_node_t* _vfs_memfs_readonly_lookup(const vfs_memfs_readonly_t* ro, const char* path)
 {
-    int ret = 0;
+    const vfs_memfs_readonly_node_t* cur = ro->nodes;
 
-    vfs_memfs_node_t* child = NULL;
-    vfs_rwlock_wrlock(&parent->rwlock);
-    do 
+    while (*path != '\0')
     {
-        if ((child = _vfs_memfs_common_search_for_nolock(parent, name)) == NULL)
+        if (*path == '/')
+        {
+            path++;
+            continue;
+        }
+
+        const char* end = strchr(path, '/');
+        const size_t len = end != NULL ? (size_t)(end - path) : strlen(path);
+        if (!(cur->stat.st_mode & VFS_S_IFDIR))
+        {
+            return NULL;
+        }
+
+        /* Binary search in sorted children. */
+        size_t lo = cur->first, hi = cur->first + cur->count;
+        while (lo < hi)
         {
-            if (!(flags & VFS_O_CREATE))
+            const size_t mid = lo + (hi - lo) / 2;
+            const vfs_memfs_readonly_node_t* child = &ro->nodes[mid];
+            const int ret = _vfs_memfs_readonly_cmp_name(child->name, child->name_len, path, len);
+            if (ret == 0)
             {
-                ret = VFS_ENOENT;
+                lo = mid;
                 break;
             }
-
-            if ((child = _vfs_memfs_common_new_node(parent, name, VFS_S_IFREG)) == NULL)
+            if (ret < 0)
             {
-                ret = VFS_ENOMEM;
-                break;
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
             }
-            _vfs_memfs_common_acquire_node(child);
         }
-    } while (0);
-    vfs_rwlock_wrunlock(&parent->rwlock);
-
-    if (ret != 0)
-    {
-        return ret;
-    }
+        if (lo == hi)
+        {
+            return NULL;
+        }
 
-    /* Check type. */
-    if (!(child->stat.st_mode & VFS_S_IFREG))
-    {
-        ret = VFS_EISDIR;
-        goto finish;
+        cur = &ro->nodes[lo];
+        path += len;
     }
 
-    /* Open file. */
-    ret = _vfs_memfs_open_exist(fs, child, fh, flags);
-
-finish:
-    _vfs_memfs_common_release_node(child, 0);
-    return ret;
+    return cur;
 }
 
-static int _vfs_memfs_open(struct vfs_operations* thiz, uintptr_t* fh, const char* path, uint64_t flags)
+/**
+ * @brief Find the first extent of \p node that ends after \p pos.
+ * @return Index of extent, or one past the last extent of \p node.
+ */
+static size_t _vfs_memfs_readonly_find_extent(const vfs_memfs_readonly_t* ro,
+    const vfs_memfs_readonly_node_t* node, uint64_t pos)
 {
-    int ret = 0;
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
-    vfs_str_t path_str = vfs_str_from_static1(path);
-    if (vfs_str_cmp1(&path_str, "/") == 0)
-    {
-        return VFS_EISDIR;
-    }
-
-    vfs_str_t basename = VFS_STR_INIT;
-    vfs_str_t parent_path = vfs_path_parent(&path_str, &basename);
-
-    /* Search for parent node. */
-    vfs_memfs_node_t* parent = NULL;
-    if (vfs_str_cmp1(&parent_path, "/") != 0)
+    size_t lo = node->first, hi = node->first + node->count;
+    while (lo < hi)
     {
-        vfs_mmefs_open_searcher_t searcher = { NULL };
-        ret = _vfs_memfs_common_op_path(fs, &parent_path, _vfs_memfs_open_searcher, &searcher);
-        if (ret != 0)
+        const size_t mid = lo + (hi - lo) / 2;
+        const vfs_memfs_readonly_extent_t* extent = &ro->extents[mid];
+        if (extent->pos + extent->len <= pos)
         {
-            goto finish;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
         }
-        parent = searcher.node;
-    }
-    else
-    {
-        parent = fs->root;
-        _vfs_memfs_common_acquire_node(parent);
     }
-
-    ret = _vfs_memfs_open_inner(fs, parent, fh, &basename, flags);
-    _vfs_memfs_common_release_node(parent, 0);
-
-finish:
-    vfs_str_exit(&parent_path);
-    vfs_str_exit(&basename);
-    return ret;
+    return lo;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// close
-//////////////////////////////////////////////////////////////////////////
+static void _vfs_memfs_readonly_destroy(struct vfs_operations* thiz)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    _vfs_memfs_readonly_release(fs->readonly);
+    fs->readonly = NULL;
+    _vfs_memfs_destroy(thiz);
+}
 
-static int _vfs_memfs_close(struct vfs_operations* thiz, uintptr_t fh)
+static int _vfs_memfs_readonly_ls(struct vfs_operations* thiz, const char* path, vfs_ls_cb fn, void* data)
 {
+    size_t i;
     vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    const vfs_memfs_readonly_t* ro = fs->readonly;
 
-    vfs_memfs_session_t tmp_session;
-    tmp_session.data.fh = fh;
+    const vfs_memfs_readonly_node_t* node = _vfs_memfs_readonly_lookup(ro, path);
+    if (node == NULL)
+    {
+        return VFS_ENOENT;
+    }
+    if (!(node->stat.st_mode & VFS_S_IFDIR))
+    {
+        return VFS_ENOTDIR;
+    }
 
-    vfs_memfs_session_t* session = NULL;
-    vfs_mutex_enter(&fs->session_map_lock);
-    do {
-        ev_map_node_t* it = vfs_map_find(&fs->session_map, &tmp_session.node);
-        if (it == NULL)
+    for (i = node->first; i < node->first + node->count; i++)
+    {
+        if (fn(ro->nodes[i].name, &ro->nodes[i].stat, data) != 0)
         {
             break;
         }
+    }
+    return 0;
+}
 
-        session = EV_CONTAINER_OF(it, vfs_memfs_session_t, node);
-        vfs_map_erase(&fs->session_map, it);
-    } while (0);
-    vfs_mutex_leave(&fs->session_map_lock);
+static int _vfs_memfs_readonly_stat(struct vfs_operations* thiz, const char* path, vfs_stat_t* info)
+{
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
 
-    if (session == NULL)
+    const vfs_memfs_readonly_node_t* node = _vfs_memfs_readonly_lookup(fs->readonly, path);
+    if (node == NULL)
     {
-        return VFS_EBADF;
+        return VFS_ENOENT;
     }
-
-    _vfs_memfs_common_release_session(session);
+    *info = node->stat;
     return 0;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// truncate
-//////////////////////////////////////////////////////////////////////////
-
-typedef struct vfs_memfs_truncate_helper
+static int _vfs_memfs_readonly_open(struct vfs_operations* thiz, uintptr_t* fh, const char* path, uint64_t flags)
 {
-    uint64_t    size;
-} vfs_memfs_truncate_helper_t;
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_memfs_readonly_t* ro = fs->readonly;
 
-static int _vfs_memfs_truncate_job(vfs_memfs_node_t* node, size_t size)
-{
-    uint8_t* new_data = realloc(node->data.reg.data, size);
-    if (new_data == NULL)
+    const vfs_memfs_readonly_node_t* node = _vfs_memfs_readonly_lookup(ro, path);
+    if (node == NULL)
     {
-        return VFS_ENOMEM;
+        return (flags & VFS_O_CREATE) ? VFS_EROFS : VFS_ENOENT;
     }
-    node->data.reg.data = new_data;
-
-    /* zero content. */
-    if (node->stat.st_size < size)
+    if (!(node->stat.st_mode & VFS_S_IFREG))
     {
-        memset(node->data.reg.data + node->stat.st_size, 0, size - node->stat.st_size);
+        return VFS_EISDIR;
+    }
+    if (flags & (VFS_O_WRONLY | VFS_O_APPEND | VFS_O_TRUNCATE))
+    {
+        return VFS_EROFS;
     }
-    node->stat.st_size = size;
-
-    return 0;
-}
-
-static int _vfs_memfs_truncate_inner(vfs_memfs_session_t* session, void* data)
-{
-    vfs_memfs_truncate_helper_t* helper = data;
-    vfs_memfs_node_t* node = session->data.node;
 
-    int ret;
-    vfs_rwlock_wrlock(&node->rwlock);
+    vfs_memfs_readonly_file_t* file = vfs_slab_alloc(&ro->file_slab);
+    if (file == NULL)
     {
-        ret = _vfs_memfs_truncate_job(node, helper->size);
+        return VFS_ENOMEM;
     }
-    vfs_rwlock_wrunlock(&node->rwlock);
+    file->node = node;
+    file->fpos = 0;
 
-    return ret;
+    *fh = (uintptr_t)file;
+    return 0;
 }
 
-static int _vfs_memfs_truncate(struct vfs_operations* thiz, uintptr_t fh, uint64_t size)
+static int _vfs_memfs_readonly_close(struct vfs_operations* thiz, uintptr_t fh)
 {
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
-    vfs_memfs_truncate_helper_t helper = { size };
-    return _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_truncate_inner, &helper);
+    (void)thiz;
+    vfs_slab_free((void*)fh);
+    return 0;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// seek
-//////////////////////////////////////////////////////////////////////////
-
-typedef struct vfs_memfs_seek_helper
+static int _vfs_memfs_readonly_truncate(struct vfs_operations* thiz, uintptr_t fh, uint64_t size)
 {
-    int64_t offset;
-    int     whence;
-    int64_t ret;
-} vfs_memfs_seek_helper_t;
+    (void)thiz; (void)fh; (void)size;
+    return VFS_EROFS;
+}
 
-static int _vfs_memfs_seek_inner(vfs_memfs_session_t* session, void* data)
+static int64_t _vfs_memfs_readonly_seek(struct vfs_operations* thiz, uintptr_t fh, int64_t offset, int whence)
 {
-    vfs_memfs_seek_helper_t* helper = data;
-    vfs_memfs_node_t* node = session->data.node;
+    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_memfs_readonly_file_t* file = (vfs_memfs_readonly_file_t*)fh;
+    const vfs_memfs_readonly_node_t* node = file->node;
+    uint64_t base;
 
-    if (helper->whence == VFS_SEEK_SET)
+    switch (whence)
     {
-        vfs_mutex_enter(&session->mutex);
+    case VFS_SEEK_SET:
+    case VFS_SEEK_CUR:
+    case VFS_SEEK_END:
+        base = whence == VFS_SEEK_SET ? 0 : (whence == VFS_SEEK_CUR ? file->fpos : node->stat.st_size);
+        if (offset < 0 && (uint64_t)0 - (uint64_t)offset > base)
         {
-            session->data.fpos = helper->offset;
-            helper->ret = session->data.fpos;
+            return VFS_EINVAL;
         }
-        vfs_mutex_leave(&session->mutex);
-        return 0;
-    }
+        file->fpos = base + (uint64_t)offset;
+        break;
 
-    if (helper->whence == VFS_SEEK_CUR)
+    case VFS_SEEK_DATA:
+    case VFS_SEEK_HOLE:
     {
-        if (session->data.fpos == UINT64_MAX)
+        if (offset < 0)
         {
-            goto handle_seek_end;
+            return VFS_EINVAL;
         }
-        vfs_mutex_enter(&session->mutex);
+        if ((uint64_t)offset >= node->stat.st_size)
         {
-            session->data.fpos += helper->offset;
-            helper->ret = session->data.fpos;
+            return VFS_ENXIO;
         }
-        vfs_mutex_leave(&session->mutex);
-        return 0;
-    }
-    /* Now whence is #VFS_SEEK_END. */
 
-    /* offset == 0 is special, it means always append to end of file. */
-    if (helper->offset == 0)
-    {
-        vfs_mutex_enter(&session->mutex);
+        uint64_t pos = (uint64_t)offset;
+        const size_t idx = _vfs_memfs_readonly_find_extent(fs->readonly, node, pos);
+        const vfs_memfs_readonly_extent_t* extent = idx < node->first + node->count ? &fs->readonly->extents[idx] : NULL;
+        if (whence == VFS_SEEK_DATA)
         {
-            session->data.fpos = UINT64_MAX;
-            helper->ret = node->stat.st_size;
+            if (extent == NULL)
+            {
+                return VFS_ENXIO;
+            }
+            pos = max(pos, extent->pos);
         }
-        vfs_mutex_leave(&session->mutex);
-        return 0;
+        else if (extent != NULL && extent->pos <= pos)
+        {
+            /* Extents are never adjacent, so a hole follows each of them. */
+            pos = min(extent->pos + extent->len, node->stat.st_size);
+        }
+        file->fpos = pos;
+        break;
     }
 
-    /* In other condition, we need to have absolute position. */
-handle_seek_end:
-    vfs_mutex_enter(&session->mutex);
-    vfs_rwlock_rdlock(&node->rwlock);
-    {
-        session->data.fpos = node->stat.st_size + helper->offset;
-        helper->ret = session->data.fpos;
+    default:
+        return VFS_EINVAL;
     }
-    vfs_rwlock_rdunlock(&node->rwlock);
-    vfs_mutex_leave(&session->mutex);
-    
-    return 0;
+
+    return (int64_t)file->fpos;
 }
 
-static int64_t _vfs_memfs_seek(struct vfs_operations* thiz, uintptr_t fh, int64_t offset, int whence)
+static int _vfs_memfs_readonly_read(struct vfs_operations* thiz, uintptr_t fh, void* buf, size_t len)
 {
     vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
+    vfs_memfs_readonly_file_t* file = (vfs_memfs_readonly_file_t*)fh;
+    const vfs_memfs_readonly_node_t* node = file->node;
 
-    vfs_memfs_seek_helper_t helper = { offset, whence, 0 };
-    int ret = _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_seek_inner, &helper);
-    if (ret != 0)
+    if (file->fpos >= node->stat.st_size)
     {
-        return ret;
+        return VFS_EOF;
     }
-    return helper.ret;
+    len = (size_t)min(len, node->stat.st_size - file->fpos);
+
+    /* Gaps between extents are holes. */
+    size_t read_sz = 0;
+    size_t idx = _vfs_memfs_readonly_find_extent(fs->readonly, node, file->fpos);
+    while (read_sz < len)
+    {
+        const uint64_t pos = file->fpos + read_sz;
+        const vfs_memfs_readonly_extent_t* extent = idx < node->first + node->count ? &fs->readonly->extents[idx] : NULL;
+        if (extent == NULL || pos < extent->pos)
+        {
+            const size_t hole_sz = extent == NULL ? len - read_sz : (size_t)min(len - read_sz, extent->pos - pos);
+            memset((uint8_t*)buf + read_sz, 0, hole_sz);
+            read_sz += hole_sz;
+            continue;
+        }
+
+        const size_t copy_sz = (size_t)min(len - read_sz, extent->pos + extent->len - pos);
+        memcpy((uint8_t*)buf + read_sz, extent->data + (pos - extent->pos), copy_sz);
+        read_sz += copy_sz;
+        idx++;
+    }
+
+    file->fpos += read_sz;
+    return (int)read_sz;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// read
-//////////////////////////////////////////////////////////////////////////
+static int _vfs_memfs_readonly_write(struct vfs_operations* thiz, uintptr_t fh, const void* buf, size_t len)
+{
+    (void)thiz; (void)fh; (void)buf; (void)len;
+    return VFS_EROFS;
+}
 
-typedef struct vfs_memfs_read_helper
+static int _vfs_memfs_readonly_path_op(struct vfs_operations* thiz, const char* path)
 {
-    vfs_memfs_t*    fs;
-    void*           buf;
-    size_t          len;
-} vfs_memfs_read_helper_t;
+    (void)thiz; (void)path;
+    return VFS_EROFS;
+}
 
-static int _vfs_memfs_read_default(vfs_memfs_session_t* session, void* buf, size_t len, void* data)
+/**
+ * @brief Replace the tree of \p fs with a read-only copy, and switch it to
+ *   read-only operations.
+ * @param[in] fs - File system object.
+ * @return 0 on success, or -errno on error.
+ */
+static int _vfs_memfs_set_readonly(vfs_memfs_t* fs)
 {
-    (void)data;
+    int ret;
+    uint64_t meta_sz, data_sz;
+    vfs_memfs_readonly_t* ro;
 
-    vfs_memfs_node_t* node = session->data.node;
-    if (session->data.fpos >= node->stat.st_size)
+    if ((ret = _vfs_memfs_readonly_build(fs, &ro, &meta_sz, &data_sz)) != 0)
     {
-        return VFS_EOF;
+        return ret;
     }
 
-    size_t left_sz = node->stat.st_size - session->data.fpos;
-    int ret = (int)min(left_sz, len);
-    memcpy(buf, node->data.reg.data + session->data.fpos, ret);
-    session->data.fpos += ret;
-
-    return ret;
+    /* Read-only content never grows, so it is charged without checking limit. */
+    _vfs_memfs_common_release_node(fs, fs->root, 1);
+    fs->root = NULL;
+    vfs_mutex_enter(&fs->usage.lock);
+    {
+        fs->usage.meta += meta_sz;
+        fs->usage.data += data_sz;
+    }
+    vfs_mutex_leave(&fs->usage.lock);
+
+    fs->readonly = ro;
+    fs->op.destroy = _vfs_memfs_readonly_destroy;
+    fs->op.ls = _vfs_memfs_readonly_ls;
+    fs->op.stat = _vfs_memfs_readonly_stat;
+    fs->op.open = _vfs_memfs_readonly_open;
+    fs->op.close = _vfs_memfs_readonly_close;
+    fs->op.truncate = _vfs_memfs_readonly_truncate;
+    fs->op.seek = _vfs_memfs_readonly_seek;
+    fs->op.read = _vfs_memfs_readonly_read;
+    fs->op.write = _vfs_memfs_readonly_write;
+    fs->op.mkdir = _vfs_memfs_readonly_path_op;
+    fs->op.rmdir = _vfs_memfs_readonly_path_op;
+    fs->op.unlink = _vfs_memfs_readonly_path_op;
+    return 0;
 }
 
-static int _vfs_memfs_read_inner(vfs_memfs_session_t* session, void* data)
+//////////////////////////////////////////////////////////////////////////
+// API
+//////////////////////////////////////////////////////////////////////////
+
+int vfs_make_memory(vfs_operations_t** fs)
 {
-    int ret = 0;
-    vfs_memfs_read_helper_t* helper = data;
-    vfs_memfs_t* fs = helper->fs;
-    vfs_memfs_node_t* node = session->data.node;
+    vfs_memfs_t* memfs = calloc(1, sizeof(vfs_memfs_t));
+    if (memfs == NULL)
+    {
+        return VFS_ENOMEM;
+    }
+
+    memfs->refcnt = 1;
+    memfs->op.destroy = _vfs_memfs_destroy;
+    memfs->op.ls = _vfs_memfs_ls;
+    memfs->op.stat = _vfs_memfs_stat;
+    memfs->op.open = _vfs_memfs_open;
+    memfs->op.close = _vfs_memfs_close;
+    memfs->op.truncate = _vfs_memfs_truncate;
+    memfs->op.seek = _vfs_memfs_seek;
+    memfs->op.read = _vfs_memfs_read;
+    memfs->op.write = _vfs_memfs_write;
+    memfs->op.mkdir = _vfs_memfs_mkdir;
+    memfs->op.rmdir = _vfs_memfs_rmdir;
+    memfs->op.unlink = _vfs_memfs_unlink;
+
+    vfs_map_init(&memfs->session_map, _vfs_memfs_common_cmp_session, NULL);
+    vfs_mutex_init(&memfs->session_map_lock);
+    vfs_mutex_init(&memfs->snap.lock);
+    vfs_list_init(&memfs->snap.list);
+    vfs_mutex_init(&memfs->chunk_pool.lock);
+    vfs_mutex_init(&memfs->usage.lock);
+    vfs_mutex_init(&memfs->compress.lock);
+    vfs_mutex_init(&memfs->dedup.lock);
+    vfs_mutex_init(&memfs->zcache.lock);
+    vfs_epoch_init(&memfs->epoch);
+    vfs_slab_init(&memfs->node_slab, sizeof(vfs_memfs_node_t));
+    vfs_slab_init(&memfs->session_slab, sizeof(vfs_memfs_session_t));
+    memfs->compress.base = vfs_clock_now();
 
-    if ((session->data.flags & VFS_O_RDWR) == VFS_O_WRONLY)
+    vfs_str_t name = vfs_str_from_static1("");
+    int ret = _vfs_memfs_common_new_node(memfs, NULL, &name, VFS_S_IFDIR, &memfs->root);
+    if (ret != 0)
     {
-        return VFS_EBADF;
+        _vfs_memfs_destroy(&memfs->op);
+        return ret;
     }
 
-    vfs_mutex_enter(&session->mutex);
-    vfs_rwlock_rdlock(&node->rwlock);
-    do 
-    {
-        ret = fs->io.read(session, helper->buf, helper->len, fs->io.data);
-    } while (0);
-    vfs_rwlock_rdunlock(&node->rwlock);
-    vfs_mutex_leave(&session->mutex);
+    const vfs_memfs_io_t io = {
+        memfs,
+        _vfs_memfs_read_default,
+        _vfs_memfs_write_default,
+    };
+    vfs_memfs_set_io(&memfs->op, &io);
 
-    return ret;
+    *fs = &memfs->op;
+    return 0;
 }
 
-static int _vfs_memfs_read(struct vfs_operations* thiz, uintptr_t fh, void* buf, size_t len)
+void vfs_memfs_set_io(vfs_operations_t* fs, const vfs_memfs_io_t* io)
 {
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
-    vfs_memfs_read_helper_t helper = { fs, buf, len };
-    return _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_read_inner, &helper);
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
+    memfs->io = *io;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// write
-//////////////////////////////////////////////////////////////////////////
-
-typedef struct vfs_memfs_write_helper
+int vfs_memfs_snapshot(vfs_operations_t* fs, vfs_memfs_snapshot_t** snapshot)
 {
-    vfs_memfs_t*    fs;
-    const void*     buf;
-    size_t          len;
-} vfs_memfs_write_helper_t;
+    int ret;
+    vfs_operations_t* op;
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
+    if (memfs->readonly != NULL)
+    {
+        return VFS_EINVAL;
+    }
 
-static int _vfs_memfs_write_append(vfs_memfs_node_t* node, const void* buf, size_t len)
-{
-    size_t old_sz = node->stat.st_size;
-    size_t new_sz = old_sz + len;
-    uint8_t* new_buf = realloc(node->data.reg.data, new_sz + 1);
-    if (new_buf == NULL)
+    vfs_memfs_snapshot_t* new_snapshot = malloc(sizeof(vfs_memfs_snapshot_t));
+    if (new_snapshot == NULL)
     {
         return VFS_ENOMEM;
     }
-    node->data.reg.data = new_buf;
-    node->stat.st_size = new_sz;
-    memcpy(node->data.reg.data + old_sz, buf, len);
-    node->data.reg.data[new_sz] = '\0';
 
-    return (int)len;
-}
-
-static int _vfs_memfs_write_pos(vfs_memfs_session_t* session, vfs_memfs_node_t* node, const void* buf, size_t len)
-{
-    if (session->data.fpos + len < node->stat.st_size)
+    if ((ret = vfs_make_memory(&op)) != 0)
     {
-        memcpy(node->data.reg.data + session->data.fpos, buf, len);
-        session->data.fpos += len;
-        return (int)len;
+        free(new_snapshot);
+        return ret;
     }
+    vfs_memfs_t* snapshot_fs = EV_CONTAINER_OF(op, vfs_memfs_t, op);
 
-    size_t new_sz = session->data.fpos + len;
-    uint8_t* new_buf = realloc(node->data.reg.data, new_sz + 1);
-    if (new_buf == NULL)
+    /* The whole tree is shared, and nodes are captured before they change. */
+    vfs_mutex_enter(&memfs->snap.lock);
+    if ((ret = _vfs_memfs_common_share_node(snapshot_fs, snapshot_fs->root, memfs, memfs->root)) == 0)
     {
-        return VFS_ENOMEM;
+        /* The first reference is held by the tree, and this one by user. */
+        (void)vfs_atomic_add(&snapshot_fs->refcnt);
+        (void)vfs_atomic_add(&memfs->refcnt);
+        snapshot_fs->source.fs = memfs;
+        snapshot_fs->source.gen = ++memfs->snap.last;
+        vfs_list_push_back(&memfs->snap.list, &snapshot_fs->source.node);
+        vfs_atomic_store(&memfs->snap.gen, snapshot_fs->source.gen);
     }
-    node->data.reg.data = new_buf;
+    vfs_mutex_leave(&memfs->snap.lock);
 
-    if (session->data.fpos >= node->stat.st_size)
+    if (ret != 0)
     {
-        memset(node->data.reg.data + node->stat.st_size, 0, session->data.fpos - node->stat.st_size);
+        op->destroy(op);
+        free(new_snapshot);
+        return ret;
     }
-    memcpy(new_buf + session->data.fpos, buf, len);
-    node->stat.st_size = new_sz;
-    node->data.reg.data[node->stat.st_size] = '\0';
 
-    session->data.fpos += len;
-    return (int)len;
+    new_snapshot->fs = snapshot_fs;
+    *snapshot = new_snapshot;
+    return 0;
 }
 
-static int _vfs_memfs_write_default(vfs_memfs_session_t* session,
-    const void* buf, size_t len, void* data)
+void vfs_memfs_snapshot_release(vfs_memfs_snapshot_t* snapshot)
 {
-    (void)data;
+    /* Tree of snapshot is released once no clone shares it. */
+    _vfs_memfs_common_release_fs(snapshot->fs);
+    free(snapshot);
+}
 
-    vfs_memfs_node_t* node = session->data.node;
-    if (session->data.fpos == UINT64_MAX)
+int vfs_memfs_clone(const vfs_memfs_snapshot_t* snapshot, vfs_operations_t** fs)
+{
+    int ret;
+    vfs_operations_t* op;
+
+    if ((ret = vfs_make_memory(&op)) != 0)
+    {
+        return ret;
+    }
+
+    /* Snapshot is never changed, so directories can be shared. */
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(op, vfs_memfs_t, op);
+    if ((ret = _vfs_memfs_common_share_node(memfs, memfs->root, snapshot->fs, snapshot->fs->root)) != 0)
     {
-        return _vfs_memfs_write_append(node, buf, len);
+        op->destroy(op);
+        return ret;
     }
-    return _vfs_memfs_write_pos(session, node, buf, len);
+
+    *fs = op;
+    return 0;
 }
 
-static int _vfs_memfs_write_inner(vfs_memfs_session_t* session, void* data)
+int vfs_memfs_set_limit(vfs_operations_t* fs, uint64_t hard_limit, uint64_t soft_limit,
+    vfs_memfs_soft_limit_cb cb, void* data)
 {
-    int ret = 0;
-    vfs_memfs_write_helper_t* helper = data;
-    vfs_memfs_t* fs = helper->fs;
-    vfs_memfs_node_t* node = session->data.node;
-
-    if ((session->data.flags & VFS_O_RDWR) == VFS_O_RDONLY)
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
+    if (hard_limit != 0 && soft_limit > hard_limit)
     {
-        return VFS_EBADF;
+        return VFS_EINVAL;
     }
 
-    vfs_mutex_enter(&session->mutex);
-    vfs_rwlock_wrlock(&node->rwlock);
-    do
+    vfs_mutex_enter(&memfs->usage.lock);
     {
-        ret = fs->io.write(session, helper->buf, helper->len, fs->io.data);
-    } while (0);
-    vfs_rwlock_wrunlock(&node->rwlock);
-    vfs_mutex_leave(&session->mutex);
+        memfs->usage.hard_limit = hard_limit;
+        memfs->usage.soft_limit = soft_limit;
+        memfs->usage.soft_notified = 0;
+        memfs->usage.soft_cb = cb;
+        memfs->usage.soft_data = data;
+    }
+    vfs_mutex_leave(&memfs->usage.lock);
 
-    return ret;
+    _vfs_memfs_usage_check_soft_limit(memfs);
+    return 0;
 }
 
-static int _vfs_memfs_write(struct vfs_operations* thiz, uintptr_t fh, const void* buf, size_t len)
+void vfs_memfs_statfs(vfs_operations_t* fs, vfs_memfs_statfs_t* info)
 {
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
-    vfs_memfs_write_helper_t helper = { fs, buf, len };
-    return _vfs_memfs_common_op_fh(fs, fh, _vfs_memfs_write_inner, &helper);
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
+    _vfs_memfs_usage_query(memfs, info);
 }
 
-//////////////////////////////////////////////////////////////////////////
-// mkdir
-//////////////////////////////////////////////////////////////////////////
-
-static int _vfs_memfs_mkdir_inner(vfs_memfs_node_t* node, void* data)
+int vfs_memfs_set_compress(vfs_operations_t* fs, int enable, uint32_t idle_sec)
 {
-    int ret = 0;
-    vfs_str_t* basename = data;
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
+    if (memfs->readonly != NULL)
+    {
+        return VFS_EINVAL;
+    }
 
-    vfs_rwlock_wrlock(&node->rwlock);
-    do 
+    vfs_mutex_enter(&memfs->compress.lock);
     {
-        vfs_memfs_node_t* child = _vfs_memfs_common_search_for_nolock(node, basename);
-        if (child != NULL)
+        if (enable && !vfs_atomic_load(&memfs->compress.enabled))
         {
-            _vfs_memfs_common_release_node(child, 0);
-            ret = VFS_EALREADY;
-            break;
+            vfs_atomic_store(&memfs->compress.enabled, 1);
+            _vfs_memfs_compress_update_tick(memfs);
+            memfs->compress.enable_tick = vfs_atomic_load(&memfs->compress.tick);
         }
-
-        if ((child = _vfs_memfs_common_new_node(node, basename, VFS_S_IFDIR)) == NULL)
+        else if (!enable)
         {
-            ret = VFS_ENOMEM;
-            break;
+            vfs_atomic_store(&memfs->compress.enabled, 0);
         }
-    } while (0);
-    vfs_rwlock_wrunlock(&node->rwlock);
+        memfs->compress.idle_sec = idle_sec;
+    }
+    vfs_mutex_leave(&memfs->compress.lock);
 
-    return ret;
+    return 0;
 }
 
-static int _vfs_memfs_mkdir(struct vfs_operations* thiz, const char* path)
+int vfs_memfs_compress(vfs_operations_t* fs)
 {
-    int ret = 0;
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
-    vfs_str_t path_str = vfs_str_from_static1(path);
+    int ret = VFS_EINVAL;
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
 
-    vfs_str_t basename = VFS_STR_INIT;
-    vfs_str_t parent = vfs_path_parent(&path_str, &basename);
+    vfs_mutex_enter(&memfs->compress.lock);
+    if (vfs_atomic_load(&memfs->compress.enabled) && memfs->readonly == NULL)
     {
-        ret = _vfs_memfs_common_op_path(fs, &parent, _vfs_memfs_mkdir_inner, &basename);
+        _vfs_memfs_compress_update_tick(memfs);
+        ret = _vfs_memfs_compress_dir(memfs, memfs->root, vfs_atomic_load(&memfs->compress.tick));
     }
-    vfs_str_exit(&basename);
-    vfs_str_exit(&parent);
+    vfs_mutex_leave(&memfs->compress.lock);
 
     return ret;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// rmdir
-//////////////////////////////////////////////////////////////////////////
-
-static int _vfs_memfs_rmdir_inner(vfs_memfs_node_t* node, void* data)
+int vfs_memfs_store_create(vfs_memfs_store_t** store)
 {
-    vfs_str_t* basename = data;
+    vfs_memfs_store_t* new_store = calloc(1, sizeof(vfs_memfs_store_t));
+    if (new_store == NULL)
+    {
+        return VFS_ENOMEM;
+    }
 
-    /* The reference count has been increased. */
-    vfs_memfs_node_t* child = _vfs_memfs_common_search_for(node, basename);
-    if (child == NULL)
+    new_store->bucket_cap = VFS_MEMFS_STORE_INIT_CAP;
+    if ((new_store->buckets = calloc(new_store->bucket_cap, sizeof(vfs_memfs_chunk_t*))) == NULL)
     {
-        return VFS_ENOENT;
+        free(new_store);
+        return VFS_ENOMEM;
     }
+    new_store->refcnt = 1;
+    vfs_mutex_init(&new_store->lock);
 
-    if (!(child->stat.st_mode & VFS_S_IFDIR))
+    *store = new_store;
+    return 0;
+}
+
+void vfs_memfs_store_release(vfs_memfs_store_t* store)
+{
+    _vfs_memfs_store_release(store);
+}
+
+void vfs_memfs_store_stat(vfs_memfs_store_t* store, vfs_memfs_store_stat_t* info)
+{
+    size_t i;
+    memset(info, 0, sizeof(*info));
+
+    vfs_mutex_enter(&store->lock);
     {
-        _vfs_memfs_common_release_node(child, 0);
-        return VFS_ENOTDIR;
+        for (i = 0; i < store->bucket_cap; i++)
+        {
+            const vfs_memfs_chunk_t* chunk = store->buckets[i];
+            for (; chunk != NULL; chunk = chunk->next)
+            {
+                info->ref_bytes += (uint64_t)vfs_atomic_load(&chunk->refcnt) * VFS_MEMFS_CHUNK_SIZE;
+            }
+        }
+        info->unique_bytes = (uint64_t)store->chunk_sz * VFS_MEMFS_CHUNK_SIZE;
+        info->lookup_cnt = store->lookup_cnt;
+        info->hit_cnt = store->hit_cnt;
     }
+    vfs_mutex_leave(&store->lock);
+}
 
-    if (child->data.dir.children_sz != 0)
+int vfs_memfs_set_dedup(vfs_operations_t* fs, vfs_memfs_store_t* store)
+{
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
+    if (memfs->readonly != NULL)
+    {
+        return VFS_EINVAL;
+    }
+    if (store != NULL)
     {
-        _vfs_memfs_common_release_node(child, 0);
-        return VFS_ENOTEMPTY;
+        (void)vfs_atomic_add(&store->refcnt);
     }
 
-    /* The first time to release reference increased by #_vfs_memfs_common_search_for(). */
-    _vfs_memfs_common_release_node(child, 0);
-    /* The second time to release reference to actually delete it. */
-    _vfs_memfs_common_release_node(child, 1);
+    vfs_mutex_enter(&memfs->dedup.lock);
+    vfs_memfs_store_t* old = memfs->dedup.store;
+    memfs->dedup.store = store;
+    vfs_mutex_leave(&memfs->dedup.lock);
 
+    if (old != NULL)
+    {
+        _vfs_memfs_store_release(old);
+    }
     return 0;
 }
 
-static int _vfs_memfs_rmdir(struct vfs_operations* thiz, const char* path)
+int vfs_memfs_save(vfs_operations_t* fs, const char* path)
 {
-    int ret;
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
-    vfs_str_t path_str = vfs_str_from_static1(path);
-
-    vfs_str_t basename = VFS_STR_INIT;
-    vfs_str_t parent = vfs_path_parent(&path_str, &basename);
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
+    if (memfs->readonly != NULL)
     {
-        ret = _vfs_memfs_common_op_path(fs, &parent, _vfs_memfs_rmdir_inner, &basename);
+        return VFS_EINVAL;
     }
-    vfs_str_exit(&basename);
-    vfs_str_exit(&parent);
-
-    return ret;
+    return _vfs_memfs_image_save_file(memfs, path, 0);
 }
 
-//////////////////////////////////////////////////////////////////////////
-// unlink
-//////////////////////////////////////////////////////////////////////////
+int vfs_memfs_load(vfs_operations_t** fs, const char* path)
+{
+    uint32_t generation;
+    return _vfs_memfs_image_load_file(fs, path, &generation);
+}
 
-static int _vfs_memfs_unlink_inner(vfs_memfs_node_t* node, void* data)
+int vfs_make_memory_journal(vfs_operations_t** fs, const vfs_memfs_journal_config_t* config)
 {
-    vfs_str_t* basename = data;
+    int ret;
+    vfs_operations_t* op;
+    uint32_t generation = 0;
 
-    /* The reference count has been increased. */
-    vfs_memfs_node_t* child = _vfs_memfs_common_search_for(node, basename);
-    if (child == NULL)
+    if ((ret = _vfs_memfs_image_load_file(&op, config->image_path, &generation)) == VFS_ENOENT)
     {
-        return VFS_ENOENT;
+        ret = vfs_make_memory(&op);
     }
-
-    if (!(child->stat.st_mode & VFS_S_IFREG))
+    if (ret != 0)
     {
-        _vfs_memfs_common_release_node(child, 0);
-        return VFS_EISDIR;
+        return ret;
     }
 
-    /* The first time to release reference increased by #_vfs_memfs_common_search_for(). */
-    _vfs_memfs_common_release_node(child, 0);
-    /* The second time to release reference to actually delete it. */
-    _vfs_memfs_common_release_node(child, 1);
+    if ((ret = _vfs_memfs_journal_init(EV_CONTAINER_OF(op, vfs_memfs_t, op), config, generation)) != 0)
+    {
+        op->destroy(op);
+        return ret;
+    }
 
+    *fs = op;
     return 0;
 }
 
-static int _vfs_memfs_unlink(struct vfs_operations* thiz, const char* path)
+int vfs_memfs_checkpoint(vfs_operations_t* fs)
 {
     int ret;
-    vfs_memfs_t* fs = EV_CONTAINER_OF(thiz, vfs_memfs_t, op);
-    vfs_str_t path_str = vfs_str_from_static1(path);
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
+    if (memfs->journal == NULL)
+    {
+        return VFS_EINVAL;
+    }
 
-    vfs_str_t basename = VFS_STR_INIT;
-    vfs_str_t parent = vfs_path_parent(&path_str, &basename);
+    if ((ret = _vfs_memfs_journal_enter(memfs->journal)) != 0)
     {
-        ret = _vfs_memfs_common_op_path(fs, &parent, _vfs_memfs_unlink_inner, &basename);
+        return ret;
     }
-    vfs_str_exit(&basename);
-    vfs_str_exit(&parent);
+    ret = _vfs_memfs_journal_checkpoint(memfs);
+    vfs_mutex_leave(&memfs->journal->lock);
 
     return ret;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// API
-//////////////////////////////////////////////////////////////////////////
-
-int vfs_make_memory(vfs_operations_t** fs)
+int vfs_memfs_sync(vfs_operations_t* fs)
 {
-    vfs_memfs_t* memfs = calloc(1, sizeof(vfs_memfs_t));
-    if (memfs == NULL)
+    int ret;
+    vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
+    if (memfs->journal == NULL)
     {
-        return VFS_ENOMEM;
+        return VFS_EINVAL;
     }
 
-    memfs->op.destroy = _vfs_memfs_destroy;
-    memfs->op.ls = _vfs_memfs_ls;
-    memfs->op.stat = _vfs_memfs_stat;
-    memfs->op.open = _vfs_memfs_open;
-    memfs->op.close = _vfs_memfs_close;
-    memfs->op.truncate = _vfs_memfs_truncate;
-    memfs->op.seek = _vfs_memfs_seek;
-    memfs->op.read = _vfs_memfs_read;
-    memfs->op.write = _vfs_memfs_write;
-    memfs->op.mkdir = _vfs_memfs_mkdir;
-    memfs->op.rmdir = _vfs_memfs_rmdir;
-    memfs->op.unlink = _vfs_memfs_unlink;
-
-    vfs_map_init(&memfs->session_map, _vfs_memfs_common_cmp_session, NULL);
-    vfs_mutex_init(&memfs->session_map_lock);
-
-    vfs_str_t name = vfs_str_from_static1("");
-    if ((memfs->root = _vfs_memfs_common_new_node(NULL, &name, VFS_S_IFDIR)) == NULL)
+    if ((ret = _vfs_memfs_journal_enter(memfs->journal)) != 0)
     {
-        _vfs_memfs_destroy(&memfs->op);
-        return VFS_ENOMEM;
+        return ret;
     }
+    ret = _vfs_memfs_journal_flush(memfs->journal, 1);
+    vfs_mutex_leave(&memfs->journal->lock);
 
-    const vfs_memfs_io_t io = {
-        NULL,
-        _vfs_memfs_read_default,
-        _vfs_memfs_write_default,
-    };
-    vfs_memfs_set_io(&memfs->op, &io);
-
-    *fs = &memfs->op;
-    return 0;
+    return ret;
 }
 
-void vfs_memfs_set_io(vfs_operations_t* fs, const vfs_memfs_io_t* io)
+int vfs_memfs_set_readonly(vfs_operations_t* fs)
 {
+    int busy;
     vfs_memfs_t* memfs = EV_CONTAINER_OF(fs, vfs_memfs_t, op);
-    memfs->io = *io;
+    if (memfs->readonly != NULL)
+    {
+        return 0;
+    }
+    if (memfs->journal != NULL)
+    {
+        return VFS_EINVAL;
+    }
+
+    vfs_mutex_enter(&memfs->session_map_lock);
+    {
+        busy = vfs_map_begin(&memfs->session_map) != NULL;
+    }
+    vfs_mutex_leave(&memfs->session_map_lock);
+    if (busy)
+    {
+        return VFS_EBUSY;
+    }
+
+    return _vfs_memfs_set_readonly(memfs);
 }
@@ -3,6 +3,7 @@
 
 #include "vfs/fs/memfs.h"
 #include "utils/atomic.h"
+#include "utils/list.h"
 #include "utils/map.h"
 #include "utils/mutex.h"
 #include "utils/rwlock.h"
@@ -12,25 +13,209 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Directories with more children than this use a hash index.
+ *
+ * Small directories are searched by a linear scan of the compact children
+ * array, which is faster than hashing when there are only a few entries.
+ */
+#define VFS_MEMFS_DIR_INDEX_THRESHOLD   16
+
+/**
+ * @brief Names shorter than this are stored in the node itself.
+ */
+#define VFS_MEMFS_NAME_INLINE           32
+
+/**
+ * @brief Regular files not larger than this store content in the node itself.
+ */
+#define VFS_MEMFS_INLINE_SIZE           256
+
+/**
+ * @brief Size in bytes of one chunk of file content, must be power of 2.
+ */
+#define VFS_MEMFS_CHUNK_SIZE            4096
+
+/**
+ * @brief The maximum number of free chunks cached by one memfs instance.
+ */
+#define VFS_MEMFS_CHUNK_POOL_MAX        1024
+
+/**
+ * @brief A chunk is kept compressed only if it shrinks to at most this size.
+ */
+#define VFS_MEMFS_COMPRESS_MAX          (VFS_MEMFS_CHUNK_SIZE - VFS_MEMFS_CHUNK_SIZE / 8)
+
+/**
+ * @brief The number of decompressed chunks cached by one memfs instance.
+ */
+#define VFS_MEMFS_ZCACHE_SIZE           8
+
+struct vfs_memfs;
 struct vfs_memfs_node;
+struct vfs_memfs_store;
+
+/**
+ * @brief Hash index of directory children.
+ */
+typedef struct vfs_memfs_dir_index
+{
+    size_t                      cap;                /**< The number of slots, always power of 2. */
+    struct vfs_memfs_node*      slots[];            /**< Open-addressing (linear probing) slots. */
+} vfs_memfs_dir_index_t;
+
+/**
+ * @brief A fixed-size block of file content.
+ *
+ * Chunks may be shared by files of different snapshots and clones. A shared
+ * chunk is never changed, it is copied before write.
+ *
+ * A chunk that is not accessed for a while may be replaced by a compressed
+ * one. A compressed chunk is never changed either, it is decompressed into a
+ * new chunk before write.
+ *
+ * A chunk in a dedup store may be found and referenced by any file with the
+ * same content, so it is taken out of the store before write.
+ */
+typedef struct vfs_memfs_chunk
+{
+    vfs_atomic_t                refcnt;             /**< Reference count. */
+    vfs_atomic_t                atime;              /**< Last access time, in seconds since file system is created. */
+    uint32_t                    zsize;              /**< Size of compressed content, or 0 if content is not compressed. */
+    uint64_t                    hash;               /**< Hash of content, only valid when it is in a dedup store. */
+    struct vfs_memfs_store*     store;              /**< Dedup store that holds this chunk, or NULL. */
+
+    /**
+     * @brief Next free chunk when it is in the pool, or next chunk in the same
+     *   bucket when it is in a dedup store.
+     */
+    struct vfs_memfs_chunk*     next;
+
+    /**
+     * @brief Content.
+     * #VFS_MEMFS_CHUNK_SIZE bytes, or #vfs_memfs_chunk_t::zsize bytes in LZ4
+     * block format if compressed.
+     */
+    uint8_t                     data[];
+} vfs_memfs_chunk_t;
 
+/**
+ * @brief Directory.
+ *
+ * Children are changed under write lock of the directory node, but they can
+ * also be searched without lock in epoch critical section. Such readers
+ * check #vfs_memfs_node_dir_t::seq to detect concurrent changes, and
+ * replaced arrays are reclaimed through epoch.
+ */
 typedef struct vfs_memfs_node_dir
 {
-    struct vfs_memfs_node**     children;           /**< This node's children. */
+    vfs_atomic_t                seq;                /**< Sequence counter, odd while children are being changed. */
+    struct vfs_memfs_node**     children;           /**< This node's children, in no particular order. */
     size_t                      children_sz;        /**< The number of children. */
     size_t                      children_cap;       /**< The capacity of children. */
+
+    /**
+     * @brief Hash index of children.
+     * It is NULL until the directory grows over #VFS_MEMFS_DIR_INDEX_THRESHOLD.
+     */
+    vfs_memfs_dir_index_t*      index;
+
+    /**
+     * @brief Directory that this directory is copied from.
+     * If not NULL, children are not copied yet and this directory has no
+     * children on its own. The origin is a referenced node of a snapshot,
+     * which never changes once it has copied its own origin. A directory of
+     * a snapshot may take a directory of the file system that the snapshot
+     * is taken from as origin, which is copied into the snapshot before it
+     * changes.
+     */
+    struct vfs_memfs_node*      origin;
+
+    /**
+     * @brief File system that owns #vfs_memfs_node_dir_t::origin.
+     * It is referenced, so the origin is always released by its owner.
+     */
+    struct vfs_memfs*           origin_fs;
 } vfs_memfs_node_dir_t;
 
+/**
+ * @brief A locked byte range of regular file.
+ */
+typedef struct vfs_memfs_range
+{
+    ev_list_node_t              node;               /**< Node in #vfs_memfs_range_lock_t::ranges. */
+    uint64_t                    beg;                /**< Start position. */
+    uint64_t                    end;                /**< End position, exclusive. */
+    int                         shared;             /**< Non-zero if readers may share this range. */
+    ev_list_t                   waiters;            /**< Threads waiting for this range to be unlocked. */
+} vfs_memfs_range_t;
+
+/**
+ * @brief Byte range lock of regular file.
+ *
+ * Overlapping ranges are exclusive unless both are shared, so accesses to
+ * disjoint parts of a file do not block each other.
+ */
+typedef struct vfs_memfs_range_lock
+{
+    vfs_mutex_t                 lock;               /**< Protects #vfs_memfs_range_lock_t::ranges. */
+    ev_list_t                   ranges;             /**< Locked ranges, type #vfs_memfs_range_t. */
+} vfs_memfs_range_lock_t;
+
 typedef struct vfs_memfs_node_reg
 {
-    uint8_t*                    data;               /**< File content. '\0' terminal is always appended. */
+    /**
+     * @brief Non-zero if content is stored in #vfs_memfs_node_reg_t::inline_data.
+     * An inline file is never larger than #VFS_MEMFS_INLINE_SIZE and has no
+     * chunk table. A new file starts inline, and it spills into chunks once
+     * it grows larger.
+     */
+    int                         inlined;
+
+    /**
+     * @brief Content of inline file.
+     * Bytes after #vfs_memfs_node_t::stat::st_size, and all bytes if file is
+     * not inline, are always zero.
+     */
+    uint8_t                     inline_data[VFS_MEMFS_INLINE_SIZE];
+
+    /**
+     * @brief File content, if file is not inline.
+     * Chunk `i` holds bytes in range [i * #VFS_MEMFS_CHUNK_SIZE, (i + 1) * #VFS_MEMFS_CHUNK_SIZE).
+     * A NULL chunk, or any chunk after #vfs_memfs_node_reg_t::chunk_sz, is a
+     * hole that reads as zeros. Bytes after #vfs_memfs_node_t::stat::st_size
+     * are always zero.
+     */
+    vfs_memfs_chunk_t**         chunks;
+    size_t                      chunk_sz;           /**< The number of entries in chunk table. */
+    size_t                      chunk_cap;          /**< The capacity of chunk table. */
+
+    /**
+     * @brief Byte range lock for file content.
+     * Always taken before #vfs_memfs_node_t::rwlock. Content in a locked range
+     * may be copied under read lock of node, while changes of chunk table and
+     * file size still require write lock.
+     */
+    vfs_memfs_range_lock_t      range;
 } vfs_memfs_node_reg_t;
 
+/**
+ * @brief File system node.
+ *
+ * When reference count drops to zero the node is reclaimed through epoch, so
+ * #vfs_memfs_node_t::name, #vfs_memfs_node_t::name_hash, the type in
+ * #vfs_memfs_node_t::stat and directory children stay readable in epoch
+ * critical section without reference.
+ */
 typedef struct vfs_memfs_node
 {
     vfs_atomic_t                refcnt;             /**< Reference count. */
-    vfs_rwlock_t                rwlock;             /**< RW lock for everything except refcnt. */
-    vfs_str_t                   name;               /**< The name of this node. */
+    vfs_atomic_t                gen;                /**< Snapshots newer than this generation capture the node before it changes. */
+    vfs_rwlock_t                rwlock;             /**< RW lock for everything except refcnt and gen. */
+    vfs_str_t                   name;               /**< The name of this node, refers to name_buf if it fits. */
+    char                        name_buf[VFS_MEMFS_NAME_INLINE]; /**< Storage of short name. */
+    uint64_t                    name_hash;          /**< Cached hash of #vfs_memfs_node_t::name. */
+    size_t                      dir_pos;            /**< Position in parent's children array. */
     vfs_stat_t                  stat;               /**< The stat of this node. */
     struct vfs_memfs_node*      parent;             /**< This node's parent. */
 
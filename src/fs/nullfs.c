@@ -128,12 +128,27 @@ static int _vfs_nullfs_write_hook(vfs_memfs_session_t* session, const void* buf,
 
     vfs_memfs_node_t* node = session->data.node;
 
+    /*
+     * Nothing is stored, so the file is a hole that grows. Inline content of
+     * such file is all zeros, it is safe to treat it as hole.
+     */
+    node->data.reg.inlined = 0;
+
+    uint64_t end = len;
     if (session->data.fpos != UINT64_MAX)
     {
         session->data.fpos += len;
+        end = session->data.fpos;
+    }
+    else
+    {
+        end += node->stat.st_size;
     }
 
-    node->stat.st_size += len;
+    if (end > node->stat.st_size)
+    {
+        node->stat.st_size = end;
+    }
 
     return (int)len;
 }
@@ -2,12 +2,16 @@
 #include <string.h>
 #include <assert.h>
 #include "vfs/fs/overlayfs.h"
+#include "utils/arena.h"
 #include "utils/atomic.h"
 #include "utils/defs.h"
 #include "utils/strlist.h"
 #include "utils/dir.h"
+#include "utils/list.h"
 #include "utils/map.h"
 #include "utils/mutex.h"
+#include "utils/taskgroup.h"
+#include "utils/threadpool.h"
 
 /**
  * @brief Suffix for whiteout files or directories.
@@ -23,13 +27,47 @@
  *
  * The type of whiteout file (directory) does not matter.
  *
+ * When there are several lower layers, a whiteout in any layer hides the entry
+ * in all layers below it.
+ *
  * If a file (directory) exist in overlay file system, it means:
- * 1. It either exist in the upper layer or in the lower layer.
- * 2. There is no whiteout file for this entry.
+ * 1. It exist in some layer.
+ * 2. There is no whiteout file for this entry in that layer or any layer above.
  */
 #define OVERLAY_WHITEOUT_SUFFIX     ".whiteout"
 #define OVERLAY_WHITEOUT_SUFFIX_SZ  (sizeof(OVERLAY_WHITEOUT_SUFFIX) - 1)
 
+/**
+ * @brief Name of opaque marker.
+ *
+ * An opaque marker is a file in a directory of the upper file system, which
+ * means nothing below the directory should be looked up in the lower file
+ * system.
+ *
+ * A directory created by the overlay file system is always opaque, because
+ * nothing in the lower file system is visible at that path when it is created.
+ * So a directory that is removed and created again hides the old content in
+ * the lower file system, and access below it only cost upper layer I/O.
+ *
+ * The marker itself is never visible in the overlay file system.
+ */
+#define OVERLAY_OPAQUE_MARKER       ".opaque"
+
+/**
+ * @brief Default block size of background copy-up.
+ */
+#define OVERLAY_COPYUP_BLOCK_SIZE   (64 * 1024)
+
+/**
+ * @brief The maximum number of directories whose merged listing is cached.
+ */
+#define OVERLAY_LSCACHE_MAX         1024
+
+/**
+ * @brief The maximum number of indexed directories of each layer.
+ */
+#define OVERLAY_INDEX_MAX           4096
+
 typedef enum vfs_overlayfs_stat_ret
 {
     VFS_OVERLAYFS_STAT_NOENT    = VFS_ENOENT,
@@ -38,12 +76,40 @@ typedef enum vfs_overlayfs_stat_ret
     VFS_OVERLAYFS_STAT_UPPER    = 1,
 } vfs_overlayfs_stat_ret_t;
 
-typedef struct vfs_overlayfs_stat_helper
+/**
+ * @brief A file that is being copied from a lower layer to upper layer.
+ *
+ * The upper file is created with the size of lower file at once, but content
+ * is copied block by block: a block is copied when it is partially written,
+ * and all remaining blocks are copied when the file is closed. Until then
+ * reads of untouched blocks are served from lower layer.
+ */
+typedef struct vfs_overlayfs_copyup
 {
-    vfs_str_t*          basename;
-    int                 found;
-    vfs_stat_t*         info;
-} vfs_overlayfs_stat_helper_t;
+    ev_map_node_t           node;       /**< Node in #vfs_overlayfs_t::copyup_map. */
+    struct vfs_overlayfs*   owner;      /**< The overlay file system. */
+    size_t                  refcnt;     /**< Reference count, protected by #vfs_overlayfs_t::copyup_lock. */
+    int                     finishing;  /**< Non-zero if remaining blocks are being copied, protected by #vfs_overlayfs_t::copyup_lock. */
+    int                     forgotten;  /**< Non-zero if the file is removed and copy-up is out of map, protected by #vfs_overlayfs_t::copyup_lock. */
+    vfs_str_t               path;       /**< Path of the file. */
+
+    /**
+     * @brief Protects fields below, and serializes I/O of all sessions of
+     *   this file.
+     */
+    vfs_mutex_t             lock;
+    vfs_operations_t*       lower;      /**< The lower layer that has the file. */
+    uintptr_t               lower_fh;   /**< Read handle in lower layer. */
+    uintptr_t               upper_fh;   /**< Write handle in upper layer. */
+    uint64_t                total;      /**< Size of lower file. */
+    uint64_t                size;       /**< Bytes before this position might still be in lower layer. */
+    size_t                  block_sz;   /**< Block size. */
+    size_t                  block_cnt;  /**< The number of blocks of lower file. */
+    size_t                  copied_cnt; /**< The number of copied blocks. */
+    int                     errcode;    /**< The first copy error, 0 if none. */
+    uint8_t*                bitmap;     /**< Bit is set if the block is copied. */
+    char*                   buf;        /**< Buffer of one block. */
+} vfs_overlayfs_copyup_t;
 
 typedef struct vfs_overlayfs_session
 {
@@ -58,21 +124,163 @@ typedef struct vfs_overlayfs_session
      * This field is valid as long as #vfs_overlayfs_session_t::fs is not NULL.
      */
     uintptr_t           real;
+
+    /**
+     * @brief Pending copy-up of this file, or NULL.
+     * If not NULL, the file position is tracked in #vfs_overlayfs_session_t::pos
+     * and all I/O goes through the copy-up.
+     */
+    vfs_overlayfs_copyup_t* copyup;
+    uint64_t            flags;      /**< Open flags. */
+    uint64_t            pos;        /**< File position. */
+
+    /**
+     * @brief File path, only set if file is writable in upper layer.
+     * Used to invalidate listing cache of parent directory.
+     */
+    vfs_str_t           path;
 } vfs_overlayfs_session_t;
 
-typedef struct vfs_overlayfs
+/**
+ * @brief Cached state of one name in a directory of a layer.
+ */
+typedef enum vfs_overlayfs_index_flag
 {
-    vfs_operations_t    op;     /**< Base operations. */
+    VFS_OVERLAYFS_INDEX_EXIST       = 0x01, /**< The entry exists in the layer. */
+    VFS_OVERLAYFS_INDEX_WHITEOUT    = 0x02, /**< The entry has a whiteout in the layer. */
+    VFS_OVERLAYFS_INDEX_STAT        = 0x04, /**< #vfs_overlayfs_index_entry_t::info is valid. */
+} vfs_overlayfs_index_flag_t;
+
+typedef struct vfs_overlayfs_index_entry
+{
+    ev_map_node_t       node;       /**< Node in #vfs_overlayfs_index_dir_t::entry_map. */
+    vfs_str_t           name;       /**< Entry name, without whiteout suffix. */
+    int                 flags;      /**< Bit-OR of #vfs_overlayfs_index_flag_t. */
+    vfs_stat_t          info;       /**< Stat of the entry, as listed by the layer. */
+} vfs_overlayfs_index_entry_t;
+
+/**
+ * @brief Index of one directory in a layer.
+ *
+ * It records every name that exists or is whiteout in the directory, so a
+ * lookup can decide which layer to visit without touching any layer.
+ */
+typedef struct vfs_overlayfs_index_dir
+{
+    ev_map_node_t       node;       /**< Node in #vfs_overlayfs_layer_t::index_map. */
+    ev_list_node_t      lru_node;   /**< Node in #vfs_overlayfs_layer_t::index_lru. */
+    vfs_str_t           path;       /**< Directory path. */
+    ev_map_t            entry_map;  /**< Entries, type #vfs_overlayfs_index_entry_t. */
+
+    /**
+     * @brief Non-zero if lower layers are hidden below this directory.
+     * That is the directory has #OVERLAY_OPAQUE_MARKER, or it is not a
+     * directory in this layer.
+     */
+    int                 opaque;
+
+    /**
+     * @brief Non-zero if it is in #vfs_overlayfs_layer_t::index_map.
+     * Otherwise it is only used by the thread that loaded it.
+     * @see #_vfs_overlayfs_index_load_dir().
+     */
+    int                 cached;
+} vfs_overlayfs_index_dir_t;
+
+typedef struct vfs_overlayfs_index_load_helper
+{
+    vfs_overlayfs_index_dir_t*  dir;
+    int                         ret;
+} vfs_overlayfs_index_load_helper_t;
+
+/**
+ * @brief Result of looking up a path in one layer.
+ */
+typedef enum vfs_overlayfs_walk_ret
+{
+    VFS_OVERLAYFS_WALK_FOUND    = 0,    /**< Every component of path exists in the layer. */
+    VFS_OVERLAYFS_WALK_MISSING  = 1,    /**< Path is not in the layer, look up in lower layers. */
+    VFS_OVERLAYFS_WALK_WHITEOUT = 2,    /**< Path or one of its parents is whiteout in the layer. */
+    VFS_OVERLAYFS_WALK_OPAQUE   = 3,    /**< Path is not in the layer, and lower layers are hidden. */
+} vfs_overlayfs_walk_ret_t;
+
+/**
+ * @brief One entry of a cached listing.
+ */
+typedef struct vfs_overlayfs_lscache_item
+{
+    const char*         name;       /**< Name in #vfs_overlayfs_lscache_list_t::arena. */
+    vfs_stat_t          info;       /**< Stat of the entry, as listed by the layer. */
+} vfs_overlayfs_lscache_item_t;
+
+/**
+ * @brief Merged listing of one directory. It never changes once it is built,
+ *   so it can be read without lock.
+ */
+typedef struct vfs_overlayfs_lscache_list
+{
+    vfs_atomic_t                    refcnt;     /**< Reference count. */
+    vfs_arena_t                     arena;      /**< Storage of names. */
+    vfs_overlayfs_lscache_item_t*   items;      /**< Entries, in listing order. */
+    size_t                          size;       /**< The number of entries. */
+    size_t                          capacity;   /**< Capacity of #vfs_overlayfs_lscache_list_t::items. */
+} vfs_overlayfs_lscache_list_t;
+
+/**
+ * @brief Listing cache of one directory.
+ */
+typedef struct vfs_overlayfs_lscache
+{
+    ev_map_node_t                   node;       /**< Node in #vfs_overlayfs_t::lscache_map. */
+    ev_list_node_t                  lru_node;   /**< Node in #vfs_overlayfs_t::lscache_lru, if listing is cached. */
+    vfs_str_t                       path;       /**< Directory path. */
+
+    /**
+     * @brief Generation of directory.
+     * It is bumped on every change of the directory, so a listing that is
+     * built while the directory changes is never cached.
+     */
+    uint64_t                        gen;
+    size_t                          fillers;    /**< The number of listings being built. */
+    vfs_overlayfs_lscache_list_t*   list;       /**< Cached listing, or NULL. */
+} vfs_overlayfs_lscache_t;
+
+/**
+ * @brief One layer of overlay file system.
+ */
+typedef struct vfs_overlayfs_layer
+{
+    vfs_operations_t*   fs;         /**< The file system of this layer. */
+
+    /**
+     * @brief Indexed directories of this layer.
+     * A directory is loaded on first lookup. Lower layers never change, and
+     * upper layer is kept in sync by every change this file system makes.
+     * @see #vfs_overlayfs_index_dir_t.
+     */
+    ev_map_t            index_map;
+
+    /**
+     * @brief Indexed directories, least recently used first.
+     * At most #OVERLAY_INDEX_MAX directories are kept, the evicted one is
+     * loaded again on next lookup.
+     */
+    ev_list_t           index_lru;
 
     /**
-     * @brief The lower file system.
-     * It is always READ ONLY.
+     * @brief Increased by every change recorded in the index of this layer.
      */
-    vfs_operations_t*   lower;
+    uint64_t            index_gen;
+} vfs_overlayfs_layer_t;
+
+typedef struct vfs_overlayfs
+{
+    vfs_operations_t    op;     /**< Base operations. */
 
     /**
      * @brief The upper file system.
-     * All modifications are done in the upper file system.
+     * All modifications are done in the upper file system. It is also the
+     * file system of the first layer.
      */
     vfs_operations_t*   upper;
 
@@ -86,6 +294,71 @@ typedef struct vfs_overlayfs
      * @brief Mutex for #vfs_overlayfs_t::session_map.
      */
     vfs_mutex_t         session_map_lock;
+
+    /**
+     * @brief Mutex for #vfs_overlayfs_layer_t::index_map of all layers.
+     */
+    vfs_mutex_t         index_lock;
+
+    /**
+     * @brief Listing cache of directories.
+     * @see #vfs_overlayfs_lscache_t.
+     */
+    ev_map_t            lscache_map;
+
+    /**
+     * @brief Mutex for #vfs_overlayfs_t::lscache_map.
+     */
+    vfs_mutex_t         lscache_lock;
+
+    /**
+     * @brief Cached listings, least recently used first.
+     * At most #OVERLAY_LSCACHE_MAX listings are kept.
+     */
+    ev_list_t           lscache_lru;
+
+    /**
+     * @brief Files that are being copied to upper layer.
+     * @see #vfs_overlayfs_copyup_t.
+     */
+    ev_map_t            copyup_map;
+
+    /**
+     * @brief Mutex for #vfs_overlayfs_t::copyup_map.
+     */
+    vfs_mutex_t         copyup_lock;
+
+    /**
+     * @brief Block size of copy-up, or 0 if whole file is copied on open.
+     */
+    size_t              copyup_block_sz;
+    int                 copyup_block_auto;  /**< Non-zero if block size is the default one of background copy-up. */
+
+    /**
+     * @brief Workers that copy files in background, or NULL if disabled.
+     */
+    vfs_threadpool_t*   copyup_pool;
+    size_t              copyup_thread_sz;   /**< The number of threads in #vfs_overlayfs_t::copyup_pool. */
+    vfs_atomic_t        copyup_next;        /**< Thread index of next background copy-up. */
+
+    /**
+     * @brief The number of threads that remove a directory tree from upper layer.
+     */
+    size_t              rmdir_thread_sz;
+
+    /**
+     * @brief Workers of #vfs_overlayfs_t::rmdir_thread_sz threads, created on
+     *   first use and kept until destroy.
+     */
+    vfs_threadpool_t*   rmdir_pool;
+    vfs_mutex_t         rmdir_lock; /**< Protects #vfs_overlayfs_t::rmdir_pool, held while it is used. */
+
+    /**
+     * @brief All layers, from top to bottom.
+     * The first layer is the upper layer, others are READ ONLY lower layers.
+     */
+    size_t              layer_sz;
+    vfs_overlayfs_layer_t layers[];
 } vfs_overlayfs_t;
 
 static int _vfs_overlayfs_cmp_session(const ev_map_node_t* key1, const ev_map_node_t* key2, void* arg)
@@ -101,258 +374,1645 @@ static int _vfs_overlayfs_cmp_session(const ev_map_node_t* key1, const ev_map_no
     return session_1->fake < session_2->fake ? -1 : 1;
 }
 
-static int _vfs_overlayfs_common_remove_whiteout_entry(vfs_overlayfs_t* fs, const vfs_str_t* path)
+static int _vfs_overlayfs_cmp_lscache(const ev_map_node_t* key1, const ev_map_node_t* key2, void* arg)
 {
-    int ret;
-    if (fs->upper->unlink == NULL || fs->upper->rmdir == NULL)
+    (void)arg;
+    vfs_overlayfs_lscache_t* cache_1 = EV_CONTAINER_OF(key1, vfs_overlayfs_lscache_t, node);
+    vfs_overlayfs_lscache_t* cache_2 = EV_CONTAINER_OF(key2, vfs_overlayfs_lscache_t, node);
+    return vfs_str_cmp2(&cache_1->path, &cache_2->path);
+}
+
+static int _vfs_overlayfs_cmp_copyup(const ev_map_node_t* key1, const ev_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    vfs_overlayfs_copyup_t* copyup_1 = EV_CONTAINER_OF(key1, vfs_overlayfs_copyup_t, node);
+    vfs_overlayfs_copyup_t* copyup_2 = EV_CONTAINER_OF(key2, vfs_overlayfs_copyup_t, node);
+    return vfs_str_cmp2(&copyup_1->path, &copyup_2->path);
+}
+
+static int _vfs_overlayfs_cmp_index_dir(const ev_map_node_t* key1, const ev_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    vfs_overlayfs_index_dir_t* dir_1 = EV_CONTAINER_OF(key1, vfs_overlayfs_index_dir_t, node);
+    vfs_overlayfs_index_dir_t* dir_2 = EV_CONTAINER_OF(key2, vfs_overlayfs_index_dir_t, node);
+    return vfs_str_cmp2(&dir_1->path, &dir_2->path);
+}
+
+static int _vfs_overlayfs_cmp_index_entry(const ev_map_node_t* key1, const ev_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    vfs_overlayfs_index_entry_t* entry_1 = EV_CONTAINER_OF(key1, vfs_overlayfs_index_entry_t, node);
+    vfs_overlayfs_index_entry_t* entry_2 = EV_CONTAINER_OF(key2, vfs_overlayfs_index_entry_t, node);
+    return vfs_str_cmp2(&entry_1->name, &entry_2->name);
+}
+
+static void _vfs_overlayfs_index_destroy_dir(vfs_overlayfs_index_dir_t* dir)
+{
+    ev_map_node_t* it;
+    while ((it = vfs_map_begin(&dir->entry_map)) != NULL)
     {
-        return VFS_ENOSYS;
+        vfs_overlayfs_index_entry_t* entry = EV_CONTAINER_OF(it, vfs_overlayfs_index_entry_t, node);
+        vfs_map_erase(&dir->entry_map, it);
+        vfs_str_exit(&entry->name);
+        free(entry);
     }
 
-    if ((ret = fs->upper->unlink(fs->upper, path->str)) == 0)
-    {/* unlink success. */
-        return 0;
+    vfs_str_exit(&dir->path);
+    free(dir);
+}
+
+static vfs_overlayfs_index_entry_t* _vfs_overlayfs_index_dir_find(vfs_overlayfs_index_dir_t* dir,
+    const vfs_str_t* name)
+{
+    vfs_overlayfs_index_entry_t tmp_entry;
+    tmp_entry.name = *name;
+
+    ev_map_node_t* it = vfs_map_find(&dir->entry_map, &tmp_entry.node);
+    return it != NULL ? EV_CONTAINER_OF(it, vfs_overlayfs_index_entry_t, node) : NULL;
+}
+
+static int _vfs_overlayfs_index_dir_flags(vfs_overlayfs_index_dir_t* dir, const vfs_str_t* name)
+{
+    vfs_overlayfs_index_entry_t* entry = _vfs_overlayfs_index_dir_find(dir, name);
+    return entry != NULL ? entry->flags : 0;
+}
+
+/**
+ * @brief Set and clear flags of \p name in \p dir.
+ * @param[in] dir - Directory index.
+ * @param[in] name - Entry name.
+ * @param[in] set - Flags to set, bit-OR of #vfs_overlayfs_index_flag_t.
+ * @param[in] clear - Flags to clear, bit-OR of #vfs_overlayfs_index_flag_t.
+ * @return - 0: on success.
+ * @return - VFS_ENOMEM: out of memory.
+ */
+static int _vfs_overlayfs_index_dir_update(vfs_overlayfs_index_dir_t* dir,
+    const vfs_str_t* name, int set, int clear)
+{
+    vfs_overlayfs_index_entry_t* entry = _vfs_overlayfs_index_dir_find(dir, name);
+    if (entry == NULL)
+    {
+        if (set == 0)
+        {
+            return 0;
+        }
+        if ((entry = malloc(sizeof(vfs_overlayfs_index_entry_t))) == NULL)
+        {
+            return VFS_ENOMEM;
+        }
+        entry->name = vfs_str_dup(name);
+        entry->flags = 0;
+        vfs_map_insert(&dir->entry_map, &entry->node);
     }
-    if (ret == VFS_ENOENT)
-    {/* no such file. */
+
+    entry->flags = (entry->flags | set) & ~clear;
+    if (entry->flags == 0)
+    {
+        vfs_map_erase(&dir->entry_map, &entry->node);
+        vfs_str_exit(&entry->name);
+        free(entry);
+    }
+
+    return 0;
+}
+
+static int _vfs_overlayfs_index_load_on_ls(const char* name, const vfs_stat_t* stat, void* data)
+{
+    vfs_overlayfs_index_load_helper_t* helper = data;
+    vfs_str_t name_str = vfs_str_from_static1(name);
+    int flag = VFS_OVERLAYFS_INDEX_EXIST;
+
+    if (strcmp(name, OVERLAY_OPAQUE_MARKER) == 0)
+    {
+        helper->dir->opaque = 1;
         return 0;
     }
-    if (ret != VFS_EISDIR)
-    {/* unknown error. */
-        return ret;
+
+    if (vfs_str_endwith(&name_str, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ))
+    {
+        name_str.len -= OVERLAY_WHITEOUT_SUFFIX_SZ;
+        flag = VFS_OVERLAYFS_INDEX_WHITEOUT;
     }
 
-    if ((ret = fs->upper->rmdir(fs->upper, path->str)) == 0)
+    if (flag == VFS_OVERLAYFS_INDEX_EXIST)
+    {/* Keep stat, so layers without stat() need not list again. */
+        flag |= VFS_OVERLAYFS_INDEX_STAT;
+    }
+    if ((helper->ret = _vfs_overlayfs_index_dir_update(helper->dir, &name_str, flag, 0)) != 0)
     {
-        return 0;
+        return 1;
     }
-    if (ret == VFS_ENOENT)
+    if (flag & VFS_OVERLAYFS_INDEX_STAT)
     {
-        return 0;
+        _vfs_overlayfs_index_dir_find(helper->dir, &name_str)->info = *stat;
     }
-    return ret;
+    return 0;
 }
 
-static int _vfs_overlayfs_common_remove_whiteout(vfs_overlayfs_t* fs, const vfs_str_t* path)
+/**
+ * @brief Find indexed directory.
+ * @note Must be called with #vfs_overlayfs_t::index_lock held.
+ * @param[in] layer - The layer.
+ * @param[in] path - Directory path.
+ * @return The directory index, or NULL if not indexed.
+ */
+static vfs_overlayfs_index_dir_t* _vfs_overlayfs_index_find_dir(vfs_overlayfs_layer_t* layer,
+    const vfs_str_t* path)
 {
-    int ret;
+    vfs_overlayfs_index_dir_t tmp_dir;
+    tmp_dir.path = *path;
 
-    vfs_str_t whiteout = vfs_str_dup(path);
-    vfs_str_append(&whiteout, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ);
+    ev_map_node_t* it = vfs_map_find(&layer->index_map, &tmp_dir.node);
+    if (it == NULL)
     {
-        ret = _vfs_overlayfs_common_remove_whiteout_entry(fs, &whiteout);
+        return NULL;
     }
-    vfs_str_exit(&whiteout);
 
-    return ret;
+    /* Recently used directory is evicted last. */
+    vfs_overlayfs_index_dir_t* dir = EV_CONTAINER_OF(it, vfs_overlayfs_index_dir_t, node);
+    vfs_list_erase(&layer->index_lru, &dir->lru_node);
+    vfs_list_push_back(&layer->index_lru, &dir->lru_node);
+    return dir;
 }
 
-static int _vfs_overlayfs_common_is_parent_exist(vfs_overlayfs_t* fs, const vfs_str_t* path)
+/**
+ * @brief Remove indexed directory \p dir from \p layer and destroy it.
+ * @note Must be called with #vfs_overlayfs_t::index_lock held.
+ * @param[in] layer - The layer.
+ * @param[in] dir - The directory index.
+ */
+static void _vfs_overlayfs_index_drop_dir(vfs_overlayfs_layer_t* layer,
+    vfs_overlayfs_index_dir_t* dir)
 {
-    int ret;
-    vfs_str_t parent = vfs_path_parent(path, NULL);
-    do {
-        vfs_stat_t info;
-        if ((ret = fs->op.stat(&fs->op, parent.str, &info)) != 0)
-        {
-            break;
-        }
-        if (!(info.st_mode & VFS_S_IFDIR))
-        {
-            ret = VFS_ENOTDIR;
-        }
-    } while (0);
-    vfs_str_exit(&parent);
-    return ret;
+    vfs_map_erase(&layer->index_map, &dir->node);
+    vfs_list_erase(&layer->index_lru, &dir->lru_node);
+    _vfs_overlayfs_index_destroy_dir(dir);
 }
 
-static void _vfs_overlayfs_common_acquire_session(vfs_overlayfs_session_t* session)
+/**
+ * @brief Release directory index returned by #_vfs_overlayfs_index_load_dir().
+ * @note Must be called with #vfs_overlayfs_t::index_lock held.
+ * @param[in] dir - The directory index.
+ */
+static void _vfs_overlayfs_index_put_dir(vfs_overlayfs_index_dir_t* dir)
 {
-    (void)vfs_atomic_add(&session->refcnt);
+    if (!dir->cached)
+    {
+        _vfs_overlayfs_index_destroy_dir(dir);
+    }
 }
 
-static void _vfs_overlayfs_common_release_session(vfs_overlayfs_session_t* session)
+/**
+ * @brief Find indexed directory, or load it from the layer.
+ *
+ * The layer is listed with #vfs_overlayfs_t::index_lock released, so a slow
+ * layer does not block lookups of other directories. If the index of the
+ * layer is changed meanwhile, the listing may miss that change, so the
+ * directory is used by the caller only and is not cached.
+ *
+ * @note Must be called with #vfs_overlayfs_t::index_lock held. Directory
+ *   indexes got before the call may be evicted during the call.
+ * @param[in] fs - File system instance.
+ * @param[in] layer - The layer.
+ * @param[in] path - Directory path.
+ * @param[out] dir - The directory index. Release by #_vfs_overlayfs_index_put_dir().
+ * @return - 0: on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_index_load_dir(vfs_overlayfs_t* fs, vfs_overlayfs_layer_t* layer,
+    const vfs_str_t* path, vfs_overlayfs_index_dir_t** dir)
 {
-    if (vfs_atomic_dec(&session->refcnt) != 0)
+    int ret;
+    if ((*dir = _vfs_overlayfs_index_find_dir(layer, path)) != NULL)
     {
-        return;
+        return 0;
+    }
+    if (layer->fs->ls == NULL)
+    {
+        return VFS_ENOSYS;
     }
 
-    if (session->fs != NULL)
+    vfs_overlayfs_index_dir_t* new_dir = malloc(sizeof(vfs_overlayfs_index_dir_t));
+    if (new_dir == NULL)
     {
-        session->fs->close(session->fs, session->real);
-        session->fs = NULL;
+        return VFS_ENOMEM;
     }
-    session->real = 0;
-    free(session);
-}
+    new_dir->path = vfs_str_dup(path);
+    vfs_map_init(&new_dir->entry_map, _vfs_overlayfs_cmp_index_entry, NULL);
+    new_dir->opaque = 0;
+    new_dir->cached = 0;
 
-/**
- * @brief Find session by \p fh file handle. If found, refcnt is increased.
- * @param[in] fs - File system instance.
- * @param[in] fh - File handle.
- * @return Found session, or NULL if not found.
- */
-static vfs_overlayfs_session_t* _vfs_overlayfs_common_find_session(vfs_overlayfs_t* fs, uintptr_t fh)
-{
-    vfs_overlayfs_session_t tmp_session;
-    tmp_session.fake = fh;
+    const uint64_t gen = layer->index_gen;
+    vfs_overlayfs_index_load_helper_t helper = { new_dir, 0 };
+    vfs_mutex_leave(&fs->index_lock);
+    {
+        ret = layer->fs->ls(layer->fs, new_dir->path.str, _vfs_overlayfs_index_load_on_ls, &helper);
+    }
+    vfs_mutex_enter(&fs->index_lock);
 
-    vfs_overlayfs_session_t* session = NULL;
-    vfs_mutex_enter(&fs->session_map_lock);
-    do 
+    if (ret == VFS_ENOENT)
+    {/* Not exist in this layer, so it has no entry. */
+        ret = 0;
+    }
+    else if (ret == VFS_ENOTDIR)
+    {/* A non-directory hides everything below it in lower layers. */
+        new_dir->opaque = 1;
+        ret = 0;
+    }
+    if (ret == 0)
+    {
+        ret = helper.ret;
+    }
+    if (ret != 0)
+    {
+        _vfs_overlayfs_index_destroy_dir(new_dir);
+        return ret;
+    }
+
+    /* Another thread may have loaded the same directory meanwhile. */
+    if ((*dir = _vfs_overlayfs_index_find_dir(layer, path)) != NULL)
+    {
+        _vfs_overlayfs_index_destroy_dir(new_dir);
+        return 0;
+    }
+    *dir = new_dir;
+    if (layer->index_gen != gen)
+    {
+        return 0;
+    }
+
+    /* Evict least recently used directories. */
+    ev_list_node_t* it;
+    while (vfs_list_size(&layer->index_lru) >= OVERLAY_INDEX_MAX
+        && (it = vfs_list_begin(&layer->index_lru)) != NULL)
+    {
+        _vfs_overlayfs_index_drop_dir(layer, EV_CONTAINER_OF(it, vfs_overlayfs_index_dir_t, lru_node));
+    }
+
+    vfs_map_insert(&layer->index_map, &new_dir->node);
+    vfs_list_push_back(&layer->index_lru, &new_dir->lru_node);
+    new_dir->cached = 1;
+    return 0;
+}
+
+static void _vfs_overlayfs_index_cleanup(vfs_overlayfs_layer_t* layer)
+{
+    ev_map_node_t* it;
+    while ((it = vfs_map_begin(&layer->index_map)) != NULL)
+    {
+        vfs_overlayfs_index_dir_t* dir = EV_CONTAINER_OF(it, vfs_overlayfs_index_dir_t, node);
+        _vfs_overlayfs_index_drop_dir(layer, dir);
+    }
+}
+
+/**
+ * @brief Get next component of \p path.
+ * @param[in] path - Path to the file.
+ * @param[in,out] pos - Position to search from. Set to the end of found component.
+ * @param[out] name - The found component, refers to \p path.
+ * @return Non-zero if found.
+ */
+static int _vfs_overlayfs_index_next(const vfs_str_t* path, size_t* pos, vfs_str_t* name)
+{
+    size_t beg = *pos;
+    while (beg < path->len && path->str[beg] == '/')
+    {
+        beg++;
+    }
+
+    size_t end = beg;
+    while (end < path->len && path->str[end] != '/')
+    {
+        end++;
+    }
+
+    if (beg == end)
+    {
+        return 0;
+    }
+
+    *name = vfs_str_from_static(path->str + beg, end - beg);
+    *pos = end;
+    return 1;
+}
+
+/**
+ * @brief Get the directory that contains the component after \p len bytes of \p path.
+ * @return The directory path, refers to \p path.
+ */
+static vfs_str_t _vfs_overlayfs_index_dir_path(const vfs_str_t* path, size_t len)
+{
+    return len == 0 ? vfs_str_from_static1("/") : vfs_str_from_static(path->str, len);
+}
+
+static void _vfs_overlayfs_index_update_entry(vfs_overlayfs_layer_t* layer, const vfs_str_t* path,
+    size_t dir_len, const vfs_str_t* name, int set, int clear)
+{
+    vfs_str_t dir_path = _vfs_overlayfs_index_dir_path(path, dir_len);
+    vfs_overlayfs_index_dir_t* dir = _vfs_overlayfs_index_find_dir(layer, &dir_path);
+    if (dir == NULL)
+    {/* Not indexed yet, it will be loaded from the layer when needed. */
+        return;
+    }
+
+    /* Stat of a changed entry is no longer known. */
+    clear |= VFS_OVERLAYFS_INDEX_STAT;
+    if (_vfs_overlayfs_index_dir_update(dir, name, set, clear) != 0)
+    {/* Drop the directory so it is loaded again. */
+        _vfs_overlayfs_index_drop_dir(layer, dir);
+    }
+}
+
+/**
+ * @brief Record a change made to upper layer.
+ * @param[in] fs - File system instance.
+ * @param[in] path - Path to the changed entry.
+ * @param[in] set - Flags to set, bit-OR of #vfs_overlayfs_index_flag_t.
+ * @param[in] clear - Flags to clear, bit-OR of #vfs_overlayfs_index_flag_t.
+ * @param[in] parents - Non-zero if all parent directories of \p path now exist in upper layer.
+ */
+static void _vfs_overlayfs_index_update(vfs_overlayfs_t* fs, const vfs_str_t* path,
+    int set, int clear, int parents)
+{
+    size_t pos = 0, dir_len = 0;
+    vfs_str_t name;
+
+    vfs_mutex_enter(&fs->index_lock);
+    fs->layers[0].index_gen++;
+    while (_vfs_overlayfs_index_next(path, &pos, &name))
+    {
+        size_t next_pos = pos;
+        vfs_str_t next_name;
+
+        if (!_vfs_overlayfs_index_next(path, &next_pos, &next_name))
+        {
+            _vfs_overlayfs_index_update_entry(&fs->layers[0], path, dir_len, &name, set, clear);
+        }
+        else if (parents)
+        {
+            _vfs_overlayfs_index_update_entry(&fs->layers[0], path, dir_len, &name,
+                VFS_OVERLAYFS_INDEX_EXIST, 0);
+        }
+        dir_len = pos;
+    }
+    vfs_mutex_leave(&fs->index_lock);
+}
+
+/**
+ * @brief Forget stat of \p path in upper layer after its content is changed.
+ * @param[in] fs - File system instance.
+ * @param[in] path - Path to the changed file.
+ */
+static void _vfs_overlayfs_index_drop_stat(vfs_overlayfs_t* fs, const vfs_str_t* path)
+{
+    _vfs_overlayfs_index_update(fs, path, 0, VFS_OVERLAYFS_INDEX_STAT, 0);
+}
+
+/**
+ * @brief Drop upper layer index of directory \p path and all directories under it.
+ * @param[in] fs - File system instance.
+ * @param[in] path - Directory path.
+ */
+static void _vfs_overlayfs_index_forget(vfs_overlayfs_t* fs, const vfs_str_t* path)
+{
+    vfs_overlayfs_layer_t* layer = &fs->layers[0];
+
+    vfs_mutex_enter(&fs->index_lock);
+    layer->index_gen++;
+    ev_map_node_t* it = vfs_map_begin(&layer->index_map);
+    while (it != NULL)
+    {
+        vfs_overlayfs_index_dir_t* dir = EV_CONTAINER_OF(it, vfs_overlayfs_index_dir_t, node);
+        it = vfs_map_next(it);
+
+        if (vfs_str_startwith2(&dir->path, path)
+            && (dir->path.len == path->len || dir->path.str[path->len] == '/'))
+        {
+            _vfs_overlayfs_index_drop_dir(layer, dir);
+        }
+    }
+    vfs_mutex_leave(&fs->index_lock);
+}
+
+/**
+ * @brief Mark directory \p path in upper layer as opaque, if it is indexed.
+ * @param[in] fs - File system instance.
+ * @param[in] path - Directory path.
+ */
+static void _vfs_overlayfs_index_set_opaque(vfs_overlayfs_t* fs, const vfs_str_t* path)
+{
+    vfs_mutex_enter(&fs->index_lock);
+    {
+        fs->layers[0].index_gen++;
+        vfs_overlayfs_index_dir_t* dir = _vfs_overlayfs_index_find_dir(&fs->layers[0], path);
+        if (dir != NULL)
+        {
+            dir->opaque = 1;
+        }
+    }
+    vfs_mutex_leave(&fs->index_lock);
+}
+
+/**
+ * @brief Look up \p path in a layer that has no #vfs_operations_t::ls().
+ *
+ * Such a layer can not be indexed, so for each component the parent
+ * directory is checked for #OVERLAY_OPAQUE_MARKER, and then the component and
+ * its whiteout are checked, all by #vfs_operations_t::stat().
+ *
+ * @param[in] layer - The file system of the layer.
+ * @param[in] path - Path to the file. Encoding in UTF-8.
+ * @param[out] pos - The end of the last checked component.
+ * @param[out] opaque - Non-zero if a parent directory of \p path hides lower layers.
+ * @return #vfs_overlayfs_walk_ret_t, or -errno on error.
+ */
+static int _vfs_overlayfs_stat_walk(vfs_operations_t* layer, const vfs_str_t* path,
+    size_t* pos, int* opaque)
+{
+    int ret = VFS_OVERLAYFS_WALK_FOUND;
+    int is_dir = 1;
+    size_t dir_len = 0;
+    vfs_stat_t info;
+    vfs_str_t name, tmp = VFS_STR_INIT;
+
+    if (layer->stat == NULL)
+    {
+        return VFS_ENOSYS;
+    }
+
+    *pos = 0;
+    *opaque = 0;
+    while (_vfs_overlayfs_index_next(path, pos, &name))
+    {
+        if (!is_dir)
+        {/* A non-directory hides everything below it in lower layers. */
+            *opaque = 1;
+        }
+        else if (!*opaque)
+        {
+            vfs_str_reset(&tmp);
+            vfs_str_append(&tmp, path->str, dir_len);
+            vfs_str_append1(&tmp, "/" OVERLAY_OPAQUE_MARKER);
+            *opaque = layer->stat(layer, tmp.str, &info) == 0;
+        }
+
+        vfs_str_reset(&tmp);
+        vfs_str_append(&tmp, path->str, *pos);
+        if (layer->stat(layer, tmp.str, &info) == 0)
+        {
+            is_dir = (info.st_mode & VFS_S_IFDIR) != 0;
+            dir_len = *pos;
+            continue;
+        }
+
+        vfs_str_append(&tmp, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ);
+        if (layer->stat(layer, tmp.str, &info) == 0)
+        {
+            ret = VFS_OVERLAYFS_WALK_WHITEOUT;
+        }
+        else
+        {/* Not in this layer, so nothing below it is in this layer either. */
+            ret = *opaque ? VFS_OVERLAYFS_WALK_OPAQUE : VFS_OVERLAYFS_WALK_MISSING;
+        }
+        break;
+    }
+
+    vfs_str_exit(&tmp);
+    return ret;
+}
+
+/**
+ * @brief Look up \p path in the index of one layer.
+ * @note Must be called with #vfs_overlayfs_t::index_lock held. The lock is
+ *   released while the layer is accessed.
+ * @param[in] fs - File system instance.
+ * @param[in] layer - The layer.
+ * @param[in] path - Path to the file. Encoding in UTF-8.
+ * @param[out] pos - The end of the last checked component.
+ * @param[out] opaque - Non-zero if a parent directory of \p path hides lower layers.
+ * @return #vfs_overlayfs_walk_ret_t, or -errno on error.
+ */
+static int _vfs_overlayfs_index_walk(vfs_overlayfs_t* fs, vfs_overlayfs_layer_t* layer,
+    const vfs_str_t* path, size_t* pos, int* opaque)
+{
+    int ret;
+    size_t dir_len = 0;
+    vfs_str_t name;
+
+    if (layer->fs->ls == NULL)
+    {
+        vfs_mutex_leave(&fs->index_lock);
+        {
+            ret = _vfs_overlayfs_stat_walk(layer->fs, path, pos, opaque);
+        }
+        vfs_mutex_enter(&fs->index_lock);
+        return ret;
+    }
+
+    *pos = 0;
+    *opaque = 0;
+    while (_vfs_overlayfs_index_next(path, pos, &name))
+    {
+        vfs_overlayfs_index_dir_t* dir;
+        vfs_str_t dir_path = _vfs_overlayfs_index_dir_path(path, dir_len);
+        if ((ret = _vfs_overlayfs_index_load_dir(fs, layer, &dir_path, &dir)) != 0)
+        {
+            return ret;
+        }
+        *opaque = *opaque || dir->opaque;
+
+        int flags = _vfs_overlayfs_index_dir_flags(dir, &name);
+        _vfs_overlayfs_index_put_dir(dir);
+        if (flags & VFS_OVERLAYFS_INDEX_EXIST)
+        {
+            dir_len = *pos;
+            continue;
+        }
+        if (flags & VFS_OVERLAYFS_INDEX_WHITEOUT)
+        {
+            return VFS_OVERLAYFS_WALK_WHITEOUT;
+        }
+
+        /* Not in this layer, so nothing below it is in this layer either. */
+        return *opaque ? VFS_OVERLAYFS_WALK_OPAQUE : VFS_OVERLAYFS_WALK_MISSING;
+    }
+
+    return VFS_OVERLAYFS_WALK_FOUND;
+}
+
+/**
+ * @brief Find the top-most layer that has \p path.
+ *
+ * Each component of \p path is checked against the index of its parent
+ * directory, layer by layer, so no file system is accessed once the
+ * directories are indexed.
+ *
+ * @param[in] fs - The file system working on.
+ * @param[in] path - Path to the file. Encoding in UTF-8.
+ * @param[out] whiteout - The whiteout file name. It is only set when return value is #VFS_OVERLAYFS_STAT_WHITEOUT.
+ * @param[out] layer - Index of the found layer. It is only set when return value is #VFS_OVERLAYFS_STAT_UPPER or #VFS_OVERLAYFS_STAT_LOWER.
+ * @return - VFS_OVERLAYFS_STAT_UPPER: \p path exists in upper layer.
+ * @return - VFS_OVERLAYFS_STAT_LOWER: \p path exists in a lower layer.
+ * @return - VFS_OVERLAYFS_STAT_WHITEOUT: \p path or one of its parents is whiteout in upper layer.
+ * @return - VFS_OVERLAYFS_STAT_NOENT: \p path is not in any layer, or is hidden by a lower layer.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_index_lookup(vfs_overlayfs_t* fs, const vfs_str_t* path,
+    vfs_str_t* whiteout, size_t* layer)
+{
+    int ret = VFS_OVERLAYFS_STAT_NOENT;
+    int opaque;
+    size_t i, pos;
+
+    vfs_mutex_enter(&fs->index_lock);
+    for (i = 0; i < fs->layer_sz; i++)
+    {
+        ret = _vfs_overlayfs_index_walk(fs, &fs->layers[i], path, &pos, &opaque);
+        if (ret == VFS_OVERLAYFS_WALK_MISSING)
+        {
+            ret = VFS_OVERLAYFS_STAT_NOENT;
+            continue;
+        }
+
+        if (ret == VFS_OVERLAYFS_WALK_FOUND)
+        {
+            *layer = i;
+            ret = i == 0 ? VFS_OVERLAYFS_STAT_UPPER : VFS_OVERLAYFS_STAT_LOWER;
+        }
+        else if (ret == VFS_OVERLAYFS_WALK_WHITEOUT && i == 0)
+        {
+            if (whiteout != NULL)
+            {
+                vfs_str_reset(whiteout);
+                vfs_str_append(whiteout, path->str, pos);
+                vfs_str_append(whiteout, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ);
+            }
+            ret = VFS_OVERLAYFS_STAT_WHITEOUT;
+        }
+        else if (ret > 0)
+        {
+            ret = VFS_OVERLAYFS_STAT_NOENT;
+        }
+        break;
+    }
+    vfs_mutex_leave(&fs->index_lock);
+
+    return ret;
+}
+
+/**
+ * @brief Get stat of \p path from the index of \p layer.
+ *
+ * Stat of every entry is recorded when a directory is indexed, so a layer
+ * without #vfs_operations_t::stat() is not listed for each lookup. Once a
+ * change drops the stat of an entry, the parent directory is dropped from the
+ * index and listed again to reload stat of all its entries.
+ *
+ * @param[in] fs - The file system working on.
+ * @param[in] layer - The layer.
+ * @param[in] path - Path to the file. Encoding in UTF-8.
+ * @param[out] info - File stat.
+ * @return - 0: on success.
+ * @return - #VFS_ENOENT: if \p path is not in the layer.
+ * @return - -errno: on other error.
+ */
+static int _vfs_overlayfs_index_stat(vfs_overlayfs_t* fs, vfs_overlayfs_layer_t* layer,
+    const vfs_str_t* path, vfs_stat_t* info)
+{
+    int ret;
+    size_t pos = 0, dir_len = 0, last_len = 0;
+    vfs_str_t name, last_name = VFS_STR_INIT;
+
+    while (_vfs_overlayfs_index_next(path, &pos, &name))
+    {
+        dir_len = last_len;
+        last_len = pos;
+        last_name = name;
+    }
+    if (VFS_STR_IS_EMPTY(&last_name))
+    {/* Root directory is not listed by any directory. */
+        return VFS_ENOENT;
+    }
+
+    vfs_str_t dir_path = _vfs_overlayfs_index_dir_path(path, dir_len);
+    vfs_mutex_enter(&fs->index_lock);
+    for (;;)
+    {
+        vfs_overlayfs_index_dir_t* dir;
+        if ((ret = _vfs_overlayfs_index_load_dir(fs, layer, &dir_path, &dir)) != 0)
+        {
+            break;
+        }
+
+        vfs_overlayfs_index_entry_t* entry = _vfs_overlayfs_index_dir_find(dir, &last_name);
+        if (entry != NULL && (entry->flags & VFS_OVERLAYFS_INDEX_EXIST)
+            && !(entry->flags & VFS_OVERLAYFS_INDEX_STAT) && dir->cached)
+        {/* Stat is dropped by a change, so list the directory again. */
+            _vfs_overlayfs_index_drop_dir(layer, dir);
+            continue;
+        }
+
+        if (entry == NULL || !(entry->flags & VFS_OVERLAYFS_INDEX_STAT))
+        {
+            ret = VFS_ENOENT;
+        }
+        else
+        {
+            *info = entry->info;
+        }
+        _vfs_overlayfs_index_put_dir(dir);
+        break;
+    }
+    vfs_mutex_leave(&fs->index_lock);
+
+    return ret;
+}
+
+static int _vfs_overlayfs_common_remove_entry(vfs_overlayfs_t* fs, const vfs_str_t* path)
+{
+    int ret;
+    if (fs->upper->unlink == NULL || fs->upper->rmdir == NULL)
+    {
+        return VFS_ENOSYS;
+    }
+
+    if ((ret = fs->upper->unlink(fs->upper, path->str)) == 0)
+    {/* unlink success. */
+        return 0;
+    }
+    if (ret == VFS_ENOENT)
+    {/* no such file. */
+        return 0;
+    }
+    if (ret != VFS_EISDIR)
+    {/* unknown error. */
+        return ret;
+    }
+
+    if ((ret = fs->upper->rmdir(fs->upper, path->str)) == 0)
+    {
+        return 0;
+    }
+    if (ret == VFS_ENOENT)
+    {
+        return 0;
+    }
+    return ret;
+}
+
+static int _vfs_overlayfs_common_remove_whiteout_entry(vfs_overlayfs_t* fs, const vfs_str_t* path)
+{
+    int ret = _vfs_overlayfs_common_remove_entry(fs, path);
+    if (ret == 0)
+    {
+        vfs_str_t name = vfs_str_from_static(path->str, path->len - OVERLAY_WHITEOUT_SUFFIX_SZ);
+        _vfs_overlayfs_index_update(fs, &name, 0, VFS_OVERLAYFS_INDEX_WHITEOUT, 0);
+    }
+    return ret;
+}
+
+static int _vfs_overlayfs_common_remove_whiteout(vfs_overlayfs_t* fs, const vfs_str_t* path)
+{
+    int ret;
+
+    vfs_str_t whiteout = vfs_str_dup(path);
+    vfs_str_append(&whiteout, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ);
+    {
+        ret = _vfs_overlayfs_common_remove_whiteout_entry(fs, &whiteout);
+    }
+    vfs_str_exit(&whiteout);
+
+    return ret;
+}
+
+static int _vfs_overlayfs_common_is_parent_exist(vfs_overlayfs_t* fs, const vfs_str_t* path)
+{
+    int ret;
+    vfs_str_t parent = vfs_path_parent(path, NULL);
+    do {
+        vfs_stat_t info;
+        if ((ret = fs->op.stat(&fs->op, parent.str, &info)) != 0)
+        {
+            break;
+        }
+        if (!(info.st_mode & VFS_S_IFDIR))
+        {
+            ret = VFS_ENOTDIR;
+        }
+    } while (0);
+    vfs_str_exit(&parent);
+    return ret;
+}
+
+/**
+ * @brief Read from \p pos of file.
+ * @return - The number of bytes read on success.
+ * @return - #VFS_EOF: if \p pos is at or after end of file.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_common_pread(vfs_operations_t* fs, uintptr_t fh, uint64_t pos,
+    void* buf, size_t len)
+{
+    int64_t ret = fs->seek(fs, fh, (int64_t)pos, VFS_SEEK_SET);
+    if (ret < 0)
+    {
+        return (int)ret;
+    }
+    return fs->read(fs, fh, buf, len);
+}
+
+/**
+ * @brief Write at \p pos of file.
+ * @return - The number of bytes written on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_common_pwrite(vfs_operations_t* fs, uintptr_t fh, uint64_t pos,
+    const void* buf, size_t len)
+{
+    int64_t ret = fs->seek(fs, fh, (int64_t)pos, VFS_SEEK_SET);
+    if (ret < 0)
+    {
+        return (int)ret;
+    }
+    return fs->write(fs, fh, buf, len);
+}
+
+/**
+ * @brief Copy from current position of \p src_fh to \p dst_fh, until \p len
+ *   bytes are copied or end of file is reached.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_common_copy_range(vfs_operations_t* src, uintptr_t src_fh,
+    vfs_operations_t* dst, uintptr_t dst_fh, char* buf, uint64_t len)
+{
+    while (len != 0)
+    {
+        size_t batch = len < OVERLAY_COPYUP_BLOCK_SIZE ? (size_t)len : OVERLAY_COPYUP_BLOCK_SIZE;
+        int read_sz = src->read(src, src_fh, buf, batch);
+        if (read_sz == VFS_EOF)
+        {
+            break;
+        }
+        if (read_sz < 0)
+        {
+            return read_sz;
+        }
+
+        int write_sz = dst->write(dst, dst_fh, buf, read_sz);
+        if (write_sz < 0)
+        {
+            return write_sz;
+        }
+        if (write_sz != read_sz)
+        {
+            return VFS_EIO;
+        }
+        len -= read_sz;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Copy data extents of \p src_fh to \p dst_fh.
+ * @note Both files must be at start, and \p dst_fh must be empty.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_common_copy_extents(vfs_operations_t* src, uintptr_t src_fh,
+    vfs_operations_t* dst, uintptr_t dst_fh, char* buf, int64_t size, int64_t beg)
+{
+    int ret;
+    int64_t end, pos;
+    while (beg != VFS_ENXIO)
+    {
+        if (beg < 0)
+        {
+            return (int)beg;
+        }
+        if ((end = src->seek(src, src_fh, beg, VFS_SEEK_HOLE)) < 0)
+        {
+            return (int)end;
+        }
+
+        if ((pos = src->seek(src, src_fh, beg, VFS_SEEK_SET)) < 0
+            || (pos = dst->seek(dst, dst_fh, beg, VFS_SEEK_SET)) < 0)
+        {
+            return (int)pos;
+        }
+        if ((ret = _vfs_overlayfs_common_copy_range(src, src_fh, dst, dst_fh, buf,
+            (uint64_t)(end - beg))) != 0)
+        {
+            return ret;
+        }
+
+        beg = src->seek(src, src_fh, end, VFS_SEEK_DATA);
+    }
+
+    /* Holes at the end are not copied. */
+    return dst->truncate(dst, dst_fh, (uint64_t)size);
+}
+
+/**
+ * @brief Copy whole content of \p src_fh to \p dst_fh.
+ *
+ * If both file systems are able to seek, and \p src knows #VFS_SEEK_DATA,
+ * only data extents are copied and holes stay holes in \p dst_fh. Otherwise
+ * the file is copied from start to end.
+ *
+ * @note Both files must be at start, and \p dst_fh must be empty.
+ * @param[in] src - Source file system.
+ * @param[in] src_fh - Source file handle.
+ * @param[in] dst - Destination file system.
+ * @param[in] dst_fh - Destination file handle.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_common_copy(vfs_operations_t* src, uintptr_t src_fh,
+    vfs_operations_t* dst, uintptr_t dst_fh)
+{
+    int ret;
+    int64_t size = -1, beg = -1;
+
+    char* buf = malloc(OVERLAY_COPYUP_BLOCK_SIZE);
+    if (buf == NULL)
+    {
+        return VFS_ENOMEM;
+    }
+
+    if (src->seek != NULL && dst->seek != NULL && dst->truncate != NULL
+        && (size = src->seek(src, src_fh, 0, VFS_SEEK_END)) >= 0
+        && ((beg = src->seek(src, src_fh, 0, VFS_SEEK_DATA)) >= 0 || beg == VFS_ENXIO))
+    {
+        ret = _vfs_overlayfs_common_copy_extents(src, src_fh, dst, dst_fh, buf, size, beg);
+    }
+    else
+    {
+        /* Position might be moved while probing. */
+        if ((ret = size >= 0 ? (int)src->seek(src, src_fh, 0, VFS_SEEK_SET) : 0) == 0)
+        {
+            ret = _vfs_overlayfs_common_copy_range(src, src_fh, dst, dst_fh, buf, UINT64_MAX);
+        }
+    }
+
+    free(buf);
+    return ret;
+}
+
+static int _vfs_overlayfs_copyup_is_copied(const vfs_overlayfs_copyup_t* copyup, uint64_t block)
+{
+    if (block >= copyup->block_cnt)
+    {
+        return 1;
+    }
+    return (copyup->bitmap[block / 8] >> (block % 8)) & 0x01;
+}
+
+static void _vfs_overlayfs_copyup_set_copied(vfs_overlayfs_copyup_t* copyup, uint64_t block)
+{
+    if (_vfs_overlayfs_copyup_is_copied(copyup, block))
+    {
+        return;
+    }
+    copyup->bitmap[block / 8] |= (uint8_t)(1 << (block % 8));
+    copyup->copied_cnt++;
+}
+
+/**
+ * @brief Drop lower content, so nothing is copied any more.
+ * @note Must be called with #vfs_overlayfs_copyup_t::lock held.
+ * @param[in] copyup - Copy-up.
+ */
+static void _vfs_overlayfs_copyup_discard(vfs_overlayfs_copyup_t* copyup)
+{
+    size_t i;
+    for (i = 0; i < copyup->block_cnt; i++)
+    {
+        _vfs_overlayfs_copyup_set_copied(copyup, i);
+    }
+    copyup->size = 0;
+}
+
+/**
+ * @brief Copy one block from lower layer to upper layer.
+ * @note Must be called with #vfs_overlayfs_copyup_t::lock held.
+ * @param[in] copyup - Copy-up.
+ * @param[in] block - Block index.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_copyup_block(vfs_overlayfs_copyup_t* copyup, uint64_t block)
+{
+    if (_vfs_overlayfs_copyup_is_copied(copyup, block))
+    {
+        return 0;
+    }
+
+    /* Bytes after #vfs_overlayfs_copyup_t::size are not from lower layer. */
+    const uint64_t beg = block * copyup->block_sz;
+    const uint64_t end = beg + copyup->block_sz < copyup->size ? beg + copyup->block_sz : copyup->size;
+
+    size_t total = 0;
+    while (beg + total < end)
+    {
+        int ret = _vfs_overlayfs_common_pread(copyup->lower, copyup->lower_fh, beg + total,
+            copyup->buf + total, (size_t)(end - beg - total));
+        if (ret == VFS_EOF)
+        {
+            break;
+        }
+        if (ret < 0)
+        {
+            return ret;
+        }
+        total += ret;
+    }
+
+    if (total != 0)
+    {
+        vfs_operations_t* upper = copyup->owner->upper;
+        int ret = _vfs_overlayfs_common_pwrite(upper, copyup->upper_fh, beg, copyup->buf, total);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        if ((size_t)ret != total)
+        {
+            return VFS_EIO;
+        }
+    }
+
+    _vfs_overlayfs_copyup_set_copied(copyup, block);
+    return 0;
+}
+
+/**
+ * @brief Copy all remaining blocks to upper layer.
+ *
+ * The result is kept in #vfs_overlayfs_copyup_t::errcode.
+ *
+ * @param[in] copyup - Copy-up.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_copyup_flush(vfs_overlayfs_copyup_t* copyup)
+{
+    int ret = 0;
+    size_t i;
+
+    vfs_mutex_enter(&copyup->lock);
+    for (i = 0; i < copyup->block_cnt && copyup->copied_cnt < copyup->block_cnt; i++)
+    {
+        if ((ret = _vfs_overlayfs_copyup_block(copyup, i)) != 0)
+        {
+            break;
+        }
+    }
+    /* Once every block is copied, an earlier error no longer matters. */
+    copyup->errcode = ret;
+    vfs_mutex_leave(&copyup->lock);
+
+    return ret;
+}
+
+static void _vfs_overlayfs_copyup_destroy(vfs_overlayfs_copyup_t* copyup)
+{
+    vfs_operations_t* upper = copyup->owner->upper;
+    if (copyup->lower_fh != 0)
+    {
+        copyup->lower->close(copyup->lower, copyup->lower_fh);
+    }
+    if (copyup->upper_fh != 0)
+    {
+        upper->close(upper, copyup->upper_fh);
+    }
+    vfs_mutex_exit(&copyup->lock);
+    vfs_str_exit(&copyup->path);
+    free(copyup->bitmap);
+    free(copyup->buf);
+    free(copyup);
+}
+
+/**
+ * @brief Drop one reference of copy-up.
+ *
+ * Remaining blocks are copied when the last reference is dropped, and the
+ * copy-up stays in #vfs_overlayfs_t::copyup_map until then, so once it is
+ * removed the upper file is complete. If copy fails, it stays in the map
+ * without reference, so reads still fall back to lower layer and next
+ * release tries again. If the file is removed meanwhile, the copy-up is
+ * already out of the map and the last release just destroys it.
+ *
+ * @param[in] copyup - Copy-up.
+ * @return - 0: on success.
+ * @return - -errno: if remaining blocks can not be copied.
+ */
+static int _vfs_overlayfs_copyup_release(vfs_overlayfs_copyup_t* copyup)
+{
+    int ret, finish, drop;
+    vfs_overlayfs_t* fs = copyup->owner;
+
+    vfs_mutex_enter(&fs->copyup_lock);
+    {
+        /* Only one thread finishes the copy-up, and a removed file needs no copy. */
+        finish = (--copyup->refcnt == 0 && !copyup->finishing);
+        if ((drop = (finish && copyup->forgotten)) == 0 && finish)
+        {
+            copyup->finishing = 1;
+        }
+    }
+    vfs_mutex_leave(&fs->copyup_lock);
+
+    if (drop)
+    {
+        _vfs_overlayfs_copyup_destroy(copyup);
+        return 0;
+    }
+    if (!finish)
+    {
+        return 0;
+    }
+
+    /* The file may be opened again while copying. */
+    ret = _vfs_overlayfs_copyup_flush(copyup);
+
+    vfs_mutex_enter(&fs->copyup_lock);
+    {
+        finish = (copyup->refcnt == 0 && (ret == 0 || copyup->forgotten));
+        if (finish && !copyup->forgotten)
+        {
+            vfs_map_erase(&fs->copyup_map, &copyup->node);
+        }
+        copyup->finishing = 0;
+    }
+    vfs_mutex_leave(&fs->copyup_lock);
+
+    if (finish)
+    {
+        _vfs_overlayfs_copyup_destroy(copyup);
+    }
+    return ret;
+}
+
+/**
+ * @brief Find pending copy-up of \p path. If found, refcnt is increased.
+ * @param[in] fs - File system instance.
+ * @param[in] path - File path.
+ * @return Found copy-up, or NULL if not found.
+ */
+static vfs_overlayfs_copyup_t* _vfs_overlayfs_copyup_find(vfs_overlayfs_t* fs,
+    const vfs_str_t* path)
+{
+    vfs_overlayfs_copyup_t tmp_copyup;
+    tmp_copyup.path = *path;
+
+    vfs_overlayfs_copyup_t* copyup = NULL;
+    vfs_mutex_enter(&fs->copyup_lock);
+    {
+        ev_map_node_t* it = vfs_map_find(&fs->copyup_map, &tmp_copyup.node);
+        if (it != NULL)
+        {
+            copyup = EV_CONTAINER_OF(it, vfs_overlayfs_copyup_t, node);
+            copyup->refcnt++;
+        }
+    }
+    vfs_mutex_leave(&fs->copyup_lock);
+
+    return copyup;
+}
+
+/**
+ * @brief Drop copy-ups of \p path and anything under it.
+ *
+ * Once the upper file is removed, a new file of the same path must not reuse
+ * the old copy-up. Copy-ups without reference are destroyed at once, others
+ * are marked as forgotten and destroyed by the last release.
+ *
+ * @param[in] fs - File system instance.
+ * @param[in] path - Path to the removed file or directory.
+ */
+static void _vfs_overlayfs_copyup_forget(vfs_overlayfs_t* fs, const vfs_str_t* path)
+{
+    vfs_mutex_enter(&fs->copyup_lock);
+    ev_map_node_t* it = vfs_map_begin(&fs->copyup_map);
+    while (it != NULL)
+    {
+        vfs_overlayfs_copyup_t* copyup = EV_CONTAINER_OF(it, vfs_overlayfs_copyup_t, node);
+        it = vfs_map_next(it);
+
+        if (vfs_str_startwith2(&copyup->path, path)
+            && (copyup->path.len == path->len || copyup->path.str[path->len] == '/'))
+        {
+            vfs_map_erase(&fs->copyup_map, &copyup->node);
+            if (copyup->refcnt == 0 && !copyup->finishing)
+            {
+                _vfs_overlayfs_copyup_destroy(copyup);
+            }
+            else
+            {
+                copyup->forgotten = 1;
+            }
+        }
+    }
+    vfs_mutex_leave(&fs->copyup_lock);
+}
+
+static void _vfs_overlayfs_common_acquire_session(vfs_overlayfs_session_t* session)
+{
+    (void)vfs_atomic_add(&session->refcnt);
+}
+
+static void _vfs_overlayfs_common_release_session(vfs_overlayfs_session_t* session)
+{
+    if (vfs_atomic_dec(&session->refcnt) != 0)
+    {
+        return;
+    }
+
+    if (session->fs != NULL)
+    {
+        session->fs->close(session->fs, session->real);
+        session->fs = NULL;
+    }
+    session->real = 0;
+    vfs_str_exit(&session->path);
+
+    if (session->copyup != NULL)
+    {
+        _vfs_overlayfs_copyup_release(session->copyup);
+        session->copyup = NULL;
+    }
+    free(session);
+}
+
+/**
+ * @brief Find session by \p fh file handle. If found, refcnt is increased.
+ * @param[in] fs - File system instance.
+ * @param[in] fh - File handle.
+ * @return Found session, or NULL if not found.
+ */
+static vfs_overlayfs_session_t* _vfs_overlayfs_common_find_session(vfs_overlayfs_t* fs, uintptr_t fh)
+{
+    vfs_overlayfs_session_t tmp_session;
+    tmp_session.fake = fh;
+
+    vfs_overlayfs_session_t* session = NULL;
+    vfs_mutex_enter(&fs->session_map_lock);
+    do 
+    {
+        ev_map_node_t* it = vfs_map_find(&fs->session_map, &tmp_session.node);
+        if (it == NULL)
+        {
+            break;
+        }
+        session = EV_CONTAINER_OF(it, vfs_overlayfs_session_t, node);
+        _vfs_overlayfs_common_acquire_session(session);
+    } while (0);
+    vfs_mutex_leave(&fs->session_map_lock);
+
+    return session;
+}
+
+/**
+ * @brief Check if the last component of \p path is #OVERLAY_OPAQUE_MARKER.
+ *
+ * The marker is never visible in overlay file system, so it can not be
+ * created through it either.
+ *
+ * @param[in] path - Path to the file. Encoding in UTF-8.
+ * @return Non-zero if \p path names an opaque marker.
+ */
+static int _vfs_overlayfs_common_is_marker(const vfs_str_t* path)
+{
+    return vfs_str_endwith(path, "/" OVERLAY_OPAQUE_MARKER, sizeof(OVERLAY_OPAQUE_MARKER));
+}
+
+/**
+ * @brief Wrapper for #vfs_operations_t::stat().
+ *
+ * The upper layer and lower layer might not implement #vfs_operations_t::stat()
+ * but does have #vfs_operations_t::ls(), so in that case stat is taken from
+ * the index of the layer.
+ */
+static int _vfs_overlayfs_common_stat_wrap(vfs_overlayfs_t* fs, vfs_overlayfs_layer_t* layer,
+    const vfs_str_t* path, vfs_stat_t* info)
+{
+    /* Try use #vfs_operations_t::stat() if possible. */
+    if (layer->fs->stat != NULL)
+    {
+        return layer->fs->stat(layer->fs, path->str, info);
+    }
+
+    /* Then try #vfs_operations_t::ls(). */
+    if (layer->fs->ls == NULL)
+    {
+        return VFS_ENOSYS;
+    }
+
+    return _vfs_overlayfs_index_stat(fs, layer, path, info);
+}
+
+/**
+ * @brief Extended stat function for overlayfs.
+ *
+ * The layer is decided by #_vfs_overlayfs_index_lookup(), so at most one file
+ * system is asked for the stat.
+ *
+ * @see #vfs_overlayfs_stat_ret_t.
+ * @param[in] fs - The file system working on.
+ * @param[in] path - Path to the file. Encoding in UTF-8.
+ * @param[out] info - File stat.
+ * @param[out] whiteout - The whiteout file name. It is only set when return value is #VFS_OVERLAYFS_STAT_WHITEOUT.
+ * @param[out] layer - The layer that has the file. It is only set when return value is #VFS_OVERLAYFS_STAT_LOWER.
+ * @return - VFS_OVERLAYFS_STAT_UPPER: The file exists in the upper file system.
+ * @return - VFS_OVERLAYFS_STAT_LOWER: The file exists in a lower file system.
+ * @return - VFS_OVERLAYFS_STAT_WHITEOUT: The file exist in a lower file system but whiteout in upper file system.
+ * @return - VFS_OVERLAYFS_STAT_NOENT: The file does not exist in any file system.
+ * @return - -errno: on other error.
+ */
+static int _vfs_overlayfs_common_stat_ex(vfs_overlayfs_t* fs, const vfs_str_t* path,
+    vfs_stat_t* info, vfs_str_t* whiteout, vfs_operations_t** layer)
+{
+    size_t idx = 0;
+    int ret = _vfs_overlayfs_index_lookup(fs, path, whiteout, &idx);
+    switch (ret)
+    {
+    case VFS_OVERLAYFS_STAT_UPPER:
+    case VFS_OVERLAYFS_STAT_LOWER:
+        if (_vfs_overlayfs_common_stat_wrap(fs, &fs->layers[idx], path, info) != 0)
+        {
+            return VFS_OVERLAYFS_STAT_NOENT;
+        }
+        if (layer != NULL)
+        {
+            *layer = fs->layers[idx].fs;
+        }
+        return ret;
+
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+static int _vfs_overlayfs_common_fh(vfs_overlayfs_t* fs, uintptr_t fh,
+    int (*cb)(vfs_overlayfs_session_t* session, void* data), void* data)
+{
+    int ret;
+    vfs_overlayfs_session_t* session = _vfs_overlayfs_common_find_session(fs, fh);
+    if (session == NULL)
+    {
+        return VFS_EBADF;
+    }
+
+    ret = cb(session, data);
+    _vfs_overlayfs_common_release_session(session);
+
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// listing cache
+//////////////////////////////////////////////////////////////////////////
+
+static void _vfs_overlayfs_lscache_release_list(vfs_overlayfs_lscache_list_t* list)
+{
+    if (vfs_atomic_dec(&list->refcnt) != 0)
+    {
+        return;
+    }
+
+    vfs_arena_exit(&list->arena);
+    free(list->items);
+    free(list);
+}
+
+static int _vfs_overlayfs_lscache_append(vfs_overlayfs_lscache_list_t* list,
+    const char* name, const vfs_stat_t* info)
+{
+    if (list->size == list->capacity)
+    {
+        size_t new_capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        vfs_overlayfs_lscache_item_t* new_items = realloc(list->items,
+            sizeof(vfs_overlayfs_lscache_item_t) * new_capacity);
+        if (new_items == NULL)
+        {
+            return VFS_ENOMEM;
+        }
+        list->items = new_items;
+        list->capacity = new_capacity;
+    }
+
+    vfs_overlayfs_lscache_item_t* item = &list->items[list->size];
+    if ((item->name = vfs_arena_strdup(&list->arena, name, strlen(name))) == NULL)
+    {
+        return VFS_ENOMEM;
+    }
+    item->info = *info;
+    list->size++;
+
+    return 0;
+}
+
+/**
+ * @brief Drop cached listing of \p cache, and the entry itself if nobody is
+ *   building a listing for it.
+ * @note Must be called with #vfs_overlayfs_t::lscache_lock held.
+ */
+static void _vfs_overlayfs_lscache_drop(vfs_overlayfs_t* fs, vfs_overlayfs_lscache_t* cache)
+{
+    if (cache->list != NULL)
+    {
+        _vfs_overlayfs_lscache_release_list(cache->list);
+        cache->list = NULL;
+        vfs_list_erase(&fs->lscache_lru, &cache->lru_node);
+    }
+
+    if (cache->fillers == 0)
     {
-        ev_map_node_t* it = vfs_map_find(&fs->session_map, &tmp_session.node);
-        if (it == NULL)
-        {
-            break;
-        }
-        session = EV_CONTAINER_OF(it, vfs_overlayfs_session_t, node);
-        _vfs_overlayfs_common_acquire_session(session);
-    } while (0);
-    vfs_mutex_leave(&fs->session_map_lock);
+        vfs_map_erase(&fs->lscache_map, &cache->node);
+        vfs_str_exit(&cache->path);
+        free(cache);
+    }
+}
 
-    return session;
+static vfs_overlayfs_lscache_t* _vfs_overlayfs_lscache_find(vfs_overlayfs_t* fs,
+    const vfs_str_t* path)
+{
+    vfs_overlayfs_lscache_t tmp_cache;
+    tmp_cache.path = *path;
+
+    ev_map_node_t* it = vfs_map_find(&fs->lscache_map, &tmp_cache.node);
+    return it != NULL ? EV_CONTAINER_OF(it, vfs_overlayfs_lscache_t, node) : NULL;
 }
 
-static int _vfs_overlayfs_common_stat_wrap_ls(const char* name, const vfs_stat_t* stat, void* data)
+/**
+ * @brief Bump generation of directory \p path.
+ * @note Must be called with #vfs_overlayfs_t::lscache_lock held.
+ */
+static void _vfs_overlayfs_lscache_bump(vfs_overlayfs_t* fs, const vfs_str_t* path)
 {
-    vfs_overlayfs_stat_helper_t* helper = data;
+    vfs_overlayfs_lscache_t* cache = _vfs_overlayfs_lscache_find(fs, path);
+    if (cache != NULL)
+    {
+        cache->gen++;
+        _vfs_overlayfs_lscache_drop(fs, cache);
+    }
+}
 
-    if (strcmp(helper->basename->str, name) != 0)
+/**
+ * @brief Check if \p path is in the form that cache uses as key, that is,
+ *   absolute path without empty component or trailing slash.
+ */
+static int _vfs_overlayfs_lscache_is_canonical(const vfs_str_t* path)
+{
+    size_t i;
+    if (path->len == 0 || path->str[0] != '/')
+    {
+        return 0;
+    }
+    if (path->len == 1)
+    {
+        return 1;
+    }
+    if (path->str[path->len - 1] == '/')
     {
         return 0;
     }
 
-    helper->found = 1;
-    memcpy(helper->info, stat, sizeof(*stat));
+    for (i = 1; i < path->len; i++)
+    {
+        if (path->str[i] == '/' && path->str[i - 1] == '/')
+        {
+            return 0;
+        }
+    }
     return 1;
 }
 
 /**
- * @brief Wrapper for #vfs_operations_t::stat().
- *
- * The upper layer and lower layer might not implement #vfs_operations_t::stat()
- * but does have #vfs_operations_t::ls(), so in that case we use ls() if stat()
- * is not implemented.
+ * @brief Invalidate cached listings affected by a change of \p path.
+ * @note Must be called after the change is done.
+ * @param[in] fs - File system instance.
+ * @param[in] path - Changed path.
+ * @param[in] ancestors - Non-zero to invalidate all ancestors of \p path, for
+ *   changes that may create parent directories in upper layer. Otherwise
+ *   only parent of \p path is invalidated.
+ * @param[in] self - Non-zero to also invalidate \p path as a directory.
  */
-static int _vfs_overlayfs_common_stat_wrap(vfs_operations_t* fs, const vfs_str_t* path, vfs_stat_t* info)
+static void _vfs_overlayfs_lscache_invalidate(vfs_overlayfs_t* fs, const vfs_str_t* path,
+    int ancestors, int self)
 {
-    int ret;
+    vfs_str_t name;
+    vfs_str_t canonical = VFS_STR_INIT;
+    size_t pos = 0, dir_len = 0, parent_len = 0;
+    int has_parent = 0;
 
-    /* Try use #vfs_operations_t::stat() if possible. */
-    if (fs->stat != NULL)
+    vfs_mutex_enter(&fs->lscache_lock);
+    if (vfs_map_size(&fs->lscache_map) == 0)
     {
-        return fs->stat(fs, path->str, info);
+        goto finish;
     }
 
-    /* Then try #vfs_operations_t::ls(). */
-    if (fs->ls == NULL)
+    if (!_vfs_overlayfs_lscache_is_canonical(path))
     {
-        return VFS_ENOSYS;
+        while (_vfs_overlayfs_index_next(path, &pos, &name))
+        {
+            vfs_str_append(&canonical, "/", 1);
+            vfs_str_append(&canonical, name.str, name.len);
+        }
+        if (canonical.len == 0)
+        {
+            vfs_str_append(&canonical, "/", 1);
+        }
+        path = &canonical;
+        pos = 0;
     }
 
-    /* Get parent directory. */
-    vfs_str_t basename = VFS_STR_INIT;
-    vfs_str_t parent = vfs_path_parent(path, &basename);
-    if (parent.len == 0)
+    while (_vfs_overlayfs_index_next(path, &pos, &name))
     {
-        vfs_str_reset(&parent);
-        vfs_str_append2(&parent, path);
+        if (ancestors)
+        {
+            vfs_str_t dir_path = _vfs_overlayfs_index_dir_path(path, dir_len);
+            _vfs_overlayfs_lscache_bump(fs, &dir_path);
+        }
+        parent_len = dir_len;
+        has_parent = 1;
+        dir_len = pos;
     }
 
-    vfs_overlayfs_stat_helper_t helper = { &basename, 0, info };
-    ret = fs->ls(fs, parent.str, _vfs_overlayfs_common_stat_wrap_ls, &helper);
-    vfs_str_exit(&basename);
-    vfs_str_exit(&parent);
-
-    if (ret != 0)
+    if (!ancestors && has_parent)
     {
-        return ret;
+        vfs_str_t dir_path = _vfs_overlayfs_index_dir_path(path, parent_len);
+        _vfs_overlayfs_lscache_bump(fs, &dir_path);
     }
-    if (!helper.found)
+    if (self)
     {
-        return VFS_ENOENT;
+        vfs_str_t dir_path = _vfs_overlayfs_index_dir_path(path, dir_len);
+        _vfs_overlayfs_lscache_bump(fs, &dir_path);
     }
-    return 0;
+
+finish:
+    vfs_mutex_leave(&fs->lscache_lock);
+    vfs_str_exit(&canonical);
 }
 
 /**
- * @brief Extended stat function for overlayfs.
- * @see #vfs_overlayfs_stat_ret_t.
- * @param[in] fs - The file system working on.
- * @param[in] path - Path to the file. Encoding in UTF-8.
- * @param[out] info - File stat.
- * @param[out] whiteout - The whiteout file name. It is only set when return value is #VFS_OVERLAYFS_STAT_WHITEOUT.
- * @return - VFS_OVERLAYFS_STAT_UPPER: The file exists in the upper file system.
- * @return - VFS_OVERLAYFS_STAT_LOWER: The file exists in the lower file system.
- * @return - VFS_OVERLAYFS_STAT_WHITEOUT: The file exist in the lower file system but whiteout in upper file system.
- * @return - VFS_OVERLAYFS_STAT_NOENT: The file does not exist in any file system.
+ * @brief Invalidate listing of parent directory after a file is changed
+ *   through \p session, because file size is part of the listing.
  */
-static int _vfs_overlayfs_common_stat_ex(vfs_overlayfs_t* fs, const vfs_str_t* path,
-    vfs_stat_t* info, vfs_str_t* whiteout)
+static void _vfs_overlayfs_lscache_invalidate_session(vfs_overlayfs_t* fs,
+    vfs_overlayfs_session_t* session)
 {
-    int ret;
-
-    if ((ret = _vfs_overlayfs_common_stat_wrap(fs->upper, path, info)) == 0)
+    if (!VFS_STR_IS_EMPTY(&session->path))
     {
-        return VFS_OVERLAYFS_STAT_UPPER;
+        _vfs_overlayfs_lscache_invalidate(fs, &session->path, 0, 0);
     }
+}
 
-    /*
-     * For path like `/foo/bar`, we need to check whether `/foo.whiteout` and
-     * `/foo/bar.whiteout` exist.
-     */
-    for (size_t i = 1; ; i++)
+/**
+ * @brief Get cached listing of \p path, or start to build one.
+ * @param[in] fs - File system instance.
+ * @param[in] path - Directory path, must be canonical.
+ * @param[out] gen - Generation of directory, only set if building.
+ * @param[out] filling - Set to non-zero if caller is building a listing, and
+ *   #_vfs_overlayfs_lscache_end() must be called.
+ * @return Cached listing with reference, or NULL if not cached.
+ */
+static vfs_overlayfs_lscache_list_t* _vfs_overlayfs_lscache_begin(vfs_overlayfs_t* fs,
+    const vfs_str_t* path, uint64_t* gen, int* filling)
+{
+    vfs_overlayfs_lscache_list_t* list = NULL;
+    *filling = 0;
+
+    vfs_mutex_enter(&fs->lscache_lock);
+    do
     {
-        vfs_str_t layer = vfs_path_layer(path, i);
-        if (VFS_STR_IS_EMPTY(&layer))
+        vfs_overlayfs_lscache_t* cache = _vfs_overlayfs_lscache_find(fs, path);
+        if (cache != NULL && cache->list != NULL)
         {
-            vfs_str_exit(&layer);
+            list = cache->list;
+            (void)vfs_atomic_add(&list->refcnt);
+
+            /* Recently used listing is evicted last. */
+            vfs_list_erase(&fs->lscache_lru, &cache->lru_node);
+            vfs_list_push_back(&fs->lscache_lru, &cache->lru_node);
             break;
         }
-        vfs_str_append(&layer, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ);
 
-        if ((ret = _vfs_overlayfs_common_stat_wrap(fs->upper, &layer, info)) == 0)
+        if (cache == NULL)
         {
-            if (whiteout != NULL)
+            if ((cache = calloc(1, sizeof(vfs_overlayfs_lscache_t))) == NULL)
             {
-                vfs_str_reset(whiteout);
-                vfs_str_append2(whiteout, &layer);
+                break;
             }
+            cache->path = vfs_str_dup(path);
+            vfs_map_insert(&fs->lscache_map, &cache->node);
+        }
+
+        cache->fillers++;
+        *gen = cache->gen;
+        *filling = 1;
+    } while (0);
+    vfs_mutex_leave(&fs->lscache_lock);
+
+    return list;
+}
+
+/**
+ * @brief Finish building listing of \p path.
+ * @param[in] fs - File system instance.
+ * @param[in] path - Directory path.
+ * @param[in] gen - Generation returned by #_vfs_overlayfs_lscache_begin().
+ * @param[in] list - Complete listing, or NULL if failed. Ownership is taken.
+ */
+static void _vfs_overlayfs_lscache_end(vfs_overlayfs_t* fs, const vfs_str_t* path,
+    uint64_t gen, vfs_overlayfs_lscache_list_t* list)
+{
+    ev_list_node_t* it;
+
+    vfs_mutex_enter(&fs->lscache_lock);
+    {
+        vfs_overlayfs_lscache_t* cache = _vfs_overlayfs_lscache_find(fs, path);
+        cache->fillers--;
+
+        /* Directory is not changed while listing. */
+        if (list != NULL && cache->gen == gen && cache->list == NULL)
+        {
+            cache->list = list;
+            list = NULL;
+            vfs_list_push_back(&fs->lscache_lru, &cache->lru_node);
+        }
+        else if (cache->list == NULL)
+        {
+            _vfs_overlayfs_lscache_drop(fs, cache);
         }
-        vfs_str_exit(&layer);
 
-        /* Whiteout file/directory is exist, treat as deleted. */
-        if (ret == 0)
+        /* Evict least recently used listings if there are too many. */
+        while (vfs_list_size(&fs->lscache_lru) > OVERLAY_LSCACHE_MAX
+            && (it = vfs_list_begin(&fs->lscache_lru)) != NULL)
         {
-            return VFS_OVERLAYFS_STAT_WHITEOUT;
+            _vfs_overlayfs_lscache_drop(fs, EV_CONTAINER_OF(it, vfs_overlayfs_lscache_t, lru_node));
         }
     }
+    vfs_mutex_leave(&fs->lscache_lock);
 
-    /* Now we can access lower layer. */
-    if ((ret = _vfs_overlayfs_common_stat_wrap(fs->lower, path, info)) == 0)
+    if (list != NULL)
     {
-        return VFS_OVERLAYFS_STAT_LOWER;
+        _vfs_overlayfs_lscache_release_list(list);
     }
-
-    return VFS_OVERLAYFS_STAT_NOENT;
 }
 
-static int _vfs_overlayfs_common_fh(vfs_overlayfs_t* fs, uintptr_t fh,
-    int (*cb)(vfs_overlayfs_session_t* session, void* data), void* data)
+static void _vfs_overlayfs_lscache_cleanup(vfs_overlayfs_t* fs)
 {
-    int ret;
-    vfs_overlayfs_session_t* session = _vfs_overlayfs_common_find_session(fs, fh);
-    if (session == NULL)
+    ev_map_node_t* it;
+    while ((it = vfs_map_begin(&fs->lscache_map)) != NULL)
     {
-        return VFS_EBADF;
+        vfs_overlayfs_lscache_t* cache = EV_CONTAINER_OF(it, vfs_overlayfs_lscache_t, node);
+        _vfs_overlayfs_lscache_drop(fs, cache);
     }
-
-    ret = cb(session, data);
-    _vfs_overlayfs_common_release_session(session);
-
-    return ret;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -375,27 +2035,48 @@ static void _vfs_overlayfs_destroy_cleanup(vfs_overlayfs_t* fs)
         vfs_mutex_enter(&fs->session_map_lock);
     }
     vfs_mutex_leave(&fs->session_map_lock);
+
+    /* Copy-ups that failed are left without reference. */
+    while ((it = vfs_map_begin(&fs->copyup_map)) != NULL)
+    {
+        vfs_overlayfs_copyup_t* copyup = EV_CONTAINER_OF(it, vfs_overlayfs_copyup_t, node);
+        vfs_map_erase(&fs->copyup_map, it);
+        _vfs_overlayfs_copyup_destroy(copyup);
+    }
 }
 
 static void _vfs_overlayfs_destroy(struct vfs_operations* thiz)
 {
     vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
 
-    _vfs_overlayfs_destroy_cleanup(fs);
-
-    if (fs->lower != NULL)
+    /* Wait for background copy-up. */
+    if (fs->copyup_pool != NULL)
+    {
+        vfs_threadpool_exit(fs->copyup_pool);
+        fs->copyup_pool = NULL;
+    }
+    if (fs->rmdir_pool != NULL)
     {
-        fs->lower->destroy(fs->lower);
-        fs->lower = NULL;
+        vfs_threadpool_exit(fs->rmdir_pool);
+        fs->rmdir_pool = NULL;
     }
+    _vfs_overlayfs_destroy_cleanup(fs);
 
-    if (fs->upper != NULL)
+    size_t i;
+    for (i = 0; i < fs->layer_sz; i++)
     {
-        fs->upper->destroy(fs->upper);
-        fs->upper = NULL;
+        _vfs_overlayfs_index_cleanup(&fs->layers[i]);
+        fs->layers[i].fs->destroy(fs->layers[i].fs);
+        fs->layers[i].fs = NULL;
     }
+    fs->upper = NULL;
 
     vfs_mutex_exit(&fs->session_map_lock);
+    vfs_mutex_exit(&fs->index_lock);
+    _vfs_overlayfs_lscache_cleanup(fs);
+    vfs_mutex_exit(&fs->lscache_lock);
+    vfs_mutex_exit(&fs->copyup_lock);
+    vfs_mutex_exit(&fs->rmdir_lock);
     free(fs);
 }
 
@@ -403,227 +2084,385 @@ static void _vfs_overlayfs_destroy(struct vfs_operations* thiz)
 // ls
 //////////////////////////////////////////////////////////////////////////
 
-typedef enum vfs_overlayfs_type
-{
-    /**
-     * @brief Item only exist in lower file system.
-     */
-    VFS_OVERLAY_LOWER       = 0x01,
-
-    /**
-     * @brief Item only exist in upper file system.
-     */
-    VFS_OVERLAY_UPPER       = 0x02,
-
-    /**
-     * @brief Item exist in lower file system, but override by upper file system.
-     */
-    VFS_OVERLAY_OVERRIDE    = VFS_OVERLAY_LOWER | VFS_OVERLAY_UPPER,
-
-    /**
-     * @brief Item exist in lower file system, but whiteout in upper file system.
-     */
-    VFS_OVERLAY_WHITEOUT    = VFS_OVERLAY_LOWER | 0x04,
-    
-} vfs_overlayfs_type_t;
-
 typedef struct vfs_overlayfs_item
 {
-    ev_map_node_t           node;
-    vfs_str_t               name;
+    const char*             name;       /**< Name in arena, without whiteout suffix. */
     vfs_stat_t              info;
-    vfs_overlayfs_type_t    type;
+    int                     whiteout;   /**< Non-zero if item hides lower layers. */
 } vfs_overlayfs_item_t;
 
+/**
+ * @brief Sorted listing of one layer.
+ */
+typedef struct vfs_overlayfs_item_list
+{
+    vfs_overlayfs_item_t*   items;
+    size_t                  size;
+    size_t                  capacity;
+    size_t                  pos;        /**< Merge position. */
+} vfs_overlayfs_item_list_t;
+
 typedef struct vfs_overlayfs_ls_helper
 {
-    ev_map_t*       item_map;
-    int             ret;
+    vfs_arena_t                 arena;      /**< Storage of item names. */
+    vfs_overlayfs_item_list_t*  lists;      /**< Listings of buffered layers, from top to bottom. */
+    size_t                      list_sz;    /**< The number of buffered layers. */
+    int                         opaque;     /**< Non-zero if lower layers are hidden. */
+    int                         ret;
+    int                         stop;       /**< Non-zero if user callback asks to stop. */
+    vfs_ls_cb                   fn;
+    void*                       data;
 } vfs_overlayfs_ls_helper_t;
 
-static int _vfs_overlayfs_cmp_item(const ev_map_node_t* key1, const ev_map_node_t* key2,
-    void* arg)
+static int _vfs_overlayfs_ls_cmp_item(const void* key1, const void* key2)
 {
-    (void)arg;
-    vfs_overlayfs_item_t* item_1 = EV_CONTAINER_OF(key1, vfs_overlayfs_item_t, node);
-    vfs_overlayfs_item_t* item_2 = EV_CONTAINER_OF(key2, vfs_overlayfs_item_t, node);
-    return vfs_str_cmp2(&item_1->name, &item_2->name);
+    const vfs_overlayfs_item_t* item_1 = key1;
+    const vfs_overlayfs_item_t* item_2 = key2;
+    return strcmp(item_1->name, item_2->name);
 }
 
-static void _vfs_overlayfs_ls_destroy_item(vfs_overlayfs_item_t* item)
+/**
+ * @brief Record one entry of a buffered layer.
+ */
+static int _vfs_overlayfs_ls_on_buffer(const char* name, const vfs_stat_t* stat, void* data)
 {
-    vfs_str_exit(&item->name);
-    free(item);
-}
+    vfs_overlayfs_ls_helper_t* helper = data;
+    vfs_overlayfs_item_list_t* list = &helper->lists[helper->list_sz];
+    vfs_str_t name_str = vfs_str_from_static1(name);
 
-static int _vfs_overlayfs_ls_append_to_map(vfs_overlayfs_ls_helper_t* helper,
-    const char* name, const vfs_stat_t* stat, int type)
-{
-    ev_map_node_t* orig;
-    vfs_overlayfs_item_t* item = malloc(sizeof(vfs_overlayfs_item_t));
-    if (item == NULL)
+    /* Opaque marker is never visible. */
+    if (strcmp(name, OVERLAY_OPAQUE_MARKER) == 0)
     {
-        helper->ret = VFS_ENOMEM;
-        return 1;
+        helper->opaque = 1;
+        return 0;
     }
-    item->name = vfs_str_from1(name);
-    item->info = *stat;
-    item->type = type;
 
-    if ((orig = vfs_map_insert(helper->item_map, &item->node)) == NULL)
+    int whiteout = vfs_str_endwith(&name_str, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ);
+    if (whiteout)
     {
-        return 0;
+        name_str.len -= OVERLAY_WHITEOUT_SUFFIX_SZ;
     }
 
-    vfs_overlayfs_item_t* orig_item = EV_CONTAINER_OF(orig, vfs_overlayfs_item_t, node);
-    assert(orig_item->type == VFS_OVERLAY_LOWER);
-    assert(type == VFS_OVERLAY_UPPER);
-    item->type |= orig_item->type;
-
-    vfs_map_erase(helper->item_map, orig);
-    _vfs_overlayfs_ls_destroy_item(orig_item);
+    if (list->size == list->capacity)
+    {
+        size_t new_capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        vfs_overlayfs_item_t* new_items = realloc(list->items,
+            sizeof(vfs_overlayfs_item_t) * new_capacity);
+        if (new_items == NULL)
+        {
+            goto error_nomem;
+        }
+        list->items = new_items;
+        list->capacity = new_capacity;
+    }
 
-    if ((orig = vfs_map_insert(helper->item_map, &item->node)) != NULL)
+    vfs_overlayfs_item_t* item = &list->items[list->size];
+    if ((item->name = vfs_arena_strdup(&helper->arena, name_str.str, name_str.len)) == NULL)
     {
-        abort();
+        goto error_nomem;
     }
+    item->info = *stat;
+    item->whiteout = whiteout;
+    list->size++;
 
     return 0;
+
+error_nomem:
+    helper->ret = VFS_ENOMEM;
+    return 1;
 }
 
-static int _vfs_overlayfs_ls_on_lower(const char* name, const vfs_stat_t* stat, void* data)
+/**
+ * @brief Emit one entry of the bottom layer, unless it is decided by buffered
+ *   layers.
+ */
+static int _vfs_overlayfs_ls_on_stream(const char* name, const vfs_stat_t* stat, void* data)
 {
+    size_t i;
     vfs_overlayfs_ls_helper_t* helper = data;
-    return _vfs_overlayfs_ls_append_to_map(helper, name, stat, VFS_OVERLAY_LOWER);
-}
+    vfs_str_t name_str = vfs_str_from_static1(name);
 
-static void _vfs_overlayfs_ls_cleanup(ev_map_t* item_map)
-{
-    ev_map_node_t* it;
-    while ((it = vfs_map_begin(item_map)) != NULL)
+    /* Nothing is below this layer, so whiteout is just hidden. */
+    if (strcmp(name, OVERLAY_OPAQUE_MARKER) == 0
+        || vfs_str_endwith(&name_str, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ))
     {
-        vfs_overlayfs_item_t* item = EV_CONTAINER_OF(it, vfs_overlayfs_item_t, node);
-        vfs_map_erase(item_map, it);
-        _vfs_overlayfs_ls_destroy_item(item);
+        return 0;
     }
-}
 
-static vfs_overlayfs_item_t* _fs_overlayfs_ls_search_item(ev_map_t* item_map, const vfs_str_t* name)
-{
-    vfs_overlayfs_item_t tmp_node;
-    tmp_node.name = *name;
-
-    ev_map_node_t* it = vfs_map_find(item_map, &tmp_node.node);
-    if (it == NULL)
+    vfs_overlayfs_item_t key;
+    key.name = name;
+    for (i = 0; i < helper->list_sz; i++)
     {
-        abort();
+        vfs_overlayfs_item_list_t* list = &helper->lists[i];
+        if (bsearch(&key, list->items, list->size, sizeof(vfs_overlayfs_item_t),
+            _vfs_overlayfs_ls_cmp_item) != NULL)
+        {
+            return 0;
+        }
     }
 
-    vfs_overlayfs_item_t* item = EV_CONTAINER_OF(it, vfs_overlayfs_item_t, node);
-    return item;
+    if (helper->fn(name, stat, helper->data) != 0)
+    {
+        helper->stop = 1;
+        return 1;
+    }
+    return 0;
 }
 
-static int _vfs_overlayfs_ls_on_upper(const char* name, const vfs_stat_t* stat, void* data)
+/**
+ * @brief Merge sorted listings of buffered layers. For each name the top-most
+ *   layer that has it decides whether it is visible.
+ */
+static void _vfs_overlayfs_ls_merge(vfs_overlayfs_ls_helper_t* helper)
 {
-    vfs_overlayfs_ls_helper_t* helper = data;
-    vfs_str_t name_str = vfs_str_from_static1(name);
+    size_t i;
 
-    /* If it is not a whiteout file, append the item in the records. */
-    if (!vfs_str_endwith(&name_str, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ))
+    while (!helper->stop)
     {
-        return _vfs_overlayfs_ls_append_to_map(helper, name, stat, VFS_OVERLAY_UPPER);
-    }
+        vfs_overlayfs_item_t* top = NULL;
+        for (i = 0; i < helper->list_sz; i++)
+        {
+            vfs_overlayfs_item_list_t* list = &helper->lists[i];
+            if (list->pos < list->size
+                && (top == NULL || strcmp(list->items[list->pos].name, top->name) < 0))
+            {
+                top = &list->items[list->pos];
+            }
+        }
+        if (top == NULL)
+        {
+            break;
+        }
 
-    /* Remove the record caused by the whiteout. */
-    const size_t left_sz = name_str.len - OVERLAY_WHITEOUT_SUFFIX_SZ;
-    vfs_str_t tmp_name = vfs_str_sub(&name_str, 0, left_sz);
-    {
-        vfs_overlayfs_item_t* item = _fs_overlayfs_ls_search_item(helper->item_map, &tmp_name);
-        assert(item->type == VFS_OVERLAY_LOWER);
-        item->type = VFS_OVERLAY_WHITEOUT;
+        if (!top->whiteout && helper->fn(top->name, &top->info, helper->data) != 0)
+        {
+            helper->stop = 1;
+        }
+
+        for (i = 0; i < helper->list_sz; i++)
+        {
+            vfs_overlayfs_item_list_t* list = &helper->lists[i];
+            while (list->pos < list->size && strcmp(list->items[list->pos].name, top->name) == 0)
+            {
+                list->pos++;
+            }
+        }
     }
-    vfs_str_exit(&tmp_name);
-    return 0;
 }
 
-static void _vfs_overlayfs_ls_docb(ev_map_t* item_map, vfs_ls_cb fn, void* data)
+/**
+ * @brief Find layers that may have entries in \p path.
+ * @param[in] fs - Overlay file system.
+ * @param[in] path - Directory path.
+ * @param[out] found - Index of layers, from top to bottom.
+ * @return - The number of layers on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_ls_find_layers(vfs_overlayfs_t* fs, const vfs_str_t* path,
+    size_t* found)
 {
-    ev_map_node_t* it = vfs_map_begin(item_map);
-    for (; it != NULL; it = vfs_map_next(it))
-    {
-        vfs_overlayfs_item_t* item = EV_CONTAINER_OF(it, vfs_overlayfs_item_t, node);
+    int ret = 0;
+    size_t i, pos, found_sz = 0;
+    int opaque = 0;
 
-        if (item->type != VFS_OVERLAY_WHITEOUT)
+    vfs_mutex_enter(&fs->index_lock);
+    for (i = 0; i < fs->layer_sz && !opaque; i++)
+    {
+        ret = _vfs_overlayfs_index_walk(fs, &fs->layers[i], path, &pos, &opaque);
+        if (ret == VFS_OVERLAYFS_WALK_FOUND)
         {
-            fn(item->name.str, &item->info, data);
+            found[found_sz++] = i;
+        }
+        else if (ret != VFS_OVERLAYFS_WALK_MISSING)
+        {
+            break;
         }
     }
+    vfs_mutex_leave(&fs->index_lock);
+
+    return ret < 0 ? ret : (int)found_sz;
 }
 
 static int _vfs_overlayfs_ls_inner(vfs_overlayfs_t* fs, const vfs_str_t* path,
     vfs_ls_cb fn, void* data)
 {
-    int ret = 0;
-    if (fs->lower->ls == NULL || fs->upper->ls == NULL)
-    {
-        return VFS_ENOSYS;
-    }
+    int ret;
+    size_t i, found_sz;
 
-    ev_map_t item_map;
-    vfs_map_init(&item_map, _vfs_overlayfs_cmp_item, NULL);
+    vfs_overlayfs_ls_helper_t helper;
+    memset(&helper, 0, sizeof(helper));
+    helper.fn = fn;
+    helper.data = data;
 
-    /* First get all items from lower layer. */
-    vfs_overlayfs_ls_helper_t helper = { &item_map, 0 };
-    ret = fs->lower->ls(fs->lower, path->str, _vfs_overlayfs_ls_on_lower, &helper);
-    if (ret != 0 && ret != VFS_ENOENT)
+    size_t* found = malloc(sizeof(size_t) * fs->layer_sz);
+    helper.lists = calloc(fs->layer_sz, sizeof(vfs_overlayfs_item_list_t));
+    if (found == NULL || helper.lists == NULL)
     {
+        ret = VFS_ENOMEM;
         goto finish;
     }
-    if (helper.ret != 0)
+
+    if ((ret = _vfs_overlayfs_ls_find_layers(fs, path, found)) <= 0)
     {
-        ret = helper.ret;
+        ret = ret == 0 ? VFS_ENOENT : ret;
         goto finish;
     }
+    found_sz = ret;
 
-    /* Fix items by check upper layer. */
-    ret = fs->upper->ls(fs->upper, path->str, _vfs_overlayfs_ls_on_upper, &helper);
-    if (ret != 0 && ret != VFS_ENOENT)
+    /*
+     * Buffer all layers but the bottom one, so the bottom layer, which is
+     * usually the largest one, can be streamed to user directly.
+     */
+    for (i = 0; i < found_sz; i++)
     {
-        goto finish;
+        vfs_operations_t* layer = fs->layers[found[i]].fs;
+        int bottom = (i == found_sz - 1);
+        if (layer->ls == NULL)
+        {
+            ret = VFS_ENOSYS;
+            goto finish;
+        }
+
+        if (bottom)
+        {
+            _vfs_overlayfs_ls_merge(&helper);
+            if (helper.stop)
+            {
+                break;
+            }
+        }
+
+        ret = layer->ls(layer, path->str,
+            bottom ? _vfs_overlayfs_ls_on_stream : _vfs_overlayfs_ls_on_buffer, &helper);
+        if (ret == VFS_ENOTDIR || ret == VFS_ENOENT)
+        {/* The entry is not a directory in this layer, so it hides all layers below. */
+            if (i == 0)
+            {
+                goto finish;
+            }
+            ret = 0;
+            found_sz = i;
+        }
+        else if (ret != 0)
+        {
+            goto finish;
+        }
+        if (helper.ret != 0)
+        {
+            ret = helper.ret;
+            goto finish;
+        }
+        if (bottom || found_sz == i)
+        {
+            break;
+        }
+
+        qsort(helper.lists[i].items, helper.lists[i].size, sizeof(vfs_overlayfs_item_t),
+            _vfs_overlayfs_ls_cmp_item);
+        helper.list_sz++;
+
+        if (helper.opaque)
+        {
+            found_sz = i + 1;
+            break;
+        }
+    }
+
+    /* No layer is streamed if the bottom one is hidden. */
+    if (helper.list_sz == found_sz)
+    {
+        _vfs_overlayfs_ls_merge(&helper);
+    }
+
+finish:
+    if (helper.lists != NULL)
+    {
+        for (i = 0; i < fs->layer_sz; i++)
+        {
+            free(helper.lists[i].items);
+        }
+        free(helper.lists);
+    }
+    free(found);
+    vfs_arena_exit(&helper.arena);
+    return ret;
+}
+
+typedef struct vfs_overlayfs_ls_fill_helper
+{
+    vfs_overlayfs_lscache_list_t*   list;       /**< Listing being built, or NULL if failed. */
+    int                             stopped;    /**< Non-zero if user callback asks to stop. */
+    vfs_ls_cb                       fn;
+    void*                           data;
+} vfs_overlayfs_ls_fill_helper_t;
+
+static int _vfs_overlayfs_ls_on_fill(const char* name, const vfs_stat_t* stat, void* data)
+{
+    vfs_overlayfs_ls_fill_helper_t* helper = data;
+
+    if (helper->list != NULL && _vfs_overlayfs_lscache_append(helper->list, name, stat) != 0)
+    {/* Out of memory only makes listing not cached. */
+        _vfs_overlayfs_lscache_release_list(helper->list);
+        helper->list = NULL;
     }
-    if (helper.ret != 0)
+
+    if (helper->fn(name, stat, helper->data) != 0)
     {
-        ret = helper.ret;
-        goto finish;
+        helper->stopped = 1;
+        return 1;
     }
-
-    _vfs_overlayfs_ls_docb(&item_map, fn, data);
-    ret = 0;
-
-finish:
-    _vfs_overlayfs_ls_cleanup(&item_map);
-    return ret;
+    return 0;
 }
 
 static int _vfs_overlayfs_ls(struct vfs_operations* thiz, const char* path,
     vfs_ls_cb fn, void* data)
 {
     int ret;
+    size_t i;
     vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
-    
-    vfs_stat_t info;
-    if ((ret = thiz->stat(thiz, path, &info)) != 0)
+    vfs_str_t path_str = vfs_str_from_static1(path);
+
+    if (!_vfs_overlayfs_lscache_is_canonical(&path_str))
     {
-        return ret;
+        return _vfs_overlayfs_ls_inner(fs, &path_str, fn, data);
+    }
+
+    /* Serve from cache. */
+    int filling;
+    uint64_t gen = 0;
+    vfs_overlayfs_lscache_list_t* list = _vfs_overlayfs_lscache_begin(fs, &path_str, &gen, &filling);
+    if (list != NULL)
+    {
+        for (i = 0; i < list->size; i++)
+        {
+            if (fn(list->items[i].name, &list->items[i].info, data) != 0)
+            {
+                break;
+            }
+        }
+        _vfs_overlayfs_lscache_release_list(list);
+        return 0;
     }
 
-    if (info.st_mode & VFS_S_IFREG)
+    /* Build listing while emitting it. */
+    vfs_overlayfs_ls_fill_helper_t helper = { NULL, 0, fn, data };
+    if (filling && (helper.list = calloc(1, sizeof(vfs_overlayfs_lscache_list_t))) != NULL)
     {
-        return VFS_ENOTDIR;
+        helper.list->refcnt = 1;
     }
 
-    vfs_str_t path_str = vfs_str_from_static1(path);
-    return _vfs_overlayfs_ls_inner(fs, &path_str, fn, data);
+    ret = _vfs_overlayfs_ls_inner(fs, &path_str, _vfs_overlayfs_ls_on_fill, &helper);
+    if ((ret != 0 || helper.stopped) && helper.list != NULL)
+    {
+        _vfs_overlayfs_lscache_release_list(helper.list);
+        helper.list = NULL;
+    }
+
+    if (filling)
+    {
+        _vfs_overlayfs_lscache_end(fs, &path_str, gen, helper.list);
+    }
+    return ret;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -635,18 +2474,21 @@ static int _vfs_overlayfs_stat(struct vfs_operations* thiz, const char* path, vf
     vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
     vfs_str_t path_str = vfs_str_from_static1(path);
 
-    int ret = _vfs_overlayfs_common_stat_ex(fs, &path_str, info, NULL);
+    int ret = _vfs_overlayfs_common_stat_ex(fs, &path_str, info, NULL, NULL);
     switch (ret)
     {
     case VFS_OVERLAYFS_STAT_LOWER:
     case VFS_OVERLAYFS_STAT_UPPER:
         return 0;
 
+    case VFS_OVERLAYFS_STAT_WHITEOUT:
+        return VFS_ENOENT;
+
     default:
         break;
     }
 
-    return VFS_ENOENT;
+    return ret;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -666,15 +2508,58 @@ static int _vfs_overlayfs_open_with_fs(vfs_overlayfs_t* fs, vfs_operations_t* op
     session->fs = NULL;
     session->fake = (uintptr_t)session;
     session->real = 0;
+    session->copyup = NULL;
+    session->flags = flags;
+    session->pos = 0;
+    session->path = (vfs_str_t)VFS_STR_INIT;
+
+    /* The file might still be copying from lower layer. */
+    if (op == fs->upper)
+    {
+        session->copyup = _vfs_overlayfs_copyup_find(fs, path);
+    }
 
     /* Open file. */
-    if ((ret = op->open(op, &session->real, path->str, flags)) != 0)
+    if (session->copyup != NULL && (flags & VFS_O_TRUNCATE))
+    {/* Truncate with copy-up locked, so no block is copied after it. */
+        vfs_mutex_enter(&session->copyup->lock);
+        if ((ret = op->open(op, &session->real, path->str, flags & ~VFS_O_TRUNCATE)) == 0)
+        {
+            if ((ret = op->truncate(op, session->real, 0)) == 0)
+            {
+                _vfs_overlayfs_copyup_discard(session->copyup);
+            }
+            else
+            {
+                op->close(op, session->real);
+            }
+        }
+        vfs_mutex_leave(&session->copyup->lock);
+    }
+    else
+    {
+        ret = op->open(op, &session->real, path->str, flags);
+    }
+    if (ret != 0)
     {
         _vfs_overlayfs_common_release_session(session);
         return ret;
     }
     session->fs = op;
 
+    /* The file and its parents now exist in upper layer. */
+    if (op == fs->upper)
+    {
+        _vfs_overlayfs_index_update(fs, path, VFS_OVERLAYFS_INDEX_EXIST, 0, 1);
+
+        /* File may be created or changed, and so may its parents. */
+        if (flags & (VFS_O_WRONLY | VFS_O_CREATE | VFS_O_TRUNCATE))
+        {
+            session->path = vfs_str_dup(path);
+            _vfs_overlayfs_lscache_invalidate(fs, path, 1, 0);
+        }
+    }
+
     /* Save session. */
     ev_map_node_t* orig;
     vfs_mutex_enter(&fs->session_map_lock);
@@ -692,11 +2577,12 @@ static int _vfs_overlayfs_open_with_fs(vfs_overlayfs_t* fs, vfs_operations_t* op
     return 0;
 }
 
-static int _vfs_overlayfs_open_copy_to_upper(vfs_overlayfs_t* fs, const vfs_str_t* path)
+static int _vfs_overlayfs_open_copy_to_upper(vfs_overlayfs_t* fs, vfs_operations_t* lower,
+    const vfs_str_t* path)
 {
     int ret = 0;
-    if (fs->lower->open == NULL || fs->upper->open == NULL
-        || fs->lower->close == NULL || fs->upper->close == NULL)
+    if (lower->open == NULL || fs->upper->open == NULL
+        || lower->close == NULL || fs->upper->close == NULL)
     {
         return VFS_ENOSYS;
     }
@@ -707,7 +2593,7 @@ static int _vfs_overlayfs_open_copy_to_upper(vfs_overlayfs_t* fs, const vfs_str_
     }
 
     uintptr_t fh_lower = 0;
-    if ((ret = fs->lower->open(fs->lower, &fh_lower, path->str, VFS_O_RDONLY)) != 0)
+    if ((ret = lower->open(lower, &fh_lower, path->str, VFS_O_RDONLY)) != 0)
     {
         return ret;
     }
@@ -716,48 +2602,148 @@ static int _vfs_overlayfs_open_copy_to_upper(vfs_overlayfs_t* fs, const vfs_str_
     if ((ret = fs->upper->open(fs->upper, &fh_upper, path->str,
         VFS_O_WRONLY | VFS_O_CREATE | VFS_O_TRUNCATE)) != 0)
     {
-        fs->lower->close(fs->lower, fh_lower);
+        lower->close(lower, fh_lower);
         return ret;
     }
+    _vfs_overlayfs_index_update(fs, path, VFS_OVERLAYFS_INDEX_EXIST, 0, 1);
 
-    const size_t buf_sz = 64 * 1024;
-    char* buf = malloc(buf_sz);
-    if (buf == NULL)
+    ret = _vfs_overlayfs_common_copy(lower, fh_lower, fs->upper, fh_upper);
+
+    lower->close(lower, fh_lower);
+    fs->upper->close(fs->upper, fh_upper);
+    return ret;
+}
+
+/**
+ * @brief Copy blocks in background. Each block is copied with
+ *   #vfs_overlayfs_copyup_t::lock held, so sessions only wait for the block
+ *   that is being copied.
+ */
+static void _vfs_overlayfs_open_copyup_work(int status, void* data)
+{
+    size_t i;
+    vfs_overlayfs_copyup_t* copyup = data;
+
+    for (i = 0; status == 0 && i < copyup->block_cnt; i++)
+    {
+        vfs_mutex_enter(&copyup->lock);
+        if ((status = _vfs_overlayfs_copyup_block(copyup, i)) != 0 && copyup->errcode == 0)
+        {
+            copyup->errcode = status;
+        }
+        vfs_mutex_leave(&copyup->lock);
+    }
+
+    /* Anything left is copied by the last release, and the error is kept. */
+    _vfs_overlayfs_copyup_release(copyup);
+}
+
+/**
+ * @brief Start block copy-up of \p path from \p lower layer.
+ * @param[in] fs - File system instance.
+ * @param[in] lower - The lower layer that has the file.
+ * @param[in] path - File path.
+ * @param[in] size - File size.
+ * @param[out] copyup - Copy-up with one reference.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_overlayfs_open_copyup_create(vfs_overlayfs_t* fs, vfs_operations_t* lower,
+    const vfs_str_t* path, uint64_t size, vfs_overlayfs_copyup_t** copyup)
+{
+    int ret;
+    vfs_operations_t* upper = fs->upper;
+    if (lower->open == NULL || lower->close == NULL || lower->seek == NULL || lower->read == NULL
+        || upper->open == NULL || upper->close == NULL || upper->seek == NULL
+        || upper->write == NULL || upper->truncate == NULL)
+    {
+        return VFS_ENOSYS;
+    }
+
+    if ((ret = vfs_path_ensure_parent_exist(upper, path)) != 0)
+    {
+        return ret;
+    }
+
+    vfs_overlayfs_copyup_t* new_copyup = calloc(1, sizeof(vfs_overlayfs_copyup_t));
+    if (new_copyup == NULL)
     {
-        fs->lower->close(fs->lower, fh_lower);
-        fs->upper->close(fs->upper, fh_upper);
         return VFS_ENOMEM;
     }
+    new_copyup->owner = fs;
+    new_copyup->refcnt = 1;
+    new_copyup->path = vfs_str_dup(path);
+    vfs_mutex_init(&new_copyup->lock);
+    new_copyup->lower = lower;
+    new_copyup->total = size;
+    new_copyup->size = size;
+    new_copyup->block_sz = fs->copyup_block_sz;
+    new_copyup->block_cnt = (size_t)((size + fs->copyup_block_sz - 1) / fs->copyup_block_sz);
+    new_copyup->bitmap = calloc(new_copyup->block_cnt / 8 + 1, 1);
+    new_copyup->buf = malloc(fs->copyup_block_sz);
+    if (new_copyup->bitmap == NULL || new_copyup->buf == NULL)
+    {
+        ret = VFS_ENOMEM;
+        goto error;
+    }
+
+    /*
+     * Look up and insert under the same lock, otherwise two openers would both
+     * truncate the upper file and one of them drops what the other copied.
+     */
+    vfs_mutex_enter(&fs->copyup_lock);
+    ev_map_node_t* it = vfs_map_find(&fs->copyup_map, &new_copyup->node);
+    if (it != NULL)
+    {/* Someone else is copying the same file. */
+        *copyup = EV_CONTAINER_OF(it, vfs_overlayfs_copyup_t, node);
+        (*copyup)->refcnt++;
+        vfs_mutex_leave(&fs->copyup_lock);
+        _vfs_overlayfs_copyup_destroy(new_copyup);
+        return 0;
+    }
 
-    while (1)
+    if ((ret = lower->open(lower, &new_copyup->lower_fh, path->str, VFS_O_RDONLY)) != 0)
     {
-        int read_sz = fs->lower->read(fs->lower, fh_lower, buf, buf_sz);
-        if (read_sz == VFS_EOF)
-        {
-            break;
-        }
-        if (read_sz < 0)
-        {
-            ret = read_sz;
-            break;
-        }
+        new_copyup->lower_fh = 0;
+        goto error_unlock;
+    }
+    if ((ret = upper->open(upper, &new_copyup->upper_fh, path->str,
+        VFS_O_WRONLY | VFS_O_CREATE | VFS_O_TRUNCATE)) != 0)
+    {
+        new_copyup->upper_fh = 0;
+        goto error_unlock;
+    }
 
-        int write_sz = fs->upper->write(fs->upper, fh_upper, buf, read_sz);
-        if (write_sz < 0)
-        {
-            ret = write_sz;
-            break;
-        }
-        if (write_sz != read_sz)
-        {
-            ret = VFS_EIO;
-            break;
+    /* Upper file has the final size at once, content is copied later. */
+    if ((ret = upper->truncate(upper, new_copyup->upper_fh, size)) != 0)
+    {
+        vfs_mutex_leave(&fs->copyup_lock);
+        _vfs_overlayfs_index_update(fs, path, VFS_OVERLAYFS_INDEX_EXIST, 0, 1);
+        goto error;
+    }
+
+    /* Background worker holds its own reference. */
+    new_copyup->refcnt += fs->copyup_pool != NULL ? 1 : 0;
+    vfs_map_insert(&fs->copyup_map, &new_copyup->node);
+    vfs_mutex_leave(&fs->copyup_lock);
+    _vfs_overlayfs_index_update(fs, path, VFS_OVERLAYFS_INDEX_EXIST, 0, 1);
+
+    if (fs->copyup_pool != NULL)
+    {
+        size_t idx = (size_t)vfs_atomic_add(&fs->copyup_next) % fs->copyup_thread_sz;
+        if (vfs_threadpool_submit(fs->copyup_pool, idx, _vfs_overlayfs_open_copyup_work, new_copyup) != 0)
+        {/* Queue is full, copy lazily instead. */
+            _vfs_overlayfs_copyup_release(new_copyup);
         }
     }
 
-    free(buf);
-    fs->lower->close(fs->lower, fh_lower);
-    fs->upper->close(fs->upper, fh_upper);
+    *copyup = new_copyup;
+    return 0;
+
+error_unlock:
+    vfs_mutex_leave(&fs->copyup_lock);
+error:
+    _vfs_overlayfs_copyup_destroy(new_copyup);
     return ret;
 }
 
@@ -769,9 +2755,22 @@ static int _vfs_overlayfs_open(struct vfs_operations* thiz, uintptr_t* fh,
     vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
     vfs_str_t path_str = vfs_str_from_static1(path);
     vfs_str_t whiteout_path = VFS_STR_INIT;
+    vfs_operations_t* layer = NULL;
+
+    if ((flags & VFS_O_CREATE) && _vfs_overlayfs_common_is_marker(&path_str))
+    {
+        return VFS_EINVAL;
+    }
+
+    ret = _vfs_overlayfs_common_stat_ex(fs, &path_str, &info, &whiteout_path, &layer);
+    if (ret < 0 && ret != VFS_OVERLAYFS_STAT_NOENT && ret != VFS_OVERLAYFS_STAT_WHITEOUT)
+    {/* Unknown error. */
+        vfs_str_exit(&whiteout_path);
+        return ret;
+    }
 
     /* If file not exist and #VFS_O_CREATE not set, open should failed. */
-    if ((ret = _vfs_overlayfs_common_stat_ex(fs, &path_str, &info, &whiteout_path)) < 0 && !(flags & VFS_O_CREATE))
+    if (ret < 0 && !(flags & VFS_O_CREATE))
     {
         vfs_str_exit(&whiteout_path);
         return VFS_ENOENT;
@@ -789,7 +2788,23 @@ static int _vfs_overlayfs_open(struct vfs_operations* thiz, uintptr_t* fh,
     {
         if (flags & VFS_O_WRONLY)
         {
-            if ((ret = _vfs_overlayfs_open_copy_to_upper(fs, &path_str)) != 0)
+            /* Old content is discarded, so nothing need to copy. */
+            if (flags & VFS_O_TRUNCATE)
+            {
+                if ((ret = vfs_path_ensure_parent_exist(fs->upper, &path_str)) != 0)
+                {
+                    return ret;
+                }
+                flags |= VFS_O_CREATE;
+                goto open_in_upper_layer;
+            }
+
+            if (fs->copyup_block_sz != 0)
+            {
+                goto open_with_copyup;
+            }
+
+            if ((ret = _vfs_overlayfs_open_copy_to_upper(fs, layer, &path_str)) != 0)
             {
                 return ret;
             }
@@ -819,9 +2834,22 @@ static int _vfs_overlayfs_open(struct vfs_operations* thiz, uintptr_t* fh,
     abort();
 
 open_in_lower_layer:
-    return _vfs_overlayfs_open_with_fs(fs, fs->lower, fh, &path_str, flags);
+    return _vfs_overlayfs_open_with_fs(fs, layer, fh, &path_str, flags);
 open_in_upper_layer:
     return _vfs_overlayfs_open_with_fs(fs, fs->upper, fh, &path_str, flags);
+
+open_with_copyup:
+    {
+        vfs_overlayfs_copyup_t* copyup = NULL;
+        if ((ret = _vfs_overlayfs_open_copyup_create(fs, layer, &path_str, info.st_size, &copyup)) != 0)
+        {
+            return ret;
+        }
+        /* The session takes its own reference of copy-up. */
+        ret = _vfs_overlayfs_open_with_fs(fs, fs->upper, fh, &path_str, flags);
+        int release_ret = _vfs_overlayfs_copyup_release(copyup);
+        return ret != 0 ? ret : release_ret;
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -838,15 +2866,44 @@ static int _vfs_overlayfs_close(struct vfs_operations* thiz, uintptr_t fh)
         return VFS_EBADF;
     }
 
+    /* Finish copy-up now, so error can be reported. */
+    int ret = 0;
+    vfs_overlayfs_copyup_t* copyup = session->copyup;
+    if (copyup != NULL)
+    {
+        int forgotten;
+        size_t refcnt;
+        vfs_mutex_enter(&fs->copyup_lock);
+        refcnt = copyup->refcnt;
+        forgotten = copyup->forgotten;
+        vfs_mutex_leave(&fs->copyup_lock);
+
+        /* A removed file needs no copy. */
+        if (refcnt == 1 && !forgotten)
+        {
+            _vfs_overlayfs_copyup_flush(copyup);
+        }
+
+        /* Background copy might have failed too. */
+        vfs_mutex_enter(&copyup->lock);
+        ret = copyup->errcode;
+        vfs_mutex_leave(&copyup->lock);
+    }
+
+    /* Size may be changed by copy-up. */
+    _vfs_overlayfs_index_drop_stat(fs, &session->path);
+
     /* Remove record. */
+    vfs_mutex_enter(&fs->session_map_lock);
     vfs_map_erase(&fs->session_map, &session->node);
+    vfs_mutex_leave(&fs->session_map_lock);
 
     /* Release session caused by #_vfs_overlayfs_common_find_session(). */
     _vfs_overlayfs_common_release_session(session);
     /* Release session caused by creation. */
     _vfs_overlayfs_common_release_session(session);
 
-    return 0;
+    return ret;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -855,25 +2912,48 @@ static int _vfs_overlayfs_close(struct vfs_operations* thiz, uintptr_t fh)
 
 typedef struct vfs_overlayfs_truncate_helper
 {
-    uint64_t    size;
+    vfs_overlayfs_t*    owner;
+    uint64_t            size;
 } vfs_overlayfs_truncate_helper_t;
 
 static int _vfs_overlayfs_truncate_inner(vfs_overlayfs_session_t* session, void* data)
 {
+    int ret;
     vfs_overlayfs_truncate_helper_t* helper = data;
     vfs_operations_t* fs = session->fs;
+    vfs_overlayfs_copyup_t* copyup = session->copyup;
 
     if (fs->truncate == NULL)
     {
         return VFS_ENOSYS;
     }
-    return fs->truncate(fs, session->real, helper->size);
+    if (copyup == NULL)
+    {
+        ret = fs->truncate(fs, session->real, helper->size);
+        goto finish;
+    }
+
+    /* Content after new size is never copied from lower layer. */
+    vfs_mutex_enter(&copyup->lock);
+    if ((ret = fs->truncate(fs, session->real, helper->size)) == 0 && helper->size < copyup->size)
+    {
+        copyup->size = helper->size;
+    }
+    vfs_mutex_leave(&copyup->lock);
+
+finish:
+    if (ret == 0)
+    {
+        _vfs_overlayfs_lscache_invalidate_session(helper->owner, session);
+        _vfs_overlayfs_index_drop_stat(helper->owner, &session->path);
+    }
+    return ret;
 }
 
 static int _vfs_overlayfs_truncate(struct vfs_operations* thiz, uintptr_t fh, uint64_t size)
 {
     vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
-    vfs_overlayfs_truncate_helper_t helper = { size };
+    vfs_overlayfs_truncate_helper_t helper = { fs, size };
     return _vfs_overlayfs_common_fh(fs, fh, _vfs_overlayfs_truncate_inner, &helper);
 }
 
@@ -888,6 +2968,51 @@ typedef struct vfs_overlayfs_seek_helper
     int64_t ret;
 } vfs_overlayfs_seek_helper_t;
 
+/**
+ * @brief Seek in a file that is being copied. Position is tracked by overlay
+ *   file system, so real file handle can be moved freely.
+ */
+static int _vfs_overlayfs_seek_copyup(vfs_overlayfs_session_t* session,
+    vfs_overlayfs_seek_helper_t* helper)
+{
+    vfs_operations_t* fs = session->fs;
+    vfs_overlayfs_copyup_t* copyup = session->copyup;
+
+    vfs_mutex_enter(&copyup->lock);
+    int64_t size = fs->seek(fs, session->real, 0, VFS_SEEK_END);
+    if (size < 0)
+    {
+        helper->ret = size;
+        goto finish;
+    }
+
+    /* There is no hole before content is copied. */
+    int64_t pos;
+    switch (helper->whence)
+    {
+    case VFS_SEEK_SET:  pos = helper->offset; break;
+    case VFS_SEEK_CUR:  pos = (int64_t)session->pos + helper->offset; break;
+    case VFS_SEEK_END:  pos = size + helper->offset; break;
+    case VFS_SEEK_DATA: pos = (helper->offset >= 0 && helper->offset < size) ? helper->offset : VFS_ENXIO; break;
+    case VFS_SEEK_HOLE: pos = (helper->offset >= 0 && helper->offset < size) ? size : VFS_ENXIO; break;
+    default:            pos = VFS_EINVAL; break;
+    }
+    if (pos < 0 && helper->whence <= VFS_SEEK_END)
+    {
+        pos = VFS_EINVAL;
+    }
+
+    if (pos >= 0)
+    {
+        session->pos = (uint64_t)pos;
+    }
+    helper->ret = pos;
+
+finish:
+    vfs_mutex_leave(&copyup->lock);
+    return 0;
+}
+
 static int _vfs_overlayfs_seek_inner(vfs_overlayfs_session_t* session, void* data)
 {
     vfs_overlayfs_seek_helper_t* helper = data;
@@ -897,6 +3022,10 @@ static int _vfs_overlayfs_seek_inner(vfs_overlayfs_session_t* session, void* dat
     {
         return VFS_ENOSYS;
     }
+    if (session->copyup != NULL)
+    {
+        return _vfs_overlayfs_seek_copyup(session, helper);
+    }
 
     helper->ret = fs->seek(fs, session->real, helper->offset, helper->whence);
     return 0;
@@ -926,6 +3055,49 @@ typedef struct vfs_overlayfs_read_helper
     size_t  len;
 } vfs_overlayfs_read_helper_t;
 
+/**
+ * @brief Read a file that is being copied. Blocks that are not copied yet are
+ *   read from lower layer.
+ */
+static int _vfs_overlayfs_read_copyup(vfs_overlayfs_session_t* session,
+    vfs_overlayfs_read_helper_t* helper)
+{
+    int ret = 0;
+    size_t total = 0;
+    vfs_operations_t* fs = session->fs;
+    vfs_overlayfs_copyup_t* copyup = session->copyup;
+
+    vfs_mutex_enter(&copyup->lock);
+    while (total < helper->len)
+    {
+        const uint64_t pos = session->pos;
+        const uint64_t block = pos / copyup->block_sz;
+        const uint64_t block_end = (block + 1) * copyup->block_sz;
+        size_t len = helper->len - total;
+        len = pos + len < block_end ? len : (size_t)(block_end - pos);
+
+        vfs_operations_t* op = fs;
+        uintptr_t fh = session->real;
+        if (pos < copyup->size && !_vfs_overlayfs_copyup_is_copied(copyup, block))
+        {
+            op = copyup->lower;
+            fh = copyup->lower_fh;
+            len = pos + len < copyup->size ? len : (size_t)(copyup->size - pos);
+        }
+
+        ret = _vfs_overlayfs_common_pread(op, fh, pos, (char*)helper->buf + total, len);
+        if (ret <= 0)
+        {
+            break;
+        }
+        total += ret;
+        session->pos += ret;
+    }
+    vfs_mutex_leave(&copyup->lock);
+
+    return total != 0 ? (int)total : ret;
+}
+
 static int _vfs_overlayfs_read_inner(vfs_overlayfs_session_t* session, void* data)
 {
     vfs_overlayfs_read_helper_t* helper = data;
@@ -935,6 +3107,10 @@ static int _vfs_overlayfs_read_inner(vfs_overlayfs_session_t* session, void* dat
     {
         return VFS_ENOSYS;
     }
+    if (session->copyup != NULL && (session->flags & VFS_O_RDONLY))
+    {
+        return _vfs_overlayfs_read_copyup(session, helper);
+    }
     return fs->read(fs, session->real, helper->buf, helper->len);
 }
 
@@ -951,10 +3127,65 @@ static int _vfs_overlayfs_read(struct vfs_operations* thiz, uintptr_t fh, void*
 
 typedef struct vfs_overlayfs_write_helper
 {
-    const void* buf;
-    size_t      len;
+    vfs_overlayfs_t*    owner;
+    const void*         buf;
+    size_t              len;
 } vfs_overlayfs_write_helper_t;
 
+/**
+ * @brief Write a file that is being copied. Blocks that are partially written
+ *   are copied first, blocks that are fully written are never copied.
+ */
+static int _vfs_overlayfs_write_copyup(vfs_overlayfs_session_t* session,
+    vfs_overlayfs_write_helper_t* helper)
+{
+    int ret;
+    vfs_operations_t* fs = session->fs;
+    vfs_overlayfs_copyup_t* copyup = session->copyup;
+    const uint64_t block_sz = copyup->block_sz;
+
+    vfs_mutex_enter(&copyup->lock);
+
+    uint64_t pos = session->pos;
+    if (session->flags & VFS_O_APPEND)
+    {
+        int64_t size = fs->seek(fs, session->real, 0, VFS_SEEK_END);
+        if (size < 0)
+        {
+            ret = (int)size;
+            goto finish;
+        }
+        pos = (uint64_t)size;
+    }
+    const uint64_t end = pos + helper->len;
+
+    if (pos % block_sz != 0 && (ret = _vfs_overlayfs_copyup_block(copyup, pos / block_sz)) != 0)
+    {
+        goto finish;
+    }
+    if (end % block_sz != 0 && (ret = _vfs_overlayfs_copyup_block(copyup, end / block_sz)) != 0)
+    {
+        goto finish;
+    }
+
+    if ((ret = _vfs_overlayfs_common_pwrite(fs, session->real, pos, helper->buf, helper->len)) <= 0)
+    {
+        goto finish;
+    }
+    session->pos = pos + ret;
+
+    /* Blocks in range are either copied above or fully written. */
+    uint64_t block;
+    for (block = pos / block_sz; block * block_sz < pos + ret; block++)
+    {
+        _vfs_overlayfs_copyup_set_copied(copyup, block);
+    }
+
+finish:
+    vfs_mutex_leave(&copyup->lock);
+    return ret;
+}
+
 static int _vfs_overlayfs_write_inner(vfs_overlayfs_session_t* session, void* data)
 {
     vfs_overlayfs_write_helper_t* helper = data;
@@ -964,20 +3195,48 @@ static int _vfs_overlayfs_write_inner(vfs_overlayfs_session_t* session, void* da
     {
         return VFS_ENOSYS;
     }
-    return fs->write(fs, session->real, helper->buf, helper->len);
+    int ret = session->copyup != NULL ? _vfs_overlayfs_write_copyup(session, helper)
+        : fs->write(fs, session->real, helper->buf, helper->len);
+    if (ret > 0)
+    {
+        _vfs_overlayfs_lscache_invalidate_session(helper->owner, session);
+        _vfs_overlayfs_index_drop_stat(helper->owner, &session->path);
+    }
+    return ret;
+}
+
+
+static int _vfs_overlayfs_write(struct vfs_operations* thiz, uintptr_t fh, const void* buf, size_t len)
+{
+    vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
+    vfs_overlayfs_write_helper_t helper = { fs, buf, len };
+    return _vfs_overlayfs_common_fh(fs, fh, _vfs_overlayfs_write_inner, &helper);
 }
 
-static int _vfs_overlayfs_write(struct vfs_operations* thiz, uintptr_t fh, const void* buf, size_t len)
-{
-    vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
-    vfs_overlayfs_write_helper_t helper = { buf, len };
-    return _vfs_overlayfs_common_fh(fs, fh, _vfs_overlayfs_write_inner, &helper);
+//////////////////////////////////////////////////////////////////////////
+// mkdir
+//////////////////////////////////////////////////////////////////////////
+
+static int _vfs_overlayfs_mkdir_create_opaque_marker(vfs_overlayfs_t* fs,
+    const vfs_str_t* path)
+{
+    int ret;
+    vfs_str_t path_str = vfs_str_dup(path);
+    vfs_str_append1(&path_str, "/" OVERLAY_OPAQUE_MARKER);
+    do {
+        uintptr_t fh = 0;
+        ret = fs->upper->open(fs->upper, &fh, path_str.str, VFS_O_WRONLY | VFS_O_CREATE);
+        if (ret != 0)
+        {
+            break;
+        }
+        fs->upper->close(fs->upper, fh);
+    } while (0);
+    vfs_str_exit(&path_str);
+
+    return ret;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// mkdir
-//////////////////////////////////////////////////////////////////////////
-
 static int _vfs_overlayfs_mkdir_inner(vfs_overlayfs_t* fs, const vfs_str_t* path)
 {
     /* Check if parent directory exist. */
@@ -993,14 +3252,38 @@ static int _vfs_overlayfs_mkdir_inner(vfs_overlayfs_t* fs, const vfs_str_t* path
         return ret;
     }
 
-    /* Create directory. */
-    return fs->upper->mkdir(fs->upper, path->str);
+    /* Create directory, the parent may only exist in lower layer. */
+    if ((ret = vfs_path_ensure_parent_exist(fs->upper, path)) != 0)
+    {
+        return ret;
+    }
+    if ((ret = fs->upper->mkdir(fs->upper, path->str)) != 0)
+    {
+        return ret;
+    }
+    _vfs_overlayfs_index_update(fs, path, VFS_OVERLAYFS_INDEX_EXIST, 0, 1);
+
+    /* Nothing in lower layer is visible here, so make it opaque. */
+    if ((ret = _vfs_overlayfs_mkdir_create_opaque_marker(fs, path)) != 0)
+    {
+        fs->upper->rmdir(fs->upper, path->str);
+        _vfs_overlayfs_index_update(fs, path, 0, VFS_OVERLAYFS_INDEX_EXIST, 0);
+        return ret;
+    }
+    _vfs_overlayfs_index_set_opaque(fs, path);
+
+    return 0;
 }
 
 static int _vfs_overlayfs_mkdir(struct vfs_operations* thiz, const char* path)
 {
     int ret;
     vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
+    vfs_str_t path_str = vfs_str_from_static1(path);
+    if (_vfs_overlayfs_common_is_marker(&path_str))
+    {
+        return VFS_EINVAL;
+    }
 
     /* Make sure entry not logically exist. */
     vfs_stat_t info;
@@ -1009,20 +3292,16 @@ static int _vfs_overlayfs_mkdir(struct vfs_operations* thiz, const char* path)
         return VFS_EEXIST;
     }
 
-    vfs_str_t path_str = vfs_str_from_static1(path);
-    return _vfs_overlayfs_mkdir_inner(fs, &path_str);
+    ret = _vfs_overlayfs_mkdir_inner(fs, &path_str);
+    _vfs_overlayfs_lscache_invalidate(fs, &path_str, 1, 1);
+
+    return ret;
 }
 
 //////////////////////////////////////////////////////////////////////////
 // rmdir
 //////////////////////////////////////////////////////////////////////////
 
-typedef struct vfs_overlayfs_rmdir_helper
-{
-    vfs_overlayfs_t*    fs;
-    const char*         path;
-} vfs_overlayfs_rmdir_helper_t;
-
 static int _vfs_overlayfs_rmdir_create_whiteout_dir(vfs_overlayfs_t* fs,
     const vfs_str_t* path)
 {
@@ -1034,6 +3313,10 @@ static int _vfs_overlayfs_rmdir_create_whiteout_dir(vfs_overlayfs_t* fs,
     }
     vfs_str_exit(&path_str);
 
+    if (ret == 0)
+    {
+        _vfs_overlayfs_index_update(fs, path, VFS_OVERLAYFS_INDEX_WHITEOUT, 0, 1);
+    }
     return ret;
 }
 
@@ -1047,50 +3330,33 @@ static int _vfs_overlayfs_rmdir_cnt(const char* name, const vfs_stat_t* stat, vo
     return 1;
 }
 
-static int _vfs_overlayfs_rmdir_recursion_children(const char* name, const vfs_stat_t* stat, void* data)
-{
-    vfs_overlayfs_rmdir_helper_t* helper = data;
-    vfs_overlayfs_t* fs = helper->fs;
-
-    vfs_str_t full_path = vfs_str_from1(helper->path);
-    vfs_str_append1(&full_path, "/");
-    vfs_str_append1(&full_path, name);
-
-    if (stat->st_mode & VFS_S_IFREG)
-    {
-        fs->upper->unlink(fs->upper, full_path.str);
-    }
-    else
-    {
-        vfs_overlayfs_rmdir_helper_t tmp_helper = { fs, full_path.str };
-        fs->upper->ls(fs->upper, full_path.str, _vfs_overlayfs_rmdir_recursion_children, &tmp_helper);
-    }
-
-    vfs_str_exit(&full_path);
-    return 0;
-}
-
+/**
+ * @brief Remove directory \p path and everything in it from upper layer.
+ */
 static int _vfs_overlayfs_rmdir_recursion(vfs_overlayfs_t* fs, const char* path)
 {
     int ret;
-
-    vfs_overlayfs_rmdir_helper_t helper = { fs, path };
-    ret = fs->upper->ls(fs->upper, path, _vfs_overlayfs_rmdir_recursion_children, &helper);
-    if (ret != 0)
+    vfs_mutex_enter(&fs->rmdir_lock);
     {
-        return ret;
+        vfs_dir_delete_cfg_t cfg = { fs->rmdir_thread_sz, NULL, NULL };
+        if (fs->rmdir_pool == NULL && fs->rmdir_thread_sz != 0)
+        {
+            vfs_threadpool_cfg_t pool_cfg = { fs->rmdir_thread_sz, VFS_DIR_DELETE_QUEUE_SIZE };
+            vfs_threadpool_init(&fs->rmdir_pool, &pool_cfg);
+        }
+        ret = vfs_dir_delete_with_pool(fs->upper, path, &cfg, fs->rmdir_pool);
     }
-
-    return fs->upper->rmdir(fs->upper, path);
+    vfs_mutex_leave(&fs->rmdir_lock);
+    return ret;
 }
 
-static int _vfs_overlayfs_rmdir(struct vfs_operations* thiz, const char* path)
+static int _vfs_overlayfs_rmdir_inner(struct vfs_operations* thiz, const char* path)
 {
     int ret;
     vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
     vfs_str_t path_str = vfs_str_from_static1(path);
 
-    if (fs->upper->rmdir == NULL || fs->upper->stat == NULL || fs->lower->stat == NULL)
+    if (fs->upper->rmdir == NULL || fs->upper->stat == NULL)
     {
         return VFS_ENOSYS;
     }
@@ -1115,20 +3381,40 @@ static int _vfs_overlayfs_rmdir(struct vfs_operations* thiz, const char* path)
     }
 
     /* Remove the \p path in upper layer. */
-    if ((ret = _vfs_overlayfs_rmdir_recursion(fs, path)) != 0)
+    ret = _vfs_overlayfs_rmdir_recursion(fs, path);
+    _vfs_overlayfs_copyup_forget(fs, &path_str);
+    _vfs_overlayfs_index_forget(fs, &path_str);
+    if (ret != 0)
     {
         return ret;
     }
+    _vfs_overlayfs_index_update(fs, &path_str, 0, VFS_OVERLAYFS_INDEX_EXIST, 0);
 
 finish:
-    /* Check if \p path is in lower layer. */
-    if ((ret = fs->lower->stat(fs->lower, path, &info)) == 0)
+    /* Check if \p path is still visible in any lower layer. */
+    ret = _vfs_overlayfs_common_stat_ex(fs, &path_str, &info, NULL, NULL);
+    if (ret == VFS_OVERLAYFS_STAT_LOWER)
     {/* Create whiteout directory. */
         return _vfs_overlayfs_rmdir_create_whiteout_dir(fs, &path_str);
     }
+    if (ret < 0 && ret != VFS_OVERLAYFS_STAT_NOENT && ret != VFS_OVERLAYFS_STAT_WHITEOUT)
+    {/* unknown error. */
+        return ret;
+    }
     return 0;
 }
 
+static int _vfs_overlayfs_rmdir(struct vfs_operations* thiz, const char* path)
+{
+    vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
+    int ret = _vfs_overlayfs_rmdir_inner(thiz, path);
+
+    vfs_str_t path_str = vfs_str_from_static1(path);
+    _vfs_overlayfs_lscache_invalidate(fs, &path_str, 1, 1);
+
+    return ret;
+}
+
 //////////////////////////////////////////////////////////////////////////
 // unlink
 //////////////////////////////////////////////////////////////////////////
@@ -1140,6 +3426,11 @@ static int _vfs_overlayfs_unlink_create_whiteout_file(vfs_overlayfs_t* fs,
     vfs_str_t path_str = vfs_str_from_static1(path);
     vfs_str_append(&path_str, OVERLAY_WHITEOUT_SUFFIX, OVERLAY_WHITEOUT_SUFFIX_SZ);
     do {
+        if ((ret = vfs_path_ensure_parent_exist(fs->upper, &path_str)) != 0)
+        {
+            break;
+        }
+
         uintptr_t fh = 0;
         ret = fs->upper->open(fs->upper, &fh, path_str.str, VFS_O_WRONLY | VFS_O_CREATE);
         if (ret != 0)
@@ -1150,14 +3441,19 @@ static int _vfs_overlayfs_unlink_create_whiteout_file(vfs_overlayfs_t* fs,
     } while (0);
     vfs_str_exit(&path_str);
 
+    if (ret == 0)
+    {
+        vfs_str_t name = vfs_str_from_static1(path);
+        _vfs_overlayfs_index_update(fs, &name, VFS_OVERLAYFS_INDEX_WHITEOUT, 0, 1);
+    }
     return ret;
 }
 
-static int _vfs_overlayfs_unlink(struct vfs_operations* thiz, const char* path)
+static int _vfs_overlayfs_unlink_inner(struct vfs_operations* thiz, const char* path)
 {
     int ret;
     vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
-    if (fs->upper->unlink == NULL || fs->lower->stat == NULL)
+    if (fs->upper->unlink == NULL)
     {
         return VFS_ENOSYS;
     }
@@ -1180,14 +3476,17 @@ static int _vfs_overlayfs_unlink(struct vfs_operations* thiz, const char* path)
         return ret;
     }
     /* The file now is not exist in upper layer. */
+    vfs_str_t path_str = vfs_str_from_static1(path);
+    _vfs_overlayfs_copyup_forget(fs, &path_str);
+    _vfs_overlayfs_index_update(fs, &path_str, 0, VFS_OVERLAYFS_INDEX_EXIST, 0);
 
-    /* Check the file in lower layer. */
-    ret = fs->lower->stat(fs->lower, path, &info);
-    if (ret == VFS_ENOENT)
-    {/* No such file in lower layer. */
+    /* Check if the file is still visible in any lower layer. */
+    ret = _vfs_overlayfs_common_stat_ex(fs, &path_str, &info, NULL, NULL);
+    if (ret == VFS_OVERLAYFS_STAT_NOENT || ret == VFS_OVERLAYFS_STAT_WHITEOUT)
+    {/* No such file in lower layers. */
         return 0;
     }
-    if (ret != 0)
+    if (ret < 0)
     {/* unknown error. */
         return ret;
     }
@@ -1200,21 +3499,212 @@ static int _vfs_overlayfs_unlink(struct vfs_operations* thiz, const char* path)
     return _vfs_overlayfs_unlink_create_whiteout_file(fs, path);
 }
 
+static int _vfs_overlayfs_unlink(struct vfs_operations* thiz, const char* path)
+{
+    vfs_overlayfs_t* fs = EV_CONTAINER_OF(thiz, vfs_overlayfs_t, op);
+    int ret = _vfs_overlayfs_unlink_inner(thiz, path);
+
+    vfs_str_t path_str = vfs_str_from_static1(path);
+    _vfs_overlayfs_lscache_invalidate(fs, &path_str, 1, 0);
+
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// squash
+//////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Maximum number of file copies queued on the thread pool.
+ */
+#define OVERLAY_SQUASH_QUEUE_SIZE   64
+
+typedef struct vfs_overlayfs_squash
+{
+    vfs_operations_t*       src;        /**< Overlay file system. */
+    vfs_operations_t*       dst;        /**< Target file system. */
+    vfs_taskgroup_t         group;      /**< File copies, and the first error. */
+} vfs_overlayfs_squash_t;
+
+typedef struct vfs_overlayfs_squash_job
+{
+    vfs_overlayfs_squash_t* squash;     /**< Squash context. */
+    vfs_str_t               path;       /**< File path. */
+} vfs_overlayfs_squash_job_t;
+
+typedef struct vfs_overlayfs_squash_ls_helper
+{
+    vfs_strlist_t           dirs;       /**< Sub directories. */
+    vfs_strlist_t           files;      /**< Files. */
+} vfs_overlayfs_squash_ls_helper_t;
+
+static int _vfs_overlayfs_squash_copy_file(vfs_overlayfs_squash_t* squash,
+    const vfs_str_t* path)
+{
+    int ret;
+    uintptr_t src_fh = 0, dst_fh = 0;
+    vfs_operations_t* src = squash->src;
+    vfs_operations_t* dst = squash->dst;
+
+    if ((ret = src->open(src, &src_fh, path->str, VFS_O_RDONLY)) != 0)
+    {
+        return ret;
+    }
+    if ((ret = dst->open(dst, &dst_fh, path->str, VFS_O_WRONLY | VFS_O_CREATE | VFS_O_TRUNCATE)) != 0)
+    {
+        src->close(src, src_fh);
+        return ret;
+    }
+
+    ret = _vfs_overlayfs_common_copy(src, src_fh, dst, dst_fh);
+
+    int close_ret = dst->close(dst, dst_fh);
+    src->close(src, src_fh);
+    return ret != 0 ? ret : close_ret;
+}
+
+static void _vfs_overlayfs_squash_work(int status, void* data)
+{
+    vfs_overlayfs_squash_job_t* job = data;
+    vfs_overlayfs_squash_t* squash = job->squash;
+
+    int ret = status != 0 ? VFS_EIO : _vfs_overlayfs_squash_copy_file(squash, &job->path);
+    if (ret != 0)
+    {
+        vfs_taskgroup_set_error(&squash->group, ret);
+    }
+
+    vfs_str_exit(&job->path);
+    free(job);
+    vfs_taskgroup_done(&squash->group);
+}
+
+static int _vfs_overlayfs_squash_submit(vfs_overlayfs_squash_t* squash,
+    const vfs_str_t* path)
+{
+    if (squash->group.pool == NULL)
+    {
+        return _vfs_overlayfs_squash_copy_file(squash, path);
+    }
+
+    vfs_overlayfs_squash_job_t* job = malloc(sizeof(vfs_overlayfs_squash_job_t));
+    if (job == NULL)
+    {
+        return VFS_ENOMEM;
+    }
+    job->squash = squash;
+    job->path = vfs_str_dup(path);
+
+    if (vfs_taskgroup_submit(&squash->group, _vfs_overlayfs_squash_work, job) != 0)
+    {
+        vfs_str_exit(&job->path);
+        free(job);
+        return VFS_ENOMEM;
+    }
+
+    return vfs_taskgroup_error(&squash->group);
+}
+
+static int _vfs_overlayfs_squash_on_ls(const char* name, const vfs_stat_t* stat, void* data)
+{
+    vfs_overlayfs_squash_ls_helper_t* helper = data;
+
+    if (stat->st_mode & VFS_S_IFDIR)
+    {
+        vfs_strlist_append1(&helper->dirs, name);
+    }
+    else
+    {
+        vfs_strlist_append1(&helper->files, name);
+    }
+    return 0;
+}
+
+static void _vfs_overlayfs_squash_join(vfs_str_t* path, const vfs_str_t* name)
+{
+    if (path->str[path->len - 1] != '/')
+    {
+        vfs_str_append1(path, "/");
+    }
+    vfs_str_append2(path, name);
+}
+
+static int _vfs_overlayfs_squash_dir(vfs_overlayfs_squash_t* squash, vfs_str_t* path)
+{
+    int ret;
+    size_t i;
+    const size_t path_len = path->len;
+    vfs_overlayfs_squash_ls_helper_t helper = { VFS_STRLIST_INIT, VFS_STRLIST_INIT };
+
+    if ((ret = squash->src->ls(squash->src, path->str, _vfs_overlayfs_squash_on_ls, &helper)) != 0)
+    {
+        goto finish;
+    }
+
+    for (i = 0; i < helper.files.num; i++)
+    {
+        _vfs_overlayfs_squash_join(path, &helper.files.arr[i]);
+        ret = _vfs_overlayfs_squash_submit(squash, path);
+        vfs_str_resize(path, path_len);
+        if (ret != 0)
+        {
+            goto finish;
+        }
+    }
+
+    for (i = 0; i < helper.dirs.num; i++)
+    {
+        _vfs_overlayfs_squash_join(path, &helper.dirs.arr[i]);
+        if ((ret = squash->dst->mkdir(squash->dst, path->str)) == 0)
+        {
+            ret = _vfs_overlayfs_squash_dir(squash, path);
+        }
+        vfs_str_resize(path, path_len);
+        if (ret != 0)
+        {
+            goto finish;
+        }
+    }
+
+finish:
+    vfs_strlist_exit(&helper.dirs);
+    vfs_strlist_exit(&helper.files);
+    return ret;
+}
+
 //////////////////////////////////////////////////////////////////////////
 // API
 //////////////////////////////////////////////////////////////////////////
 
-int vfs_make_overlay(vfs_operations_t** fs, vfs_operations_t* lower,
-    vfs_operations_t* upper)
+int vfs_make_overlay_ex(vfs_operations_t** fs, vfs_operations_t** lowers,
+    size_t lower_sz, vfs_operations_t* upper)
 {
-    vfs_overlayfs_t* overlayfs = calloc(1, sizeof(vfs_overlayfs_t));
+    size_t i;
+    if (lowers == NULL || lower_sz == 0)
+    {
+        return VFS_EINVAL;
+    }
+
+    const size_t layer_sz = lower_sz + 1;
+    vfs_overlayfs_t* overlayfs = calloc(1,
+        sizeof(vfs_overlayfs_t) + sizeof(vfs_overlayfs_layer_t) * layer_sz);
     if (overlayfs == NULL)
     {
         return VFS_ENOMEM;
     }
 
-    overlayfs->lower = lower;
     overlayfs->upper = upper;
+    overlayfs->layer_sz = layer_sz;
+    overlayfs->layers[0].fs = upper;
+    for (i = 0; i < lower_sz; i++)
+    {
+        overlayfs->layers[i + 1].fs = lowers[i];
+    }
+    for (i = 0; i < layer_sz; i++)
+    {
+        vfs_map_init(&overlayfs->layers[i].index_map, _vfs_overlayfs_cmp_index_dir, NULL);
+        vfs_list_init(&overlayfs->layers[i].index_lru);
+    }
 
     overlayfs->op.destroy = _vfs_overlayfs_destroy;
     overlayfs->op.ls = _vfs_overlayfs_ls;
@@ -1231,7 +3721,140 @@ int vfs_make_overlay(vfs_operations_t** fs, vfs_operations_t* lower,
 
     vfs_map_init(&overlayfs->session_map, _vfs_overlayfs_cmp_session, NULL);
     vfs_mutex_init(&overlayfs->session_map_lock);
+    vfs_mutex_init(&overlayfs->index_lock);
+    vfs_map_init(&overlayfs->lscache_map, _vfs_overlayfs_cmp_lscache, NULL);
+    vfs_list_init(&overlayfs->lscache_lru);
+    vfs_mutex_init(&overlayfs->lscache_lock);
+    vfs_map_init(&overlayfs->copyup_map, _vfs_overlayfs_cmp_copyup, NULL);
+    vfs_mutex_init(&overlayfs->copyup_lock);
+    vfs_mutex_init(&overlayfs->rmdir_lock);
 
     *fs = &overlayfs->op;
     return 0;
 }
+
+int vfs_make_overlay(vfs_operations_t** fs, vfs_operations_t* lower,
+    vfs_operations_t* upper)
+{
+    return vfs_make_overlay_ex(fs, &lower, 1, upper);
+}
+
+int vfs_overlayfs_set_copyup_block(vfs_operations_t* fs, size_t block_sz)
+{
+    vfs_overlayfs_t* overlayfs = EV_CONTAINER_OF(fs, vfs_overlayfs_t, op);
+    overlayfs->copyup_block_sz = block_sz;
+    overlayfs->copyup_block_auto = 0;
+    return 0;
+}
+
+int vfs_overlayfs_set_copyup_async(vfs_operations_t* fs, size_t thread_sz)
+{
+    vfs_overlayfs_t* overlayfs = EV_CONTAINER_OF(fs, vfs_overlayfs_t, op);
+
+    if (overlayfs->copyup_pool != NULL)
+    {
+        vfs_threadpool_exit(overlayfs->copyup_pool);
+        overlayfs->copyup_pool = NULL;
+    }
+    overlayfs->copyup_thread_sz = thread_sz;
+    if (thread_sz == 0)
+    {
+        /* Block size that was not chosen by user goes away with workers. */
+        if (overlayfs->copyup_block_auto)
+        {
+            overlayfs->copyup_block_sz = 0;
+            overlayfs->copyup_block_auto = 0;
+        }
+        return 0;
+    }
+
+    /* Background copy-up works block by block. */
+    if (overlayfs->copyup_block_sz == 0)
+    {
+        overlayfs->copyup_block_sz = OVERLAY_COPYUP_BLOCK_SIZE;
+        overlayfs->copyup_block_auto = 1;
+    }
+
+    vfs_threadpool_cfg_t cfg = { thread_sz, 1024 };
+    vfs_threadpool_init(&overlayfs->copyup_pool, &cfg);
+    return 0;
+}
+
+int vfs_overlayfs_copyup_progress(vfs_operations_t* fs, const char* path,
+    uint64_t* copied, uint64_t* total)
+{
+    int ret;
+    vfs_overlayfs_t* overlayfs = EV_CONTAINER_OF(fs, vfs_overlayfs_t, op);
+    vfs_str_t path_str = vfs_str_from_static1(path);
+
+    vfs_overlayfs_copyup_t* copyup = _vfs_overlayfs_copyup_find(overlayfs, &path_str);
+    if (copyup == NULL)
+    {
+        return VFS_ENOENT;
+    }
+
+    vfs_mutex_enter(&copyup->lock);
+    {
+        uint64_t copied_sz = (uint64_t)copyup->copied_cnt * copyup->block_sz;
+        *copied = copied_sz < copyup->total ? copied_sz : copyup->total;
+        *total = copyup->total;
+        ret = copyup->errcode;
+    }
+    vfs_mutex_leave(&copyup->lock);
+
+    /* If the file is closed meanwhile, this finishes copy-up. */
+    _vfs_overlayfs_copyup_release(copyup);
+    return ret;
+}
+
+int vfs_overlay_squash(vfs_operations_t* fs, vfs_operations_t* dst, size_t thread_sz)
+{
+    vfs_threadpool_t* pool = NULL;
+    vfs_overlayfs_squash_t squash;
+    squash.src = fs;
+    squash.dst = dst;
+
+    if (thread_sz != 0)
+    {
+        vfs_threadpool_cfg_t cfg = { thread_sz, OVERLAY_SQUASH_QUEUE_SIZE };
+        vfs_threadpool_init(&pool, &cfg);
+    }
+    vfs_taskgroup_init(&squash.group, pool, thread_sz, OVERLAY_SQUASH_QUEUE_SIZE);
+
+    vfs_str_t path = vfs_str_from1("/");
+    int ret = _vfs_overlayfs_squash_dir(&squash, &path);
+    vfs_str_exit(&path);
+
+    /* Wait for all queued copies. */
+    vfs_taskgroup_wait(&squash.group);
+    if (ret == 0)
+    {
+        ret = vfs_taskgroup_error(&squash.group);
+    }
+    vfs_taskgroup_exit(&squash.group);
+
+    if (pool != NULL)
+    {
+        vfs_threadpool_exit(pool);
+    }
+    return ret;
+}
+
+int vfs_overlayfs_set_rmdir_async(vfs_operations_t* fs, size_t thread_sz)
+{
+    vfs_overlayfs_t* overlayfs = EV_CONTAINER_OF(fs, vfs_overlayfs_t, op);
+
+    vfs_mutex_enter(&overlayfs->rmdir_lock);
+    {
+        /* Workers are created again on next rmdir. */
+        if (overlayfs->rmdir_pool != NULL)
+        {
+            vfs_threadpool_exit(overlayfs->rmdir_pool);
+            overlayfs->rmdir_pool = NULL;
+        }
+        overlayfs->rmdir_thread_sz = thread_sz;
+    }
+    vfs_mutex_leave(&overlayfs->rmdir_lock);
+
+    return 0;
+}
@@ -133,6 +133,7 @@ static int _vfs_randfs_stat(struct vfs_operations* thiz, const char* path, vfs_s
         info->st_mode = VFS_S_IFDIR;
         info->st_mtime = 0;
         info->st_size = 0;
+        info->st_blocks = 0;
         return 0;
     }
 
@@ -141,6 +142,7 @@ static int _vfs_randfs_stat(struct vfs_operations* thiz, const char* path, vfs_s
         info->st_mode = VFS_S_IFREG;
         info->st_mtime = 0;
         info->st_size = 1;
+        info->st_blocks = 0;
         return 0;
     }
 
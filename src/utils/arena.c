@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+/**
+ * @brief Alignment of allocations.
+ */
+#define VFS_ARENA_ALIGN         16
+
+typedef struct vfs_arena_block
+{
+    struct vfs_arena_block* next;       /**< Next block. */
+    size_t                  pad;        /**< Keep data aligned. */
+    char                    data[];     /**< Memory to carve. */
+} vfs_arena_block_t;
+
+void vfs_arena_exit(vfs_arena_t* arena)
+{
+    vfs_arena_block_t* block;
+    while ((block = arena->blocks) != NULL)
+    {
+        arena->blocks = block->next;
+        free(block);
+    }
+    arena->used = 0;
+    arena->cap = 0;
+}
+
+void* vfs_arena_alloc(vfs_arena_t* arena, size_t size)
+{
+    size = (size + VFS_ARENA_ALIGN - 1) & ~(size_t)(VFS_ARENA_ALIGN - 1);
+
+    if (arena->blocks == NULL || arena->cap - arena->used < size)
+    {
+        /* Large allocation takes a block on its own. */
+        size_t cap = size > VFS_ARENA_BLOCK_SIZE ? size : VFS_ARENA_BLOCK_SIZE;
+        vfs_arena_block_t* block = malloc(sizeof(vfs_arena_block_t) + cap);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->used = 0;
+        arena->cap = cap;
+    }
+
+    void* ptr = arena->blocks->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+char* vfs_arena_strdup(vfs_arena_t* arena, const char* data, size_t size)
+{
+    char* str = vfs_arena_alloc(arena, size + 1);
+    if (str == NULL)
+    {
+        return NULL;
+    }
+    memcpy(str, data, size);
+    str[size] = '\0';
+    return str;
+}
@@ -0,0 +1,61 @@
+#ifndef __VFS_UTILS_ARENA_H__
+#define __VFS_UTILS_ARENA_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Size in bytes of one arena block.
+ */
+#define VFS_ARENA_BLOCK_SIZE    (64 * 1024)
+
+struct vfs_arena_block;
+
+/**
+ * @brief Allocator for short-lived memory.
+ *
+ * Memory is carved from large blocks and never freed one by one, all blocks
+ * are freed at once when the arena is destroyed. It is not thread safe.
+ */
+typedef struct vfs_arena
+{
+    struct vfs_arena_block* blocks;     /**< All blocks, the first one is being carved. */
+    size_t                  used;       /**< Bytes used in the first block. */
+    size_t                  cap;        /**< Capacity in bytes of the first block. */
+} vfs_arena_t;
+
+/**
+ * @brief Static initializer for #vfs_arena_t.
+ */
+#define VFS_ARENA_INIT  { NULL, 0, 0 }
+
+/**
+ * @brief Free all memory allocated from arena.
+ * @param[in,out] arena - Arena object, it is ready for reuse after return.
+ */
+void vfs_arena_exit(vfs_arena_t* arena);
+
+/**
+ * @brief Allocate memory.
+ * @param[in] arena - Arena object.
+ * @param[in] size - Size in bytes.
+ * @return Memory with undefined content, or NULL if out of memory.
+ */
+void* vfs_arena_alloc(vfs_arena_t* arena, size_t size);
+
+/**
+ * @brief Copy string into arena.
+ * @param[in] arena - Arena object.
+ * @param[in] data - String.
+ * @param[in] size - Size in bytes, not including terminal '\0'.
+ * @return Copied string with terminal '\0', or NULL if out of memory.
+ */
+char* vfs_arena_strdup(vfs_arena_t* arena, const char* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1 +1,26 @@
 #include "atomic.h"
+
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+
+int vfs_atomic_cas(vfs_atomic_t* a, int expected, int desired)
+{
+    atomic_compare_exchange_strong(a, &expected, desired);
+    return expected;
+}
+
+#elif defined(_WIN32)
+
+int vfs_atomic_cas(vfs_atomic_t* a, int expected, int desired)
+{
+    return InterlockedCompareExchange(a, desired, expected);
+}
+
+#else
+
+int vfs_atomic_cas(vfs_atomic_t* a, int expected, int desired)
+{
+    __atomic_compare_exchange_n(a, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
+}
+
+#endif
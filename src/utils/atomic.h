@@ -14,6 +14,9 @@ extern "C" {
 typedef atomic_int vfs_atomic_t;
 #define vfs_atomic_add(a) (atomic_fetch_add(a, 1) + 1)
 #define vfs_atomic_dec(a) (atomic_fetch_add(a, -1) - 1)
+#define vfs_atomic_load(a) atomic_load(a)
+#define vfs_atomic_store(a, v) atomic_store(a, v)
+#define vfs_atomic_fence() atomic_thread_fence(memory_order_seq_cst)
 
 typedef atomic_int_fast64_t vfs_atomic64_t;
 #define vfs_atomic64_add(a) vfs_atomic_add(a)
@@ -30,6 +33,9 @@ typedef atomic_int_fast64_t vfs_atomic64_t;
 typedef LONG vfs_atomic_t;
 #define vfs_atomic_add(a) InterlockedIncrement(a)
 #define vfs_atomic_dec(a) InterlockedDecrement(a)
+#define vfs_atomic_load(a) InterlockedCompareExchange(a, 0, 0)
+#define vfs_atomic_store(a, v) InterlockedExchange(a, v)
+#define vfs_atomic_fence() MemoryBarrier()
 
 typedef LONG64 vfs_atomic64_t;
 #define vfs_atomic64_add(a) InterlockedIncrement64(a)
@@ -46,6 +52,9 @@ typedef LONG64 vfs_atomic64_t;
 typedef int vfs_atomic_t;
 #define vfs_atomic_add(a) __atomic_add_fetch(a, 1, __ATOMIC_SEQ_CST)
 #define vfs_atomic_dec(a) __atomic_sub_fetch(a, 1, __ATOMIC_SEQ_CST)
+#define vfs_atomic_load(a) __atomic_load_n(a, __ATOMIC_SEQ_CST)
+#define vfs_atomic_store(a, v) __atomic_store_n(a, v, __ATOMIC_SEQ_CST)
+#define vfs_atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
 
 typedef int64_t vfs_atomic64_t;
 #define vfs_atomic64_add(a) vfs_atomic_add(a)
@@ -57,6 +66,19 @@ typedef int64_t vfs_atomic64_t;
 
 #endif
 
+/**
+ * @brief Compare and swap.
+ *
+ * Set \p a to \p desired if it is \p expected, as one atomic operation.
+ *
+ * @param[in,out] a - Atomic object.
+ * @param[in] expected - Expected value.
+ * @param[in] desired - New value.
+ * @return The value of \p a before this operation. The swap is done if it
+ *   equals to \p expected.
+ */
+int vfs_atomic_cas(vfs_atomic_t* a, int expected, int desired);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,26 @@
+#include "clock.h"
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+uint64_t vfs_clock_now(void)
+{
+    LARGE_INTEGER freq, cnt;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&cnt);
+    return (uint64_t)((double)cnt.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+}
+
+#else
+
+#include <time.h>
+
+uint64_t vfs_clock_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __VFS_UTILS_CLOCK_H__
+#define __VFS_UTILS_CLOCK_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Get monotonic time.
+ * @return Time in nanoseconds since an unspecified point in the past.
+ */
+uint64_t vfs_clock_now(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,12 +1,40 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include "dir.h"
+#include "mutex.h"
+#include "strlist.h"
+#include "taskgroup.h"
 
-typedef struct vfs_dir_delete_helper
+/**
+ * @brief The number of files removed by one job.
+ */
+#define VFS_DIR_DELETE_BATCH_SIZE   64
+
+typedef struct vfs_dir_delete_ctx
+{
+    vfs_operations_t*           fs;         /**< The file system we are working on. */
+    const vfs_dir_delete_cfg_t* cfg;        /**< Configuration. */
+
+    vfs_taskgroup_t             group;      /**< Jobs that remove files, and the first error. */
+
+    vfs_mutex_t                 lock;       /**< Protects #vfs_dir_delete_ctx_t::removed. */
+    uint64_t                    removed;    /**< The number of removed entries. */
+} vfs_dir_delete_ctx_t;
+
+typedef struct vfs_dir_delete_job
+{
+    vfs_dir_delete_ctx_t*       ctx;        /**< Delete context. */
+    size_t                      num;        /**< The number of files. */
+    vfs_str_t                   paths[];    /**< Files to remove, owned by the job. */
+} vfs_dir_delete_job_t;
+
+typedef struct vfs_dir_delete_ls_helper
 {
-    vfs_operations_t*   fs;         /**< The file system we are working on. */
-    int                 errcode;    /**< Error code. */
-    vfs_str_t           path;       /**< The path need to delete. */
-} vfs_dir_delete_helper_t;
+    const vfs_str_t*            path;       /**< The directory being listed. */
+    vfs_strlist_t*              dirs;       /**< All directories found so far. */
+    vfs_strlist_t               files;      /**< Files in the directory. */
+} vfs_dir_delete_ls_helper_t;
 
 static void _vfs_path_to_generic(vfs_str_t* str, char s, char t)
 {
@@ -23,24 +51,224 @@ static void _vfs_path_to_generic(vfs_str_t* str, char s, char t)
     }
 }
 
-static int _vfs_dir_delete_on_ls(const char* name, const vfs_stat_t* stat, void* data)
+static void _vfs_dir_delete_report(vfs_dir_delete_ctx_t* ctx, int errcode, uint64_t removed)
+{
+    if (errcode != 0)
+    {
+        vfs_taskgroup_set_error(&ctx->group, errcode);
+    }
+
+    vfs_mutex_enter(&ctx->lock);
+    ctx->removed += removed;
+    vfs_mutex_leave(&ctx->lock);
+}
+
+static void _vfs_dir_delete_progress(vfs_dir_delete_ctx_t* ctx)
 {
-    vfs_dir_delete_helper_t* helper = data;
+    if (ctx->cfg->progress == NULL)
+    {
+        return;
+    }
+
+    uint64_t removed;
+    vfs_mutex_enter(&ctx->lock);
+    removed = ctx->removed;
+    vfs_mutex_leave(&ctx->lock);
+
+    ctx->cfg->progress(removed, ctx->cfg->data);
+}
 
-    vfs_str_t full_path = vfs_str_dup(&helper->path);
-    vfs_str_append1(&full_path, "/");
-    vfs_str_append1(&full_path, name);
-    do
+static void _vfs_dir_delete_unlink(vfs_dir_delete_ctx_t* ctx, const vfs_str_t* paths, size_t num)
+{
+    int ret = 0;
+    size_t i;
+    for (i = 0; i < num; i++)
     {
-        if (stat->st_mode & VFS_S_IFREG)
+        if ((ret = ctx->fs->unlink(ctx->fs, paths[i].str)) != 0)
         {
-            helper->errcode = helper->fs->unlink(helper->fs, full_path.str);
             break;
         }
-        helper->errcode = vfs_dir_delete(helper->fs, full_path.str);
-    } while (0);
-    vfs_str_exit(&full_path);
-    return helper->errcode != 0 ? 1 : 0;
+    }
+    _vfs_dir_delete_report(ctx, ret, i);
+}
+
+static void _vfs_dir_delete_free_paths(vfs_str_t* paths, size_t num)
+{
+    size_t i;
+    for (i = 0; i < num; i++)
+    {
+        vfs_str_exit(&paths[i]);
+    }
+}
+
+static void _vfs_dir_delete_work(int status, void* data)
+{
+    vfs_dir_delete_job_t* job = data;
+    vfs_dir_delete_ctx_t* ctx = job->ctx;
+
+    if (status != 0)
+    {
+        _vfs_dir_delete_report(ctx, VFS_EIO, 0);
+    }
+    else if (vfs_taskgroup_error(&ctx->group) == 0)
+    {
+        _vfs_dir_delete_unlink(ctx, job->paths, job->num);
+    }
+
+    _vfs_dir_delete_free_paths(job->paths, job->num);
+    free(job);
+    vfs_taskgroup_done(&ctx->group);
+}
+
+/**
+ * @brief Remove \p paths by a worker, or in calling thread if there is no
+ *   worker.
+ * @note Strings in \p paths are moved, so caller must not free them.
+ * @param[in] ctx - Delete context.
+ * @param[in] paths - Files to remove.
+ * @param[in] num - The number of files.
+ */
+static void _vfs_dir_delete_submit(vfs_dir_delete_ctx_t* ctx, vfs_str_t* paths, size_t num)
+{
+    if (ctx->group.pool == NULL)
+    {
+        _vfs_dir_delete_unlink(ctx, paths, num);
+        _vfs_dir_delete_free_paths(paths, num);
+        return;
+    }
+
+    vfs_dir_delete_job_t* job = malloc(sizeof(vfs_dir_delete_job_t) + sizeof(vfs_str_t) * num);
+    if (job == NULL)
+    {
+        _vfs_dir_delete_free_paths(paths, num);
+        _vfs_dir_delete_report(ctx, VFS_ENOMEM, 0);
+        return;
+    }
+    job->ctx = ctx;
+    job->num = num;
+    memcpy(job->paths, paths, sizeof(vfs_str_t) * num);
+
+    if (vfs_taskgroup_submit(&ctx->group, _vfs_dir_delete_work, job) != 0)
+    {
+        _vfs_dir_delete_free_paths(job->paths, job->num);
+        free(job);
+        _vfs_dir_delete_report(ctx, VFS_ENOMEM, 0);
+    }
+}
+
+static int _vfs_dir_delete_on_ls(const char* name, const vfs_stat_t* stat, void* data)
+{
+    vfs_dir_delete_ls_helper_t* helper = data;
+    vfs_strlist_t* list = (stat->st_mode & VFS_S_IFREG) ? &helper->files : helper->dirs;
+
+    vfs_strlist_append(list, helper->path->str, helper->path->len);
+    vfs_str_t* full_path = &list->arr[list->num - 1];
+    if (!vfs_str_endwith(full_path, "/", 1))
+    {
+        vfs_str_append1(full_path, "/");
+    }
+    vfs_str_append1(full_path, name);
+
+    return 0;
+}
+
+/**
+ * @brief Remove all files in directory \p path, and record its sub directories.
+ *
+ * Entries are collected first, so the file system is not changed while it is
+ * listing. Files may still be being removed when it returns.
+ *
+ * @param[in] ctx - Delete context.
+ * @param[in] path - The directory path.
+ * @param[in,out] dirs - Sub directories are appended to it.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_dir_delete_files(vfs_dir_delete_ctx_t* ctx, const vfs_str_t* path,
+    vfs_strlist_t* dirs)
+{
+    int ret;
+    size_t i;
+    vfs_dir_delete_ls_helper_t helper = { path, dirs, VFS_STRLIST_INIT };
+
+    if ((ret = ctx->fs->ls(ctx->fs, path->str, _vfs_dir_delete_on_ls, &helper)) != 0)
+    {
+        goto finish;
+    }
+
+    /* Each job takes its files, so no need to wait for them here. */
+    for (i = 0; i < helper.files.num; i += VFS_DIR_DELETE_BATCH_SIZE)
+    {
+        size_t num = helper.files.num - i;
+        num = num < VFS_DIR_DELETE_BATCH_SIZE ? num : VFS_DIR_DELETE_BATCH_SIZE;
+        if (vfs_taskgroup_error(&ctx->group) == 0)
+        {
+            _vfs_dir_delete_submit(ctx, helper.files.arr + i, num);
+        }
+        else
+        {
+            _vfs_dir_delete_free_paths(helper.files.arr + i, num);
+        }
+    }
+    helper.files.num = 0;
+    ret = vfs_taskgroup_error(&ctx->group);
+
+finish:
+    vfs_strlist_exit(&helper.files);
+    return ret;
+}
+
+/**
+ * @brief Remove files under \p path, then remove directories bottom-up.
+ * @param[in] ctx - Delete context.
+ * @param[in] path - The directory path.
+ * @return - 0: on success.
+ * @return - -errno: on error.
+ */
+static int _vfs_dir_delete_tree(vfs_dir_delete_ctx_t* ctx, const char* path)
+{
+    int ret = 0;
+    size_t i;
+    vfs_strlist_t dirs = VFS_STRLIST_INIT;
+    vfs_strlist_append1(&dirs, path);
+
+    /* Every directory is listed after its parent. */
+    for (i = 0; i < dirs.num; i++)
+    {
+        vfs_str_t dir = vfs_str_dup(&dirs.arr[i]);
+        ret = _vfs_dir_delete_files(ctx, &dir, &dirs);
+        vfs_str_exit(&dir);
+        if (ret != 0)
+        {
+            goto finish;
+        }
+        _vfs_dir_delete_progress(ctx);
+    }
+
+    /* Directories must be empty before removed. */
+    vfs_taskgroup_wait(&ctx->group);
+    if ((ret = vfs_taskgroup_error(&ctx->group)) != 0)
+    {
+        goto finish;
+    }
+    _vfs_dir_delete_progress(ctx);
+
+    /* So children are removed before their parent. */
+    for (i = dirs.num; i > 0; i--)
+    {
+        if ((ret = ctx->fs->rmdir(ctx->fs, dirs.arr[i - 1].str)) != 0)
+        {
+            goto finish;
+        }
+        _vfs_dir_delete_report(ctx, 0, 1);
+        _vfs_dir_delete_progress(ctx);
+    }
+
+finish:
+    /* Jobs refer to the context. */
+    vfs_taskgroup_wait(&ctx->group);
+    vfs_strlist_exit(&dirs);
+    return ret;
 }
 
 /**
@@ -108,8 +336,10 @@ static int _vfs_dir_mkdir(vfs_operations_t* fs, const vfs_str_t* root, const vfs
      * We are starting from `root->len+2`, that's because:
      * 1. `root->len` refer to the root, which is always an exist directory.
      * 2. `root->len+1` refer to the root plus '/'.
+     *
+     * If root is `/`, the '/' is the root itself, so start from 1.
      */
-    for (pos = root->len + 2; pos < path->len; pos++)
+    for (pos = vfs_path_is_root(root) ? 1 : root->len + 2; pos < path->len; pos++)
     {
         if (path->str[pos] == '/')
         {
@@ -286,24 +516,57 @@ int vfs_dir_make(vfs_operations_t* fs, const char* path)
 }
 
 int vfs_dir_delete(vfs_operations_t* fs, const char* path)
+{
+    return vfs_dir_delete_ex(fs, path, NULL);
+}
+
+int vfs_dir_delete_ex(vfs_operations_t* fs, const char* path, const vfs_dir_delete_cfg_t* cfg)
 {
     int ret;
-    vfs_dir_delete_helper_t helper = { fs, 0, VFS_STR_INIT };
-    helper.path = vfs_str_from_static1(path);
+    vfs_threadpool_t* pool = NULL;
 
     if (fs->ls == NULL || fs->rmdir == NULL || fs->unlink == NULL)
     {
         return VFS_ENOSYS;
     }
 
-    if ((ret = fs->ls(fs, path, _vfs_dir_delete_on_ls, &helper)) != 0)
+    if (cfg != NULL && cfg->thread_sz != 0)
     {
-        return ret;
+        vfs_threadpool_cfg_t pool_cfg = { cfg->thread_sz, VFS_DIR_DELETE_QUEUE_SIZE };
+        vfs_threadpool_init(&pool, &pool_cfg);
     }
-    if (helper.errcode != 0)
+
+    ret = vfs_dir_delete_with_pool(fs, path, cfg, pool);
+
+    if (pool != NULL)
     {
-        return helper.errcode;
+        vfs_threadpool_exit(pool);
     }
+    return ret;
+}
+
+int vfs_dir_delete_with_pool(vfs_operations_t* fs, const char* path,
+    const vfs_dir_delete_cfg_t* cfg, vfs_threadpool_t* pool)
+{
+    int ret;
+    const vfs_dir_delete_cfg_t default_cfg = { 0, NULL, NULL };
 
-    return fs->rmdir(fs, path);
+    if (fs->ls == NULL || fs->rmdir == NULL || fs->unlink == NULL)
+    {
+        return VFS_ENOSYS;
+    }
+
+    vfs_dir_delete_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fs = fs;
+    ctx.cfg = cfg != NULL ? cfg : &default_cfg;
+    vfs_taskgroup_init(&ctx.group, pool, ctx.cfg->thread_sz, VFS_DIR_DELETE_QUEUE_SIZE);
+    vfs_mutex_init(&ctx.lock);
+
+    ret = _vfs_dir_delete_tree(&ctx, path);
+
+    vfs_mutex_exit(&ctx.lock);
+    vfs_taskgroup_exit(&ctx.group);
+
+    return ret;
 }
@@ -3,6 +3,7 @@
 
 #include "vfs/utils/dir.h"
 #include "utils/str.h"
+#include "utils/threadpool.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -77,6 +78,33 @@ int vfs_path_ensure_dir_exist(vfs_operations_t* fs, const vfs_str_t* path);
  */
 int vfs_path_ensure_parent_exist(vfs_operations_t* fs, const vfs_str_t* path);
 
+/**
+ * @brief Maximum number of jobs #vfs_dir_delete_with_pool() queues on the
+ *   thread pool.
+ */
+#define VFS_DIR_DELETE_QUEUE_SIZE   64
+
+/**
+ * @brief Same as #vfs_dir_delete_ex(), but files are removed by \p pool.
+ *
+ * The pool can be kept for many calls, so threads are not created for each
+ * of them.
+ *
+ * @note \p pool must have #vfs_dir_delete_cfg_t::thread_sz threads, each
+ *   queues at least #VFS_DIR_DELETE_QUEUE_SIZE jobs, and it must not be used
+ *   by another call at the same time.
+ * @param[in] fs - The file system.
+ * @param[in] path - The path of the directory, encoding in UTF-8.
+ * @param[in] cfg - (Optional) Configuration, NULL to remove in calling thread.
+ * @param[in] pool - (Optional) Workers, NULL to remove in calling thread.
+ * @return - 0: on success.
+ * @return - #VFS_ENOSYS: \p fs does not implement #vfs_operations_t::rmdir(),
+ *   #vfs_operations_t::unlink() or #vfs_operations_t::ls().
+ * @return - -errno: on error.
+ */
+int vfs_dir_delete_with_pool(vfs_operations_t* fs, const char* path,
+    const vfs_dir_delete_cfg_t* cfg, vfs_threadpool_t* pool);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include "epoch.h"
+#include "thread.h"
+
+#if defined(_MSC_VER)
+#   define VFS_THREAD_LOCAL __declspec(thread)
+#elif __STDC_VERSION__ >= 201112L
+#   define VFS_THREAD_LOCAL _Thread_local
+#else
+#   define VFS_THREAD_LOCAL __thread
+#endif
+
+/**
+ * @brief Slot of current thread, plus one. Zero means not assigned yet.
+ */
+static VFS_THREAD_LOCAL unsigned s_epoch_slot = 0;
+
+/**
+ * @brief Slots are assigned to threads round robin.
+ */
+static vfs_atomic_t s_epoch_slot_next = 0;
+
+static unsigned _vfs_epoch_slot(void)
+{
+    if (s_epoch_slot == 0)
+    {
+        s_epoch_slot = ((unsigned)vfs_atomic_add(&s_epoch_slot_next) % VFS_EPOCH_SLOTS) + 1;
+    }
+    return s_epoch_slot - 1;
+}
+
+static void _vfs_epoch_wait_phase(vfs_epoch_t* epoch, int phase)
+{
+    size_t i;
+    for (i = 0; i < VFS_EPOCH_SLOTS; i++)
+    {
+        while (vfs_atomic_load(&epoch->slots[i].cnt[phase]) != 0)
+        {
+            vfs_thread_yield();
+        }
+    }
+}
+
+static void _vfs_epoch_reclaim(vfs_epoch_retired_t* list)
+{
+    vfs_epoch_retired_t* rec;
+    while ((rec = list) != NULL)
+    {
+        list = rec->next;
+        rec->fn(rec->ptr);
+        free(rec);
+    }
+}
+
+void vfs_epoch_init(vfs_epoch_t* epoch)
+{
+    size_t i;
+
+    epoch->phase = 0;
+    vfs_mutex_init(&epoch->sync_lock);
+    vfs_mutex_init(&epoch->retire_lock);
+    epoch->retire_list = NULL;
+    epoch->retire_sz = 0;
+
+    for (i = 0; i < VFS_EPOCH_SLOTS; i++)
+    {
+        epoch->slots[i].cnt[0] = 0;
+        epoch->slots[i].cnt[1] = 0;
+    }
+}
+
+void vfs_epoch_exit(vfs_epoch_t* epoch)
+{
+    _vfs_epoch_reclaim(epoch->retire_list);
+    epoch->retire_list = NULL;
+    epoch->retire_sz = 0;
+
+    vfs_mutex_exit(&epoch->retire_lock);
+    vfs_mutex_exit(&epoch->sync_lock);
+}
+
+int vfs_epoch_enter(vfs_epoch_t* epoch)
+{
+    const unsigned slot = _vfs_epoch_slot();
+    const int phase = vfs_atomic_load(&epoch->phase);
+
+    (void)vfs_atomic_add(&epoch->slots[slot].cnt[phase]);
+
+    /*
+     * Pairs with the fence in #vfs_epoch_synchronize(). Either the writer sees
+     * our counter, or we see everything it unlinked before waiting.
+     */
+    vfs_atomic_fence();
+
+    return (int)(slot << 1) | phase;
+}
+
+void vfs_epoch_leave(vfs_epoch_t* epoch, int token)
+{
+    (void)vfs_atomic_dec(&epoch->slots[token >> 1].cnt[token & 0x01]);
+}
+
+void vfs_epoch_synchronize(vfs_epoch_t* epoch)
+{
+    int i;
+
+    vfs_mutex_enter(&epoch->sync_lock);
+    vfs_atomic_fence();
+
+    /*
+     * A reader may read the phase just before we flip it and increase the
+     * counter after we have checked it, so both phases must be drained.
+     */
+    for (i = 0; i < 2; i++)
+    {
+        const int phase = vfs_atomic_load(&epoch->phase);
+        vfs_atomic_store(&epoch->phase, phase ^ 0x01);
+        vfs_atomic_fence();
+
+        _vfs_epoch_wait_phase(epoch, phase);
+    }
+
+    vfs_mutex_leave(&epoch->sync_lock);
+}
+
+void vfs_epoch_retire(vfs_epoch_t* epoch, void* ptr, vfs_epoch_free_cb fn)
+{
+    vfs_epoch_retired_t* rec = malloc(sizeof(vfs_epoch_retired_t));
+    if (rec == NULL)
+    {
+        vfs_epoch_synchronize(epoch);
+        fn(ptr);
+        return;
+    }
+    rec->ptr = ptr;
+    rec->fn = fn;
+
+    vfs_epoch_retired_t* list = NULL;
+    vfs_mutex_enter(&epoch->retire_lock);
+    {
+        rec->next = epoch->retire_list;
+        epoch->retire_list = rec;
+        epoch->retire_sz++;
+
+        if (epoch->retire_sz >= VFS_EPOCH_RETIRE_BATCH)
+        {
+            list = epoch->retire_list;
+            epoch->retire_list = NULL;
+            epoch->retire_sz = 0;
+        }
+    }
+    vfs_mutex_leave(&epoch->retire_lock);
+
+    if (list != NULL)
+    {
+        vfs_epoch_synchronize(epoch);
+        _vfs_epoch_reclaim(list);
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef __VFS_UTILS_EPOCH_H__
+#define __VFS_UTILS_EPOCH_H__
+
+#include "atomic.h"
+#include "mutex.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief The number of reader slots. Threads are spread over the slots so
+ *   readers do not share cache lines.
+ */
+#define VFS_EPOCH_SLOTS         64
+
+/**
+ * @brief Retired objects are reclaimed in batches of this size.
+ */
+#define VFS_EPOCH_RETIRE_BATCH  64
+
+/**
+ * @brief Reclaim callback.
+ * @param[in] ptr - Retired object.
+ */
+typedef void (*vfs_epoch_free_cb)(void* ptr);
+
+typedef struct vfs_epoch_slot
+{
+    vfs_atomic_t                cnt[2];             /**< Active readers on each phase. */
+    char                        padding[64 - 2 * sizeof(vfs_atomic_t)];
+} vfs_epoch_slot_t;
+
+typedef struct vfs_epoch_retired
+{
+    struct vfs_epoch_retired*   next;               /**< Next retired object. */
+    void*                       ptr;                /**< Retired object. */
+    vfs_epoch_free_cb           fn;                 /**< Reclaim callback. */
+} vfs_epoch_retired_t;
+
+/**
+ * @brief Epoch based memory reclamation.
+ *
+ * Readers wrap access to shared objects in #vfs_epoch_enter() and
+ * #vfs_epoch_leave(), which only touch a per-thread slot. Writers unlink an
+ * object so new readers can not find it, then #vfs_epoch_retire() it. The
+ * object is reclaimed once every reader that might still see it has left.
+ *
+ * A reader must never block on anything a writer may hold while waiting for
+ * readers, e.g. a lock held around #vfs_epoch_retire().
+ */
+typedef struct vfs_epoch
+{
+    vfs_atomic_t                phase;              /**< Current phase, 0 or 1. */
+    vfs_mutex_t                 sync_lock;          /**< Serialize grace periods. */
+
+    vfs_mutex_t                 retire_lock;        /**< Lock for retire list. */
+    vfs_epoch_retired_t*        retire_list;        /**< Objects waiting for reclamation. */
+    size_t                      retire_sz;          /**< The number of objects in retire list. */
+
+    vfs_epoch_slot_t            slots[VFS_EPOCH_SLOTS];
+} vfs_epoch_t;
+
+/**
+ * @brief Initialize epoch.
+ * @param[out] epoch - Epoch object.
+ */
+void vfs_epoch_init(vfs_epoch_t* epoch);
+
+/**
+ * @brief Reclaim all retired objects and destroy epoch.
+ * @warning There must be no active readers.
+ * @param[in] epoch - Epoch object.
+ */
+void vfs_epoch_exit(vfs_epoch_t* epoch);
+
+/**
+ * @brief Enter read side critical section.
+ * @param[in] epoch - Epoch object.
+ * @return Token that must be passed to #vfs_epoch_leave().
+ */
+int vfs_epoch_enter(vfs_epoch_t* epoch);
+
+/**
+ * @brief Leave read side critical section.
+ * @param[in] epoch - Epoch object.
+ * @param[in] token - Token returned by #vfs_epoch_enter().
+ */
+void vfs_epoch_leave(vfs_epoch_t* epoch, int token);
+
+/**
+ * @brief Wait until every reader that was in critical section has left.
+ * @warning Must not be called in read side critical section.
+ * @param[in] epoch - Epoch object.
+ */
+void vfs_epoch_synchronize(vfs_epoch_t* epoch);
+
+/**
+ * @brief Reclaim \p ptr by \p fn once no reader can see it.
+ * @warning Must not be called in read side critical section.
+ * @param[in] epoch - Epoch object.
+ * @param[in] ptr - Object that is no longer reachable by new readers.
+ * @param[in] fn - Reclaim callback.
+ */
+void vfs_epoch_retire(vfs_epoch_t* epoch, void* ptr, vfs_epoch_free_cb fn);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
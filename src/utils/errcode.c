@@ -8,14 +8,18 @@
 #define VFS_ERR_MAP(xx) \
     xx(ENOENT)      \
     xx(EIO)         \
+    xx(ENXIO)       \
     xx(EBADF)       \
     xx(ENOMEM)      \
     xx(EACCES)      \
+    xx(EBUSY)       \
     xx(EEXIST)      \
     xx(ENOTDIR)     \
     xx(EISDIR)      \
     xx(EINVAL)      \
+    xx(ENOSPC)      \
     xx(ESPIPE)      \
+    xx(EROFS)       \
     xx(ENOSYS)      \
     xx(ENOTEMPTY)   \
     xx(EALREADY)
@@ -56,6 +60,9 @@ int vfs_translate_sys_err(int errcode)
     case ERROR_DIR_NOT_EMPTY:       return VFS_ENOTEMPTY;
     case ERROR_ALREADY_EXISTS:      return VFS_EALREADY;
     case ERROR_DIRECTORY:           return VFS_ENOTDIR;
+    case ERROR_DISK_FULL:           return VFS_ENOSPC;
+    case ERROR_HANDLE_DISK_FULL:    return VFS_ENOSPC;
+    case ERROR_WRITE_PROTECT:       return VFS_EROFS;
     default:
         break;
     }
@@ -0,0 +1,110 @@
+#include <string.h>
+#include "hash.h"
+
+#define VFS_HASH64_PRIME_1  0x9E3779B185EBCA87ULL
+#define VFS_HASH64_PRIME_2  0xC2B2AE3D27D4EB4FULL
+#define VFS_HASH64_PRIME_3  0x165667B19E3779F9ULL
+#define VFS_HASH64_PRIME_4  0x85EBCA77C2B2AE63ULL
+#define VFS_HASH64_PRIME_5  0x27D4EB2F165667C5ULL
+
+static uint64_t _vfs_hash64_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t _vfs_hash64_read64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t _vfs_hash64_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t _vfs_hash64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * VFS_HASH64_PRIME_2;
+    acc = _vfs_hash64_rotl(acc, 31);
+    acc *= VFS_HASH64_PRIME_1;
+    return acc;
+}
+
+static uint64_t _vfs_hash64_merge_round(uint64_t acc, uint64_t val)
+{
+    val = _vfs_hash64_round(0, val);
+    acc ^= val;
+    acc = acc * VFS_HASH64_PRIME_1 + VFS_HASH64_PRIME_4;
+    return acc;
+}
+
+uint64_t vfs_hash64(const void* data, size_t size, uint64_t seed)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = p + size;
+    uint64_t h64;
+
+    if (size >= 32)
+    {
+        const uint8_t* limit = end - 32;
+        uint64_t v1 = seed + VFS_HASH64_PRIME_1 + VFS_HASH64_PRIME_2;
+        uint64_t v2 = seed + VFS_HASH64_PRIME_2;
+        uint64_t v3 = seed + 0;
+        uint64_t v4 = seed - VFS_HASH64_PRIME_1;
+
+        do
+        {
+            v1 = _vfs_hash64_round(v1, _vfs_hash64_read64(p)); p += 8;
+            v2 = _vfs_hash64_round(v2, _vfs_hash64_read64(p)); p += 8;
+            v3 = _vfs_hash64_round(v3, _vfs_hash64_read64(p)); p += 8;
+            v4 = _vfs_hash64_round(v4, _vfs_hash64_read64(p)); p += 8;
+        } while (p <= limit);
+
+        h64 = _vfs_hash64_rotl(v1, 1) + _vfs_hash64_rotl(v2, 7)
+            + _vfs_hash64_rotl(v3, 12) + _vfs_hash64_rotl(v4, 18);
+        h64 = _vfs_hash64_merge_round(h64, v1);
+        h64 = _vfs_hash64_merge_round(h64, v2);
+        h64 = _vfs_hash64_merge_round(h64, v3);
+        h64 = _vfs_hash64_merge_round(h64, v4);
+    }
+    else
+    {
+        h64 = seed + VFS_HASH64_PRIME_5;
+    }
+
+    h64 += (uint64_t)size;
+
+    while (p + 8 <= end)
+    {
+        h64 ^= _vfs_hash64_round(0, _vfs_hash64_read64(p));
+        h64 = _vfs_hash64_rotl(h64, 27) * VFS_HASH64_PRIME_1 + VFS_HASH64_PRIME_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end)
+    {
+        h64 ^= (uint64_t)_vfs_hash64_read32(p) * VFS_HASH64_PRIME_1;
+        h64 = _vfs_hash64_rotl(h64, 23) * VFS_HASH64_PRIME_2 + VFS_HASH64_PRIME_3;
+        p += 4;
+    }
+
+    while (p < end)
+    {
+        h64 ^= (*p) * VFS_HASH64_PRIME_5;
+        h64 = _vfs_hash64_rotl(h64, 11) * VFS_HASH64_PRIME_1;
+        p++;
+    }
+
+    /* Avalanche. */
+    h64 ^= h64 >> 33;
+    h64 *= VFS_HASH64_PRIME_2;
+    h64 ^= h64 >> 29;
+    h64 *= VFS_HASH64_PRIME_3;
+    h64 ^= h64 >> 32;
+
+    return h64;
+}
@@ -0,0 +1,27 @@
+#ifndef __VFS_UTILS_HASH_H__
+#define __VFS_UTILS_HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Calculate 64-bit hash of \p data.
+ *
+ * The algorithm is XXH64, which is fast and well distributed, but it is not a
+ * cryptographic hash, so never use it for anything security related.
+ *
+ * @param[in] data - Data to hash.
+ * @param[in] size - Data size in bytes.
+ * @param[in] seed - Hash seed.
+ * @return 64-bit hash value.
+ */
+uint64_t vfs_hash64(const void* data, size_t size, uint64_t seed);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
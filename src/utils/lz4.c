@@ -0,0 +1,251 @@
+#include <string.h>
+#include <stdint.h>
+#include "vfs/vfs.h"
+#include "lz4.h"
+
+/**
+ * @brief The minimum length of a match.
+ */
+#define VFS_LZ4_MIN_MATCH       4
+
+/**
+ * @brief The last bytes of input are always literals.
+ */
+#define VFS_LZ4_LAST_LITERALS   5
+
+/**
+ * @brief A match never starts in the last bytes of input.
+ */
+#define VFS_LZ4_MF_LIMIT        12
+
+/**
+ * @brief The maximum distance of a match.
+ */
+#define VFS_LZ4_MAX_DISTANCE    65535
+
+/**
+ * @brief Size of match finder hash table in bits.
+ */
+#define VFS_LZ4_HASH_LOG        12
+
+static uint32_t _vfs_lz4_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t _vfs_lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - VFS_LZ4_HASH_LOG);
+}
+
+/**
+ * @brief Write length \p len as a sequence of 255 bytes and a remainder.
+ * @return The next output position, or NULL if it does not fit.
+ */
+static uint8_t* _vfs_lz4_write_length(uint8_t* op, const uint8_t* oend, size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (op >= oend)
+        {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op >= oend)
+    {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * @brief Write one sequence of literals followed by an optional match.
+ * @param[in] op - Output position.
+ * @param[in] oend - End of output buffer.
+ * @param[in] lit - Literals.
+ * @param[in] lit_len - The number of literals.
+ * @param[in] offset - Match distance, ignored if \p match_len is 0.
+ * @param[in] match_len - Match length, or 0 for the last sequence.
+ * @return The next output position, or NULL if it does not fit.
+ */
+static uint8_t* _vfs_lz4_write_sequence(uint8_t* op, const uint8_t* oend,
+    const uint8_t* lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    size_t ml = match_len != 0 ? match_len - VFS_LZ4_MIN_MATCH : 0;
+
+    if (op >= oend)
+    {
+        return NULL;
+    }
+    uint8_t* token = op++;
+    *token = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+
+    if (lit_len >= 15 && (op = _vfs_lz4_write_length(op, oend, lit_len - 15)) == NULL)
+    {
+        return NULL;
+    }
+    if ((size_t)(oend - op) < lit_len)
+    {
+        return NULL;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0)
+    {
+        return op;
+    }
+
+    if (oend - op < 2)
+    {
+        return NULL;
+    }
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+
+    if (ml >= 15 && (op = _vfs_lz4_write_length(op, oend, ml - 15)) == NULL)
+    {
+        return NULL;
+    }
+    return op;
+}
+
+size_t vfs_lz4_compress(const void* src, size_t src_sz, void* dst, size_t dst_cap)
+{
+    uint32_t table[1 << VFS_LZ4_HASH_LOG];
+    const uint8_t* base = src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* iend = base + src_sz;
+    uint8_t* op = dst;
+    const uint8_t* oend = op + dst_cap;
+
+    if (src_sz > VFS_LZ4_MF_LIMIT)
+    {
+        const uint8_t* mflimit = iend - VFS_LZ4_MF_LIMIT;
+        const uint8_t* matchlimit = iend - VFS_LZ4_LAST_LITERALS;
+        memset(table, 0, sizeof(table));
+
+        while (ip < mflimit)
+        {
+            uint32_t seq = _vfs_lz4_read32(ip);
+            uint32_t h = _vfs_lz4_hash(seq);
+            const uint8_t* ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if (ref >= ip || ip - ref > VFS_LZ4_MAX_DISTANCE || _vfs_lz4_read32(ref) != seq)
+            {
+                ip++;
+                continue;
+            }
+
+            size_t match_len = VFS_LZ4_MIN_MATCH;
+            while (ip + match_len < matchlimit && ref[match_len] == ip[match_len])
+            {
+                match_len++;
+            }
+
+            op = _vfs_lz4_write_sequence(op, oend, anchor, ip - anchor, ip - ref, match_len);
+            if (op == NULL)
+            {
+                return 0;
+            }
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    op = _vfs_lz4_write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL)
+    {
+        return 0;
+    }
+    return op - (uint8_t*)dst;
+}
+
+/**
+ * @brief Read a length extension.
+ * @return 0 on success, or -1 if input is truncated.
+ */
+static int _vfs_lz4_read_length(const uint8_t** ip, const uint8_t* iend, size_t* len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend)
+        {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int vfs_lz4_decompress(const void* src, size_t src_sz, void* dst, size_t dst_cap)
+{
+    const uint8_t* ip = src;
+    const uint8_t* iend = ip + src_sz;
+    uint8_t* op = dst;
+    uint8_t* oend = op + dst_cap;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && _vfs_lz4_read_length(&ip, iend, &lit_len) != 0)
+        {
+            return VFS_EIO;
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+        {
+            return VFS_EIO;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        /* The last sequence has no match. */
+        if (ip == iend)
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return VFS_EIO;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t*)dst))
+        {
+            return VFS_EIO;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && _vfs_lz4_read_length(&ip, iend, &match_len) != 0)
+        {
+            return VFS_EIO;
+        }
+        match_len += VFS_LZ4_MIN_MATCH;
+        if (match_len > (size_t)(oend - op))
+        {
+            return VFS_EIO;
+        }
+
+        /* Match may overlap output, so copy byte by byte. */
+        const uint8_t* ref = op - offset;
+        for (size_t i = 0; i < match_len; i++)
+        {
+            op[i] = ref[i];
+        }
+        op += match_len;
+    }
+
+    return (int)(op - (uint8_t*)dst);
+}
@@ -0,0 +1,44 @@
+#ifndef __VFS_UTILS_LZ4_H__
+#define __VFS_UTILS_LZ4_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Compress \p src into \p dst.
+ *
+ * The output is in LZ4 block format, produced by a single pass greedy match
+ * finder. It trades compression ratio for speed and is meant for in-memory
+ * data, so there is no frame header or checksum.
+ *
+ * @param[in] src - Data to compress.
+ * @param[in] src_sz - Data size in bytes.
+ * @param[out] dst - Output buffer.
+ * @param[in] dst_cap - Output buffer size in bytes.
+ * @return The number of bytes written to \p dst, or 0 if the output does not
+ *   fit in \p dst_cap.
+ */
+size_t vfs_lz4_compress(const void* src, size_t src_sz, void* dst, size_t dst_cap);
+
+/**
+ * @brief Decompress LZ4 block \p src into \p dst.
+ *
+ * Malformed input is detected and never makes this function access memory
+ * out of bounds.
+ *
+ * @param[in] src - Compressed data.
+ * @param[in] src_sz - Compressed data size in bytes.
+ * @param[out] dst - Output buffer.
+ * @param[in] dst_cap - Output buffer size in bytes.
+ * @return The number of bytes written to \p dst, or #VFS_EIO if \p src is
+ *   malformed or does not fit in \p dst_cap.
+ */
+int vfs_lz4_decompress(const void* src, size_t src_sz, void* dst, size_t dst_cap);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 #include "sem.h"
 
 #if defined(_WIN32)
@@ -33,6 +34,20 @@ void vfs_sem_wait(vfs_sem_t* sem)
     }
 }
 
+int vfs_sem_timedwait(vfs_sem_t* sem, uint32_t timeout_ms)
+{
+    DWORD r = WaitForSingleObject(sem, timeout_ms);
+    if (r == WAIT_TIMEOUT)
+    {
+        return 1;
+    }
+    if (r != WAIT_OBJECT_0)
+    {
+        abort();
+    }
+    return 0;
+}
+
 #else
 
 void vfs_sem_init(vfs_sem_t* sem, unsigned val)
@@ -73,4 +88,36 @@ void vfs_sem_wait(vfs_sem_t* sem)
     }
 }
 
+int vfs_sem_timedwait(vfs_sem_t* sem, uint32_t timeout_ms)
+{
+    int r;
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
+    {
+        abort();
+    }
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    do
+    {
+        r = sem_timedwait(sem, &ts);
+    } while (r == -1 && errno == EINTR);
+
+    if (r == -1 && errno == ETIMEDOUT)
+    {
+        return 1;
+    }
+    if (r)
+    {
+        abort();
+    }
+    return 0;
+}
+
 #endif
@@ -4,6 +4,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 #if defined(_WIN32)
 #include <windows.h>
 typedef HANDLE vfs_sem_t;
@@ -37,6 +39,14 @@ void vfs_sem_post(vfs_sem_t* sem);
  */
 void vfs_sem_wait(vfs_sem_t* sem);
 
+/**
+ * @brief Wait for semaphore with timeout
+ * @param[in] sem - Semaphore handle
+ * @param[in] timeout_ms - Timeout in milliseconds
+ * @return 0 if semaphore is acquired, or 1 if timed out
+ */
+int vfs_sem_timedwait(vfs_sem_t* sem, uint32_t timeout_ms);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include "slab.h"
+
+/**
+ * @brief Offset of the first object in page, large enough for page header
+ *   and alignment of any object.
+ */
+#define VFS_SLAB_PAGE_HEADER    64
+
+/**
+ * @brief Alignment of objects.
+ */
+#define VFS_SLAB_ALIGN          16
+
+typedef struct vfs_slab_page
+{
+    vfs_slab_t*             slab;       /**< Slab that owns this page. */
+    struct vfs_slab_page*   next;       /**< Next page. */
+    size_t                  used;       /**< The number of objects ever taken from this page. */
+} vfs_slab_page_t;
+
+#if defined(_WIN32)
+
+#include <malloc.h>
+
+static void* _vfs_slab_page_alloc(void)
+{
+    return _aligned_malloc(VFS_SLAB_PAGE_SIZE, VFS_SLAB_PAGE_SIZE);
+}
+
+static void _vfs_slab_page_free(void* page)
+{
+    _aligned_free(page);
+}
+
+#else
+
+static void* _vfs_slab_page_alloc(void)
+{
+    void* page = NULL;
+    return posix_memalign(&page, VFS_SLAB_PAGE_SIZE, VFS_SLAB_PAGE_SIZE) == 0 ? page : NULL;
+}
+
+static void _vfs_slab_page_free(void* page)
+{
+    free(page);
+}
+
+#endif
+
+void vfs_slab_init(vfs_slab_t* slab, size_t obj_sz)
+{
+    obj_sz = obj_sz < sizeof(void*) ? sizeof(void*) : obj_sz;
+    slab->obj_sz = (obj_sz + VFS_SLAB_ALIGN - 1) & ~(size_t)(VFS_SLAB_ALIGN - 1);
+    slab->obj_cnt = (VFS_SLAB_PAGE_SIZE - VFS_SLAB_PAGE_HEADER) / slab->obj_sz;
+    slab->free_list = NULL;
+    slab->pages = NULL;
+    vfs_mutex_init(&slab->lock);
+
+    assert(sizeof(vfs_slab_page_t) <= VFS_SLAB_PAGE_HEADER);
+    assert(slab->obj_cnt != 0);
+}
+
+void vfs_slab_exit(vfs_slab_t* slab)
+{
+    vfs_slab_page_t* page;
+    while ((page = slab->pages) != NULL)
+    {
+        slab->pages = page->next;
+        _vfs_slab_page_free(page);
+    }
+    slab->free_list = NULL;
+    vfs_mutex_exit(&slab->lock);
+}
+
+void* vfs_slab_alloc(vfs_slab_t* slab)
+{
+    void* obj = NULL;
+    vfs_slab_page_t* page;
+
+    vfs_mutex_enter(&slab->lock);
+    do
+    {
+        if ((obj = slab->free_list) != NULL)
+        {
+            slab->free_list = *(void**)obj;
+            break;
+        }
+
+        if ((page = slab->pages) == NULL || page->used == slab->obj_cnt)
+        {
+            if ((page = _vfs_slab_page_alloc()) == NULL)
+            {
+                break;
+            }
+            page->slab = slab;
+            page->next = slab->pages;
+            page->used = 0;
+            slab->pages = page;
+        }
+
+        obj = (char*)page + VFS_SLAB_PAGE_HEADER + page->used * slab->obj_sz;
+        page->used++;
+    } while (0);
+    vfs_mutex_leave(&slab->lock);
+
+    return obj;
+}
+
+void vfs_slab_free(void* obj)
+{
+    vfs_slab_page_t* page = (vfs_slab_page_t*)((uintptr_t)obj & ~(uintptr_t)(VFS_SLAB_PAGE_SIZE - 1));
+    vfs_slab_t* slab = page->slab;
+
+    vfs_mutex_enter(&slab->lock);
+    {
+        *(void**)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    vfs_mutex_leave(&slab->lock);
+}
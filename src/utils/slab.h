@@ -0,0 +1,67 @@
+#ifndef __VFS_UTILS_SLAB_H__
+#define __VFS_UTILS_SLAB_H__
+
+#include <stddef.h>
+#include "mutex.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Size in bytes of one slab page, must be power of 2.
+ *
+ * Pages are aligned to their size, so the page of an object is found from
+ * its address.
+ */
+#define VFS_SLAB_PAGE_SIZE      (64 * 1024)
+
+struct vfs_slab_page;
+
+/**
+ * @brief Allocator of fixed-size objects.
+ *
+ * Objects are carved from large pages and recycled through a free list, so
+ * allocating and freeing many small objects does not go through malloc. All
+ * pages are freed at once when the slab is destroyed.
+ */
+typedef struct vfs_slab
+{
+    vfs_mutex_t             lock;       /**< Protects all fields below. */
+    size_t                  obj_sz;     /**< Object size, rounded up for alignment. */
+    size_t                  obj_cnt;    /**< The number of objects in one page. */
+    void*                   free_list;  /**< Freed objects, linked through their first word. */
+    struct vfs_slab_page*   pages;      /**< All pages, the first one may have unused objects. */
+} vfs_slab_t;
+
+/**
+ * @brief Initialize slab.
+ * @param[out] slab - Slab object.
+ * @param[in] obj_sz - Object size, must be much smaller than #VFS_SLAB_PAGE_SIZE.
+ */
+void vfs_slab_init(vfs_slab_t* slab, size_t obj_sz);
+
+/**
+ * @brief Destroy slab and free all pages.
+ * @warning Objects that are not freed yet become invalid.
+ * @param[in] slab - Slab object.
+ */
+void vfs_slab_exit(vfs_slab_t* slab);
+
+/**
+ * @brief Allocate an object.
+ * @param[in] slab - Slab object.
+ * @return Object with undefined content, or NULL if out of memory.
+ */
+void* vfs_slab_alloc(vfs_slab_t* slab);
+
+/**
+ * @brief Give an object back to the slab it is allocated from.
+ * @param[in] obj - Object.
+ */
+void vfs_slab_free(void* obj);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -51,17 +51,23 @@ void vfs_strlist_exit(vfs_strlist_t* list)
     free(list->arr);
     list->arr = NULL;
     list->num = 0;
+    list->cap = 0;
 }
 
 void vfs_strlist_append(vfs_strlist_t* list, const char* data, size_t size)
 {
-    list->num += 1;
-    vfs_str_t* new_arr = realloc(list->arr, sizeof(vfs_str_t) * list->num);
-    if (new_arr == NULL)
+    if (list->num == list->cap)
     {
-        abort();
+        size_t new_cap = list->cap != 0 ? list->cap * 2 : 8;
+        vfs_str_t* new_arr = realloc(list->arr, sizeof(vfs_str_t) * new_cap);
+        if (new_arr == NULL)
+        {
+            abort();
+        }
+        list->arr = new_arr;
+        list->cap = new_cap;
     }
-    list->arr = new_arr;
+    list->num += 1;
 
     vfs_str_t* str = &list->arr[list->num - 1];
     *str = vfs_str_from(data, size);
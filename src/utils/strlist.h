@@ -11,13 +11,14 @@ typedef struct vfs_strlist
 {
     vfs_str_t*  arr;    /**< Array of strings. */
     size_t      num;    /**< Number of strings. */
+    size_t      cap;    /**< Capacity of #vfs_strlist_t::arr. */
 } vfs_strlist_t;
 
 /**
  * @brief Static initializer for #vfs_strlist_t.
  * Any instance of #vfs_strlist_t must always initialized to it.
  */
-#define VFS_STRLIST_INIT    { NULL, 0 }
+#define VFS_STRLIST_INIT    { NULL, 0, 0 }
 
 /**
  * @brief Split the string \p str wherever \p sep occurs, and return the list
@@ -0,0 +1,97 @@
+#include "vfs/vfs.h"
+#include "taskgroup.h"
+
+void vfs_taskgroup_init(vfs_taskgroup_t* group, vfs_threadpool_t* pool,
+    size_t thread_sz, size_t queue_sz)
+{
+    group->pool = thread_sz != 0 ? pool : NULL;
+    group->thread_sz = thread_sz;
+    group->queue_sz = queue_sz;
+    group->next_idx = 0;
+    group->errcode = 0;
+    vfs_mutex_init(&group->lock);
+
+    if (group->pool != NULL)
+    {
+        vfs_sem_init(&group->slot_sem, (unsigned)queue_sz);
+    }
+}
+
+void vfs_taskgroup_exit(vfs_taskgroup_t* group)
+{
+    vfs_taskgroup_wait(group);
+
+    if (group->pool != NULL)
+    {
+        vfs_sem_exit(&group->slot_sem);
+    }
+    vfs_mutex_exit(&group->lock);
+}
+
+int vfs_taskgroup_submit(vfs_taskgroup_t* group, vfs_threadpool_work_cb cb, void* data)
+{
+    if (group->pool == NULL)
+    {
+        cb(0, data);
+        return 0;
+    }
+
+    /* Wait for a free slot so the queue never overflows. */
+    vfs_sem_wait(&group->slot_sem);
+
+    size_t idx = group->next_idx;
+    group->next_idx = (group->next_idx + 1) % group->thread_sz;
+    if (vfs_threadpool_submit(group->pool, idx, cb, data) != 0)
+    {
+        vfs_sem_post(&group->slot_sem);
+        return VFS_ENOMEM;
+    }
+
+    return 0;
+}
+
+void vfs_taskgroup_done(vfs_taskgroup_t* group)
+{
+    if (group->pool != NULL)
+    {
+        vfs_sem_post(&group->slot_sem);
+    }
+}
+
+void vfs_taskgroup_wait(vfs_taskgroup_t* group)
+{
+    size_t i;
+    if (group->pool == NULL)
+    {
+        return;
+    }
+
+    /* Every slot is free once all jobs finish. */
+    for (i = 0; i < group->queue_sz; i++)
+    {
+        vfs_sem_wait(&group->slot_sem);
+    }
+    for (i = 0; i < group->queue_sz; i++)
+    {
+        vfs_sem_post(&group->slot_sem);
+    }
+}
+
+void vfs_taskgroup_set_error(vfs_taskgroup_t* group, int errcode)
+{
+    vfs_mutex_enter(&group->lock);
+    if (group->errcode == 0)
+    {
+        group->errcode = errcode;
+    }
+    vfs_mutex_leave(&group->lock);
+}
+
+int vfs_taskgroup_error(vfs_taskgroup_t* group)
+{
+    int errcode;
+    vfs_mutex_enter(&group->lock);
+    errcode = group->errcode;
+    vfs_mutex_leave(&group->lock);
+    return errcode;
+}
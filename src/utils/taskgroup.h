@@ -0,0 +1,89 @@
+#ifndef __VFS_UTILS_TASKGROUP_H__
+#define __VFS_UTILS_TASKGROUP_H__
+
+#include <stddef.h>
+#include "mutex.h"
+#include "sem.h"
+#include "threadpool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Jobs of one operation that run on a thread pool.
+ *
+ * Jobs are spread over workers round robin, and a job waits for a free slot
+ * before it is queued, so the queue of the pool never overflows. The first
+ * error reported by any job is kept.
+ */
+typedef struct vfs_taskgroup
+{
+    vfs_threadpool_t*   pool;       /**< Workers, or NULL to run jobs in calling thread. */
+    size_t              thread_sz;  /**< The number of threads in #vfs_taskgroup_t::pool. */
+    size_t              queue_sz;   /**< The number of jobs that can be queued at once. */
+    size_t              next_idx;   /**< Worker of next job. */
+    vfs_sem_t           slot_sem;   /**< Free slots of job queue. */
+
+    vfs_mutex_t         lock;       /**< Protects #vfs_taskgroup_t::errcode. */
+    int                 errcode;    /**< The first error. */
+} vfs_taskgroup_t;
+
+/**
+ * @brief Initialize task group.
+ * @param[out] group - Task group.
+ * @param[in] pool - (Optional) Workers, NULL to run jobs in calling thread.
+ * @param[in] thread_sz - The number of threads in \p pool.
+ * @param[in] queue_sz - The number of jobs that can be queued at once. Each
+ *   worker of \p pool must be able to queue that many jobs.
+ */
+void vfs_taskgroup_init(vfs_taskgroup_t* group, vfs_threadpool_t* pool,
+    size_t thread_sz, size_t queue_sz);
+
+/**
+ * @brief Wait for all jobs and destroy task group.
+ * @param[in] group - Task group.
+ */
+void vfs_taskgroup_exit(vfs_taskgroup_t* group);
+
+/**
+ * @brief Run \p cb by a worker, or in calling thread if there is no worker.
+ * @note \p cb must call #vfs_taskgroup_done() when it finishes.
+ * @param[in] group - Task group.
+ * @param[in] cb - Job callback.
+ * @param[in] data - Job data.
+ * @return - 0: on success.
+ * @return - #VFS_ENOMEM: if the job can not be queued, \p cb is not called.
+ */
+int vfs_taskgroup_submit(vfs_taskgroup_t* group, vfs_threadpool_work_cb cb, void* data);
+
+/**
+ * @brief Mark one job as finished.
+ * @param[in] group - Task group.
+ */
+void vfs_taskgroup_done(vfs_taskgroup_t* group);
+
+/**
+ * @brief Wait for all submitted jobs.
+ * @param[in] group - Task group.
+ */
+void vfs_taskgroup_wait(vfs_taskgroup_t* group);
+
+/**
+ * @brief Record \p errcode if no error is recorded yet.
+ * @param[in] group - Task group.
+ * @param[in] errcode - Error code, 0 is ignored.
+ */
+void vfs_taskgroup_set_error(vfs_taskgroup_t* group, int errcode);
+
+/**
+ * @brief Get the first error.
+ * @param[in] group - Task group.
+ * @return The first error, or 0 if none.
+ */
+int vfs_taskgroup_error(vfs_taskgroup_t* group);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
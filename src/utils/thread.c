@@ -62,8 +62,14 @@ void vfs_thread_exit(vfs_thread_t thr)
     CloseHandle(thr);
 }
 
+void vfs_thread_yield(void)
+{
+    SwitchToThread();
+}
+
 #else
 
+#include <sched.h>
 #include <semaphore.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -121,4 +127,9 @@ void vfs_thread_exit(vfs_thread_t thr)
     pthread_join(thr, NULL);
 }
 
+void vfs_thread_yield(void)
+{
+    sched_yield();
+}
+
 #endif
@@ -32,6 +32,11 @@ void vfs_thread_init(vfs_thread_t* thr, vfs_thread_cb cb, void* arg);
  */
 void vfs_thread_exit(vfs_thread_t thr);
 
+/**
+ * @brief Give up the CPU so other threads can run.
+ */
+void vfs_thread_yield(void);
+
 #ifdef __cplusplus
 }
 #endif
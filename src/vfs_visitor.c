@@ -156,6 +156,7 @@ static int _vfs_visitor_stat_inner(vfs_mount_t* fs, const vfs_str_t* path, void*
         helper->info->st_mode = VFS_S_IFDIR;
         helper->info->st_mtime = 0;
         helper->info->st_size = 0;
+        helper->info->st_blocks = 0;
         return 0;
     }
 
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "utils/memfs_chunk.h"
+
+/* Not a multiple of chunk size, so the last chunk is partially used. */
+#define TEST_MEMFS_CHUNK_FILE_SIZE  (64 * 1024 + 123)
+
+static vfs_operations_t* s_test_memfs_chunk = NULL;
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_chunk), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_chunk->destroy(s_test_memfs_chunk);
+    s_test_memfs_chunk = NULL;
+}
+
+static uint8_t _test_memfs_chunk_pattern(size_t pos)
+{
+    return (uint8_t)(pos * 31 + 7);
+}
+
+static void _test_memfs_chunk_check(vfs_operations_t* fs, uintptr_t fh, size_t size, size_t valid)
+{
+    uint8_t* buf = malloc(size + 1);
+    ASSERT_NE_PTR(buf, NULL);
+
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 0, VFS_SEEK_SET), 0);
+    ASSERT_EQ_INT(fs->read(fs, fh, buf, size + 1), size != 0 ? (int)size : VFS_EOF);
+
+    size_t i;
+    for (i = 0; i < size; i++)
+    {
+        ASSERT_EQ_INT(buf[i], i < valid ? _test_memfs_chunk_pattern(i) : 0);
+    }
+    free(buf);
+}
+
+TEST_F(memfs, chunk_append_truncate)
+{
+    size_t i;
+    uintptr_t fh;
+    vfs_operations_t* fs = s_test_memfs_chunk;
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/f", VFS_O_RDWR | VFS_O_CREATE | VFS_O_APPEND), 0);
+
+    /* Odd sized appends cross chunk boundaries. */
+    for (i = 0; i < TEST_MEMFS_CHUNK_FILE_SIZE; i += 1000)
+    {
+        uint8_t buf[1000];
+        size_t len = TEST_MEMFS_CHUNK_FILE_SIZE - i < sizeof(buf) ? TEST_MEMFS_CHUNK_FILE_SIZE - i : sizeof(buf);
+        size_t j;
+        for (j = 0; j < len; j++)
+        {
+            buf[j] = _test_memfs_chunk_pattern(i + j);
+        }
+        ASSERT_EQ_INT(fs->write(fs, fh, buf, len), (int)len);
+    }
+    _test_memfs_chunk_check(fs, fh, TEST_MEMFS_CHUNK_FILE_SIZE, TEST_MEMFS_CHUNK_FILE_SIZE);
+
+    /* Shrink into the middle of a chunk, then grow again: the tail must read as zero. */
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 5000), 0);
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 20000), 0);
+    _test_memfs_chunk_check(fs, fh, 20000, 5000);
+
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 0), 0);
+    _test_memfs_chunk_check(fs, fh, 0, 0);
+
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_F(memfs, chunk_write_beyond_end)
+{
+    uintptr_t fh;
+    vfs_operations_t* fs = s_test_memfs_chunk;
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/f", VFS_O_RDWR | VFS_O_CREATE), 0);
+
+    const char* data = "hello";
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 10000, VFS_SEEK_SET), 10000);
+    ASSERT_EQ_INT(fs->write(fs, fh, data, 5), 5);
+
+    vfs_stat_t info;
+    ASSERT_EQ_INT(fs->stat(fs, "/f", &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 10005);
+
+    char buf[16];
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 9995, VFS_SEEK_SET), 9995);
+    ASSERT_EQ_INT(fs->read(fs, fh, buf, sizeof(buf)), 10);
+    ASSERT_EQ_INT(memcmp(buf, "\0\0\0\0\0hello", 10), 0);
+
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_F(memfs, chunk_inline)
+{
+    size_t i;
+    uintptr_t fh;
+    vfs_stat_t info;
+    vfs_memfs_statfs_t usage;
+    vfs_operations_t* fs = s_test_memfs_chunk;
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/f", VFS_O_RDWR | VFS_O_CREATE | VFS_O_APPEND), 0);
+
+    /* Small file lives in its node. */
+    uint8_t buf[100];
+    for (i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = _test_memfs_chunk_pattern(i);
+    }
+    ASSERT_EQ_INT(fs->write(fs, fh, buf, sizeof(buf)), (int)sizeof(buf));
+    ASSERT_EQ_INT(fs->stat(fs, "/f", &info), 0);
+    ASSERT_EQ_UINT64(info.st_blocks, 0);
+    vfs_memfs_statfs(fs, &usage);
+    ASSERT_EQ_UINT64(usage.data_used, 0);
+    _test_memfs_chunk_check(fs, fh, 100, 100);
+
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 0, VFS_SEEK_DATA), 0);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 0, VFS_SEEK_HOLE), 100);
+
+    /* Appends spill it into chunks. */
+    for (i = 100; i < 5000; i += sizeof(buf))
+    {
+        size_t j;
+        for (j = 0; j < sizeof(buf); j++)
+        {
+            buf[j] = _test_memfs_chunk_pattern(i + j);
+        }
+        ASSERT_EQ_INT(fs->write(fs, fh, buf, sizeof(buf)), (int)sizeof(buf));
+    }
+    ASSERT_EQ_INT(fs->stat(fs, "/f", &info), 0);
+    ASSERT_EQ_UINT64(info.st_blocks, 2 * TEST_MEMFS_CHUNK / 512);
+    _test_memfs_chunk_check(fs, fh, 5000, 5000);
+
+    /* Shrinking moves it back. */
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 50), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/f", &info), 0);
+    ASSERT_EQ_UINT64(info.st_blocks, 0);
+    vfs_memfs_statfs(fs, &usage);
+    ASSERT_EQ_UINT64(usage.data_used, 0);
+    _test_memfs_chunk_check(fs, fh, 50, 50);
+
+    /* A grown hole after inline content reads as zero. */
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 10000), 0);
+    _test_memfs_chunk_check(fs, fh, 10000, 50);
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 200), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    /* Clones get their own copy. */
+    vfs_operations_t* clone;
+    vfs_memfs_snapshot_t* snapshot;
+    ASSERT_EQ_INT(vfs_memfs_snapshot(fs, &snapshot), 0);
+    ASSERT_EQ_INT(vfs_memfs_clone(snapshot, &clone), 0);
+    vfs_memfs_snapshot_release(snapshot);
+
+    ASSERT_EQ_INT(clone->open(clone, &fh, "/f", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT(clone->write(clone, fh, "x", 1), 1);
+    ASSERT_EQ_INT(clone->close(clone, fh), 0);
+    clone->destroy(clone);
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/f", VFS_O_RDONLY), 0);
+    _test_memfs_chunk_check(fs, fh, 200, 50);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "utils/fsbuilder.h"
+#include "utils/memfs_chunk.h"
+
+/* Compressible chunks followed by one incompressible chunk. */
+#define TEST_MEMFS_COMPRESS_SIZE    (6 * TEST_MEMFS_CHUNK)
+
+static vfs_operations_t* s_test_memfs_compress = NULL;
+static char s_test_memfs_compress_data[TEST_MEMFS_COMPRESS_SIZE];
+
+static void _test_memfs_compress_fill(void)
+{
+    size_t pos = 0;
+    unsigned line = 0;
+    while (pos < 5 * TEST_MEMFS_CHUNK)
+    {
+        char tmp[64];
+        int len = snprintf(tmp, sizeof(tmp), "[info] build step %u finished\n", line++);
+        size_t copy_sz = 5 * TEST_MEMFS_CHUNK - pos;
+        copy_sz = copy_sz < (size_t)len ? copy_sz : (size_t)len;
+        memcpy(s_test_memfs_compress_data + pos, tmp, copy_sz);
+        pos += copy_sz;
+    }
+
+    uint32_t seed = 2463534242U;
+    for (; pos < TEST_MEMFS_COMPRESS_SIZE; pos++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        s_test_memfs_compress_data[pos] = (char)seed;
+    }
+}
+
+static void _test_memfs_compress_write_file(vfs_operations_t* fs, const char* path)
+{
+    uintptr_t fh;
+    ASSERT_EQ_INT(fs->open(fs, &fh, path, VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, s_test_memfs_compress_data, TEST_MEMFS_COMPRESS_SIZE), TEST_MEMFS_COMPRESS_SIZE);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    _test_memfs_compress_fill();
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_compress), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_compress->destroy(s_test_memfs_compress);
+    s_test_memfs_compress = NULL;
+}
+
+TEST_F(memfs, compress_read)
+{
+    vfs_memfs_statfs_t info;
+    vfs_operations_t* fs = s_test_memfs_compress;
+
+    ASSERT_EQ_INT(vfs_memfs_compress(fs), VFS_EINVAL);
+
+    ASSERT_EQ_INT(fs->mkdir(fs, "/d"), 0);
+    _test_memfs_compress_write_file(fs, "/d/f");
+
+    /* Content is not cold enough. */
+    ASSERT_EQ_INT(vfs_memfs_set_compress(fs, 1, 3600), 0);
+    ASSERT_EQ_INT(vfs_memfs_compress(fs), 0);
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.zsrc_bytes, 0);
+    ASSERT_EQ_UINT64(info.data_used, TEST_MEMFS_COMPRESS_SIZE);
+
+    /* Only compressible chunks are compressed. */
+    ASSERT_EQ_INT(vfs_memfs_set_compress(fs, 1, 0), 0);
+    ASSERT_EQ_INT(vfs_memfs_compress(fs), 0);
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.zsrc_bytes, 5 * TEST_MEMFS_CHUNK);
+    ASSERT_LT_UINT64(info.zdata_bytes, info.zsrc_bytes / 3);
+    ASSERT_EQ_UINT64(info.data_used, info.zdata_bytes + TEST_MEMFS_CHUNK);
+    ASSERT_EQ_UINT64(info.decompress_cnt, 0);
+
+    vfs_stat_t stat;
+    ASSERT_EQ_INT(fs->stat(fs, "/d/f", &stat), 0);
+    ASSERT_EQ_UINT64(stat.st_size, TEST_MEMFS_COMPRESS_SIZE);
+
+    vfs_test_check_file(fs, "/d/f", s_test_memfs_compress_data, TEST_MEMFS_COMPRESS_SIZE);
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.decompress_cnt, 5);
+
+    /* Second read is served from cache. */
+    vfs_test_check_file(fs, "/d/f", s_test_memfs_compress_data, TEST_MEMFS_COMPRESS_SIZE);
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.decompress_cnt, 5);
+
+    ASSERT_EQ_INT(fs->unlink(fs, "/d/f"), 0);
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.data_used, 0);
+    ASSERT_EQ_UINT64(info.zsrc_bytes, 0);
+    ASSERT_EQ_UINT64(info.zdata_bytes, 0);
+}
+
+TEST_F(memfs, compress_write)
+{
+    uintptr_t fh;
+    vfs_memfs_statfs_t info;
+    vfs_operations_t* fs = s_test_memfs_compress;
+    static char expect[TEST_MEMFS_COMPRESS_SIZE];
+
+    _test_memfs_compress_write_file(fs, "/f");
+    ASSERT_EQ_INT(vfs_memfs_set_compress(fs, 1, 0), 0);
+    ASSERT_EQ_INT(vfs_memfs_compress(fs), 0);
+
+    /* Write in the middle of a compressed chunk decompresses it. */
+    memcpy(expect, s_test_memfs_compress_data, sizeof(expect));
+    memcpy(expect + TEST_MEMFS_CHUNK + 100, "hello", 5);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/f", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT((int)fs->seek(fs, fh, TEST_MEMFS_CHUNK + 100, VFS_SEEK_SET), TEST_MEMFS_CHUNK + 100);
+    ASSERT_EQ_INT(fs->write(fs, fh, "hello", 5), 5);
+
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.zsrc_bytes, 4 * TEST_MEMFS_CHUNK);
+    ASSERT_EQ_UINT64(info.data_used, info.zdata_bytes + 2 * TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    vfs_test_check_file(fs, "/f", expect, TEST_MEMFS_COMPRESS_SIZE);
+
+    /* Truncate in the middle of a compressed chunk. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/f", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 3 * TEST_MEMFS_CHUNK - 10), 0);
+    ASSERT_EQ_INT(fs->truncate(fs, fh, TEST_MEMFS_COMPRESS_SIZE), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    memset(expect + 3 * TEST_MEMFS_CHUNK - 10, 0, 3 * TEST_MEMFS_CHUNK + 10);
+    vfs_test_check_file(fs, "/f", expect, TEST_MEMFS_COMPRESS_SIZE);
+
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.zsrc_bytes, TEST_MEMFS_CHUNK);
+    ASSERT_EQ_UINT64(info.data_used, info.zdata_bytes + 2 * TEST_MEMFS_CHUNK);
+}
+
+TEST_F(memfs, compress_snapshot)
+{
+    vfs_memfs_statfs_t info;
+    vfs_memfs_snapshot_t* snapshot;
+    vfs_operations_t* clone;
+    vfs_operations_t* fs = s_test_memfs_compress;
+
+    _test_memfs_compress_write_file(fs, "/f");
+    ASSERT_EQ_INT(vfs_memfs_set_compress(fs, 1, 0), 0);
+
+    /* Shared content is not compressed. */
+    ASSERT_EQ_INT(vfs_memfs_snapshot(fs, &snapshot), 0);
+    ASSERT_EQ_INT(vfs_memfs_compress(fs), 0);
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.zsrc_bytes, 0);
+    vfs_memfs_snapshot_release(snapshot);
+
+    /* Compressed content is shared by snapshot and clone. */
+    ASSERT_EQ_INT(vfs_memfs_compress(fs), 0);
+    ASSERT_EQ_INT(vfs_memfs_snapshot(fs, &snapshot), 0);
+    ASSERT_EQ_INT(vfs_memfs_clone(snapshot, &clone), 0);
+    vfs_memfs_snapshot_release(snapshot);
+
+    vfs_test_check_file(clone, "/f", s_test_memfs_compress_data, TEST_MEMFS_COMPRESS_SIZE);
+    vfs_memfs_statfs(clone, &info);
+    ASSERT_EQ_UINT64(info.zsrc_bytes, 5 * TEST_MEMFS_CHUNK);
+
+    ASSERT_EQ_INT(fs->unlink(fs, "/f"), 0);
+    vfs_test_check_file(clone, "/f", s_test_memfs_compress_data, TEST_MEMFS_COMPRESS_SIZE);
+    clone->destroy(clone);
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "utils/atomic.h"
+#include "utils/thread.h"
+
+#define TEST_MEMFS_CONCURRENT_READERS   4
+#define TEST_MEMFS_CONCURRENT_ROUNDS    200
+#define TEST_MEMFS_CONCURRENT_FILES     40
+
+typedef struct test_memfs_concurrent
+{
+    vfs_operations_t*   fs;
+    vfs_atomic_t        done;
+    vfs_atomic_t        fail;
+} test_memfs_concurrent_t;
+
+static test_memfs_concurrent_t s_test_memfs_concurrent;
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    s_test_memfs_concurrent.done = 0;
+    s_test_memfs_concurrent.fail = 0;
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_concurrent.fs), 0);
+
+    vfs_operations_t* fs = s_test_memfs_concurrent.fs;
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a"), 0);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a/b"), 0);
+
+    uintptr_t fh;
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/b/keep", VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_concurrent.fs->destroy(s_test_memfs_concurrent.fs);
+    s_test_memfs_concurrent.fs = NULL;
+}
+
+static int _test_memfs_concurrent_ls_cb(const char* name, const vfs_stat_t* stat, void* data)
+{
+    (void)stat;
+    int* found = data;
+    if (strcmp(name, "keep") == 0)
+    {
+        *found += 1;
+    }
+    return 0;
+}
+
+static void _test_memfs_concurrent_reader(void* arg)
+{
+    test_memfs_concurrent_t* ctx = arg;
+    vfs_operations_t* fs = ctx->fs;
+
+    while (vfs_atomic_load(&ctx->done) == 0)
+    {
+        vfs_stat_t info;
+        uintptr_t fh;
+
+        /* The file is never removed, so it must always be found. */
+        if (fs->stat(fs, "/a/b/keep", &info) != 0)
+        {
+            (void)vfs_atomic_add(&ctx->fail);
+        }
+        if (fs->open(fs, &fh, "/a/b/keep", VFS_O_RDONLY) != 0)
+        {
+            (void)vfs_atomic_add(&ctx->fail);
+        }
+        else
+        {
+            fs->close(fs, fh);
+        }
+
+        /* The listing is a snapshot, so the file appears exactly once. */
+        int found = 0;
+        if (fs->ls(fs, "/a/b", _test_memfs_concurrent_ls_cb, &found) != 0 || found != 1)
+        {
+            (void)vfs_atomic_add(&ctx->fail);
+        }
+
+        /* Files that come and go. */
+        (void)fs->stat(fs, "/a/b/f7", &info);
+        (void)fs->stat(fs, "/a/b/d/x", &info);
+    }
+}
+
+static void _test_memfs_concurrent_writer(vfs_operations_t* fs)
+{
+    int round, i;
+    char path[64];
+
+    for (round = 0; round < TEST_MEMFS_CONCURRENT_ROUNDS; round++)
+    {
+        /* Grow over the hash index threshold and shrink back. */
+        for (i = 0; i < TEST_MEMFS_CONCURRENT_FILES; i++)
+        {
+            uintptr_t fh;
+            snprintf(path, sizeof(path), "/a/b/f%d", i);
+            ASSERT_EQ_INT(fs->open(fs, &fh, path, VFS_O_WRONLY | VFS_O_CREATE), 0);
+            ASSERT_EQ_INT(fs->close(fs, fh), 0);
+        }
+        ASSERT_EQ_INT(fs->mkdir(fs, "/a/b/d"), 0);
+        ASSERT_EQ_INT(fs->mkdir(fs, "/a/b/d/x"), 0);
+
+        for (i = 0; i < TEST_MEMFS_CONCURRENT_FILES; i++)
+        {
+            snprintf(path, sizeof(path), "/a/b/f%d", i);
+            ASSERT_EQ_INT(fs->unlink(fs, path), 0);
+        }
+        ASSERT_EQ_INT(fs->rmdir(fs, "/a/b/d/x"), 0);
+        ASSERT_EQ_INT(fs->rmdir(fs, "/a/b/d"), 0);
+    }
+}
+
+TEST_F(memfs, concurrent_lookup)
+{
+    size_t i;
+    vfs_thread_t readers[TEST_MEMFS_CONCURRENT_READERS];
+
+    for (i = 0; i < TEST_MEMFS_CONCURRENT_READERS; i++)
+    {
+        vfs_thread_init(&readers[i], _test_memfs_concurrent_reader, &s_test_memfs_concurrent);
+    }
+
+    _test_memfs_concurrent_writer(s_test_memfs_concurrent.fs);
+
+    vfs_atomic_store(&s_test_memfs_concurrent.done, 1);
+    for (i = 0; i < TEST_MEMFS_CONCURRENT_READERS; i++)
+    {
+        vfs_thread_exit(readers[i]);
+    }
+
+    ASSERT_EQ_INT(vfs_atomic_load(&s_test_memfs_concurrent.fail), 0);
+}
+
+static int _test_memfs_concurrent_unlink_cb(const char* name, const vfs_stat_t* stat, void* data)
+{
+    (void)stat;
+    char path[64];
+    size_t* cnt = data;
+
+    snprintf(path, sizeof(path), "/a/b/%s", name);
+    ASSERT_EQ_INT(s_test_memfs_concurrent.fs->unlink(s_test_memfs_concurrent.fs, path), 0);
+    *cnt += 1;
+    return 0;
+}
+
+TEST_F(memfs, concurrent_ls_unlink_in_callback)
+{
+    int i;
+    char path[64];
+    size_t cnt = 0;
+    vfs_operations_t* fs = s_test_memfs_concurrent.fs;
+
+    for (i = 0; i < TEST_MEMFS_CONCURRENT_FILES; i++)
+    {
+        uintptr_t fh;
+        snprintf(path, sizeof(path), "/a/b/f%d", i);
+        ASSERT_EQ_INT(fs->open(fs, &fh, path, VFS_O_WRONLY | VFS_O_CREATE), 0);
+        ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    }
+
+    /* Every entry is visited exactly once even though the directory shrinks. */
+    ASSERT_EQ_INT(fs->ls(fs, "/a/b", _test_memfs_concurrent_unlink_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, TEST_MEMFS_CONCURRENT_FILES + 1);
+}
+
+#define TEST_MEMFS_CONCURRENT_WRITERS   4
+#define TEST_MEMFS_CONCURRENT_REGION    (64 * 1024 + 100)
+
+typedef struct test_memfs_concurrent_writer
+{
+    vfs_operations_t*   fs;
+    int                 idx;
+    uintptr_t           fh;
+} test_memfs_concurrent_writer_t;
+
+static void _test_memfs_concurrent_region_writer(void* arg)
+{
+    test_memfs_concurrent_writer_t* writer = arg;
+    vfs_operations_t* fs = writer->fs;
+    uint8_t buf[1000];
+    size_t off;
+
+    memset(buf, 'a' + writer->idx, sizeof(buf));
+
+    /* Writers fill their own region in small pieces, so they interleave. */
+    int64_t beg = (int64_t)writer->idx * TEST_MEMFS_CONCURRENT_REGION;
+    if (fs->seek(fs, writer->fh, beg, VFS_SEEK_SET) != beg)
+    {
+        (void)vfs_atomic_add(&s_test_memfs_concurrent.fail);
+    }
+    for (off = 0; off < TEST_MEMFS_CONCURRENT_REGION; off += sizeof(buf))
+    {
+        size_t len = TEST_MEMFS_CONCURRENT_REGION - off;
+        len = len < sizeof(buf) ? len : sizeof(buf);
+        if (fs->write(fs, writer->fh, buf, len) != (int)len)
+        {
+            (void)vfs_atomic_add(&s_test_memfs_concurrent.fail);
+        }
+    }
+}
+
+TEST_F(memfs, concurrent_write_disjoint)
+{
+    int i;
+    size_t off;
+    uintptr_t fh;
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_memfs_concurrent.fs;
+    vfs_thread_t threads[TEST_MEMFS_CONCURRENT_WRITERS];
+    test_memfs_concurrent_writer_t writers[TEST_MEMFS_CONCURRENT_WRITERS];
+
+    for (i = 0; i < TEST_MEMFS_CONCURRENT_WRITERS; i++)
+    {
+        writers[i].fs = fs;
+        writers[i].idx = i;
+        ASSERT_EQ_INT(fs->open(fs, &writers[i].fh, "/a/b/keep", VFS_O_WRONLY), 0);
+    }
+    for (i = 0; i < TEST_MEMFS_CONCURRENT_WRITERS; i++)
+    {
+        vfs_thread_init(&threads[i], _test_memfs_concurrent_region_writer, &writers[i]);
+    }
+    for (i = 0; i < TEST_MEMFS_CONCURRENT_WRITERS; i++)
+    {
+        vfs_thread_exit(threads[i]);
+        ASSERT_EQ_INT(fs->close(fs, writers[i].fh), 0);
+    }
+    ASSERT_EQ_INT(vfs_atomic_load(&s_test_memfs_concurrent.fail), 0);
+
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/keep", &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, (uint64_t)TEST_MEMFS_CONCURRENT_REGION * TEST_MEMFS_CONCURRENT_WRITERS);
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/b/keep", VFS_O_RDONLY), 0);
+    for (i = 0; i < TEST_MEMFS_CONCURRENT_WRITERS; i++)
+    {
+        for (off = 0; off < TEST_MEMFS_CONCURRENT_REGION; off++)
+        {
+            uint8_t c;
+            ASSERT_EQ_INT(fs->read(fs, fh, &c, 1), 1);
+            ASSERT_EQ_INT(c, 'a' + i);
+        }
+    }
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+static void _test_memfs_concurrent_appender(void* arg)
+{
+    test_memfs_concurrent_writer_t* writer = arg;
+    vfs_operations_t* fs = writer->fs;
+    uint8_t buf[100];
+    int i;
+
+    memset(buf, 'a' + writer->idx, sizeof(buf));
+    for (i = 0; i < 100; i++)
+    {
+        if (fs->write(fs, writer->fh, buf, sizeof(buf)) != (int)sizeof(buf))
+        {
+            (void)vfs_atomic_add(&s_test_memfs_concurrent.fail);
+        }
+    }
+}
+
+TEST_F(memfs, concurrent_append)
+{
+    int i, j;
+    uintptr_t fh;
+    vfs_operations_t* fs = s_test_memfs_concurrent.fs;
+    vfs_thread_t threads[TEST_MEMFS_CONCURRENT_WRITERS];
+    test_memfs_concurrent_writer_t writers[TEST_MEMFS_CONCURRENT_WRITERS];
+
+    for (i = 0; i < TEST_MEMFS_CONCURRENT_WRITERS; i++)
+    {
+        writers[i].fs = fs;
+        writers[i].idx = i;
+        ASSERT_EQ_INT(fs->open(fs, &writers[i].fh, "/a/b/keep", VFS_O_WRONLY | VFS_O_APPEND), 0);
+        vfs_thread_init(&threads[i], _test_memfs_concurrent_appender, &writers[i]);
+    }
+    for (i = 0; i < TEST_MEMFS_CONCURRENT_WRITERS; i++)
+    {
+        vfs_thread_exit(threads[i]);
+        ASSERT_EQ_INT(fs->close(fs, writers[i].fh), 0);
+    }
+    ASSERT_EQ_INT(vfs_atomic_load(&s_test_memfs_concurrent.fail), 0);
+
+    /* Appends never overwrite each other, so every record is intact. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/b/keep", VFS_O_RDONLY), 0);
+    for (i = 0; i < 100 * TEST_MEMFS_CONCURRENT_WRITERS; i++)
+    {
+        uint8_t buf[100];
+        ASSERT_EQ_INT(fs->read(fs, fh, buf, sizeof(buf)), (int)sizeof(buf));
+        for (j = 1; j < (int)sizeof(buf); j++)
+        {
+            ASSERT_EQ_INT(buf[j], buf[0]);
+        }
+    }
+    ASSERT_EQ_INT(fs->read(fs, fh, &j, 1), VFS_EOF);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
@@ -0,0 +1,141 @@
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "utils/fsbuilder.h"
+#include "utils/memfs_chunk.h"
+
+/* Four distinct chunks. */
+#define TEST_MEMFS_DEDUP_SIZE   (4 * TEST_MEMFS_CHUNK)
+
+static vfs_operations_t* s_test_memfs_dedup = NULL;
+static vfs_memfs_store_t* s_test_memfs_dedup_store = NULL;
+static char s_test_memfs_dedup_data[TEST_MEMFS_DEDUP_SIZE];
+
+static void _test_memfs_dedup_write_file(vfs_operations_t* fs, const char* path, const char* data)
+{
+    uintptr_t fh;
+    ASSERT_EQ_INT(fs->open(fs, &fh, path, VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, data, TEST_MEMFS_DEDUP_SIZE), TEST_MEMFS_DEDUP_SIZE);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    size_t i;
+    for (i = 0; i < TEST_MEMFS_DEDUP_SIZE; i++)
+    {
+        s_test_memfs_dedup_data[i] = (char)(i * 7 + i / TEST_MEMFS_CHUNK);
+    }
+
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_dedup), 0);
+    ASSERT_EQ_INT(vfs_memfs_store_create(&s_test_memfs_dedup_store), 0);
+    ASSERT_EQ_INT(vfs_memfs_set_dedup(s_test_memfs_dedup, s_test_memfs_dedup_store), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    vfs_memfs_store_release(s_test_memfs_dedup_store);
+    s_test_memfs_dedup_store = NULL;
+    s_test_memfs_dedup->destroy(s_test_memfs_dedup);
+    s_test_memfs_dedup = NULL;
+}
+
+TEST_F(memfs, dedup_same_fs)
+{
+    vfs_memfs_store_stat_t info;
+    vfs_operations_t* fs = s_test_memfs_dedup;
+
+    _test_memfs_dedup_write_file(fs, "/a", s_test_memfs_dedup_data);
+    vfs_memfs_store_stat(s_test_memfs_dedup_store, &info);
+    ASSERT_EQ_UINT64(info.unique_bytes, TEST_MEMFS_DEDUP_SIZE);
+    ASSERT_EQ_UINT64(info.ref_bytes, TEST_MEMFS_DEDUP_SIZE);
+    ASSERT_EQ_UINT64(info.hit_cnt, 0);
+
+    _test_memfs_dedup_write_file(fs, "/b", s_test_memfs_dedup_data);
+    vfs_memfs_store_stat(s_test_memfs_dedup_store, &info);
+    ASSERT_EQ_UINT64(info.unique_bytes, TEST_MEMFS_DEDUP_SIZE);
+    ASSERT_EQ_UINT64(info.ref_bytes, 2 * TEST_MEMFS_DEDUP_SIZE);
+    ASSERT_EQ_UINT64(info.hit_cnt, 4);
+
+    vfs_test_check_file(fs, "/a", s_test_memfs_dedup_data, TEST_MEMFS_DEDUP_SIZE);
+    vfs_test_check_file(fs, "/b", s_test_memfs_dedup_data, TEST_MEMFS_DEDUP_SIZE);
+
+    ASSERT_EQ_INT(fs->unlink(fs, "/a"), 0);
+    ASSERT_EQ_INT(fs->unlink(fs, "/b"), 0);
+    vfs_memfs_store_stat(s_test_memfs_dedup_store, &info);
+    ASSERT_EQ_UINT64(info.unique_bytes, 0);
+    ASSERT_EQ_UINT64(info.ref_bytes, 0);
+}
+
+TEST_F(memfs, dedup_write)
+{
+    uintptr_t fh;
+    vfs_memfs_store_stat_t info;
+    vfs_operations_t* fs = s_test_memfs_dedup;
+    static char expect[TEST_MEMFS_DEDUP_SIZE];
+
+    _test_memfs_dedup_write_file(fs, "/a", s_test_memfs_dedup_data);
+    _test_memfs_dedup_write_file(fs, "/b", s_test_memfs_dedup_data);
+
+    /* Shared chunk is copied before write. */
+    memcpy(expect, s_test_memfs_dedup_data, sizeof(expect));
+    memcpy(expect + TEST_MEMFS_CHUNK + 10, "hello", 5);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/b", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT((int)fs->seek(fs, fh, TEST_MEMFS_CHUNK + 10, VFS_SEEK_SET), TEST_MEMFS_CHUNK + 10);
+    ASSERT_EQ_INT(fs->write(fs, fh, "hello", 5), 5);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    vfs_test_check_file(fs, "/a", s_test_memfs_dedup_data, TEST_MEMFS_DEDUP_SIZE);
+    vfs_test_check_file(fs, "/b", expect, TEST_MEMFS_DEDUP_SIZE);
+
+    /* The new chunk is stored on close. */
+    vfs_memfs_store_stat(s_test_memfs_dedup_store, &info);
+    ASSERT_EQ_UINT64(info.unique_bytes, TEST_MEMFS_DEDUP_SIZE + TEST_MEMFS_CHUNK);
+    ASSERT_EQ_UINT64(info.ref_bytes, 2 * TEST_MEMFS_DEDUP_SIZE);
+
+    /* Unshared chunk is taken out of store before write. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/b", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT((int)fs->seek(fs, fh, TEST_MEMFS_CHUNK + 10, VFS_SEEK_SET), TEST_MEMFS_CHUNK + 10);
+    ASSERT_EQ_INT(fs->write(fs, fh, "world", 5), 5);
+    vfs_memfs_store_stat(s_test_memfs_dedup_store, &info);
+    ASSERT_EQ_UINT64(info.unique_bytes, TEST_MEMFS_DEDUP_SIZE);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    memcpy(expect + TEST_MEMFS_CHUNK + 10, "world", 5);
+    vfs_test_check_file(fs, "/a", s_test_memfs_dedup_data, TEST_MEMFS_DEDUP_SIZE);
+    vfs_test_check_file(fs, "/b", expect, TEST_MEMFS_DEDUP_SIZE);
+}
+
+TEST_F(memfs, dedup_shared_store)
+{
+    vfs_memfs_statfs_t fs_info;
+    vfs_memfs_store_stat_t info;
+    vfs_operations_t* other;
+    vfs_operations_t* fs = s_test_memfs_dedup;
+
+    ASSERT_EQ_INT(vfs_make_memory(&other), 0);
+    ASSERT_EQ_INT(vfs_memfs_set_dedup(other, s_test_memfs_dedup_store), 0);
+
+    _test_memfs_dedup_write_file(fs, "/a", s_test_memfs_dedup_data);
+    _test_memfs_dedup_write_file(other, "/a", s_test_memfs_dedup_data);
+
+    vfs_memfs_store_stat(s_test_memfs_dedup_store, &info);
+    ASSERT_EQ_UINT64(info.unique_bytes, TEST_MEMFS_DEDUP_SIZE);
+    ASSERT_EQ_UINT64(info.ref_bytes, 2 * TEST_MEMFS_DEDUP_SIZE);
+
+    /* Each file system is still charged for the content it references. */
+    vfs_memfs_statfs(other, &fs_info);
+    ASSERT_EQ_UINT64(fs_info.data_used, TEST_MEMFS_DEDUP_SIZE);
+
+    /* Store outlives user references as long as chunks are stored. */
+    ASSERT_EQ_INT(vfs_memfs_set_dedup(fs, NULL), 0);
+    vfs_memfs_store_release(s_test_memfs_dedup_store);
+    s_test_memfs_dedup_store = NULL;
+    ASSERT_EQ_INT(vfs_memfs_set_dedup(other, NULL), 0);
+
+    vfs_test_check_file(other, "/a", s_test_memfs_dedup_data, TEST_MEMFS_DEDUP_SIZE);
+    other->destroy(other);
+    vfs_test_check_file(fs, "/a", s_test_memfs_dedup_data, TEST_MEMFS_DEDUP_SIZE);
+
+    ASSERT_EQ_INT(vfs_memfs_store_create(&s_test_memfs_dedup_store), 0);
+}
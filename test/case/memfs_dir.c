@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+
+#define TEST_MEMFS_DIR_SIZE 1000
+
+static vfs_operations_t* s_test_memfs_dir = NULL;
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_dir), 0);
+    ASSERT_EQ_INT(s_test_memfs_dir->mkdir(s_test_memfs_dir, "/d"), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_dir->destroy(s_test_memfs_dir);
+    s_test_memfs_dir = NULL;
+}
+
+static int _test_memfs_dir_count_cb(const char* name, const vfs_stat_t* stat, void* data)
+{
+    (void)name; (void)stat;
+    size_t* cnt = data;
+    *cnt += 1;
+    return 0;
+}
+
+static void _test_memfs_dir_create(vfs_operations_t* fs, size_t idx)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/d/f%zu", idx);
+
+    uintptr_t fh;
+    ASSERT_EQ_INT(fs->open(fs, &fh, path, VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+static int _test_memfs_dir_stat(vfs_operations_t* fs, size_t idx)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/d/f%zu", idx);
+
+    vfs_stat_t info;
+    return fs->stat(fs, path, &info);
+}
+
+static int _test_memfs_dir_unlink(vfs_operations_t* fs, size_t idx)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/d/f%zu", idx);
+    return fs->unlink(fs, path);
+}
+
+TEST_F(memfs, dir_large)
+{
+    size_t i;
+    vfs_operations_t* fs = s_test_memfs_dir;
+
+    for (i = 0; i < TEST_MEMFS_DIR_SIZE; i++)
+    {
+        _test_memfs_dir_create(fs, i);
+    }
+    for (i = 0; i < TEST_MEMFS_DIR_SIZE; i++)
+    {
+        ASSERT_EQ_INT(_test_memfs_dir_stat(fs, i), 0);
+    }
+    ASSERT_EQ_INT(_test_memfs_dir_stat(fs, TEST_MEMFS_DIR_SIZE), VFS_ENOENT);
+
+    /* Remove every odd entry. */
+    for (i = 1; i < TEST_MEMFS_DIR_SIZE; i += 2)
+    {
+        ASSERT_EQ_INT(_test_memfs_dir_unlink(fs, i), 0);
+    }
+    for (i = 0; i < TEST_MEMFS_DIR_SIZE; i++)
+    {
+        ASSERT_EQ_INT(_test_memfs_dir_stat(fs, i), (i & 0x01) ? VFS_ENOENT : 0);
+    }
+
+    size_t cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/d", _test_memfs_dir_count_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, TEST_MEMFS_DIR_SIZE / 2);
+
+    /* Shrink the directory back to a small one. */
+    for (i = 0; i < TEST_MEMFS_DIR_SIZE - 2; i += 2)
+    {
+        ASSERT_EQ_INT(_test_memfs_dir_unlink(fs, i), 0);
+    }
+    ASSERT_EQ_INT(_test_memfs_dir_stat(fs, TEST_MEMFS_DIR_SIZE - 2), 0);
+    ASSERT_EQ_INT(_test_memfs_dir_stat(fs, 0), VFS_ENOENT);
+    ASSERT_EQ_INT(_test_memfs_dir_unlink(fs, TEST_MEMFS_DIR_SIZE - 2), 0);
+    ASSERT_EQ_INT(fs->rmdir(fs, "/d"), 0);
+}
+
+/* Names around the size that fits in node, and a long one. */
+static const size_t s_test_memfs_dir_name_lens[] = { 1, 30, 31, 32, 33, 255 };
+#define TEST_MEMFS_DIR_NAME_CNT (sizeof(s_test_memfs_dir_name_lens) / sizeof(s_test_memfs_dir_name_lens[0]))
+
+TEST_F(memfs, dir_name_length)
+{
+    size_t i, cnt = 0;
+    uintptr_t fh;
+    vfs_stat_t info;
+    char path[300];
+    vfs_operations_t* fs = s_test_memfs_dir;
+
+    for (i = 0; i < TEST_MEMFS_DIR_NAME_CNT; i++)
+    {
+        memcpy(path, "/d/", 3);
+        memset(path + 3, 'a' + (int)i, s_test_memfs_dir_name_lens[i]);
+        path[3 + s_test_memfs_dir_name_lens[i]] = '\0';
+        ASSERT_EQ_INT(fs->open(fs, &fh, path, VFS_O_WRONLY | VFS_O_CREATE), 0);
+        ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    }
+
+    ASSERT_EQ_INT(fs->ls(fs, "/d", _test_memfs_dir_count_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, TEST_MEMFS_DIR_NAME_CNT);
+
+    for (i = 0; i < TEST_MEMFS_DIR_NAME_CNT; i++)
+    {
+        memset(path + 3, 'a' + (int)i, s_test_memfs_dir_name_lens[i]);
+        path[3 + s_test_memfs_dir_name_lens[i]] = '\0';
+        ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+        ASSERT_EQ_INT(fs->unlink(fs, path), 0);
+        ASSERT_EQ_INT(fs->stat(fs, path, &info), VFS_ENOENT);
+    }
+}
@@ -0,0 +1,134 @@
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/localfs.h"
+#include "vfs/fs/memfs.h"
+#include "utils/fsbuilder.h"
+#include "utils/memfs_chunk.h"
+#include "vfs/utils/file.h"
+
+/* A file with a hole and a partial last chunk. */
+#define TEST_MEMFS_IMAGE_SIZE   (5 * TEST_MEMFS_CHUNK + 100)
+
+static vfs_operations_t* s_test_memfs_image = NULL;
+static vfs_operations_t* s_test_memfs_image_local = NULL;
+static vfs_str_t s_test_memfs_image_path = VFS_STR_INIT;
+static char s_test_memfs_image_data[TEST_MEMFS_IMAGE_SIZE];
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    size_t i;
+    for (i = 0; i < TEST_MEMFS_IMAGE_SIZE; i++)
+    {
+        s_test_memfs_image_data[i] = (char)(i % 251);
+    }
+    memset(s_test_memfs_image_data + TEST_MEMFS_CHUNK, 0, 2 * TEST_MEMFS_CHUNK);
+
+    s_test_memfs_image_path = vfs_str_dup(&g_cwd_path);
+    vfs_str_append1(&s_test_memfs_image_path, "/test_memfs_image.bin");
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_image), 0);
+    ASSERT_EQ_INT(vfs_make_local(&s_test_memfs_image_local, g_cwd_path.str), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_image->destroy(s_test_memfs_image);
+    s_test_memfs_image = NULL;
+    s_test_memfs_image_local->unlink(s_test_memfs_image_local, "/test_memfs_image.bin");
+    s_test_memfs_image_local->destroy(s_test_memfs_image_local);
+    s_test_memfs_image_local = NULL;
+    vfs_str_exit(&s_test_memfs_image_path);
+}
+
+TEST_F(memfs, image_save_load)
+{
+    uintptr_t fh;
+    vfs_stat_t stat;
+    vfs_memfs_statfs_t info, load_info;
+    vfs_operations_t* load;
+    vfs_operations_t* fs = s_test_memfs_image;
+
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a"), 0);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a/b"), 0);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/empty"), 0);
+
+    /* The middle chunks are left as a hole. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/b/sparse", VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, s_test_memfs_image_data, TEST_MEMFS_CHUNK), TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT((int)fs->seek(fs, fh, 3 * TEST_MEMFS_CHUNK, VFS_SEEK_SET), 3 * TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT(fs->write(fs, fh, s_test_memfs_image_data + 3 * TEST_MEMFS_CHUNK,
+        TEST_MEMFS_IMAGE_SIZE - 3 * TEST_MEMFS_CHUNK), TEST_MEMFS_IMAGE_SIZE - 3 * TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/empty_file", VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    /* Compressed content is saved as is. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/zeros", VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, s_test_memfs_image_data + TEST_MEMFS_CHUNK, TEST_MEMFS_CHUNK),
+        TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    ASSERT_EQ_INT(vfs_memfs_set_compress(fs, 1, 0), 0);
+    ASSERT_EQ_INT(vfs_memfs_compress(fs), 0);
+
+    ASSERT_EQ_INT(vfs_memfs_save(fs, s_test_memfs_image_path.str), 0);
+    ASSERT_EQ_INT(vfs_memfs_load(&load, s_test_memfs_image_path.str), 0);
+
+    ASSERT_EQ_INT(load->stat(load, "/empty", &stat), 0);
+    ASSERT_NE_UINT64(stat.st_mode & VFS_S_IFDIR, 0);
+    ASSERT_EQ_INT(load->stat(load, "/a/empty_file", &stat), 0);
+    ASSERT_EQ_UINT64(stat.st_size, 0);
+    ASSERT_EQ_INT(load->stat(load, "/a/b/sparse", &stat), 0);
+    ASSERT_EQ_UINT64(stat.st_size, TEST_MEMFS_IMAGE_SIZE);
+    ASSERT_EQ_UINT64(stat.st_blocks, 4 * TEST_MEMFS_CHUNK / 512);
+
+    vfs_test_check_file(load, "/a/b/sparse", s_test_memfs_image_data, TEST_MEMFS_IMAGE_SIZE);
+    vfs_test_check_file(load, "/zeros", s_test_memfs_image_data + TEST_MEMFS_CHUNK, TEST_MEMFS_CHUNK);
+
+    vfs_memfs_statfs(fs, &info);
+    vfs_memfs_statfs(load, &load_info);
+    ASSERT_EQ_UINT64(load_info.data_used, info.data_used);
+    ASSERT_EQ_UINT64(load_info.zsrc_bytes, info.zsrc_bytes);
+
+    /* Loaded file system is writable. */
+    ASSERT_EQ_INT(load->unlink(load, "/zeros"), 0);
+    ASSERT_EQ_INT(load->open(load, &fh, "/a/b/sparse", VFS_O_WRONLY), 0);
+    ASSERT_EQ_INT(load->truncate(load, fh, 10), 0);
+    ASSERT_EQ_INT(load->close(load, fh), 0);
+    vfs_test_check_file(load, "/a/b/sparse", s_test_memfs_image_data, 10);
+
+    load->destroy(load);
+}
+
+TEST_F(memfs, image_malformed)
+{
+    int size;
+    uintptr_t fh;
+    vfs_operations_t* load;
+    vfs_operations_t* fs = s_test_memfs_image;
+    vfs_operations_t* local = s_test_memfs_image_local;
+    static char image[2 * TEST_MEMFS_IMAGE_SIZE];
+
+    ASSERT_EQ_INT(vfs_memfs_load(&load, s_test_memfs_image_path.str), VFS_ENOENT);
+
+    ASSERT_EQ_INT(fs->mkdir(fs, "/d"), 0);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/d/f", VFS_O_WRONLY | VFS_O_CREATE,
+        s_test_memfs_image_data, TEST_MEMFS_IMAGE_SIZE), TEST_MEMFS_IMAGE_SIZE);
+    ASSERT_EQ_INT(vfs_memfs_save(fs, s_test_memfs_image_path.str), 0);
+
+    ASSERT_EQ_INT(local->open(local, &fh, "/test_memfs_image.bin", VFS_O_RDONLY), 0);
+    size = local->read(local, fh, image, sizeof(image));
+    ASSERT_EQ_INT(local->close(local, fh), 0);
+    ASSERT_GT_INT(size, 0);
+    ASSERT_LT_INT(size, (int)sizeof(image));
+
+    /* Truncated image. */
+    ASSERT_EQ_INT(vfs_file_write(local, "/test_memfs_image.bin", VFS_O_WRONLY | VFS_O_TRUNCATE,
+        image, size - 1), size - 1);
+    ASSERT_EQ_INT(vfs_memfs_load(&load, s_test_memfs_image_path.str), VFS_EIO);
+
+    /* Bad magic. */
+    image[0] = 'X';
+    ASSERT_EQ_INT(vfs_file_write(local, "/test_memfs_image.bin", VFS_O_WRONLY | VFS_O_TRUNCATE,
+        image, size), size);
+    ASSERT_EQ_INT(vfs_memfs_load(&load, s_test_memfs_image_path.str), VFS_EIO);
+}
@@ -0,0 +1,140 @@
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/localfs.h"
+#include "vfs/fs/memfs.h"
+#include "vfs/utils/file.h"
+#include "utils/fsbuilder.h"
+
+static vfs_operations_t* s_test_memfs_journal_local = NULL;
+static vfs_str_t s_test_memfs_journal_image = VFS_STR_INIT;
+static vfs_str_t s_test_memfs_journal_log = VFS_STR_INIT;
+static vfs_memfs_journal_config_t s_test_memfs_journal_config;
+
+static vfs_operations_t* _test_memfs_journal_open(uint32_t flush_ms, uint64_t checkpoint_bytes)
+{
+    vfs_operations_t* fs = NULL;
+    s_test_memfs_journal_config.flush_ms = flush_ms;
+    s_test_memfs_journal_config.checkpoint_bytes = checkpoint_bytes;
+    ASSERT_EQ_INT(vfs_make_memory_journal(&fs, &s_test_memfs_journal_config), 0);
+    return fs;
+}
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    ASSERT_EQ_INT(vfs_make_local(&s_test_memfs_journal_local, g_cwd_path.str), 0);
+
+    s_test_memfs_journal_image = vfs_str_dup(&g_cwd_path);
+    vfs_str_append1(&s_test_memfs_journal_image, "/test_memfs_journal.img");
+    s_test_memfs_journal_log = vfs_str_dup(&g_cwd_path);
+    vfs_str_append1(&s_test_memfs_journal_log, "/test_memfs_journal.log");
+
+    s_test_memfs_journal_config.image_path = s_test_memfs_journal_image.str;
+    s_test_memfs_journal_config.journal_path = s_test_memfs_journal_log.str;
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_journal_local->unlink(s_test_memfs_journal_local, "/test_memfs_journal.img");
+    s_test_memfs_journal_local->unlink(s_test_memfs_journal_local, "/test_memfs_journal.log");
+    s_test_memfs_journal_local->destroy(s_test_memfs_journal_local);
+    s_test_memfs_journal_local = NULL;
+
+    vfs_str_exit(&s_test_memfs_journal_image);
+    vfs_str_exit(&s_test_memfs_journal_log);
+}
+
+TEST_F(memfs, journal_replay)
+{
+    uintptr_t fh;
+    vfs_stat_t stat;
+    vfs_operations_t* fs = _test_memfs_journal_open(0, 0);
+
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a"), 0);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/b"), 0);
+    ASSERT_EQ_INT(fs->rmdir(fs, "/b"), 0);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/a/f", VFS_O_WRONLY | VFS_O_CREATE, "hello world", 11), 11);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/a/g", VFS_O_WRONLY | VFS_O_CREATE, "temp", 4), 4);
+    ASSERT_EQ_INT(fs->unlink(fs, "/a/g"), 0);
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/f", VFS_O_WRONLY | VFS_O_APPEND), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, "!!", 2), 2);
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 12), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    /* Writes to unlinked file are not recorded. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/h", VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->unlink(fs, "/a/h"), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, "lost", 4), 4);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    fs->destroy(fs);
+
+    fs = _test_memfs_journal_open(0, 0);
+    vfs_test_check_file(fs, "/a/f", "hello world!", 12);
+    ASSERT_EQ_INT(fs->stat(fs, "/b", &stat), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/g", &stat), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/h", &stat), VFS_ENOENT);
+
+    /* Replayed content is kept by checkpoint taken on startup. */
+    ASSERT_EQ_INT(vfs_file_write(fs, "/a/f", VFS_O_WRONLY | VFS_O_TRUNCATE, "bye", 3), 3);
+    fs->destroy(fs);
+
+    fs = _test_memfs_journal_open(0, 0);
+    vfs_test_check_file(fs, "/a/f", "bye", 3);
+    fs->destroy(fs);
+}
+
+TEST_F(memfs, journal_checkpoint)
+{
+    vfs_operations_t* fs = _test_memfs_journal_open(0, 0);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/f", VFS_O_WRONLY | VFS_O_CREATE, "first", 5), 5);
+    ASSERT_EQ_INT(vfs_memfs_checkpoint(fs), 0);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/g", VFS_O_WRONLY | VFS_O_CREATE, "second", 6), 6);
+    fs->destroy(fs);
+
+    /* Checkpoints are also taken when journal grows. */
+    fs = _test_memfs_journal_open(0, 64);
+    vfs_test_check_file(fs, "/f", "first", 5);
+    vfs_test_check_file(fs, "/g", "second", 6);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/h", VFS_O_WRONLY | VFS_O_CREATE, "third", 5), 5);
+    fs->destroy(fs);
+
+    vfs_stat_t stat;
+    ASSERT_EQ_INT(s_test_memfs_journal_local->stat(s_test_memfs_journal_local, "/test_memfs_journal.log", &stat), 0);
+    ASSERT_LE_UINT64(stat.st_size, 64);
+
+    fs = _test_memfs_journal_open(0, 0);
+    vfs_test_check_file(fs, "/h", "third", 5);
+    ASSERT_EQ_INT(vfs_memfs_checkpoint(fs), 0);
+    fs->destroy(fs);
+
+    ASSERT_EQ_INT(vfs_make_memory(&fs), 0);
+    ASSERT_EQ_INT(vfs_memfs_checkpoint(fs), VFS_EINVAL);
+    fs->destroy(fs);
+}
+
+TEST_F(memfs, journal_broken_tail)
+{
+    uintptr_t fh;
+    vfs_stat_t stat;
+    vfs_operations_t* local = s_test_memfs_journal_local;
+    vfs_operations_t* fs = _test_memfs_journal_open(10, 0);
+
+    ASSERT_EQ_INT(vfs_file_write(fs, "/f", VFS_O_WRONLY | VFS_O_CREATE, "data", 4), 4);
+    ASSERT_EQ_INT(vfs_memfs_sync(fs), 0);
+    fs->destroy(fs);
+
+    /* A record that is cut short is ignored. */
+    ASSERT_EQ_INT(local->open(local, &fh, "/test_memfs_journal.log", VFS_O_WRONLY | VFS_O_APPEND), 0);
+    ASSERT_EQ_INT(local->write(local, fh, "\x40\x00\x00\x00\x01\x02\x03\x04\x05", 9), 9);
+    ASSERT_EQ_INT(local->close(local, fh), 0);
+
+    fs = _test_memfs_journal_open(10, 0);
+    vfs_test_check_file(fs, "/f", "data", 4);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/d"), 0);
+    fs->destroy(fs);
+
+    fs = _test_memfs_journal_open(10, 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/d", &stat), 0);
+    vfs_test_check_file(fs, "/f", "data", 4);
+    fs->destroy(fs);
+}
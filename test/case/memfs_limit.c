@@ -0,0 +1,128 @@
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "utils/memfs_chunk.h"
+
+static vfs_operations_t* s_test_memfs_limit = NULL;
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_limit), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_limit->destroy(s_test_memfs_limit);
+    s_test_memfs_limit = NULL;
+}
+
+TEST_F(memfs, limit_accounting)
+{
+    uintptr_t fh;
+    char buf[10000];
+    vfs_memfs_statfs_t base, info;
+    vfs_operations_t* fs = s_test_memfs_limit;
+
+    vfs_memfs_statfs(fs, &base);
+    ASSERT_EQ_UINT64(base.data_used, 0);
+    ASSERT_EQ_UINT64(base.hard_limit, 0);
+
+    /* Directory keeps capacity of its children array. */
+    ASSERT_EQ_INT(fs->mkdir(fs, "/d"), 0);
+    ASSERT_EQ_INT(fs->rmdir(fs, "/d"), 0);
+    vfs_memfs_statfs(fs, &base);
+
+    memset(buf, 'a', sizeof(buf));
+    ASSERT_EQ_INT(fs->mkdir(fs, "/d"), 0);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/d/f", VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, buf, sizeof(buf)), (int)sizeof(buf));
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.data_used, 3 * TEST_MEMFS_CHUNK);
+    ASSERT_GT_UINT64(info.meta_used, base.meta_used);
+
+    /* Everything is given back. */
+    ASSERT_EQ_INT(fs->unlink(fs, "/d/f"), 0);
+    ASSERT_EQ_INT(fs->rmdir(fs, "/d"), 0);
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.data_used, 0);
+    ASSERT_EQ_UINT64(info.meta_used, base.meta_used);
+}
+
+TEST_F(memfs, limit_hard)
+{
+    uintptr_t fh;
+    char buf[TEST_MEMFS_CHUNK];
+    vfs_memfs_statfs_t info;
+    vfs_operations_t* fs = s_test_memfs_limit;
+
+    ASSERT_EQ_INT(vfs_memfs_set_limit(fs, 100, 200, NULL, NULL), VFS_EINVAL);
+
+    vfs_memfs_statfs(fs, &info);
+    const uint64_t limit = info.meta_used + 64 * 1024;
+    ASSERT_EQ_INT(vfs_memfs_set_limit(fs, limit, 0, NULL, NULL), 0);
+
+    memset(buf, 'a', sizeof(buf));
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/f", VFS_O_WRONLY | VFS_O_CREATE), 0);
+
+    int ret;
+    uint64_t written = 0;
+    while ((ret = fs->write(fs, fh, buf, sizeof(buf))) > 0)
+    {
+        written += ret;
+    }
+    ASSERT_EQ_INT(ret, VFS_ENOSPC);
+    ASSERT_GT_UINT64(written, 0);
+
+    /* Failed write changes nothing. */
+    vfs_stat_t stat;
+    ASSERT_EQ_INT(fs->stat(fs, "/f", &stat), 0);
+    ASSERT_EQ_UINT64(stat.st_size, written);
+
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_LE_UINT64(info.meta_used + info.data_used, limit);
+
+    /* Space is available again after shrink. */
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 0), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, buf, sizeof(buf)), (int)sizeof(buf));
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+static void _test_memfs_limit_soft_cb(vfs_operations_t* fs, const vfs_memfs_statfs_t* info, void* data)
+{
+    int* cnt = data;
+    *cnt += 1;
+
+    /* Evict from callback. */
+    ASSERT_GT_UINT64(info->meta_used + info->data_used, info->soft_limit);
+    ASSERT_EQ_INT(fs->unlink(fs, "/cache"), 0);
+}
+
+TEST_F(memfs, limit_soft)
+{
+    int cnt = 0;
+    uintptr_t fh;
+    char buf[TEST_MEMFS_CHUNK];
+    vfs_operations_t* fs = s_test_memfs_limit;
+
+    ASSERT_EQ_INT(vfs_memfs_set_limit(fs, 0, 16 * 1024, _test_memfs_limit_soft_cb, &cnt), 0);
+
+    memset(buf, 'a', sizeof(buf));
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/cache", VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, buf, sizeof(buf)), (int)sizeof(buf));
+    ASSERT_EQ_INT(cnt, 0);
+
+    /* Going over soft limit evicts the cache file. */
+    uint64_t i;
+    for (i = 0; i < 4; i++)
+    {
+        ASSERT_EQ_INT(fs->write(fs, fh, buf, sizeof(buf)), (int)sizeof(buf));
+    }
+    ASSERT_EQ_INT(cnt, 1);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    vfs_memfs_statfs_t info;
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.data_used, 0);
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "utils/fsbuilder.h"
+#include "utils/memfs_chunk.h"
+#include "vfs/utils/file.h"
+
+/* More children than a directory holds without hash index. */
+#define TEST_MEMFS_READONLY_DIR_SIZE  40
+
+static vfs_operations_t* s_test_memfs_readonly = NULL;
+static char s_test_memfs_readonly_data[3 * TEST_MEMFS_CHUNK];
+
+typedef struct test_memfs_readonly_ls
+{
+    size_t  cnt;
+    char    last[32];
+    int     sorted;
+} test_memfs_readonly_ls_t;
+
+static int _test_memfs_readonly_ls_cb(const char* name, const vfs_stat_t* stat, void* data)
+{
+    (void)stat;
+    test_memfs_readonly_ls_t* helper = data;
+    if (helper->cnt != 0 && strcmp(helper->last, name) >= 0)
+    {
+        helper->sorted = 0;
+    }
+    snprintf(helper->last, sizeof(helper->last), "%s", name);
+    helper->cnt++;
+    return 0;
+}
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    size_t i;
+    for (i = 0; i < sizeof(s_test_memfs_readonly_data); i++)
+    {
+        s_test_memfs_readonly_data[i] = (char)(i % 251 + 1);
+    }
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_readonly), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_readonly->destroy(s_test_memfs_readonly);
+    s_test_memfs_readonly = NULL;
+}
+
+TEST_F(memfs, readonly_read)
+{
+    size_t i;
+    uintptr_t fh;
+    vfs_stat_t stat;
+    vfs_memfs_statfs_t info;
+    static char buf[6 * TEST_MEMFS_CHUNK];
+    vfs_operations_t* fs = s_test_memfs_readonly;
+
+    ASSERT_EQ_INT(fs->mkdir(fs, "/d"), 0);
+    for (i = TEST_MEMFS_READONLY_DIR_SIZE; i > 0; i--)
+    {
+        char path[32];
+        snprintf(path, sizeof(path), "/d/%02u", (unsigned)i);
+        ASSERT_EQ_INT(vfs_file_write(fs, path, VFS_O_WRONLY | VFS_O_CREATE, path, strlen(path)), (int)strlen(path));
+    }
+
+    /* A file with a hole between two extents. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/big", VFS_O_RDWR | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, s_test_memfs_readonly_data, TEST_MEMFS_CHUNK), TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 3 * TEST_MEMFS_CHUNK, VFS_SEEK_SET), 3 * TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT(fs->write(fs, fh, s_test_memfs_readonly_data, 2 * TEST_MEMFS_CHUNK + 10),
+        2 * TEST_MEMFS_CHUNK + 10);
+
+    /* Open files block switching to read-only. */
+    ASSERT_EQ_INT(vfs_memfs_set_readonly(fs), VFS_EBUSY);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    ASSERT_EQ_INT(vfs_memfs_set_readonly(fs), 0);
+    ASSERT_EQ_INT(vfs_memfs_set_readonly(fs), 0);
+    vfs_memfs_statfs(fs, &info);
+    ASSERT_EQ_UINT64(info.data_used, 3 * TEST_MEMFS_CHUNK + 10 + TEST_MEMFS_READONLY_DIR_SIZE * 5);
+
+    /* Children are listed in name order. */
+    test_memfs_readonly_ls_t helper;
+    memset(&helper, 0, sizeof(helper));
+    helper.sorted = 1;
+    ASSERT_EQ_INT(fs->ls(fs, "/d", _test_memfs_readonly_ls_cb, &helper), 0);
+    ASSERT_EQ_SIZE(helper.cnt, TEST_MEMFS_READONLY_DIR_SIZE);
+    ASSERT_EQ_INT(helper.sorted, 1);
+    ASSERT_EQ_INT(fs->ls(fs, "/big", _test_memfs_readonly_ls_cb, &helper), VFS_ENOTDIR);
+    ASSERT_EQ_INT(fs->ls(fs, "/none", _test_memfs_readonly_ls_cb, &helper), VFS_ENOENT);
+
+    ASSERT_EQ_INT(fs->stat(fs, "/", &stat), 0);
+    ASSERT_EQ_UINT64(stat.st_mode, VFS_S_IFDIR);
+    ASSERT_EQ_INT(fs->stat(fs, "/d/07", &stat), 0);
+    ASSERT_EQ_UINT64(stat.st_size, 5);
+    ASSERT_EQ_INT(fs->stat(fs, "/d/07/x", &stat), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->stat(fs, "/d/7", &stat), VFS_ENOENT);
+
+    vfs_test_check_file(fs, "/d/40", "/d/40", 5);
+
+    /* Holes read as zeros. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/big", VFS_O_RDONLY), 0);
+    ASSERT_EQ_INT(fs->read(fs, fh, buf, sizeof(buf)), 5 * TEST_MEMFS_CHUNK + 10);
+    ASSERT_EQ_INT(memcmp(buf, s_test_memfs_readonly_data, TEST_MEMFS_CHUNK), 0);
+    for (i = TEST_MEMFS_CHUNK; i < 3 * TEST_MEMFS_CHUNK; i++)
+    {
+        ASSERT_EQ_INT(buf[i], 0);
+    }
+    ASSERT_EQ_INT(memcmp(buf + 3 * TEST_MEMFS_CHUNK, s_test_memfs_readonly_data, 2 * TEST_MEMFS_CHUNK + 10), 0);
+    ASSERT_EQ_INT(fs->read(fs, fh, buf, sizeof(buf)), VFS_EOF);
+
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 100, VFS_SEEK_HOLE), TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, TEST_MEMFS_CHUNK, VFS_SEEK_DATA), 3 * TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 3 * TEST_MEMFS_CHUNK + 1, VFS_SEEK_HOLE), 5 * TEST_MEMFS_CHUNK + 10);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 5 * TEST_MEMFS_CHUNK + 10, VFS_SEEK_DATA), VFS_ENXIO);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, -1, VFS_SEEK_SET), VFS_EINVAL);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, -(5 * TEST_MEMFS_CHUNK + 11), VFS_SEEK_END), VFS_EINVAL);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, -10, VFS_SEEK_END), 5 * TEST_MEMFS_CHUNK);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, -(5 * TEST_MEMFS_CHUNK + 1), VFS_SEEK_CUR), VFS_EINVAL);
+    ASSERT_EQ_INT(fs->read(fs, fh, buf, sizeof(buf)), 10);
+    ASSERT_EQ_INT(memcmp(buf, s_test_memfs_readonly_data + 2 * TEST_MEMFS_CHUNK, 10), 0);
+
+    ASSERT_EQ_INT(fs->write(fs, fh, "x", 1), VFS_EROFS);
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 0), VFS_EROFS);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_F(memfs, readonly_change)
+{
+    uintptr_t fh;
+    vfs_operations_t* fs = s_test_memfs_readonly;
+    ASSERT_EQ_INT(fs->mkdir(fs, "/d"), 0);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/d/f", VFS_O_WRONLY | VFS_O_CREATE, "hello", 5), 5);
+    ASSERT_EQ_INT(vfs_memfs_set_readonly(fs), 0);
+
+    ASSERT_EQ_INT(fs->mkdir(fs, "/e"), VFS_EROFS);
+    ASSERT_EQ_INT(fs->rmdir(fs, "/d"), VFS_EROFS);
+    ASSERT_EQ_INT(fs->unlink(fs, "/d/f"), VFS_EROFS);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/d/f", VFS_O_RDWR), VFS_EROFS);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/d/f", VFS_O_RDONLY | VFS_O_TRUNCATE), VFS_EROFS);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/d/g", VFS_O_RDONLY | VFS_O_CREATE), VFS_EROFS);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/d/g", VFS_O_RDONLY), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/d", VFS_O_RDONLY), VFS_EISDIR);
+
+    vfs_memfs_snapshot_t* snapshot;
+    ASSERT_EQ_INT(vfs_memfs_snapshot(fs, &snapshot), VFS_EINVAL);
+    ASSERT_EQ_INT(vfs_memfs_set_compress(fs, 1, 0), VFS_EINVAL);
+    ASSERT_EQ_INT(vfs_memfs_set_dedup(fs, NULL), VFS_EINVAL);
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/d/f", VFS_O_RDONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_F(memfs, readonly_clone)
+{
+    vfs_operations_t* clone;
+    vfs_memfs_snapshot_t* snapshot;
+    vfs_operations_t* fs = s_test_memfs_readonly;
+    ASSERT_EQ_INT(fs->mkdir(fs, "/d"), 0);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/d/f", VFS_O_WRONLY | VFS_O_CREATE, "hello", 5), 5);
+
+    /* Directories of a clone are not copied until they are accessed. */
+    ASSERT_EQ_INT(vfs_memfs_snapshot(fs, &snapshot), 0);
+    ASSERT_EQ_INT(vfs_memfs_clone(snapshot, &clone), 0);
+    vfs_memfs_snapshot_release(snapshot);
+    ASSERT_EQ_INT(vfs_memfs_set_readonly(clone), 0);
+
+    vfs_test_check_file(clone, "/d/f", "hello", 5);
+    clone->destroy(clone);
+
+    /* The original is not affected. */
+    ASSERT_EQ_INT(vfs_file_write(fs, "/d/f", VFS_O_WRONLY | VFS_O_APPEND, "!", 1), 1);
+}
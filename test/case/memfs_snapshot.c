@@ -0,0 +1,179 @@
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+
+static vfs_operations_t* s_test_memfs_snapshot = NULL;
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_snapshot), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_snapshot->destroy(s_test_memfs_snapshot);
+    s_test_memfs_snapshot = NULL;
+}
+
+static void _test_memfs_snapshot_write(vfs_operations_t* fs, const char* path, uint64_t pos, const char* data)
+{
+    uintptr_t fh;
+    ASSERT_EQ_INT(fs->open(fs, &fh, path, VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, (int64_t)pos, VFS_SEEK_SET), (int64_t)pos);
+    ASSERT_EQ_INT(fs->write(fs, fh, data, strlen(data)), (int)strlen(data));
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+static void _test_memfs_snapshot_check(vfs_operations_t* fs, const char* path, uint64_t pos, const char* data)
+{
+    uintptr_t fh;
+    char buf[64];
+    const size_t len = strlen(data);
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, path, VFS_O_RDONLY), 0);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, (int64_t)pos, VFS_SEEK_SET), (int64_t)pos);
+    ASSERT_EQ_INT(fs->read(fs, fh, buf, len), (int)len);
+    ASSERT_EQ_INT(memcmp(buf, data, len), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+static int _test_memfs_snapshot_count_cb(const char* name, const vfs_stat_t* stat, void* data)
+{
+    (void)name; (void)stat;
+    size_t* cnt = data;
+    *cnt += 1;
+    return 0;
+}
+
+TEST_F(memfs, snapshot_isolation)
+{
+    vfs_operations_t* fs = s_test_memfs_snapshot;
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a"), 0);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a/b"), 0);
+    _test_memfs_snapshot_write(fs, "/a/b/f", 0, "hello world");
+    _test_memfs_snapshot_write(fs, "/a/g", 5000, "second chunk");
+
+    vfs_memfs_snapshot_t* snapshot = NULL;
+    ASSERT_EQ_INT(vfs_memfs_snapshot(fs, &snapshot), 0);
+
+    /* Changes of source after snapshot are not visible. */
+    _test_memfs_snapshot_write(fs, "/a/b/f", 0, "HELLO");
+    ASSERT_EQ_INT(fs->unlink(fs, "/a/g"), 0);
+
+    vfs_operations_t* clone_1 = NULL;
+    vfs_operations_t* clone_2 = NULL;
+    ASSERT_EQ_INT(vfs_memfs_clone(snapshot, &clone_1), 0);
+    ASSERT_EQ_INT(vfs_memfs_clone(snapshot, &clone_2), 0);
+
+    /* Clones outlive snapshot. */
+    vfs_memfs_snapshot_release(snapshot);
+
+    _test_memfs_snapshot_check(clone_1, "/a/b/f", 0, "hello world");
+    _test_memfs_snapshot_check(clone_1, "/a/g", 5000, "second chunk");
+    _test_memfs_snapshot_check(fs, "/a/b/f", 0, "HELLO world");
+
+    /* Changes of one clone are not visible to others. */
+    _test_memfs_snapshot_write(clone_1, "/a/b/f", 6, "there");
+    ASSERT_EQ_INT(clone_1->unlink(clone_1, "/a/g"), 0);
+    ASSERT_EQ_INT(clone_1->mkdir(clone_1, "/a/c"), 0);
+    _test_memfs_snapshot_check(clone_1, "/a/b/f", 0, "hello there");
+    _test_memfs_snapshot_check(clone_2, "/a/b/f", 0, "hello world");
+    _test_memfs_snapshot_check(clone_2, "/a/g", 5000, "second chunk");
+
+    size_t cnt = 0;
+    ASSERT_EQ_INT(clone_2->ls(clone_2, "/a", _test_memfs_snapshot_count_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 2);
+
+    /* Shrinking a file must not zero the shared chunk. */
+    uintptr_t fh;
+    ASSERT_EQ_INT(clone_1->open(clone_1, &fh, "/a/b/f", VFS_O_WRONLY), 0);
+    ASSERT_EQ_INT(clone_1->truncate(clone_1, fh, 2), 0);
+    ASSERT_EQ_INT(clone_1->close(clone_1, fh), 0);
+    _test_memfs_snapshot_check(clone_2, "/a/b/f", 0, "hello world");
+
+    clone_1->destroy(clone_1);
+    clone_2->destroy(clone_2);
+}
+
+TEST_F(memfs, snapshot_of_clone)
+{
+    vfs_operations_t* fs = s_test_memfs_snapshot;
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a"), 0);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a/b"), 0);
+    _test_memfs_snapshot_write(fs, "/a/b/f", 0, "data");
+
+    vfs_memfs_snapshot_t* snapshot_1 = NULL;
+    ASSERT_EQ_INT(vfs_memfs_snapshot(fs, &snapshot_1), 0);
+    vfs_operations_t* clone_1 = NULL;
+    ASSERT_EQ_INT(vfs_memfs_clone(snapshot_1, &clone_1), 0);
+    vfs_memfs_snapshot_release(snapshot_1);
+
+    /* Only part of clone is copied before it is snapshot again. */
+    ASSERT_EQ_INT(clone_1->mkdir(clone_1, "/x"), 0);
+
+    vfs_memfs_snapshot_t* snapshot_2 = NULL;
+    ASSERT_EQ_INT(vfs_memfs_snapshot(clone_1, &snapshot_2), 0);
+    vfs_operations_t* clone_2 = NULL;
+    ASSERT_EQ_INT(vfs_memfs_clone(snapshot_2, &clone_2), 0);
+    vfs_memfs_snapshot_release(snapshot_2);
+    clone_1->destroy(clone_1);
+
+    vfs_stat_t info;
+    ASSERT_EQ_INT(clone_2->stat(clone_2, "/x", &info), 0);
+    ASSERT_EQ_UINT64(info.st_mode & VFS_S_IFDIR, VFS_S_IFDIR);
+    _test_memfs_snapshot_check(clone_2, "/a/b/f", 0, "data");
+
+    /* Directories that are not copied yet are still not empty. */
+    ASSERT_EQ_INT(clone_2->rmdir(clone_2, "/a/b"), VFS_ENOTEMPTY);
+    ASSERT_EQ_INT(clone_2->unlink(clone_2, "/a/b/f"), 0);
+    ASSERT_EQ_INT(clone_2->rmdir(clone_2, "/a/b"), 0);
+    ASSERT_EQ_INT(clone_2->rmdir(clone_2, "/a"), 0);
+
+    clone_2->destroy(clone_2);
+    _test_memfs_snapshot_check(fs, "/a/b/f", 0, "data");
+}
+
+TEST_F(memfs, snapshot_capture_on_change)
+{
+    uintptr_t fh;
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_memfs_snapshot;
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a"), 0);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a/b"), 0);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a/e"), 0);
+    _test_memfs_snapshot_write(fs, "/a/b/f", 0, "first");
+
+    /* Source changes after each snapshot, before any clone is made. */
+    vfs_memfs_snapshot_t* snapshot_1 = NULL;
+    ASSERT_EQ_INT(vfs_memfs_snapshot(fs, &snapshot_1), 0);
+    _test_memfs_snapshot_write(fs, "/a/b/f", 0, "FIRST");
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a/b/c"), 0);
+    ASSERT_EQ_INT(fs->rmdir(fs, "/a/e"), 0);
+
+    vfs_memfs_snapshot_t* snapshot_2 = NULL;
+    ASSERT_EQ_INT(vfs_memfs_snapshot(fs, &snapshot_2), 0);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/b/f", VFS_O_WRONLY | VFS_O_TRUNCATE), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    _test_memfs_snapshot_write(fs, "/a/b/c/g", 0, "new");
+
+    vfs_operations_t* clone_1 = NULL;
+    vfs_operations_t* clone_2 = NULL;
+    ASSERT_EQ_INT(vfs_memfs_clone(snapshot_1, &clone_1), 0);
+    ASSERT_EQ_INT(vfs_memfs_clone(snapshot_2, &clone_2), 0);
+    vfs_memfs_snapshot_release(snapshot_1);
+    vfs_memfs_snapshot_release(snapshot_2);
+
+    _test_memfs_snapshot_check(clone_1, "/a/b/f", 0, "first");
+    ASSERT_EQ_INT(clone_1->stat(clone_1, "/a/b/c", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(clone_1->stat(clone_1, "/a/e", &info), 0);
+
+    _test_memfs_snapshot_check(clone_2, "/a/b/f", 0, "FIRST");
+    ASSERT_EQ_INT(clone_2->stat(clone_2, "/a/b/c", &info), 0);
+    ASSERT_EQ_INT(clone_2->stat(clone_2, "/a/b/c/g", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(clone_2->stat(clone_2, "/a/e", &info), VFS_ENOENT);
+
+    clone_1->destroy(clone_1);
+    clone_2->destroy(clone_2);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/f", &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 0);
+}
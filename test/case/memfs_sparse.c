@@ -0,0 +1,88 @@
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "utils/memfs_chunk.h"
+
+static vfs_operations_t* s_test_memfs_sparse = NULL;
+
+TEST_FIXTURE_SETUP(memfs)
+{
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_memfs_sparse), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(memfs)
+{
+    s_test_memfs_sparse->destroy(s_test_memfs_sparse);
+    s_test_memfs_sparse = NULL;
+}
+
+TEST_F(memfs, sparse_truncate)
+{
+    uintptr_t fh;
+    vfs_operations_t* fs = s_test_memfs_sparse;
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/f", VFS_O_RDWR | VFS_O_CREATE), 0);
+
+    /* A huge file costs no memory. */
+    const uint64_t size = (uint64_t)10 << 30;
+    ASSERT_EQ_INT(fs->truncate(fs, fh, size), 0);
+
+    vfs_stat_t info;
+    ASSERT_EQ_INT(fs->stat(fs, "/f", &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, size);
+    ASSERT_EQ_UINT64(info.st_blocks, 0);
+
+    char buf[64];
+    memset(buf, 0xff, sizeof(buf));
+    ASSERT_EQ_INT64(fs->seek(fs, fh, (int64_t)(size / 2), VFS_SEEK_SET), (int64_t)(size / 2));
+    ASSERT_EQ_INT(fs->read(fs, fh, buf, sizeof(buf)), (int)sizeof(buf));
+    ASSERT_EQ_INT(buf[0], 0);
+    ASSERT_EQ_INT(buf[sizeof(buf) - 1], 0);
+
+    /* Write in the middle only allocates one chunk. */
+    ASSERT_EQ_INT64(fs->seek(fs, fh, (int64_t)(size / 2), VFS_SEEK_SET), (int64_t)(size / 2));
+    ASSERT_EQ_INT(fs->write(fs, fh, "hello", 5), 5);
+    ASSERT_EQ_INT(fs->stat(fs, "/f", &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, size);
+    ASSERT_EQ_UINT64(info.st_blocks, TEST_MEMFS_CHUNK / 512);
+
+    /* Shrink release the chunk. */
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 100), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/f", &info), 0);
+    ASSERT_EQ_UINT64(info.st_blocks, 0);
+
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_F(memfs, sparse_seek_data_hole)
+{
+    uintptr_t fh;
+    vfs_operations_t* fs = s_test_memfs_sparse;
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/f", VFS_O_RDWR | VFS_O_CREATE), 0);
+
+    /* Layout: [hole][data][hole][data][hole] */
+    const int64_t data_1 = TEST_MEMFS_CHUNK * 2 + 10;
+    const int64_t data_2 = TEST_MEMFS_CHUNK * 5;
+    const int64_t size = TEST_MEMFS_CHUNK * 9;
+    ASSERT_EQ_INT64(fs->seek(fs, fh, data_1, VFS_SEEK_SET), data_1);
+    ASSERT_EQ_INT(fs->write(fs, fh, "a", 1), 1);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, data_2, VFS_SEEK_SET), data_2);
+    ASSERT_EQ_INT(fs->write(fs, fh, "b", 1), 1);
+    ASSERT_EQ_INT(fs->truncate(fs, fh, size), 0);
+
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 0, VFS_SEEK_DATA), TEST_MEMFS_CHUNK * 2);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, data_1, VFS_SEEK_DATA), data_1);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, data_1, VFS_SEEK_HOLE), TEST_MEMFS_CHUNK * 3);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, TEST_MEMFS_CHUNK * 3, VFS_SEEK_DATA), data_2);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, data_2, VFS_SEEK_HOLE), TEST_MEMFS_CHUNK * 6);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, TEST_MEMFS_CHUNK * 6, VFS_SEEK_DATA), VFS_ENXIO);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, size - 1, VFS_SEEK_HOLE), size - 1);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, size, VFS_SEEK_HOLE), VFS_ENXIO);
+
+    /* The position is moved. */
+    char c = 0;
+    ASSERT_EQ_INT64(fs->seek(fs, fh, TEST_MEMFS_CHUNK * 3, VFS_SEEK_DATA), data_2);
+    ASSERT_EQ_INT(fs->read(fs, fh, &c, 1), 1);
+    ASSERT_EQ_CHAR(c, 'b');
+
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
@@ -155,3 +155,35 @@ TEST_F(nullfs, mkdir)
     const char* path = LOCALFS_TEST_MOUNT_PATH "/foo";
     ASSERT_EQ_INT(vfs->mkdir(vfs, path), 0);
 }
+
+TEST_F(nullfs, sparse)
+{
+    vfs_operations_t* vfs = vfs_visitor_instance();
+    ASSERT_NE_PTR(vfs, NULL);
+
+    uintptr_t fh = 0;
+    const char* path = LOCALFS_TEST_MOUNT_PATH "/foo";
+    ASSERT_EQ_INT(vfs->open(vfs, &fh, path, VFS_O_RDWR | VFS_O_CREATE), 0);
+
+    /* Positional write extends the file to the end of written range. */
+    ASSERT_EQ_INT64(vfs->seek(vfs, fh, 100, VFS_SEEK_SET), 100);
+    ASSERT_EQ_INT(vfs->write(vfs, fh, "dummy", 5), 5);
+    ASSERT_EQ_INT64(vfs->seek(vfs, fh, 0, VFS_SEEK_SET), 0);
+    ASSERT_EQ_INT(vfs->write(vfs, fh, "dummy", 5), 5);
+
+    vfs_stat_t info;
+    ASSERT_EQ_INT(vfs->stat(vfs, path, &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 105);
+    ASSERT_EQ_UINT64(info.st_blocks, 0);
+
+    /* The whole file is a hole. */
+    ASSERT_EQ_INT64(vfs->seek(vfs, fh, 0, VFS_SEEK_DATA), VFS_ENXIO);
+    ASSERT_EQ_INT64(vfs->seek(vfs, fh, 0, VFS_SEEK_HOLE), 0);
+
+    ASSERT_EQ_INT(vfs->truncate(vfs, fh, (uint64_t)1 << 40), 0);
+    ASSERT_EQ_INT(vfs->stat(vfs, path, &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, (uint64_t)1 << 40);
+    ASSERT_EQ_UINT64(info.st_blocks, 0);
+
+    ASSERT_EQ_INT(vfs->close(vfs, fh), 0);
+}
@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "vfs/fs/overlayfs.h"
+#include "vfs/utils/file.h"
+#include "utils/atomic.h"
+#include "utils/defs.h"
+#include "utils/dir.h"
+#include "utils/sem.h"
+#include "utils/thread.h"
+#include "utils/fsbuilder.h"
+
+#define TEST_OVERLAYFS_COPYUP_FILE_SZ   (64 * 1024)
+#define TEST_OVERLAYFS_COPYUP_BLOCK_SZ  4096
+
+/**
+ * @brief Lower layer that can slow down or fail reads.
+ */
+typedef struct test_overlayfs_copyup_lower
+{
+    vfs_operations_t    op;
+    vfs_operations_t*   real;
+    vfs_sem_t           sem;        /**< Never posted, used for sleep. */
+    uint32_t            delay_ms;   /**< Delay of each read. */
+    vfs_atomic_t        read_cnt;   /**< The number of reads. */
+    int                 fail;       /**< Reads fail with #VFS_EIO if set. */
+} test_overlayfs_copyup_lower_t;
+
+static vfs_operations_t* s_test_overlayfs_copyup = NULL;
+static vfs_operations_t* s_test_overlayfs_copyup_upper = NULL;
+static test_overlayfs_copyup_lower_t* s_test_overlayfs_copyup_lower = NULL;
+static char s_test_overlayfs_copyup_data[TEST_OVERLAYFS_COPYUP_FILE_SZ];
+
+static void _test_overlayfs_copyup_lower_destroy(struct vfs_operations* thiz)
+{
+    test_overlayfs_copyup_lower_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_copyup_lower_t, op);
+    fs->real->destroy(fs->real);
+    vfs_sem_exit(&fs->sem);
+    free(fs);
+}
+
+static int _test_overlayfs_copyup_lower_ls(struct vfs_operations* thiz, const char* path,
+    vfs_ls_cb fn, void* data)
+{
+    test_overlayfs_copyup_lower_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_copyup_lower_t, op);
+    return fs->real->ls(fs->real, path, fn, data);
+}
+
+static int _test_overlayfs_copyup_lower_stat(struct vfs_operations* thiz, const char* path,
+    vfs_stat_t* info)
+{
+    test_overlayfs_copyup_lower_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_copyup_lower_t, op);
+    return fs->real->stat(fs->real, path, info);
+}
+
+static int _test_overlayfs_copyup_lower_open(struct vfs_operations* thiz, uintptr_t* fh,
+    const char* path, uint64_t flags)
+{
+    test_overlayfs_copyup_lower_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_copyup_lower_t, op);
+    return fs->real->open(fs->real, fh, path, flags);
+}
+
+static int _test_overlayfs_copyup_lower_close(struct vfs_operations* thiz, uintptr_t fh)
+{
+    test_overlayfs_copyup_lower_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_copyup_lower_t, op);
+    return fs->real->close(fs->real, fh);
+}
+
+static int64_t _test_overlayfs_copyup_lower_seek(struct vfs_operations* thiz, uintptr_t fh,
+    int64_t offset, int whence)
+{
+    test_overlayfs_copyup_lower_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_copyup_lower_t, op);
+    return fs->real->seek(fs->real, fh, offset, whence);
+}
+
+static int _test_overlayfs_copyup_lower_read(struct vfs_operations* thiz, uintptr_t fh,
+    void* buf, size_t len)
+{
+    test_overlayfs_copyup_lower_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_copyup_lower_t, op);
+    (void)vfs_atomic_add(&fs->read_cnt);
+    if (fs->delay_ms != 0)
+    {
+        vfs_sem_timedwait(&fs->sem, fs->delay_ms);
+    }
+    if (fs->fail)
+    {
+        return VFS_EIO;
+    }
+    return fs->real->read(fs->real, fh, buf, len);
+}
+
+static test_overlayfs_copyup_lower_t* _test_overlayfs_copyup_lower_make(void)
+{
+    test_overlayfs_copyup_lower_t* fs = calloc(1, sizeof(test_overlayfs_copyup_lower_t));
+    ASSERT_NE_PTR(fs, NULL);
+    ASSERT_EQ_INT(vfs_make_memory(&fs->real), 0);
+    vfs_sem_init(&fs->sem, 0);
+
+    fs->op.destroy = _test_overlayfs_copyup_lower_destroy;
+    fs->op.ls = _test_overlayfs_copyup_lower_ls;
+    fs->op.stat = _test_overlayfs_copyup_lower_stat;
+    fs->op.open = _test_overlayfs_copyup_lower_open;
+    fs->op.close = _test_overlayfs_copyup_lower_close;
+    fs->op.seek = _test_overlayfs_copyup_lower_seek;
+    fs->op.read = _test_overlayfs_copyup_lower_read;
+
+    return fs;
+}
+
+TEST_FIXTURE_SETUP(overlayfs)
+{
+    size_t i;
+    s_test_overlayfs_copyup_lower = _test_overlayfs_copyup_lower_make();
+    vfs_operations_t* lower = s_test_overlayfs_copyup_lower->real;
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_overlayfs_copyup_upper), 0);
+
+    for (i = 0; i < sizeof(s_test_overlayfs_copyup_data); i++)
+    {
+        s_test_overlayfs_copyup_data[i] = (char)('a' + i % 26);
+    }
+    ASSERT_EQ_INT(vfs_dir_make(lower, "/foo"), 0);
+    ASSERT_EQ_INT(vfs_file_write(lower, "/foo/bar", VFS_O_WRONLY | VFS_O_CREATE,
+        s_test_overlayfs_copyup_data, sizeof(s_test_overlayfs_copyup_data)),
+        (int)sizeof(s_test_overlayfs_copyup_data));
+
+    ASSERT_EQ_INT(vfs_make_overlay(&s_test_overlayfs_copyup,
+        &s_test_overlayfs_copyup_lower->op, s_test_overlayfs_copyup_upper), 0);
+    ASSERT_EQ_INT(vfs_overlayfs_set_copyup_block(s_test_overlayfs_copyup, TEST_OVERLAYFS_COPYUP_BLOCK_SZ), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(overlayfs)
+{
+    s_test_overlayfs_copyup->destroy(s_test_overlayfs_copyup);
+    s_test_overlayfs_copyup = NULL;
+    s_test_overlayfs_copyup_upper = NULL;
+    s_test_overlayfs_copyup_lower = NULL;
+}
+
+static void _test_overlayfs_copyup_check(vfs_operations_t* fs, const char* path,
+    const char* expect, size_t expect_sz)
+{
+    vfs_str_t dat = VFS_STR_INIT;
+    vfs_test_read_file(fs, path, &dat);
+    ASSERT_EQ_SIZE(dat.len, expect_sz);
+    ASSERT_EQ_INT(memcmp(dat.str, expect, expect_sz), 0);
+    vfs_str_exit(&dat);
+}
+
+TEST_F(overlayfs, copyup_block)
+{
+    uintptr_t fh = 0;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+    vfs_operations_t* upper = s_test_overlayfs_copyup_upper;
+    const uint64_t pos = TEST_OVERLAYFS_COPYUP_BLOCK_SZ + 100;
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_WRONLY), 0);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, pos, VFS_SEEK_SET), (int64_t)pos);
+    ASSERT_EQ_INT(fs->write(fs, fh, "0123456789abcdef", 16), 16);
+    memcpy(s_test_overlayfs_copyup_data + pos, "0123456789abcdef", 16);
+
+    /* Only the written block is copied, the rest of upper file is a hole. */
+    {
+        char buf[TEST_OVERLAYFS_COPYUP_BLOCK_SZ];
+        char zero[TEST_OVERLAYFS_COPYUP_BLOCK_SZ];
+        memset(zero, 0, sizeof(zero));
+
+        uintptr_t upper_fh = 0;
+        ASSERT_EQ_INT(upper->open(upper, &upper_fh, "/foo/bar", VFS_O_RDONLY), 0);
+        ASSERT_EQ_INT(upper->read(upper, upper_fh, buf, sizeof(buf)), (int)sizeof(buf));
+        ASSERT_EQ_INT(memcmp(buf, zero, sizeof(buf)), 0);
+        ASSERT_EQ_INT(upper->read(upper, upper_fh, buf, sizeof(buf)), (int)sizeof(buf));
+        ASSERT_EQ_INT(memcmp(buf, s_test_overlayfs_copyup_data + TEST_OVERLAYFS_COPYUP_BLOCK_SZ, sizeof(buf)), 0);
+        ASSERT_EQ_INT(upper->close(upper, upper_fh), 0);
+    }
+
+    /* Other readers see the merged content before copy-up is finished. */
+    _test_overlayfs_copyup_check(fs, "/foo/bar", s_test_overlayfs_copyup_data,
+        sizeof(s_test_overlayfs_copyup_data));
+
+    /* Closing the file finishes copy-up. */
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    _test_overlayfs_copyup_check(upper, "/foo/bar", s_test_overlayfs_copyup_data,
+        sizeof(s_test_overlayfs_copyup_data));
+}
+
+TEST_F(overlayfs, copyup_append)
+{
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+    vfs_operations_t* upper = s_test_overlayfs_copyup_upper;
+
+    ASSERT_EQ_INT(vfs_file_write(fs, "/foo/bar", VFS_O_WRONLY | VFS_O_APPEND, "tail", 4), 4);
+
+    vfs_str_t expect = vfs_str_from(s_test_overlayfs_copyup_data, sizeof(s_test_overlayfs_copyup_data));
+    vfs_str_append(&expect, "tail", 4);
+    _test_overlayfs_copyup_check(fs, "/foo/bar", expect.str, expect.len);
+    _test_overlayfs_copyup_check(upper, "/foo/bar", expect.str, expect.len);
+    vfs_str_exit(&expect);
+}
+
+TEST_F(overlayfs, copyup_truncate)
+{
+    uintptr_t fh = 0;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+    vfs_operations_t* upper = s_test_overlayfs_copyup_upper;
+
+    /* Shrink and grow in the middle of copy-up, grown part is zero. */
+    char expect[100];
+    memset(expect, 0, sizeof(expect));
+    memcpy(expect, s_test_overlayfs_copyup_data, 10);
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT(fs->truncate(fs, fh, 10), 0);
+    ASSERT_EQ_INT(fs->truncate(fs, fh, sizeof(expect)), 0);
+    _test_overlayfs_copyup_check(fs, "/foo/bar", expect, sizeof(expect));
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    _test_overlayfs_copyup_check(upper, "/foo/bar", expect, sizeof(expect));
+}
+
+TEST_F(overlayfs, copyup_open_truncate)
+{
+    uintptr_t fh = 0;
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+    vfs_operations_t* upper = s_test_overlayfs_copyup_upper;
+
+    /* Open with truncate never copies content. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_WRONLY | VFS_O_TRUNCATE), 0);
+    ASSERT_EQ_INT(upper->stat(upper, "/foo/bar", &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, "new", 3), 3);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    _test_overlayfs_copyup_check(fs, "/foo/bar", "new", 3);
+}
+
+TEST_F(overlayfs, copyup_async)
+{
+    uintptr_t fh = 0;
+    uint64_t copied = 0, total = 0;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+    vfs_operations_t* upper = s_test_overlayfs_copyup_upper;
+
+    ASSERT_EQ_INT(vfs_overlayfs_set_copyup_async(fs, 1), 0);
+    ASSERT_EQ_INT(vfs_overlayfs_copyup_progress(fs, "/foo/bar", &copied, &total), VFS_ENOENT);
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, "head", 4), 4);
+    memcpy(s_test_overlayfs_copyup_data, "head", 4);
+
+    /* Wait for background copy-up. */
+    do
+    {
+        ASSERT_EQ_INT(vfs_overlayfs_copyup_progress(fs, "/foo/bar", &copied, &total), 0);
+        ASSERT_EQ_UINT64(total, TEST_OVERLAYFS_COPYUP_FILE_SZ);
+    } while (copied < total);
+
+    /* Upper file is complete while file is still open. */
+    _test_overlayfs_copyup_check(upper, "/foo/bar", s_test_overlayfs_copyup_data,
+        sizeof(s_test_overlayfs_copyup_data));
+    _test_overlayfs_copyup_check(fs, "/foo/bar", s_test_overlayfs_copyup_data,
+        sizeof(s_test_overlayfs_copyup_data));
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_F(overlayfs, copyup_async_disable)
+{
+    uintptr_t fh = 0;
+    uint64_t copied = 0, total = 0;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+    vfs_operations_t* upper = s_test_overlayfs_copyup_upper;
+
+    /* Default block size does not outlive background copy-up. */
+    ASSERT_EQ_INT(vfs_overlayfs_set_copyup_block(fs, 0), 0);
+    ASSERT_EQ_INT(vfs_overlayfs_set_copyup_async(fs, 1), 0);
+    ASSERT_EQ_INT(vfs_overlayfs_set_copyup_async(fs, 0), 0);
+
+    /* Whole file is copied on open. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT(vfs_overlayfs_copyup_progress(fs, "/foo/bar", &copied, &total), VFS_ENOENT);
+    _test_overlayfs_copyup_check(upper, "/foo/bar", s_test_overlayfs_copyup_data,
+        sizeof(s_test_overlayfs_copyup_data));
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_F(overlayfs, copyup_open_truncate_async)
+{
+    uintptr_t fh = 0, trunc_fh = 0;
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+    vfs_operations_t* upper = s_test_overlayfs_copyup_upper;
+
+    ASSERT_EQ_INT(vfs_overlayfs_set_copyup_async(fs, 1), 0);
+    s_test_overlayfs_copyup_lower->delay_ms = 5;
+
+    /* Truncate while background worker is copying, nothing is copied after it. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_RDWR), 0);
+    while (vfs_atomic_load(&s_test_overlayfs_copyup_lower->read_cnt) == 0)
+    {
+    }
+    ASSERT_EQ_INT(fs->open(fs, &trunc_fh, "/foo/bar", VFS_O_WRONLY | VFS_O_TRUNCATE), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/foo/bar", &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 0);
+    ASSERT_EQ_INT(fs->write(fs, trunc_fh, "new", 3), 3);
+    ASSERT_EQ_INT(fs->close(fs, trunc_fh), 0);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    _test_overlayfs_copyup_check(fs, "/foo/bar", "new", 3);
+    _test_overlayfs_copyup_check(upper, "/foo/bar", "new", 3);
+}
+
+TEST_F(overlayfs, copyup_async_error)
+{
+    uintptr_t fh = 0;
+    uint64_t copied = 0, total = 0;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+    vfs_operations_t* upper = s_test_overlayfs_copyup_upper;
+
+    ASSERT_EQ_INT(vfs_overlayfs_set_copyup_async(fs, 1), 0);
+    s_test_overlayfs_copyup_lower->fail = 1;
+
+    /* Background copy-up fails, and the error is reported. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_RDWR), 0);
+    while (vfs_overlayfs_copyup_progress(fs, "/foo/bar", &copied, &total) == 0)
+    {
+    }
+    ASSERT_EQ_INT(vfs_overlayfs_copyup_progress(fs, "/foo/bar", &copied, &total), VFS_EIO);
+    ASSERT_EQ_INT(fs->close(fs, fh), VFS_EIO);
+
+    /* Lower content is still visible, and copy-up finishes on next close. */
+    s_test_overlayfs_copyup_lower->fail = 0;
+    _test_overlayfs_copyup_check(fs, "/foo/bar", s_test_overlayfs_copyup_data,
+        sizeof(s_test_overlayfs_copyup_data));
+    ASSERT_EQ_INT(vfs_overlayfs_copyup_progress(fs, "/foo/bar", &copied, &total), VFS_ENOENT);
+    _test_overlayfs_copyup_check(upper, "/foo/bar", s_test_overlayfs_copyup_data,
+        sizeof(s_test_overlayfs_copyup_data));
+}
+
+TEST_F(overlayfs, copyup_close_error)
+{
+    uintptr_t fh = 0;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_WRONLY), 0);
+    ASSERT_EQ_INT(fs->write(fs, fh, "head", 4), 4);
+
+    /* Remaining blocks can not be copied on close. */
+    s_test_overlayfs_copyup_lower->fail = 1;
+    ASSERT_EQ_INT(fs->close(fs, fh), VFS_EIO);
+
+    /* Removed file does not leave copy-up behind. */
+    ASSERT_EQ_INT(fs->unlink(fs, "/foo/bar"), 0);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/foo/bar", VFS_O_WRONLY | VFS_O_CREATE, "new", 3), 3);
+    _test_overlayfs_copyup_check(fs, "/foo/bar", "new", 3);
+}
+
+TEST_F(overlayfs, copyup_unlink_open)
+{
+    uintptr_t fh = 0;
+    uint64_t copied = 0, total = 0;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+
+    /* Remove the file while copy-up is still referenced. */
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT(fs->unlink(fs, "/foo/bar"), 0);
+    ASSERT_EQ_INT(vfs_overlayfs_copyup_progress(fs, "/foo/bar", &copied, &total), VFS_ENOENT);
+
+    /* New file of the same path does not go through the old copy-up. */
+    ASSERT_EQ_INT(vfs_file_write(fs, "/foo/bar", VFS_O_WRONLY | VFS_O_CREATE, "new", 3), 3);
+    _test_overlayfs_copyup_check(fs, "/foo/bar", "new", 3);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+    _test_overlayfs_copyup_check(fs, "/foo/bar", "new", 3);
+}
+
+TEST_F(overlayfs, copyup_seek_hole)
+{
+    uintptr_t fh = 0;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 0, VFS_SEEK_DATA), 0);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, 0, VFS_SEEK_HOLE), TEST_OVERLAYFS_COPYUP_FILE_SZ);
+
+    /* Nothing at or after end of file. */
+    ASSERT_EQ_INT64(fs->seek(fs, fh, TEST_OVERLAYFS_COPYUP_FILE_SZ, VFS_SEEK_DATA), VFS_ENXIO);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, TEST_OVERLAYFS_COPYUP_FILE_SZ, VFS_SEEK_HOLE), VFS_ENXIO);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+#define TEST_OVERLAYFS_COPYUP_WRITER_NUM    4
+
+static void _test_overlayfs_copyup_writer(void* arg)
+{
+    uintptr_t fh = 0;
+    size_t idx = (size_t)(uintptr_t)arg;
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/foo/bar", VFS_O_RDWR), 0);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, (int64_t)(idx * TEST_OVERLAYFS_COPYUP_BLOCK_SZ), VFS_SEEK_SET),
+        (int64_t)(idx * TEST_OVERLAYFS_COPYUP_BLOCK_SZ));
+    ASSERT_EQ_INT(fs->write(fs, fh, "X", 1), 1);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+}
+
+TEST_F(overlayfs, copyup_open_parallel)
+{
+    size_t i;
+    vfs_thread_t threads[TEST_OVERLAYFS_COPYUP_WRITER_NUM];
+    vfs_operations_t* fs = s_test_overlayfs_copyup;
+    vfs_operations_t* upper = s_test_overlayfs_copyup_upper;
+    s_test_overlayfs_copyup_lower->delay_ms = 1;
+
+    /* Openers share one copy-up, so no write is lost by a second truncate. */
+    for (i = 0; i < ARRAY_SIZE(threads); i++)
+    {
+        vfs_thread_init(&threads[i], _test_overlayfs_copyup_writer, (void*)(uintptr_t)i);
+        s_test_overlayfs_copyup_data[i * TEST_OVERLAYFS_COPYUP_BLOCK_SZ] = 'X';
+    }
+    for (i = 0; i < ARRAY_SIZE(threads); i++)
+    {
+        vfs_thread_exit(threads[i]);
+    }
+
+    _test_overlayfs_copyup_check(fs, "/foo/bar", s_test_overlayfs_copyup_data,
+        sizeof(s_test_overlayfs_copyup_data));
+    _test_overlayfs_copyup_check(upper, "/foo/bar", s_test_overlayfs_copyup_data,
+        sizeof(s_test_overlayfs_copyup_data));
+}
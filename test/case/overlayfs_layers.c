@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "vfs/fs/overlayfs.h"
+#include "vfs/utils/file.h"
+#include "utils/defs.h"
+#include "utils/dir.h"
+#include "utils/fsbuilder.h"
+
+static vfs_operations_t* s_test_overlayfs_layers = NULL;
+static vfs_operations_t* s_test_overlayfs_layers_upper = NULL;
+
+static void _test_overlayfs_layers_write(vfs_operations_t* fs, const char* path, const char* dat)
+{
+    size_t len = strlen(dat);
+    ASSERT_EQ_INT(vfs_file_write(fs, path, VFS_O_WRONLY | VFS_O_CREATE, dat, len), (int)len);
+}
+
+static void _test_overlayfs_layers_check(vfs_operations_t* fs, const char* path, const char* expect)
+{
+    vfs_test_check_file(fs, path, expect, strlen(expect));
+}
+
+TEST_FIXTURE_SETUP(overlayfs)
+{
+    vfs_operations_t* base = NULL;
+    vfs_operations_t* middle = NULL;
+    vfs_operations_t* top = NULL;
+    ASSERT_EQ_INT(vfs_make_memory(&base), 0);
+    ASSERT_EQ_INT(vfs_make_memory(&middle), 0);
+    ASSERT_EQ_INT(vfs_make_memory(&top), 0);
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_overlayfs_layers_upper), 0);
+
+    /* Bottom layer. */
+    ASSERT_EQ_INT(vfs_dir_make(base, "/etc"), 0);
+    ASSERT_EQ_INT(vfs_dir_make(base, "/bin"), 0);
+    _test_overlayfs_layers_write(base, "/etc/a", "base_a");
+    _test_overlayfs_layers_write(base, "/etc/b", "base_b");
+    _test_overlayfs_layers_write(base, "/bin/x", "base_x");
+
+    /* Middle layer overrides /etc/b and removes /etc/a. */
+    ASSERT_EQ_INT(vfs_dir_make(middle, "/etc"), 0);
+    _test_overlayfs_layers_write(middle, "/etc/b", "middle_b");
+    _test_overlayfs_layers_write(middle, "/etc/a.whiteout", "");
+
+    /* Top layer adds /etc/c. */
+    ASSERT_EQ_INT(vfs_dir_make(top, "/etc"), 0);
+    _test_overlayfs_layers_write(top, "/etc/c", "top_c");
+
+    vfs_operations_t* lowers[] = { top, middle, base };
+    ASSERT_EQ_INT(vfs_make_overlay_ex(&s_test_overlayfs_layers, lowers,
+        ARRAY_SIZE(lowers), s_test_overlayfs_layers_upper), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(overlayfs)
+{
+    s_test_overlayfs_layers->destroy(s_test_overlayfs_layers);
+    s_test_overlayfs_layers = NULL;
+    s_test_overlayfs_layers_upper = NULL;
+}
+
+static int _test_overlayfs_layers_ls_cb(const char* name, const vfs_stat_t* stat, void* data)
+{
+    (void)name; (void)stat;
+    size_t* cnt = data;
+    *cnt += 1;
+    return 0;
+}
+
+TEST_F(overlayfs, layers_lookup)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_layers;
+
+    ASSERT_EQ_INT(fs->stat(fs, "/etc/a", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->stat(fs, "/bin/x", &info), 0);
+
+    _test_overlayfs_layers_check(fs, "/etc/b", "middle_b");
+    _test_overlayfs_layers_check(fs, "/etc/c", "top_c");
+    _test_overlayfs_layers_check(fs, "/bin/x", "base_x");
+
+    /* /etc has b and c, /etc/a is removed by middle layer. */
+    size_t cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 2);
+
+    cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 2);
+}
+
+TEST_F(overlayfs, layers_modify)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_layers;
+    vfs_operations_t* upper = s_test_overlayfs_layers_upper;
+
+    /* Copy up from the bottom layer. */
+    ASSERT_EQ_INT(vfs_file_write(fs, "/bin/x", VFS_O_WRONLY | VFS_O_APPEND, "_new", 4), 4);
+    _test_overlayfs_layers_check(fs, "/bin/x", "base_x_new");
+    _test_overlayfs_layers_check(upper, "/bin/x", "base_x_new");
+
+    /* Remove a file of middle layer. */
+    ASSERT_EQ_INT(fs->unlink(fs, "/etc/b"), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/etc/b", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(upper->stat(upper, "/etc/b.whiteout", &info), 0);
+
+    /* Removed file can be created again. */
+    _test_overlayfs_layers_write(fs, "/etc/a", "upper_a");
+    _test_overlayfs_layers_check(fs, "/etc/a", "upper_a");
+
+    size_t cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 2);
+}
+
+static int _test_overlayfs_layers_ls_stop_cb(const char* name, const vfs_stat_t* stat, void* data)
+{
+    (void)name; (void)stat;
+    size_t* cnt = data;
+    *cnt += 1;
+    return 1;
+}
+
+TEST_F(overlayfs, layers_ls)
+{
+    size_t i;
+    char path[64];
+    vfs_operations_t* fs = s_test_overlayfs_layers;
+    vfs_operations_t* upper = s_test_overlayfs_layers_upper;
+
+    /* Large directory, half of the entries are removed. */
+    ASSERT_EQ_INT(fs->mkdir(fs, "/many"), 0);
+    for (i = 0; i < 1000; i++)
+    {
+        snprintf(path, sizeof(path), "/many/%zu", i);
+        _test_overlayfs_layers_write(fs, path, "x");
+    }
+    for (i = 0; i < 1000; i += 2)
+    {
+        snprintf(path, sizeof(path), "/many/%zu", i);
+        ASSERT_EQ_INT(fs->unlink(fs, path), 0);
+    }
+
+    size_t cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/many", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 500);
+
+    /* Entries of several layers, whiteout in upper layer hides lower ones. */
+    ASSERT_EQ_INT(fs->unlink(fs, "/etc/c"), 0);
+    _test_overlayfs_layers_write(fs, "/etc/d", "upper_d");
+    cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 2);
+
+    /* Listing stops as soon as callback asks. */
+    cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_stop_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 1);
+
+    /* Only directories can be listed. */
+    vfs_stat_t info;
+    ASSERT_EQ_INT(upper->stat(upper, "/etc/c.whiteout", &info), 0);
+    ASSERT_EQ_INT(fs->ls(fs, "/etc/b", _test_overlayfs_layers_ls_cb, &cnt), VFS_ENOTDIR);
+    ASSERT_EQ_INT(fs->ls(fs, "/etc/a", _test_overlayfs_layers_ls_cb, &cnt), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->ls(fs, "/none", _test_overlayfs_layers_ls_cb, &cnt), VFS_ENOENT);
+}
+
+static int _test_overlayfs_layers_ls_size_cb(const char* name, const vfs_stat_t* stat, void* data)
+{
+    uint64_t* size = data;
+    if (strcmp(name, "c") == 0)
+    {
+        *size = stat->st_size;
+    }
+    return 0;
+}
+
+TEST_F(overlayfs, layers_lscache)
+{
+    size_t cnt = 0;
+    uint64_t size = 0;
+    vfs_operations_t* fs = s_test_overlayfs_layers;
+
+    /* Listing twice gives the same result. */
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 4);
+
+    /* Write is visible in cached listing. */
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_size_cb, &size), 0);
+    ASSERT_EQ_UINT64(size, 5);
+    ASSERT_EQ_INT(vfs_file_write(fs, "/etc/c", VFS_O_WRONLY | VFS_O_APPEND, "_new", 4), 4);
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_size_cb, &size), 0);
+    ASSERT_EQ_UINT64(size, 9);
+
+    /* Create, mkdir, rmdir and unlink are visible in cached listing. */
+    _test_overlayfs_layers_write(fs, "/etc/d", "upper_d");
+    ASSERT_EQ_INT(fs->mkdir(fs, "/etc/e"), 0);
+    cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 4);
+
+    ASSERT_EQ_INT(fs->rmdir(fs, "/etc/e"), 0);
+    ASSERT_EQ_INT(fs->unlink(fs, "/etc/b"), 0);
+    cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/etc", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 2);
+
+    /* New directory is visible in cached listing of its parent. */
+    cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 2);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/var"), 0);
+    cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, "/", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 3);
+}
+
+static void _test_overlayfs_layers_squash(size_t thread_sz, size_t many_sz)
+{
+    size_t i, cnt = 0;
+    char path[64];
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_layers;
+    vfs_operations_t* squashed = NULL;
+    vfs_operations_t* upper = NULL;
+    vfs_operations_t* overlay = NULL;
+
+    ASSERT_EQ_INT(fs->unlink(fs, "/etc/c"), 0);
+    _test_overlayfs_layers_write(fs, "/etc/d", "upper_d");
+    ASSERT_EQ_INT(vfs_file_write(fs, "/bin/x", VFS_O_WRONLY | VFS_O_APPEND, "_new", 4), 4);
+
+    ASSERT_EQ_INT(vfs_make_memory(&squashed), 0);
+    ASSERT_EQ_INT(vfs_overlay_squash(fs, squashed, thread_sz), 0);
+
+    /* No whiteout left. */
+    ASSERT_EQ_INT(squashed->ls(squashed, "/etc", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 2);
+    ASSERT_EQ_INT(squashed->stat(squashed, "/etc/a.whiteout", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(squashed->stat(squashed, "/etc/c.whiteout", &info), VFS_ENOENT);
+    _test_overlayfs_layers_check(squashed, "/etc/b", "middle_b");
+    _test_overlayfs_layers_check(squashed, "/etc/d", "upper_d");
+    _test_overlayfs_layers_check(squashed, "/bin/x", "base_x_new");
+    for (i = 0; i < many_sz; i++)
+    {
+        snprintf(path, sizeof(path), "/many/%zu", i);
+        _test_overlayfs_layers_check(squashed, path, path);
+    }
+
+    /* Squashed tree works as a fresh lower layer. */
+    ASSERT_EQ_INT(vfs_make_memory(&upper), 0);
+    ASSERT_EQ_INT(vfs_make_overlay(&overlay, squashed, upper), 0);
+    cnt = 0;
+    ASSERT_EQ_INT(overlay->ls(overlay, "/", _test_overlayfs_layers_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, many_sz != 0 ? 3 : 2);
+    ASSERT_EQ_INT(overlay->stat(overlay, "/etc/c", &info), VFS_ENOENT);
+    _test_overlayfs_layers_check(overlay, "/etc/b", "middle_b");
+    overlay->destroy(overlay);
+}
+
+TEST_F(overlayfs, layers_squash)
+{
+    _test_overlayfs_layers_squash(0, 0);
+}
+
+TEST_F(overlayfs, layers_squash_parallel)
+{
+    size_t i;
+    char path[64];
+    vfs_operations_t* fs = s_test_overlayfs_layers;
+
+    ASSERT_EQ_INT(fs->mkdir(fs, "/many"), 0);
+    for (i = 0; i < 200; i++)
+    {
+        snprintf(path, sizeof(path), "/many/%zu", i);
+        _test_overlayfs_layers_write(fs, path, path);
+    }
+
+    _test_overlayfs_layers_squash(4, 200);
+}
+
+TEST_F(overlayfs, layers_squash_sparse)
+{
+    uintptr_t fh = 0;
+    vfs_stat_t info;
+    const int64_t tail = 1024 * 1024;
+    vfs_operations_t* fs = s_test_overlayfs_layers;
+    vfs_operations_t* squashed = NULL;
+
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/sparse", VFS_O_WRONLY | VFS_O_CREATE), 0);
+    ASSERT_EQ_INT64(fs->seek(fs, fh, tail, VFS_SEEK_SET), tail);
+    ASSERT_EQ_INT(fs->write(fs, fh, "tail", 4), 4);
+    ASSERT_EQ_INT(fs->close(fs, fh), 0);
+
+    ASSERT_EQ_INT(vfs_make_memory(&squashed), 0);
+    ASSERT_EQ_INT(vfs_overlay_squash(fs, squashed, 0), 0);
+
+    /* Only data is copied, the hole stays a hole. */
+    ASSERT_EQ_INT(squashed->stat(squashed, "/sparse", &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, tail + 4);
+    ASSERT_EQ_INT(squashed->open(squashed, &fh, "/sparse", VFS_O_RDONLY), 0);
+    ASSERT_EQ_INT64(squashed->seek(squashed, fh, 0, VFS_SEEK_DATA), tail);
+    ASSERT_EQ_INT64(squashed->seek(squashed, fh, tail, VFS_SEEK_SET), tail);
+    char buf[4];
+    ASSERT_EQ_INT(squashed->read(squashed, fh, buf, sizeof(buf)), 4);
+    ASSERT_EQ_INT(memcmp(buf, "tail", 4), 0);
+    ASSERT_EQ_INT(squashed->close(squashed, fh), 0);
+    squashed->destroy(squashed);
+}
+
+TEST_F(overlayfs, layers_rmdir_async)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_layers;
+    vfs_operations_t* upper = s_test_overlayfs_layers_upper;
+
+    ASSERT_EQ_INT(vfs_overlayfs_set_rmdir_async(fs, 4), 0);
+
+    /* Whiteouts in upper layer are removed with the directory. */
+    ASSERT_EQ_INT(fs->unlink(fs, "/etc/b"), 0);
+    ASSERT_EQ_INT(fs->unlink(fs, "/etc/c"), 0);
+    ASSERT_EQ_INT(upper->stat(upper, "/etc/b.whiteout", &info), 0);
+    ASSERT_EQ_INT(fs->rmdir(fs, "/etc"), 0);
+
+    ASSERT_EQ_INT(fs->stat(fs, "/etc", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(upper->stat(upper, "/etc/b.whiteout", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(upper->stat(upper, "/etc.whiteout", &info), 0);
+}
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "vfs/fs/overlayfs.h"
+#include "vfs/utils/file.h"
+#include "utils/defs.h"
+#include "utils/dir.h"
+
+/**
+ * @brief File system that counts lookups made to another file system.
+ */
+typedef struct test_overlayfs_count
+{
+    vfs_operations_t    op;
+    vfs_operations_t*   real;
+    size_t              stat_cnt;
+    size_t              ls_cnt;
+} test_overlayfs_count_t;
+
+static test_overlayfs_count_t* s_test_overlayfs_lower = NULL;
+static test_overlayfs_count_t* s_test_overlayfs_upper = NULL;
+static vfs_operations_t* s_test_overlayfs_whiteout = NULL;
+
+static void _test_overlayfs_count_destroy(struct vfs_operations* thiz)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    fs->real->destroy(fs->real);
+    free(fs);
+}
+
+static int _test_overlayfs_count_stat(struct vfs_operations* thiz, const char* path, vfs_stat_t* info)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    fs->stat_cnt++;
+    return fs->real->stat(fs->real, path, info);
+}
+
+static int _test_overlayfs_count_ls(struct vfs_operations* thiz, const char* path, vfs_ls_cb fn, void* data)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    fs->ls_cnt++;
+    return fs->real->ls(fs->real, path, fn, data);
+}
+
+static int _test_overlayfs_count_open(struct vfs_operations* thiz, uintptr_t* fh, const char* path, uint64_t flags)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    return fs->real->open(fs->real, fh, path, flags);
+}
+
+static int _test_overlayfs_count_close(struct vfs_operations* thiz, uintptr_t fh)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    return fs->real->close(fs->real, fh);
+}
+
+static int _test_overlayfs_count_truncate(struct vfs_operations* thiz, uintptr_t fh, uint64_t size)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    return fs->real->truncate(fs->real, fh, size);
+}
+
+static int64_t _test_overlayfs_count_seek(struct vfs_operations* thiz, uintptr_t fh, int64_t offset, int whence)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    return fs->real->seek(fs->real, fh, offset, whence);
+}
+
+static int _test_overlayfs_count_read(struct vfs_operations* thiz, uintptr_t fh, void* buf, size_t len)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    return fs->real->read(fs->real, fh, buf, len);
+}
+
+static int _test_overlayfs_count_write(struct vfs_operations* thiz, uintptr_t fh, const void* buf, size_t len)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    return fs->real->write(fs->real, fh, buf, len);
+}
+
+static int _test_overlayfs_count_mkdir(struct vfs_operations* thiz, const char* path)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    return fs->real->mkdir(fs->real, path);
+}
+
+static int _test_overlayfs_count_rmdir(struct vfs_operations* thiz, const char* path)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    return fs->real->rmdir(fs->real, path);
+}
+
+static int _test_overlayfs_count_unlink(struct vfs_operations* thiz, const char* path)
+{
+    test_overlayfs_count_t* fs = EV_CONTAINER_OF(thiz, test_overlayfs_count_t, op);
+    return fs->real->unlink(fs->real, path);
+}
+
+static test_overlayfs_count_t* _test_overlayfs_count_make(void)
+{
+    test_overlayfs_count_t* fs = calloc(1, sizeof(test_overlayfs_count_t));
+    ASSERT_NE_PTR(fs, NULL);
+    ASSERT_EQ_INT(vfs_make_memory(&fs->real), 0);
+
+    fs->op.destroy = _test_overlayfs_count_destroy;
+    fs->op.stat = _test_overlayfs_count_stat;
+    fs->op.ls = _test_overlayfs_count_ls;
+    fs->op.open = _test_overlayfs_count_open;
+    fs->op.close = _test_overlayfs_count_close;
+    fs->op.truncate = _test_overlayfs_count_truncate;
+    fs->op.seek = _test_overlayfs_count_seek;
+    fs->op.read = _test_overlayfs_count_read;
+    fs->op.write = _test_overlayfs_count_write;
+    fs->op.mkdir = _test_overlayfs_count_mkdir;
+    fs->op.rmdir = _test_overlayfs_count_rmdir;
+    fs->op.unlink = _test_overlayfs_count_unlink;
+
+    return fs;
+}
+
+static void _test_overlayfs_count_reset(void)
+{
+    s_test_overlayfs_lower->stat_cnt = 0;
+    s_test_overlayfs_lower->ls_cnt = 0;
+    s_test_overlayfs_upper->stat_cnt = 0;
+    s_test_overlayfs_upper->ls_cnt = 0;
+}
+
+static size_t _test_overlayfs_count_backend(void)
+{
+    return s_test_overlayfs_lower->stat_cnt + s_test_overlayfs_lower->ls_cnt
+        + s_test_overlayfs_upper->stat_cnt + s_test_overlayfs_upper->ls_cnt;
+}
+
+TEST_FIXTURE_SETUP(overlayfs)
+{
+    s_test_overlayfs_lower = _test_overlayfs_count_make();
+    s_test_overlayfs_upper = _test_overlayfs_count_make();
+
+    vfs_operations_t* lower = s_test_overlayfs_lower->real;
+    ASSERT_EQ_INT(vfs_dir_make(lower, "/a/b/c/d/e/f/g/h"), 0);
+    ASSERT_EQ_INT(vfs_file_write(lower, "/a/b/c/d/e/f/g/h/file", VFS_O_WRONLY | VFS_O_CREATE, "lower", 5), 5);
+    ASSERT_EQ_INT(vfs_file_write(lower, "/a/b/other", VFS_O_WRONLY | VFS_O_CREATE, "other", 5), 5);
+
+    ASSERT_EQ_INT(vfs_make_overlay(&s_test_overlayfs_whiteout,
+        &s_test_overlayfs_lower->op, &s_test_overlayfs_upper->op), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(overlayfs)
+{
+    s_test_overlayfs_whiteout->destroy(s_test_overlayfs_whiteout);
+    s_test_overlayfs_whiteout = NULL;
+    s_test_overlayfs_lower = NULL;
+    s_test_overlayfs_upper = NULL;
+}
+
+TEST_F(overlayfs, whiteout_index_lookup)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_whiteout;
+    const char* path = "/a/b/c/d/e/f/g/h/file";
+
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 5);
+
+    /* Upper layer is indexed, so only lower layer is asked once. */
+    _test_overlayfs_count_reset();
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->stat_cnt, 1);
+    ASSERT_EQ_SIZE(_test_overlayfs_count_backend(), 1);
+
+    /* Whiteout is found in index without asking any layer. */
+    ASSERT_EQ_INT(fs->unlink(fs, "/a/b/other"), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/other", &info), VFS_ENOENT);
+
+    _test_overlayfs_count_reset();
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/other", &info), VFS_ENOENT);
+    ASSERT_EQ_SIZE(_test_overlayfs_count_backend(), 0);
+
+    /* Parent directories now exist in upper layer, but the file is still in lower layer. */
+    _test_overlayfs_count_reset();
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->stat_cnt, 1);
+    ASSERT_EQ_SIZE(s_test_overlayfs_upper->stat_cnt, 0);
+}
+
+TEST_F(overlayfs, whiteout_index_update)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_whiteout;
+    const char* path = "/a/b/c/d/e/f/g/h/file";
+
+    ASSERT_EQ_INT(fs->unlink(fs, path), 0);
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->unlink(fs, path), VFS_ENOENT);
+
+    /* Create the file again in upper layer. */
+    ASSERT_EQ_INT(vfs_file_write(fs, path, VFS_O_WRONLY | VFS_O_CREATE, "hi", 2), 2);
+    _test_overlayfs_count_reset();
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 2);
+    ASSERT_EQ_SIZE(s_test_overlayfs_upper->stat_cnt, 1);
+    ASSERT_EQ_SIZE(_test_overlayfs_count_backend(), 1);
+
+    /* Remove the whole tree. */
+    ASSERT_EQ_INT(fs->unlink(fs, path), 0);
+    ASSERT_EQ_INT(fs->rmdir(fs, "/a/b/c/d/e/f/g/h"), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/c/d/e/f/g/h", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), VFS_ENOENT);
+
+    /* Create the directory again. */
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a/b/c/d/e/f/g/h"), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/c/d/e/f/g/h", &info), 0);
+    ASSERT_EQ_UINT64(info.st_mode, VFS_S_IFDIR);
+}
+
+TEST_F(overlayfs, whiteout_index_stat)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_whiteout;
+    const char* path = "/a/b/c/d/e/f/g/h/file";
+
+    /* Lower layer without stat() is served from index. */
+    s_test_overlayfs_lower->op.stat = NULL;
+
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 5);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/other", &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 5);
+
+    _test_overlayfs_count_reset();
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 5);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/other", &info), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/c", &info), 0);
+    ASSERT_EQ_UINT64(info.st_mode, VFS_S_IFDIR);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/none", &info), VFS_ENOENT);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->ls_cnt, 0);
+
+    /* Copied up file is served from upper layer. */
+    ASSERT_EQ_INT(vfs_file_write(fs, path, VFS_O_WRONLY | VFS_O_APPEND, "_new", 4), 4);
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 9);
+}
+
+TEST_F(overlayfs, whiteout_stat_walk)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_whiteout;
+    const char* path = "/a/b/c/d/e/f/g/h/file";
+
+    /* Upper layer without ls() is looked up by stat(). */
+    s_test_overlayfs_upper->op.ls = NULL;
+
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 5);
+
+    ASSERT_EQ_INT(fs->unlink(fs, "/a/b/other"), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/other", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b", &info), 0);
+
+    /* Opaque marker hides lower layer. */
+    vfs_operations_t* upper = s_test_overlayfs_upper->real;
+    ASSERT_EQ_INT(vfs_dir_make(upper, "/a/b/c"), 0);
+    ASSERT_EQ_INT(vfs_file_write(upper, "/a/b/c/.opaque", VFS_O_WRONLY | VFS_O_CREATE, "", 0), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/c", &info), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/c/d", &info), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), VFS_ENOENT);
+    ASSERT_EQ_SIZE(s_test_overlayfs_upper->ls_cnt, 0);
+}
+
+TEST_F(overlayfs, whiteout_index_evict)
+{
+    size_t i;
+    char path[64];
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_whiteout;
+    vfs_operations_t* lower = s_test_overlayfs_lower->real;
+
+    /* More directories than the index keeps. */
+    for (i = 0; i < 5000; i++)
+    {
+        snprintf(path, sizeof(path), "/many/%u/file", (unsigned)i);
+        ASSERT_EQ_INT(vfs_dir_make(lower, path), 0);
+    }
+
+    ASSERT_EQ_INT(fs->stat(fs, "/many/0/file", &info), 0);
+    _test_overlayfs_count_reset();
+    ASSERT_EQ_INT(fs->stat(fs, "/many/0/file", &info), 0);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->ls_cnt, 0);
+
+    for (i = 1; i < 5000; i++)
+    {
+        snprintf(path, sizeof(path), "/many/%u/file", (unsigned)i);
+        ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    }
+
+    /* Evicted directory is loaded again. */
+    _test_overlayfs_count_reset();
+    ASSERT_EQ_INT(fs->stat(fs, "/many/0/file", &info), 0);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->ls_cnt, 1);
+    ASSERT_EQ_INT(fs->stat(fs, "/many/0/none", &info), VFS_ENOENT);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->ls_cnt, 1);
+}
+
+static int _test_overlayfs_opaque_ls_cb(const char* name, const vfs_stat_t* stat, void* data)
+{
+    (void)name; (void)stat;
+    size_t* cnt = data;
+    *cnt += 1;
+    return 0;
+}
+
+TEST_F(overlayfs, opaque)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_overlayfs_whiteout;
+    const char* dir = "/a/b/c/d/e/f/g/h";
+    const char* path = "/a/b/c/d/e/f/g/h/file";
+
+    /* Remove the directory and create it again. */
+    ASSERT_EQ_INT(fs->unlink(fs, path), 0);
+    ASSERT_EQ_INT(fs->rmdir(fs, dir), 0);
+    ASSERT_EQ_INT(fs->mkdir(fs, dir), 0);
+
+    /* Old content in lower layer is not visible, and lower layer is not asked. */
+    _test_overlayfs_count_reset();
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), VFS_ENOENT);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->stat_cnt, 0);
+
+    size_t cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, dir, _test_overlayfs_opaque_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 0);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->ls_cnt, 0);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->stat_cnt, 0);
+
+    /* New file lives only in upper layer, and no whiteout is left after unlink. */
+    ASSERT_EQ_INT(vfs_file_write(fs, path, VFS_O_WRONLY | VFS_O_CREATE, "new", 3), 3);
+    ASSERT_EQ_INT(fs->stat(fs, path, &info), 0);
+    ASSERT_EQ_UINT64(info.st_size, 3);
+
+    cnt = 0;
+    ASSERT_EQ_INT(fs->ls(fs, dir, _test_overlayfs_opaque_ls_cb, &cnt), 0);
+    ASSERT_EQ_SIZE(cnt, 1);
+
+    _test_overlayfs_count_reset();
+    ASSERT_EQ_INT(fs->unlink(fs, path), 0);
+    ASSERT_EQ_SIZE(s_test_overlayfs_lower->stat_cnt, 0);
+    vfs_operations_t* upper = s_test_overlayfs_upper->real;
+    ASSERT_EQ_INT(upper->stat(upper, "/a/b/c/d/e/f/g/h/file.whiteout", &info), VFS_ENOENT);
+
+    /* The marker can not be created through overlay file system. */
+    uintptr_t fh;
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/b/c/d/e/f/g/h/.opaque", VFS_O_WRONLY | VFS_O_CREATE), VFS_EINVAL);
+    ASSERT_EQ_INT(fs->open(fs, &fh, "/a/b/c/d/e/f/g/h/.opaque", VFS_O_RDONLY), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/a/b/c/d/e/f/g/h/.opaque"), VFS_EINVAL);
+    ASSERT_EQ_INT(fs->mkdir(fs, "/.opaque"), VFS_EINVAL);
+    ASSERT_EQ_INT(upper->stat(upper, "/a/b/c/d/e/f/g/h/.opaque", &info), 0);
+    ASSERT_EQ_UINT64(info.st_mode, VFS_S_IFREG);
+
+    /* Removing the opaque directory still hides the directory in lower layer. */
+    ASSERT_EQ_INT(fs->rmdir(fs, dir), 0);
+    ASSERT_EQ_INT(fs->stat(fs, dir, &info), VFS_ENOENT);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/c/d/e/f/g", &info), 0);
+}
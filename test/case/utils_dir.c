@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include "test.h"
+#include "vfs/fs/memfs.h"
+#include "vfs/utils/file.h"
+#include "utils/dir.h"
+#include "utils/threadpool.h"
+
+#define TEST_UTILS_DIR_SIZE 1000
+
+static vfs_operations_t* s_test_utils_dir = NULL;
+
+TEST_FIXTURE_SETUP(utils_dir)
+{
+    ASSERT_EQ_INT(vfs_make_memory(&s_test_utils_dir), 0);
+}
+
+TEST_FIXTURE_TEARDOWN(utils_dir)
+{
+    s_test_utils_dir->destroy(s_test_utils_dir);
+    s_test_utils_dir = NULL;
+}
+
+TEST_F(utils_dir, make_under_root)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_utils_dir;
+
+    ASSERT_EQ_INT(vfs_dir_make(fs, "/a/b/c"), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/a", &info), 0);
+    ASSERT_EQ_UINT64(info.st_mode, VFS_S_IFDIR);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/c", &info), 0);
+    ASSERT_EQ_UINT64(info.st_mode, VFS_S_IFDIR);
+
+    /* Existing directories are kept. */
+    ASSERT_EQ_INT(vfs_dir_make(fs, "/a/b/d"), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/a/b/c", &info), 0);
+    ASSERT_EQ_INT(vfs_dir_make(fs, "/e"), 0);
+    ASSERT_EQ_INT(fs->stat(fs, "/e", &info), 0);
+}
+
+static void _test_utils_dir_delete_progress(uint64_t removed, void* data)
+{
+    uint64_t* last = data;
+    ASSERT_LE_UINT64(*last, removed);
+    *last = removed;
+}
+
+/**
+ * @brief Create a tree of #TEST_UTILS_DIR_SIZE files and 2 directories under
+ *   \p path, that is #TEST_UTILS_DIR_SIZE + 5 entries including \p path.
+ */
+static void _test_utils_dir_delete_prepare(vfs_operations_t* fs, const char* path)
+{
+    size_t i;
+    char buf[64];
+
+    ASSERT_EQ_INT(fs->mkdir(fs, path), 0);
+    for (i = 0; i < TEST_UTILS_DIR_SIZE; i++)
+    {
+        snprintf(buf, sizeof(buf), "%s/f%u", path, (unsigned)i);
+        ASSERT_EQ_INT(vfs_file_write(fs, buf, VFS_O_WRONLY | VFS_O_CREATE, "", 0), 0);
+    }
+    snprintf(buf, sizeof(buf), "%s/s", path);
+    ASSERT_EQ_INT(fs->mkdir(fs, buf), 0);
+    snprintf(buf, sizeof(buf), "%s/s/t", path);
+    ASSERT_EQ_INT(fs->mkdir(fs, buf), 0);
+    snprintf(buf, sizeof(buf), "%s/s/a", path);
+    ASSERT_EQ_INT(vfs_file_write(fs, buf, VFS_O_WRONLY | VFS_O_CREATE, "a", 1), 1);
+    snprintf(buf, sizeof(buf), "%s/s/t/b", path);
+    ASSERT_EQ_INT(vfs_file_write(fs, buf, VFS_O_WRONLY | VFS_O_CREATE, "b", 1), 1);
+}
+
+TEST_F(utils_dir, delete_parallel)
+{
+    vfs_stat_t info;
+    vfs_operations_t* fs = s_test_utils_dir;
+    _test_utils_dir_delete_prepare(fs, "/d");
+
+    uint64_t removed = 0;
+    vfs_dir_delete_cfg_t cfg = { 4, _test_utils_dir_delete_progress, &removed };
+    ASSERT_EQ_INT(vfs_dir_delete_ex(fs, "/d", &cfg), 0);
+    ASSERT_EQ_UINT64(removed, TEST_UTILS_DIR_SIZE + 5);
+    ASSERT_EQ_INT(fs->stat(fs, "/d", &info), VFS_ENOENT);
+
+    /* Missing directory is reported. */
+    ASSERT_EQ_INT(vfs_dir_delete_ex(fs, "/d", &cfg), VFS_ENOENT);
+}
+
+TEST_F(utils_dir, delete_with_pool)
+{
+    vfs_stat_t info;
+    vfs_threadpool_t* pool;
+    vfs_operations_t* fs = s_test_utils_dir;
+
+    vfs_threadpool_cfg_t pool_cfg = { 4, VFS_DIR_DELETE_QUEUE_SIZE };
+    vfs_threadpool_init(&pool, &pool_cfg);
+
+    /* The pool is kept for next removal. */
+    uint64_t removed = 0;
+    vfs_dir_delete_cfg_t cfg = { 4, _test_utils_dir_delete_progress, &removed };
+    _test_utils_dir_delete_prepare(fs, "/d");
+    ASSERT_EQ_INT(vfs_dir_delete_with_pool(fs, "/d", &cfg, pool), 0);
+    ASSERT_EQ_UINT64(removed, TEST_UTILS_DIR_SIZE + 5);
+    ASSERT_EQ_INT(fs->stat(fs, "/d", &info), VFS_ENOENT);
+
+    removed = 0;
+    _test_utils_dir_delete_prepare(fs, "/e");
+    ASSERT_EQ_INT(vfs_dir_delete_with_pool(fs, "/e", &cfg, pool), 0);
+    ASSERT_EQ_UINT64(removed, TEST_UTILS_DIR_SIZE + 5);
+    ASSERT_EQ_INT(fs->stat(fs, "/e", &info), VFS_ENOENT);
+
+    vfs_threadpool_exit(pool);
+}
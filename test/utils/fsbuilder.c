@@ -1,3 +1,4 @@
+#include <string.h>
 #include "test.h"
 #include "vfs/vfs.h"
 #include "fsbuilder.h"
@@ -49,3 +50,14 @@ void vfs_test_read_file(vfs_operations_t* fs, const char* path, vfs_str_t* dat)
 
     ASSERT_EQ_INT(fs->close(fs, fh), 0);
 }
+
+void vfs_test_check_file(vfs_operations_t* fs, const char* path, const void* expect, size_t size)
+{
+    vfs_str_t dat = VFS_STR_INIT;
+    vfs_test_read_file(fs, path, &dat);
+
+    ASSERT_EQ_SIZE(dat.len, size);
+    ASSERT_EQ_INT(memcmp(dat.str, expect, size), 0);
+
+    vfs_str_exit(&dat);
+}
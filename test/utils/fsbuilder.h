@@ -31,6 +31,15 @@ void vfs_test_fs_build(vfs_operations_t* fs, const vfs_fsbuilder_item_t* items,
  */
 void vfs_test_read_file(vfs_operations_t* fs, const char* path, vfs_str_t* dat);
 
+/**
+ * @brief Check that the content of \p path is exactly \p size bytes of \p expect.
+ * @param[in] fs - The file system.
+ * @param[in] path - The path of the file.
+ * @param[in] expect - Expected content.
+ * @param[in] size - Size of expected content.
+ */
+void vfs_test_check_file(vfs_operations_t* fs, const char* path, const void* expect, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,10 @@
+#ifndef __VFS_TEST_MEMFS_CHUNK_H__
+#define __VFS_TEST_MEMFS_CHUNK_H__
+
+/**
+ * @brief Size of one chunk of memfs, which is the unit of sharing, compression
+ *   and deduplication of file content.
+ */
+#define TEST_MEMFS_CHUNK    4096
+
+#endif